@@ -0,0 +1,83 @@
+#include "arena.h"
+#include "exception.h"
+#include "expression.h"
+
+#include <new>
+
+using namespace std;
+
+namespace {
+
+const size_t kAlignment = alignof(max_align_t);
+
+size_t align(size_t size) {
+  return (size + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+// Every node is preceded by the arena it's in (null for the heap), so that
+// delete knows whether to free it
+const size_t kHeaderSize = align(sizeof(Arena*));
+
+}  // namespace
+
+Arena::Arena(size_t inBlockSize)
+    : blockSize(align(inBlockSize)), next(nullptr), end(nullptr), used(0) {
+  PRECONDITION(blockSize > 0);
+}
+
+Arena::~Arena() {
+  for (char* block : blocks) {
+    ::operator delete(block);
+  }
+}
+
+void* Arena::allocate(size_t size) {
+  size = align(size);
+
+  if (size > size_t(end - next)) {
+    // Something too big for a block gets one to itself, so as not to waste
+    // the rest of the current block
+    if (size > blockSize) {
+      char* block = static_cast<char*>(::operator new(size));
+      blocks.push_back(block);
+      used += size;
+      return block;
+    }
+
+    next = static_cast<char*>(::operator new(blockSize));
+    end = next + blockSize;
+    blocks.push_back(next);
+  }
+
+  void* result = next;
+  next += size;
+  used += size;
+  return result;
+}
+
+// Allocation for expression nodes
+
+void* Expression::operator new(size_t size) {
+  return operator new(size, nullptr);
+}
+
+void* Expression::operator new(size_t size, Arena* arena) {
+  char* p = static_cast<char*>((arena != nullptr) ?
+                               arena->allocate(kHeaderSize + size) :
+                               ::operator new(kHeaderSize + size));
+  *reinterpret_cast<Arena**>(p) = arena;
+  return p + kHeaderSize;
+}
+
+void Expression::operator delete(void* p) {
+  if (p == nullptr) return;
+
+  char* start = static_cast<char*>(p) - kHeaderSize;
+  if (*reinterpret_cast<Arena**>(start) == nullptr) {
+    ::operator delete(start);
+  }
+}
+
+void Expression::operator delete(void* p, Arena*) {
+  operator delete(p);
+}
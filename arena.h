@@ -0,0 +1,44 @@
+#if !defined ARENA_H
+#define      ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+// Hands out memory from large blocks, so that the nodes of many compiled
+// expressions share a few allocations and sit next to each other. Memory
+// is only given back when the arena is destroyed, all at once, so the arena
+// must outlive everything allocated in it. Not thread-safe.
+//
+// To compile into an arena, set Expression::CompileOptions::arena.
+//
+// Only the nodes themselves go in the arena. What they own (the text of
+// string constants and variable names, the children of sequences, and so
+// on) is still on the heap, and deleting the root still runs every node's
+// destructor to free it; the arena saves the per-node allocations and the
+// frees, and keeps the nodes together, but not the walk over the tree.
+class Arena {
+public:
+  static const size_t kDefaultBlockSize = 64 * 1024;
+
+  explicit Arena(size_t blockSize = kDefaultBlockSize);
+  ~Arena();
+
+  // Return memory for 'size' bytes, aligned for any type
+  void* allocate(size_t size);
+
+  // Bytes handed out, and blocks allocated to hold them
+  size_t getBytesUsed() const { return used; }
+  int getBlockCount() const { return blocks.size(); }
+
+private:
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  size_t blockSize;
+  std::vector<char*> blocks;
+  char* next;
+  char* end;
+  size_t used;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include <memory>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+#include "arena.h"
+#include "exception.h"
+#include "expression.h"
+#include "test_util.h"
+#include "textsource.h"
+#include "tokenizer.h"
+
+#include "gtest/gtest.h"
+
+// Count heap allocations and frees, so tests can check what the arena
+// saves.
+static int allocations = 0;
+static int frees = 0;
+
+void* operator new(size_t size) {
+  ++allocations;
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  if (p != nullptr) ++frees;
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  if (p != nullptr) ++frees;
+  free(p);
+}
+
+namespace {
+
+Expression* Compile(const std::string& text, Arena* arena,
+                    bool optimize = false) {
+  Expression::CompileOptions options;
+  options.arena = arena;
+  options.optimize = optimize;
+  return ::Compile(text, options);
+}
+
+// Heap allocations made compiling the expression
+int CountAllocations(const std::string& text, Arena* arena) {
+  const int before = allocations;
+  delete Compile(text, arena);
+  return allocations - before;
+}
+
+}  // namespace
+
+TEST(ArenaTest, Allocate) {
+  Arena arena(256);
+  EXPECT_EQ(0, arena.getBlockCount());
+  EXPECT_EQ(0u, arena.getBytesUsed());
+
+  char* a = static_cast<char*>(arena.allocate(1));
+  char* b = static_cast<char*>(arena.allocate(24));
+  EXPECT_EQ(1, arena.getBlockCount());
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(a) % alignof(max_align_t));
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(b) % alignof(max_align_t));
+  EXPECT_LT(a, b);
+  EXPECT_LE(a + 1, b);
+
+  // Running out of room starts a new block
+  for (int i = 0; i < 20; i++) {
+    arena.allocate(24);
+  }
+  EXPECT_LT(1, arena.getBlockCount());
+
+  // Big allocations get blocks of their own
+  const int blocks = arena.getBlockCount();
+  char* big = static_cast<char*>(arena.allocate(1000));
+  big[999] = 'x';
+  EXPECT_EQ(blocks + 1, arena.getBlockCount());
+  EXPECT_LE(1000u + 21 * 24, arena.getBytesUsed());
+}
+
+TEST(ArenaTest, NodesDontUseTheHeap) {
+  const char* text = "1 + 2 * 3 - (4 < 5 ? 6 : 7)";
+  CountAllocations(text, nullptr);  // builds the tokenizer's tables
+  const int heap = CountAllocations(text, nullptr);
+
+  Arena arena;
+  const int first = CountAllocations(text, &arena);
+  const int second = CountAllocations(text, &arena);
+
+  // The first compile allocates the arena's block; after that, only the
+  // tokenizer allocates. There are 12 nodes.
+  EXPECT_LT(first, heap);
+  EXPECT_LT(second, first);
+  EXPECT_EQ(12, heap - second);
+  EXPECT_LT(0u, arena.getBytesUsed());
+}
+
+TEST(ArenaTest, DeletingLeavesMemoryToTheArena) {
+  Arena arena;
+  std::unique_ptr<Expression> e(Compile("(1 + 2) * 3", &arena));
+  ExecutionContext context;
+  EXPECT_EQ(9, e->evaluate(context).getInteger());
+
+  const int before = frees;
+  e.reset();
+  EXPECT_EQ(before, frees);
+}
+
+TEST(ArenaTest, ChildrenComeFirst) {
+  // Nodes are laid out in the order they're evaluated, so the root is the
+  // last thing in the arena
+  Arena arena;
+  std::unique_ptr<Expression> e(Compile("1 + 2 * -3", &arena));
+  const char* next = static_cast<char*>(arena.allocate(1));
+  const size_t gap = next - reinterpret_cast<char*>(e.get());
+  EXPECT_LE(sizeof(BinaryOperator), gap);
+  EXPECT_GT(sizeof(BinaryOperator) + alignof(max_align_t), gap);
+}
+
+TEST(ArenaTest, Optimizing) {
+  // Folded and specialized nodes go in the arena too, and freeing the
+  // ones they replace is harmless
+  Arena arena;
+  const size_t before = arena.getBytesUsed();
+  std::unique_ptr<Expression> e(Compile("(1 + 2) * 3, 'a' + 'b'", &arena,
+                                        true));
+  EXPECT_LT(before, arena.getBytesUsed());
+
+  ExecutionContext context;
+  EXPECT_EQ("ab", e->evaluate(context).getString());
+}
+
+TEST(ArenaTest, MixedWithHeap) {
+  Arena arena;
+  Expression* inArena = Compile("1 + 2", &arena);
+  Expression* onHeap = Compile("1 + 2", nullptr);
+
+  const int before = frees;
+  delete inArena;
+  EXPECT_EQ(before, frees);
+  delete onHeap;
+  EXPECT_LT(before, frees);
+}
+
+TEST(ArenaTest, Errors) {
+  // A syntax error leaves what was parsed so far to the arena
+  Arena arena;
+  EXPECT_THROW(Compile("1 + (2 *", &arena), Exception);
+  EXPECT_THROW(Compile("1 + 2 3", &arena), Exception);
+}
+
+// An expression too large for bytecode is freed when lowering it fails
+TEST(ArenaTest, FreedWhenLoweringFails) {
+  std::string text = "1";
+  for (int i = 0; i < 70000; i++) {
+    text += ", x";
+  }
+  SymbolTable symbols;
+  symbols.add("x");
+
+  const int before = allocations - frees;
+  EXPECT_THROW(::Compile(text, symbols, Expression::BACKEND_BYTECODE),
+               Exception);
+  EXPECT_EQ(before, allocations - frees);
+}
@@ -0,0 +1,689 @@
+#include "batch.h"
+#include "bytecode.h"
+#include "exception.h"
+#include "kernels.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Column::Column() : layout(VALUES), count(0) {}
+
+Expression::Value Column::get(int row) const {
+  PRECONDITION((row >= 0) && (row < count));
+  switch (layout) {
+    case NUMBERS:  return Expression::Value(numbers[row]);
+    case INTEGERS: return Expression::Value(integers[row]);
+    case BOOLS:    return Expression::Value(bools[row] != 0);
+    default:       return values[row];
+  }
+}
+
+void Column::append(const Expression::Value& v) {
+  if (count == 0) {
+    clear();
+    if (v.getType() == Expression::TYPE_NUMBER) {
+      layout = NUMBERS;
+    } else if (v.getType() == Expression::TYPE_INTEGER) {
+      layout = INTEGERS;
+    } else if (v.getType() == Expression::TYPE_BOOL) {
+      layout = BOOLS;
+    }
+  } else if (((layout == NUMBERS) &&
+              (v.getType() != Expression::TYPE_NUMBER)) ||
+             ((layout == INTEGERS) &&
+              (v.getType() != Expression::TYPE_INTEGER)) ||
+             ((layout == BOOLS) &&
+              (v.getType() != Expression::TYPE_BOOL))) {
+    box();
+  }
+
+  switch (layout) {
+    case NUMBERS:  numbers.push_back(v.getNumber()); break;
+    case INTEGERS: integers.push_back(v.getInteger()); break;
+    case BOOLS:    bools.push_back(v.getBool()); break;
+    default:       values.push_back(v);
+  }
+  ++count;
+}
+
+void Column::clear() {
+  layout = VALUES;
+  count = 0;
+  numbers.clear();
+  integers.clear();
+  bools.clear();
+  values.clear();
+}
+
+void Column::reset(Layout inLayout, int n) {
+  clear();
+  layout = inLayout;
+  count = n;
+
+  switch (layout) {
+    case NUMBERS:  numbers.resize(n); break;
+    case INTEGERS: integers.resize(n); break;
+    case BOOLS:    bools.resize(n); break;
+    default:       values.resize(n);
+  }
+}
+
+void Column::box() {
+  if (layout == VALUES) return;
+
+  values.reserve(count);
+  for (int i = 0; i < count; i++) {
+    values.push_back(get(i));
+  }
+  numbers.clear();
+  integers.clear();
+  bools.clear();
+  layout = VALUES;
+}
+
+ColumnBatch::ColumnBatch(int inRows) : rows(inRows) {
+  PRECONDITION(rows >= 0);
+}
+
+Column& ColumnBatch::getColumn(int slot) {
+  PRECONDITION(slot >= 0);
+  if (slot >= (int) columns.size()) {
+    columns.resize(slot + 1);
+  }
+  return columns[slot];
+}
+
+const Column& ColumnBatch::getColumn(int slot) const {
+  PRECONDITION((slot >= 0) && (slot < (int) columns.size()));
+  return columns[slot];
+}
+
+void ColumnBatch::loadRow(int row, ExecutionContext& e) const {
+  for (int slot = 0; slot < (int) columns.size(); slot++) {
+    const Column& column = columns[slot];
+    e.set(slot, (column.size() == 0) ? Expression::Value() : column.get(row));
+  }
+}
+
+namespace {
+
+bool isTrue(const Column& column, int i) {
+  switch (column.getLayout()) {
+    case Column::NUMBERS:  return column.getNumbers()[i] != 0;
+    case Column::INTEGERS: return column.getIntegers()[i] != 0;
+    case Column::BOOLS:    return column.getBools()[i] != 0;
+    default:               return column.getValues()[i].asBool();
+  }
+}
+
+// How && and || see a row: true, false or (for unknown values) neither
+enum Truth {
+  TRUTH_FALSE,
+  TRUTH_TRUE,
+  TRUTH_UNKNOWN
+};
+
+Truth getTruth(const Column& column, int i) {
+  if (column.getLayout() == Column::VALUES &&
+      column.getValues()[i].getType() == Expression::TYPE_UNKNOWN) {
+    return TRUTH_UNKNOWN;
+  }
+  return isTrue(column, i) ? TRUTH_TRUE : TRUTH_FALSE;
+}
+
+// The numbers in a column of numbers, integers or Booleans, converted if
+// need be
+const double* asNumbers(const Column& column, vector<double>& buffer) {
+  if (column.getLayout() == Column::NUMBERS) {
+    return column.getNumbers();
+  }
+
+  buffer.resize(column.size());
+  if (column.getLayout() == Column::INTEGERS) {
+    for (int i = 0; i < column.size(); i++) {
+      buffer[i] = column.getIntegers()[i];
+    }
+  } else {
+    for (int i = 0; i < column.size(); i++) {
+      buffer[i] = column.getBools()[i] ? 1 : 0;
+    }
+  }
+  return buffer.data();
+}
+
+// As above, for the integers in a column of integers or Booleans
+const int64_t* asIntegers(const Column& column, vector<int64_t>& buffer) {
+  if (column.getLayout() == Column::INTEGERS) {
+    return column.getIntegers();
+  }
+
+  buffer.resize(column.size());
+  for (int i = 0; i < column.size(); i++) {
+    buffer[i] = column.getBools()[i] ? 1 : 0;
+  }
+  return buffer.data();
+}
+
+template <typename Function>
+void numberLoop(const double* left, const double* right, int n,
+                Column& result, Function f) {
+  result.reset(Column::NUMBERS, n);
+  double* out = result.getNumbers();
+  for (int i = 0; i < n; i++) {
+    out[i] = f(left[i], right[i]);
+  }
+}
+
+// Apply an operator to columns of numbers, with the same results as
+// Expression::applyBinary. Returns false if the operator isn't valid on
+// numbers, so the caller can report the error.
+bool numberOperation(Expression::Operator op, const double* l,
+                     const double* r, int n, Column& result) {
+  result.reset(Column::NUMBERS, n);
+  if (numberKernel(op, l, r, result.getNumbers(), n)) {
+    return true;
+  }
+
+  vector<uint64_t> mask((n + 63) / 64);
+  if (compareKernel(op, l, r, mask.data(), n)) {
+    result.reset(Column::BOOLS, n);
+    uint8_t* out = result.getBools();
+    for (int i = 0; i < n; i++) {
+      out[i] = (mask[i >> 6] >> (i & 63)) & 1;
+    }
+    return true;
+  }
+
+  switch (op) {
+    case Expression::OP_MOD:
+      // Leave division by zero to the caller, to report the error
+      for (int i = 0; i < n; i++) {
+        if (int32_t(r[i]) == 0) {
+          return false;
+        }
+      }
+      // The smallest integer % -1 overflows
+      numberLoop(l, r, n, result, [](double a, double b) {
+          return (int32_t(b) == -1) ?
+                 0.0 : double(int32_t(a) % int32_t(b)); });
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+template <typename Result, typename Function>
+void integerLoop(const int64_t* left, const int64_t* right, int n,
+                 Result* out, Function f) {
+  for (int i = 0; i < n; i++) {
+    out[i] = f(left[i], right[i]);
+  }
+}
+
+// As above, for columns of integers. The arithmetic is done unsigned, so
+// that it wraps around. Returns false for % by zero too, leaving the
+// caller to report it.
+bool integerOperation(Expression::Operator op, const int64_t* l,
+                      const int64_t* r, int n, Column& result) {
+  typedef uint64_t U;
+
+  switch (op) {
+    case Expression::OP_DIVIDE:
+      result.reset(Column::NUMBERS, n);
+      integerLoop(l, r, n, result.getNumbers(), [](int64_t a, int64_t b) {
+          return double(a) / double(b); });
+      return true;
+
+    case Expression::OP_LESS:
+    case Expression::OP_LESSEQ:
+    case Expression::OP_GREATER:
+    case Expression::OP_GREATEREQ:
+    case Expression::OP_EQUAL:
+    case Expression::OP_NOTEQUAL: {
+      result.reset(Column::BOOLS, n);
+      uint8_t* out = result.getBools();
+      switch (op) {
+        case Expression::OP_LESS:
+          integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+              return a < b; });
+          break;
+        case Expression::OP_LESSEQ:
+          integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+              return a <= b; });
+          break;
+        case Expression::OP_GREATER:
+          integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+              return a > b; });
+          break;
+        case Expression::OP_GREATEREQ:
+          integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+              return a >= b; });
+          break;
+        case Expression::OP_EQUAL:
+          integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+              return a == b; });
+          break;
+        default:
+          integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+              return a != b; });
+      }
+      return true;
+    }
+
+    default:
+      break;
+  }
+
+  if ((op == Expression::OP_MOD) && (find(r, r + n, 0) != r + n)) {
+    return false;
+  }
+
+  result.reset(Column::INTEGERS, n);
+  int64_t* out = result.getIntegers();
+  switch (op) {
+    case Expression::OP_MULTIPLY:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+          return int64_t(U(a) * U(b)); });
+      break;
+    case Expression::OP_MOD:
+      // The smallest integer % -1 overflows
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+          return (b == -1) ? 0 : a % b; });
+      break;
+    case Expression::OP_PLUS:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+          return int64_t(U(a) + U(b)); });
+      break;
+    case Expression::OP_MINUS:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+          return int64_t(U(a) - U(b)); });
+      break;
+    case Expression::OP_SHIFTLEFT:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+          return int64_t(U(a) << (b & 63)); });
+      break;
+    case Expression::OP_SHIFTRIGHT:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) {
+          return a >> (b & 63); });
+      break;
+    case Expression::OP_AND:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) { return a & b; });
+      break;
+    case Expression::OP_XOR:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) { return a ^ b; });
+      break;
+    case Expression::OP_OR:
+      integerLoop(l, r, n, out, [](int64_t a, int64_t b) { return a | b; });
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+// As above, for columns of Booleans
+bool boolOperation(Expression::Operator op, const uint8_t* l,
+                   const uint8_t* r, int n, Column& result) {
+  result.reset(Column::BOOLS, n);
+  uint8_t* out = result.getBools();
+
+  switch (op) {
+    case Expression::OP_EQUAL:
+      for (int i = 0; i < n; i++) out[i] = (l[i] == r[i]);
+      break;
+    case Expression::OP_NOTEQUAL:
+      for (int i = 0; i < n; i++) out[i] = (l[i] != r[i]);
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+void Expression::evaluateBatch(const ColumnBatch& batch,
+                               Column& result) const {
+  vector<int> rows(batch.getRowCount());
+  for (int i = 0; i < (int) rows.size(); i++) {
+    rows[i] = i;
+  }
+  evaluateRows(batch, rows, result);
+}
+
+// Batch evaluation for each of the node types
+
+void Expression::evaluateRows(const ColumnBatch& batch,
+                              const vector<int>& rows,
+                              Column& result) const {
+  result.clear();
+  ExecutionContext e;
+  for (int row : rows) {
+    batch.loadRow(row, e);
+    result.append(evaluate(e));
+  }
+}
+
+void ConstantExpression::evaluateRows(const ColumnBatch&,
+                                      const vector<int>& rows,
+                                      Column& result) const {
+  const int n = rows.size();
+  if (value.getType() == TYPE_NUMBER) {
+    result.reset(Column::NUMBERS, n);
+    fill(result.getNumbers(), result.getNumbers() + n, value.getNumber());
+  } else if (value.getType() == TYPE_INTEGER) {
+    result.reset(Column::INTEGERS, n);
+    fill(result.getIntegers(), result.getIntegers() + n, value.getInteger());
+  } else if (value.getType() == TYPE_BOOL) {
+    result.reset(Column::BOOLS, n);
+    fill(result.getBools(), result.getBools() + n, value.getBool());
+  } else {
+    result.reset(Column::VALUES, n);
+    fill(result.getValues(), result.getValues() + n, value);
+  }
+}
+
+void VariableExpression::evaluateRows(const ColumnBatch& batch,
+                                      const vector<int>& rows,
+                                      Column& result) const {
+  const int n = rows.size();
+  if (n == 0) {
+    result.clear();
+    return;
+  }
+
+  if (slot >= batch.getColumnCount()) {
+    throw Exception("Undefined variable: " + name);
+  }
+
+  const Column& column = batch.getColumn(slot);
+  if (column.size() == 0) {
+    result.reset(Column::VALUES, n);  // all unknown
+    return;
+  } else if (column.size() != batch.getRowCount()) {
+    throw Exception("Wrong number of rows in the column for " + name);
+  }
+
+  result.reset(column.getLayout(), n);
+  switch (column.getLayout()) {
+    case Column::NUMBERS:
+      for (int i = 0; i < n; i++) {
+        result.getNumbers()[i] = column.getNumbers()[rows[i]];
+      }
+      break;
+    case Column::INTEGERS:
+      for (int i = 0; i < n; i++) {
+        result.getIntegers()[i] = column.getIntegers()[rows[i]];
+      }
+      break;
+    case Column::BOOLS:
+      for (int i = 0; i < n; i++) {
+        result.getBools()[i] = column.getBools()[rows[i]];
+      }
+      break;
+    default:
+      for (int i = 0; i < n; i++) {
+        result.getValues()[i] = column.getValues()[rows[i]];
+      }
+  }
+}
+
+void UnaryOperator::evaluateRows(const ColumnBatch& batch,
+                                 const vector<int>& rows,
+                                 Column& result) const {
+  Column operand;
+  child->evaluateRows(batch, rows, operand);
+  const int n = operand.size();
+
+  if (operand.getLayout() == Column::NUMBERS) {
+    const double* in = operand.getNumbers();
+
+    if (op == OP_NOT) {
+      result.reset(Column::BOOLS, n);
+      for (int i = 0; i < n; i++) result.getBools()[i] = !(in[i] != 0);
+      return;
+    } else if (op == OP_BITNOT) {
+      result.reset(Column::NUMBERS, n);
+      for (int i = 0; i < n; i++) {
+        int64_t v = in[i];
+        result.getNumbers()[i] = ~v;
+      }
+      return;
+    } else if (op == OP_NEGATIVE) {
+      result.reset(Column::NUMBERS, n);
+      for (int i = 0; i < n; i++) result.getNumbers()[i] = -in[i];
+      return;
+    } else if (op == OP_POSITIVE) {
+      result = operand;
+      return;
+    }
+
+  } else if (operand.getLayout() == Column::INTEGERS) {
+    const int64_t* in = operand.getIntegers();
+
+    if (op == OP_NOT) {
+      result.reset(Column::BOOLS, n);
+      for (int i = 0; i < n; i++) result.getBools()[i] = (in[i] == 0);
+      return;
+    } else if (op == OP_BITNOT) {
+      result.reset(Column::INTEGERS, n);
+      for (int i = 0; i < n; i++) result.getIntegers()[i] = ~in[i];
+      return;
+    } else if (op == OP_NEGATIVE) {
+      result.reset(Column::INTEGERS, n);
+      for (int i = 0; i < n; i++) {
+        result.getIntegers()[i] = int64_t(0 - uint64_t(in[i]));
+      }
+      return;
+    } else if (op == OP_POSITIVE) {
+      result = operand;
+      return;
+    }
+
+  } else if (operand.getLayout() == Column::BOOLS) {
+    const uint8_t* in = operand.getBools();
+
+    if ((op == OP_NOT) || (op == OP_BITNOT)) {
+      result.reset(Column::BOOLS, n);
+      for (int i = 0; i < n; i++) result.getBools()[i] = !in[i];
+      return;
+    } else if (op == OP_NEGATIVE) {
+      result.reset(Column::NUMBERS, n);
+      for (int i = 0; i < n; i++) {
+        result.getNumbers()[i] = -(in[i] ? 1.0 : 0.0);
+      }
+      return;
+    } else if (op == OP_POSITIVE) {
+      result.reset(Column::NUMBERS, n);
+      for (int i = 0; i < n; i++) result.getNumbers()[i] = in[i] ? 1 : 0;
+      return;
+    }
+  }
+
+  result.clear();
+  for (int i = 0; i < n; i++) {
+    result.append(applyUnary(op, operand.get(i)));
+  }
+}
+
+void BinaryOperator::evaluateRows(const ColumnBatch& batch,
+                                  const vector<int>& rows,
+                                  Column& result) const {
+  if (isAssignment(op) && !rows.empty()) {
+    throw Exception("Not implemented: " + string(operator2string(op)));
+  }
+
+  Column l, r;
+  left->evaluateRows(batch, rows, l);
+  right->evaluateRows(batch, rows, r);
+  const int n = l.size();
+
+  // When the types are the same all the way down the columns, we can
+  // settle the upcast once for the whole batch
+  const bool lnum = (l.getLayout() == Column::NUMBERS);
+  const bool rnum = (r.getLayout() == Column::NUMBERS);
+  const bool lint = (l.getLayout() == Column::INTEGERS);
+  const bool rint = (r.getLayout() == Column::INTEGERS);
+  const bool lbool = (l.getLayout() == Column::BOOLS);
+  const bool rbool = (r.getLayout() == Column::BOOLS);
+
+  if ((lnum || lint || lbool) && (rnum || rint || rbool) && (lnum || rnum)) {
+    vector<double> lbuffer, rbuffer;
+    if (numberOperation(op, asNumbers(l, lbuffer), asNumbers(r, rbuffer),
+                        n, result)) {
+      return;
+    }
+  } else if ((lint || lbool) && (rint || rbool) && (lint || rint)) {
+    vector<int64_t> lbuffer, rbuffer;
+    if (integerOperation(op, asIntegers(l, lbuffer), asIntegers(r, rbuffer),
+                         n, result)) {
+      return;
+    }
+  } else if (lbool && rbool) {
+    if (boolOperation(op, l.getBools(), r.getBools(), n, result)) {
+      return;
+    }
+  }
+
+  result.clear();
+  for (int i = 0; i < n; i++) {
+    result.append(applyBinary(op, l.get(i), r.get(i)));
+  }
+}
+
+void LogicalOperator::evaluateRows(const ColumnBatch& batch,
+                                   const vector<int>& rows,
+                                   Column& result) const {
+  Column lefts;
+  left->evaluateRows(batch, rows, lefts);
+  const int n = rows.size();
+
+  // The right operand only sees the rows the left one doesn't settle
+  const Truth pending = (op == OP_ANDAND) ? TRUTH_TRUE : TRUTH_FALSE;
+  vector<uint8_t> truths(n);
+  vector<int> rightRows;
+  for (int i = 0; i < n; i++) {
+    truths[i] = getTruth(lefts, i);
+    if (truths[i] == pending) {
+      rightRows.push_back(rows[i]);
+    }
+  }
+
+  Column rights;
+  right->evaluateRows(batch, rightRows, rights);
+
+  bool unknown = false;
+  for (int i = 0, j = 0; i < n; i++) {
+    if (truths[i] == pending) {
+      truths[i] = getTruth(rights, j++);
+    }
+    unknown |= (truths[i] == TRUTH_UNKNOWN);
+  }
+
+  if (!unknown) {
+    result.reset(Column::BOOLS, n);
+    copy(truths.begin(), truths.end(), result.getBools());
+    return;
+  }
+
+  result.reset(Column::VALUES, n);
+  for (int i = 0; i < n; i++) {
+    if (truths[i] != TRUTH_UNKNOWN) {
+      result.getValues()[i] = Value(truths[i] == TRUTH_TRUE);
+    }
+  }
+}
+
+void TernaryOperator::evaluateRows(const ColumnBatch& batch,
+                                   const vector<int>& rows,
+                                   Column& result) const {
+  Column tests;
+  test->evaluateRows(batch, rows, tests);
+  const int n = rows.size();
+
+  // Each branch only sees the rows that select it
+  vector<uint8_t> choices(n);
+  vector<int> positiveRows, negativeRows;
+  for (int i = 0; i < n; i++) {
+    choices[i] = isTrue(tests, i);
+    (choices[i] ? positiveRows : negativeRows).push_back(rows[i]);
+  }
+
+  Column positives, negatives;
+  positive->evaluateRows(batch, positiveRows, positives);
+  negative->evaluateRows(batch, negativeRows, negatives);
+
+  if (negativeRows.empty()) {
+    result = positives;
+    return;
+  } else if (positiveRows.empty()) {
+    result = negatives;
+    return;
+  }
+
+  // Merge the two back in row order
+  const Column::Layout layout =
+      (positives.getLayout() == negatives.getLayout()) ?
+      positives.getLayout() : Column::VALUES;
+  result.reset(layout, n);
+
+  int p = 0, q = 0;
+  for (int i = 0; i < n; i++) {
+    const Column& from = choices[i] ? positives : negatives;
+    const int j = choices[i] ? p++ : q++;
+
+    switch (layout) {
+      case Column::NUMBERS:
+        result.getNumbers()[i] = from.getNumbers()[j];
+        break;
+      case Column::INTEGERS:
+        result.getIntegers()[i] = from.getIntegers()[j];
+        break;
+      case Column::BOOLS:
+        result.getBools()[i] = from.getBools()[j];
+        break;
+      default:
+        result.getValues()[i] = from.get(j);
+    }
+  }
+}
+
+void SequenceExpression::evaluateRows(const ColumnBatch& batch,
+                                      const vector<int>& rows,
+                                      Column& result) const {
+  if (subs.empty() && !rows.empty()) {
+    throw Exception("Attempt to execute an empty sequence");
+  }
+
+  result.clear();
+  for (const auto* sub : subs) {
+    sub->evaluateRows(batch, rows, result);
+  }
+}
+
+void ConcatExpression::evaluateRows(const ColumnBatch& batch,
+                                    const vector<int>& rows,
+                                    Column& result) const {
+  const int count = operands.size();
+  vector<Column> columns(count);
+  for (int i = 0; i < count; i++) {
+    operands[i]->evaluateRows(batch, rows, columns[i]);
+  }
+
+  result.clear();
+  vector<Value> values(count);
+  for (int row = 0; row < (int) rows.size(); row++) {
+    for (int i = 0; i < count; i++) {
+      values[i] = columns[i].get(row);
+    }
+    result.append(applyConcat(values.data(), count));
+  }
+}
+
+void BytecodeExpression::evaluateRows(const ColumnBatch& batch,
+                                      const vector<int>& rows,
+                                      Column& result) const {
+  tree->evaluateRows(batch, rows, result);
+}
@@ -0,0 +1,79 @@
+#if !defined BATCH_H
+#define      BATCH_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "expression.h"
+
+// A Column holds one value per row. While every value in it has the same
+// type, numbers, integers and Booleans are stored unboxed in a plain array
+// that operators can loop over; otherwise the column falls back to Values.
+class Column {
+public:
+  enum Layout {
+    NUMBERS,
+    INTEGERS,
+    BOOLS,
+    VALUES
+  };
+
+  Column();
+
+  Layout getLayout() const { return layout; }
+  int size() const { return count; }
+
+  Expression::Value get(int row) const;
+
+  void append(const Expression::Value&);
+  void clear();
+
+  // Replace the contents with 'n' entries of the given layout, to be
+  // filled in through the arrays below.
+  void reset(Layout, int n);
+
+  double* getNumbers() { return numbers.data(); }
+  const double* getNumbers() const { return numbers.data(); }
+  int64_t* getIntegers() { return integers.data(); }
+  const int64_t* getIntegers() const { return integers.data(); }
+  uint8_t* getBools() { return bools.data(); }
+  const uint8_t* getBools() const { return bools.data(); }
+  Expression::Value* getValues() { return values.data(); }
+  const Expression::Value* getValues() const { return values.data(); }
+
+private:
+  // Switch to the VALUES layout, keeping the contents
+  void box();
+
+  Layout layout;
+  int count;
+
+  std::vector<double> numbers;
+  std::vector<int64_t> integers;
+  std::vector<uint8_t> bools;
+  std::vector<Expression::Value> values;
+};
+
+// The input to a batch evaluation: one Column per variable slot, each with
+// a value for every row. Columns left empty hold unknown values, like slots
+// that were never set in an ExecutionContext.
+class ColumnBatch {
+public:
+  explicit ColumnBatch(int rows);
+
+  int getRowCount() const { return rows; }
+  int getColumnCount() const { return columns.size(); }
+
+  // Return the column for the slot, adding empty columns as needed
+  Column& getColumn(int slot);
+  const Column& getColumn(int slot) const;
+
+  // Copy one row into the context, to evaluate it on its own
+  void loadRow(int row, ExecutionContext&) const;
+
+private:
+  int rows;
+  std::vector<Column> columns;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "batch.h"
+#include "exception.h"
+#include "expression.h"
+#include "test_util.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int kRows = 100;
+
+// Evaluating the batch must give the same results as evaluating each row,
+// and must throw if and only if some row throws.
+void ExpectSameAsRows(const std::string& text, bool optimize = false) {
+  SymbolTable symbols;
+  ColumnBatch batch(kRows);
+  FillBatch(symbols, batch);
+  std::unique_ptr<Expression> e(Compile(text, symbols,
+                                        Expression::BACKEND_TREE, optimize));
+
+  std::vector<std::string> expected;
+  bool rowThrew = false;
+  ExecutionContext exe;
+  for (int i = 0; i < kRows; i++) {
+    batch.loadRow(i, exe);
+    try {
+      expected.push_back(Describe(e->evaluate(exe)));
+    } catch (const Exception&) {
+      rowThrew = true;
+    }
+  }
+
+  Column result;
+  try {
+    e->evaluateBatch(batch, result);
+  } catch (const Exception&) {
+    EXPECT_TRUE(rowThrew) << text;
+    return;
+  }
+
+  ASSERT_FALSE(rowThrew) << text;
+  ASSERT_EQ(kRows, result.size()) << text;
+  for (int i = 0; i < kRows; i++) {
+    EXPECT_EQ(expected[i], Describe(result.get(i))) << text << " row " << i;
+  }
+}
+
+}  // namespace
+
+TEST(BatchTest, Column) {
+  Column c;
+  EXPECT_EQ(0, c.size());
+
+  c.append(Expression::Value(1.0));
+  c.append(Expression::Value(2.0));
+  EXPECT_EQ(Column::NUMBERS, c.getLayout());
+  EXPECT_EQ(2, c.getNumbers()[1]);
+
+  c.append(Expression::Value("x"));
+  EXPECT_EQ(Column::VALUES, c.getLayout());
+  ASSERT_EQ(3, c.size());
+  EXPECT_EQ(1, c.get(0).getNumber());
+  EXPECT_EQ("x", c.get(2).getString());
+
+  c.clear();
+  c.append(Expression::Value(true));
+  EXPECT_EQ(Column::BOOLS, c.getLayout());
+  EXPECT_TRUE(c.get(0).getBool());
+}
+
+TEST(BatchTest, MatchesRows) {
+  const char* const cases[] = {
+    "1", "'const'", "true", "x", "s", "unset",
+    "!x", "~x", "-x", "+x", "!b", "~b", "-b", "+b", "-s", "!s",
+    "x * y", "x / y", "x % (y + 1)", "x + y", "x - y", "y << 3",
+    "x >> 1", "x & 12", "x | 3", "x ^ y", "x && y", "x || y",
+    "x < y", "x <= y", "x > y", "x >= y", "x == y * 3", "x != y",
+    "b == true", "b != (x < 0)", "b && x < 0", "b || y == 2",
+    "s && x", "x || s", "x && unset", "unset || b", "b && y || x > 10",
+    "y == 0 || x / y > 1", "b && s * 2", "!b || s * 2",
+    "b + 1", "x * b", "s + 'z'", "s + x", "s < 'm'", "s == 4",
+    "'n' + unset", "x + unset",
+    "x < 0 ? 'neg' : x", "b ? x : y", "y ? x / y : 0", "s ? 1 : 2",
+    "x < 0 ? (b ? 1 : 2) : (y > 3 ? 3 : 4)",
+    "x, y, x + y", "(x * 2 + y) * (x - y) / 3",
+    // Errors
+    "b + b", "s * 2", "x < 0 ? 'a' * 2 : 1", "x < -100 ? 'a' * 2 : 1",
+    "x = 1", "missing", "b || s * 2", "x % y", "x % b",
+    "(x - 2147483628) % (y - 1)",
+  };
+
+  for (const char* text : cases) {
+    ExpectSameAsRows(text);
+  }
+}
+
+TEST(BatchTest, Concatenation) {
+  const char* const cases[] = {
+    "s + x + b + y", "'a' + s + 'b' + x", "x + 'a' + unset + 'b'",
+    "'a' + x + s * 2 + 'b'", "(x < 0 ? 'neg' : x) + y + b",
+  };
+
+  for (const char* text : cases) {
+    ExpectSameAsRows(text, true);
+  }
+}
+
+TEST(BatchTest, Layouts) {
+  SymbolTable symbols;
+  ColumnBatch batch(kRows);
+  FillBatch(symbols, batch);
+
+  std::unique_ptr<Expression> e(Compile("(x + 1) * y", symbols));
+  Column result;
+  e->evaluateBatch(batch, result);
+  EXPECT_EQ(Column::NUMBERS, result.getLayout());
+
+  e.reset(Compile("x < y && b", symbols));
+  e->evaluateBatch(batch, result);
+  EXPECT_EQ(Column::BOOLS, result.getLayout());
+}
+
+TEST(BatchTest, Empty) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> e(Compile("x = 1", symbols));
+
+  ColumnBatch batch(0);
+  Column result;
+  e->evaluateBatch(batch, result);
+  EXPECT_EQ(0, result.size());
+}
@@ -0,0 +1,372 @@
+#include "bytecode.h"
+#include "exception.h"
+
+#include <iostream>
+
+using namespace std;
+
+namespace {
+
+// Programs needing no more registers than this run without allocating
+const int kFixedRegisters = 16;
+
+// Operands are 16 bits wide
+const int kMaxOperand = 0xffff;
+
+int checkOperand(int value) {
+  if (value < 0 || value > kMaxOperand) {
+    throw Exception("Expression is too large to lower to bytecode");
+  }
+  return value;
+}
+
+}  // namespace
+
+Program::Program() : registers(1) {}
+
+Expression::Value Program::run(ExecutionContext& e) const {
+  Expression::Value fixed[kFixedRegisters];
+  vector<Expression::Value> allocated;
+  Expression::Value* r = fixed;
+  if (registers > kFixedRegisters) {
+    allocated.resize(registers);
+    r = &allocated[0];
+  }
+
+  const Instruction* const start = code.data();
+  const Instruction* const end = start + code.size();
+  const Instruction* pc = start;
+
+  while (pc != end) {
+    const Instruction& i = *pc++;
+
+    switch (i.opcode) {
+      case LOAD:
+        r[i.dest] = constants[i.a];
+        break;
+
+      case VARIABLE:
+        if (i.a < e.size()) {
+          r[i.dest] = e.get(i.a);
+        } else {
+          r[i.dest] = fallbacks[i.b]->compute(e);
+        }
+        break;
+
+      case UNARY:
+        r[i.dest] = Expression::applyUnary(Expression::Operator(i.op),
+                                           r[i.a], e.getStatus());
+        break;
+
+      case BINARY: {
+        const Expression::Value& left = r[i.a];
+        const Expression::Value& right = r[i.b];
+        Expression::Value& dest = r[i.dest];
+
+        // Numbers and integers are by far the most common operands, so
+        // handle the simple arithmetic and comparisons here. An integer
+        // mixed with a number is converted to one.
+        const Expression::Type ltype = left.getType();
+        const Expression::Type rtype = right.getType();
+        if ((ltype == Expression::TYPE_INTEGER) &&
+            (rtype == Expression::TYPE_INTEGER)) {
+          const int64_t lval = left.getInteger();
+          const int64_t rval = right.getInteger();
+          bool handled = true;
+
+          switch (i.op) {
+            case Expression::OP_MULTIPLY:
+              dest = Expression::Value(int64_t(uint64_t(lval) * rval));
+              break;
+            case Expression::OP_PLUS:
+              dest = Expression::Value(int64_t(uint64_t(lval) + rval));
+              break;
+            case Expression::OP_MINUS:
+              dest = Expression::Value(int64_t(uint64_t(lval) - rval));
+              break;
+            case Expression::OP_LESS:
+              dest = Expression::Value(lval < rval);
+              break;
+            case Expression::OP_LESSEQ:
+              dest = Expression::Value(lval <= rval);
+              break;
+            case Expression::OP_GREATER:
+              dest = Expression::Value(lval > rval);
+              break;
+            case Expression::OP_GREATEREQ:
+              dest = Expression::Value(lval >= rval);
+              break;
+            case Expression::OP_EQUAL:
+              dest = Expression::Value(lval == rval);
+              break;
+            case Expression::OP_NOTEQUAL:
+              dest = Expression::Value(lval != rval);
+              break;
+            case Expression::OP_AND:
+              dest = Expression::Value(lval & rval);
+              break;
+            case Expression::OP_XOR:
+              dest = Expression::Value(lval ^ rval);
+              break;
+            case Expression::OP_OR:
+              dest = Expression::Value(lval | rval);
+              break;
+            default:
+              handled = false;
+          }
+
+          if (handled) break;
+        } else if (((ltype == Expression::TYPE_NUMBER) ||
+                    (ltype == Expression::TYPE_INTEGER)) &&
+                   ((rtype == Expression::TYPE_NUMBER) ||
+                    (rtype == Expression::TYPE_INTEGER))) {
+          const double lval = (ltype == Expression::TYPE_NUMBER) ?
+              left.getNumber() : double(left.getInteger());
+          const double rval = (rtype == Expression::TYPE_NUMBER) ?
+              right.getNumber() : double(right.getInteger());
+          bool handled = true;
+
+          switch (i.op) {
+            case Expression::OP_MULTIPLY:
+              dest = Expression::Value(lval * rval);
+              break;
+            case Expression::OP_DIVIDE:
+              dest = Expression::Value(lval / rval);
+              break;
+            case Expression::OP_PLUS:
+              dest = Expression::Value(lval + rval);
+              break;
+            case Expression::OP_MINUS:
+              dest = Expression::Value(lval - rval);
+              break;
+            case Expression::OP_LESS:
+              dest = Expression::Value(lval < rval);
+              break;
+            case Expression::OP_LESSEQ:
+              dest = Expression::Value(lval <= rval);
+              break;
+            case Expression::OP_GREATER:
+              dest = Expression::Value(lval > rval);
+              break;
+            case Expression::OP_GREATEREQ:
+              dest = Expression::Value(lval >= rval);
+              break;
+            case Expression::OP_EQUAL:
+              dest = Expression::Value(lval == rval);
+              break;
+            case Expression::OP_NOTEQUAL:
+              dest = Expression::Value(lval != rval);
+              break;
+            default:
+              handled = false;
+          }
+
+          if (handled) break;
+        }
+
+        dest = Expression::applyBinary(Expression::Operator(i.op),
+                                       left, right, e.getStatus());
+        break;
+      }
+
+      case JUMP:
+        pc = start + i.a;
+        break;
+
+      case JUMP_IF_FALSE:
+        if (!r[i.dest].asBool()) {
+          pc = start + i.a;
+        }
+        break;
+
+      case TO_BOOL:
+        if (r[i.dest].getType() != Expression::TYPE_UNKNOWN) {
+          r[i.dest] = Expression::Value(r[i.dest].asBool());
+        }
+        break;
+
+      case JUMP_UNLESS_TRUE:
+        if (r[i.dest].getType() != Expression::TYPE_BOOL ||
+            !r[i.dest].getBool()) {
+          pc = start + i.a;
+        }
+        break;
+
+      case JUMP_UNLESS_FALSE:
+        if (r[i.dest].getType() != Expression::TYPE_BOOL ||
+            r[i.dest].getBool()) {
+          pc = start + i.a;
+        }
+        break;
+
+      case EVALUATE:
+        r[i.dest] = fallbacks[i.a]->compute(e);
+        break;
+
+      case CONCAT:
+        r[i.dest] = Expression::applyConcat(r + i.a, i.b);
+        break;
+
+      default:
+        ASSERTION(false);
+    }
+  }
+
+  return r[0];
+}
+
+BytecodeBuilder::BytecodeBuilder(Program& p) : program(p) {}
+
+int BytecodeBuilder::emit(Program::Opcode opcode, int dest, int a, int b,
+                          int op) {
+  useRegister(dest);
+  if (opcode == Program::UNARY || opcode == Program::BINARY) {
+    useRegister(a);
+  }
+  if (opcode == Program::BINARY) {
+    useRegister(b);
+  }
+  if (opcode == Program::CONCAT && b > 0) {
+    useRegister(a + b - 1);
+  }
+
+  Program::Instruction i;
+  i.opcode = opcode;
+  i.op = op;
+  i.dest = checkOperand(dest);
+  i.a = checkOperand(a);
+  i.b = checkOperand(b);
+
+  program.code.push_back(i);
+  return program.code.size() - 1;
+}
+
+void BytecodeBuilder::patch(int address) {
+  PRECONDITION(address < (int) program.code.size());
+  program.code[address].a = checkOperand(program.code.size());
+}
+
+int BytecodeBuilder::addConstant(const Expression::Value& v) {
+  program.constants.push_back(v);
+  return checkOperand(program.constants.size() - 1);
+}
+
+int BytecodeBuilder::addFallback(const Expression* expr) {
+  PRECONDITION(expr != nullptr);
+  program.fallbacks.push_back(expr);
+  return checkOperand(program.fallbacks.size() - 1);
+}
+
+void BytecodeBuilder::useRegister(int reg) {
+  checkOperand(reg);
+  if (reg >= program.registers) {
+    program.registers = reg + 1;
+  }
+}
+
+BytecodeExpression::BytecodeExpression(Expression* inTree) : tree(inTree) {
+  PRECONDITION(tree != nullptr);
+  // The tree is ours even if it can't be lowered, and the destructor won't
+  // run then
+  try {
+    BytecodeBuilder builder(program);
+    tree->lower(builder, 0);
+  } catch (...) {
+    delete tree;
+    throw;
+  }
+  annotate();
+}
+
+BytecodeExpression::~BytecodeExpression() {
+  delete tree;
+}
+
+Expression::Value BytecodeExpression::compute(ExecutionContext& e) const {
+  return program.run(e);
+}
+
+void BytecodeExpression::print(ostream& out) const {
+  tree->print(out);
+}
+
+Expression::Type BytecodeExpression::inferType() const {
+  return tree->getStaticType();
+}
+
+void BytecodeExpression::lower(BytecodeBuilder& builder, int reg) const {
+  tree->lower(builder, reg);
+}
+
+// Lowering for each of the node types
+
+void Expression::lower(BytecodeBuilder& builder, int reg) const {
+  builder.emit(Program::EVALUATE, reg, builder.addFallback(this));
+}
+
+void ConstantExpression::lower(BytecodeBuilder& builder, int reg) const {
+  builder.emit(Program::LOAD, reg, builder.addConstant(value));
+}
+
+void VariableExpression::lower(BytecodeBuilder& builder, int reg) const {
+  // The fallback reports an undefined variable
+  builder.emit(Program::VARIABLE, reg, slot, builder.addFallback(this));
+}
+
+void UnaryOperator::lower(BytecodeBuilder& builder, int reg) const {
+  child->lower(builder, reg);
+  builder.emit(Program::UNARY, reg, reg, 0, op);
+}
+
+void BinaryOperator::lower(BytecodeBuilder& builder, int reg) const {
+  // These fail before evaluating their operands; let the tree do that
+  if (isAssignment(op)) {
+    Expression::lower(builder, reg);
+    return;
+  }
+
+  left->lower(builder, reg);
+  right->lower(builder, reg + 1);
+  builder.emit(Program::BINARY, reg, reg, reg + 1, op);
+}
+
+void LogicalOperator::lower(BytecodeBuilder& builder, int reg) const {
+  // An unknown left operand, or one that settles the result, is the result
+  left->lower(builder, reg);
+  builder.emit(Program::TO_BOOL, reg);
+  const int toEnd = builder.emit((op == OP_ANDAND) ?
+                                 Program::JUMP_UNLESS_TRUE :
+                                 Program::JUMP_UNLESS_FALSE, reg);
+  right->lower(builder, reg);
+  builder.emit(Program::TO_BOOL, reg);
+  builder.patch(toEnd);
+}
+
+void TernaryOperator::lower(BytecodeBuilder& builder, int reg) const {
+  test->lower(builder, reg);
+  const int toNegative = builder.emit(Program::JUMP_IF_FALSE, reg);
+  positive->lower(builder, reg);
+  const int toEnd = builder.emit(Program::JUMP, reg);
+  builder.patch(toNegative);
+  negative->lower(builder, reg);
+  builder.patch(toEnd);
+}
+
+void SequenceExpression::lower(BytecodeBuilder& builder, int reg) const {
+  // An empty sequence fails when evaluated
+  if (subs.empty()) {
+    Expression::lower(builder, reg);
+    return;
+  }
+
+  for (const auto* sub : subs) {
+    sub->lower(builder, reg);
+  }
+}
+
+void ConcatExpression::lower(BytecodeBuilder& builder, int reg) const {
+  for (unsigned i = 0; i < operands.size(); i++) {
+    operands[i]->lower(builder, reg + i);
+  }
+  builder.emit(Program::CONCAT, reg, reg, operands.size());
+}
@@ -0,0 +1,108 @@
+#if !defined BYTECODE_H
+#define      BYTECODE_H
+
+#include <iosfwd>
+#include <stdint.h>
+#include <vector>
+
+#include "expression.h"
+
+// A Program is an expression tree lowered to a flat array of instructions
+// that work on a file of Value registers. Running it gives the same results
+// (and records the same errors) as evaluating the tree, but without a
+// virtual call and a returned Value per node.
+class Program {
+public:
+  enum Opcode {
+    LOAD,               // r[dest] = constants[a]
+    VARIABLE,           // r[dest] = slot a, or fallbacks[b]->compute() if
+                        // the context doesn't have slot a
+    UNARY,              // r[dest] = op r[a]
+    BINARY,             // r[dest] = r[a] op r[b]
+    JUMP,               // continue at instruction a
+    JUMP_IF_FALSE,      // continue at instruction a unless r[dest].asBool()
+    TO_BOOL,            // r[dest] = r[dest].asBool(), unless it's unknown
+    JUMP_UNLESS_TRUE,   // continue at instruction a unless r[dest] is true
+    JUMP_UNLESS_FALSE,  // continue at instruction a unless r[dest] is false
+    EVALUATE,           // r[dest] = fallbacks[a]->compute()
+    CONCAT              // r[dest] = r[a] + ... + r[a + b - 1], joined as
+                        // by Expression::applyConcat
+  };
+
+  struct Instruction {
+    uint8_t  opcode;
+    uint8_t  op;     // An Expression::Operator, for UNARY and BINARY
+    uint16_t dest;
+    uint16_t a;
+    uint16_t b;
+  };
+
+  Program();
+
+  // The result is left in register 0
+  Expression::Value run(ExecutionContext&) const;
+
+  int getRegisterCount() const { return registers; }
+  const std::vector<Instruction>& getCode() const { return code; }
+
+private:
+  friend class BytecodeBuilder;
+
+  std::vector<Instruction> code;
+  std::vector<Expression::Value> constants;
+  std::vector<const Expression*> fallbacks;
+  int registers;
+};
+
+// Used by Expression::lower to append instructions to a Program. Registers
+// are allocated as a stack: an expression lowered into register N may use
+// any register above N as scratch space.
+class BytecodeBuilder {
+public:
+  BytecodeBuilder(Program&);
+
+  // Append an instruction and return its address
+  int emit(Program::Opcode, int dest, int a = 0, int b = 0, int op = 0);
+
+  // Point the jump at 'address' to the next instruction to be emitted
+  void patch(int address);
+
+  int addConstant(const Expression::Value&);
+
+  // The expression is evaluated by the tree interpreter. It must outlive
+  // the program.
+  int addFallback(const Expression*);
+
+private:
+  void useRegister(int reg);
+
+  Program& program;
+};
+
+// Evaluates a tree by running the Program it lowers to. Printing goes to
+// the original tree.
+class BytecodeExpression : public Expression {
+public:
+  // Takes ownership of the tree
+  explicit BytecodeExpression(Expression* tree);
+  ~BytecodeExpression() override;
+
+  Value compute(ExecutionContext&) const override;
+  void print(std::ostream&) const override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+
+  const Program& getProgram() const { return program; }
+
+protected:
+  Type inferType() const override;
+
+private:
+  Expression* tree;
+  Program program;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "bytecode.h"
+#include "exception.h"
+#include "expression.h"
+#include "test_util.h"
+#include "textsource.h"
+#include "tokenizer.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+Expression* Compile(const std::string& text, Expression::Backend backend,
+                    bool optimize = false) {
+  Expression::CompileOptions options;
+  options.backend = backend;
+  options.optimize = optimize;
+  return ::Compile(text, options);
+}
+
+// Evaluate with the given backend, and describe the outcome
+std::string Evaluate(const std::string& text, Expression::Backend backend,
+                     bool optimize = false) {
+  std::unique_ptr<Expression> e(Compile(text, backend, optimize));
+  ExecutionContext exe;
+  return Outcome(*e, exe);
+}
+
+}  // namespace
+
+// Both backends must agree on every value and every error.
+TEST(BytecodeTest, MatchesTree) {
+  const char* const cases[] = {
+    "1", "1.5", "'str'", "true", "false",
+    "!1", "~1", "-1", "+1", "!'foo'", "~true", "-'12'", "+false",
+    "5 * 7", "12 / 4", "12 / -4", "11 % 10", "11 % -10", "12 - 4",
+    "12 + 4", "1 << 8", "156 >> 3", "127 & 48", "48 | 1", "5 ^ 31",
+    "4 && 0", "4 || 0", "1 / 0", "-1 / 0",
+    "5 < 7", "5 > 7", "5 <= 7", "5 >= 7", "5 == 5", "5 != 5",
+    "'foo' + 'bar'", "'foo' < 'bar'", "'foo' == 'foo'", "'foo' + 1",
+    "1 + '2'", "'3' * 2", "true + 1", "true == false", "true && false",
+    "true || false", "1 < 3 ? 2 : 4", "1 > 3 ? 2 : 4", "'' ? 1 : 'x'",
+    "2 * (4 + 5)", "(2 * 4) + 5", "4, 5, 6", "true, false, 'x'",
+    "1 ? 2 : 3, 4", "1 ? 2, 3 : 4",
+    "false && 'a' * 2", "true || (1 += 2)", "'foo' && 1", "'' || 'x'",
+    "0 || 1 && 2", "'' && (1 || 0)",
+    "((1 + 2) * (3 + 4)) - ((5 + 6) * (7 + 8)) / ((9 - 10) * (11 - 12))",
+    // Errors
+    "true + true", "'foo' * 2", "'foo' - 'bar'", "1 + 'x' * 2",
+    "4 = 2", "1 += (1 / 0)", "true << true", "7 % 0", "1.5 % 0",
+    "-2147483648.0 % -1",
+    "true && true + true", "false || 'a' - 'b'",
+  };
+
+  for (const char* text : cases) {
+    EXPECT_EQ(Evaluate(text, Expression::BACKEND_TREE),
+              Evaluate(text, Expression::BACKEND_BYTECODE)) << text;
+  }
+}
+
+// Chains of + on strings are one instruction, when optimizing
+TEST(BytecodeTest, Concatenation) {
+  const char* const cases[] = {
+    "'a' + -'1' + 'b' + -'2'", "-'1' + 'a' + 2.5 + true + (1 < 2)",
+    "'a' + -'1' + ('b' + -'2') + 'c'", "'a' + -'x' + (true + true) + 'b'",
+    "'a' + (1 ? 'b' : 2) + 0x7fffffffffffffff + (1, 'c')",
+  };
+
+  for (const char* text : cases) {
+    EXPECT_EQ(Evaluate(text, Expression::BACKEND_TREE),
+              Evaluate(text, Expression::BACKEND_BYTECODE, true)) << text;
+  }
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.backend = Expression::BACKEND_BYTECODE;
+  options.optimize = true;
+
+  std::string text = "'a' + x";
+  for (int i = 0; i < 20; i++) {
+    text += (i % 2) ? " + x" : " + '-'";
+  }
+  std::istringstream s(text);
+  Tokenizer tokenizer(new TextSource(s));
+  tokenizer.next();
+  std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+
+  const BytecodeExpression* bytecode =
+      dynamic_cast<const BytecodeExpression*>(e.get());
+  ASSERT_NE(nullptr, bytecode);
+  const Program& program = bytecode->getProgram();
+  EXPECT_EQ(Program::CONCAT, program.getCode().back().opcode);
+  EXPECT_EQ(22, program.getCode().back().b);
+  EXPECT_EQ(22, program.getRegisterCount());
+
+  ExecutionContext exe(symbols);
+  exe.set(symbols.find("x"), Expression::Value(1.0));
+  EXPECT_EQ("a1-1-1-1-1-1-1-1-1-1-1", e->evaluate(exe).asString());
+
+  exe.set(symbols.find("x"), Expression::Value());
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e->evaluate(exe).getType());
+
+  ExecutionContext empty;
+  EXPECT_THROW(e->evaluate(empty), Exception);
+}
+
+TEST(BytecodeTest, Printing) {
+  std::unique_ptr<Expression> e(Compile("1 + 2 * 3",
+                                        Expression::BACKEND_BYTECODE));
+  std::ostringstream out;
+  e->print(out);
+  EXPECT_EQ("(1+(2*3))", out.str());
+}
+
+TEST(BytecodeTest, Program) {
+  std::unique_ptr<Expression> e(Compile("1 + 2 * 3",
+                                        Expression::BACKEND_BYTECODE));
+  const BytecodeExpression* b = dynamic_cast<BytecodeExpression*>(e.get());
+  ASSERT_TRUE(b != nullptr);
+
+  const Program& program = b->getProgram();
+  EXPECT_EQ(3, program.getRegisterCount());
+  ASSERT_EQ(5u, program.getCode().size());
+  EXPECT_EQ(Program::LOAD, program.getCode()[0].opcode);
+  EXPECT_EQ(Program::BINARY, program.getCode()[3].opcode);
+  EXPECT_EQ(Expression::OP_MULTIPLY, program.getCode()[3].op);
+  EXPECT_EQ(Program::BINARY, program.getCode()[4].opcode);
+  EXPECT_EQ(Expression::OP_PLUS, program.getCode()[4].op);
+}
+
+// Deep expressions need more registers than fit on the stack.
+TEST(BytecodeTest, ManyRegisters) {
+  std::string text = "1";
+  for (int i = 0; i < 40; i++) {
+    text = "(" + text + " + (1";
+  }
+  for (int i = 0; i < 40; i++) {
+    text += "))";
+  }
+
+  std::unique_ptr<Expression> e(Compile(text, Expression::BACKEND_BYTECODE));
+  const BytecodeExpression* b = dynamic_cast<BytecodeExpression*>(e.get());
+  ASSERT_TRUE(b != nullptr);
+  EXPECT_LT(16, b->getProgram().getRegisterCount());
+
+  ExecutionContext exe;
+  EXPECT_EQ(41, e->evaluate(exe).asNumber());
+}
+
+TEST(BytecodeTest, Variables) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.backend = Expression::BACKEND_BYTECODE;
+
+  std::istringstream s("a < b ? a + b : name + a");
+  Tokenizer tokenizer(new TextSource(s));
+  tokenizer.next();
+  std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+
+  ExecutionContext exe(symbols);
+  exe.set(symbols.find("a"), Expression::Value(1.0));
+  exe.set(symbols.find("b"), Expression::Value(2.0));
+  exe.set(symbols.find("name"), Expression::Value("n"));
+  EXPECT_EQ(3, e->evaluate(exe).asNumber());
+
+  exe.set(symbols.find("a"), Expression::Value(5.0));
+  EXPECT_EQ("n5", e->evaluate(exe).asString());
+
+  ExecutionContext empty;
+  EXPECT_THROW(e->evaluate(empty), Exception);
+}
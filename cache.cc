@@ -0,0 +1,114 @@
+#include "cache.h"
+#include "exception.h"
+#include "textsource.h"
+#include "tokenizer.h"
+
+#include <functional>
+
+using namespace std;
+
+ExpressionCache::ExpressionCache(size_t inCapacity,
+                                 const Expression::CompileOptions& inOptions,
+                                 int shardCount)
+    : capacity(inCapacity), options(inOptions),
+      hits(0), misses(0), evictions(0) {
+  PRECONDITION(capacity > 0);
+  PRECONDITION(shardCount > 0);
+  PRECONDITION(options.arena == nullptr);
+
+  // Small caches get fewer shards, so that each holds at least one entry
+  if (size_t(shardCount) > capacity) {
+    shardCount = capacity;
+  }
+
+  // The first shards take the remainder, so the shares add up to the
+  // capacity exactly
+  for (int i = 0; i < shardCount; i++) {
+    shards.push_back(unique_ptr<Shard>(new Shard));
+    shards.back()->capacity = capacity / shardCount +
+        ((size_t(i) < capacity % shardCount) ? 1 : 0);
+  }
+}
+
+shared_ptr<const Expression> ExpressionCache::get(const string& text) {
+  const Result<shared_ptr<const Expression> > expr = tryGet(text);
+  expr.getStatus().check();
+  return expr.get();
+}
+
+Result<shared_ptr<const Expression> >
+ExpressionCache::tryGet(const string& text) {
+  Shard& shard = getShard(text);
+  {
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(text);
+    if (it != shard.index.end()) {
+      shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+      ++hits;
+      return it->second->second;
+    }
+  }
+
+  ++misses;
+  const Result<shared_ptr<const Expression> > compiled = compile(text);
+  if (!compiled.ok()) {
+    return compiled;
+  }
+  const shared_ptr<const Expression>& expr = compiled.get();
+
+  lock_guard<mutex> guard(shard.lock);
+
+  // Another thread may have compiled it meanwhile; keep theirs
+  auto it = shard.index.find(text);
+  if (it != shard.index.end()) {
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return it->second->second;
+  }
+
+  shard.entries.push_front(Entry(text, expr));
+  shard.index[text] = shard.entries.begin();
+
+  if (shard.entries.size() > shard.capacity) {
+    shard.index.erase(shard.entries.back().first);
+    shard.entries.pop_back();
+    ++evictions;
+  }
+  return expr;
+}
+
+void ExpressionCache::clear() {
+  for (auto& shard : shards) {
+    lock_guard<mutex> guard(shard->lock);
+    shard->index.clear();
+    shard->entries.clear();
+  }
+}
+
+size_t ExpressionCache::size() const {
+  size_t total = 0;
+  for (auto& shard : shards) {
+    lock_guard<mutex> guard(shard->lock);
+    total += shard->entries.size();
+  }
+  return total;
+}
+
+ExpressionCache::Shard& ExpressionCache::getShard(const string& text) {
+  return *shards[hash<string>()(text) % shards.size()];
+}
+
+Result<shared_ptr<const Expression> >
+ExpressionCache::compile(const string& text) {
+  unique_lock<mutex> guard(compileLock, defer_lock);
+  if (options.symbols != nullptr) {
+    guard.lock();
+  }
+
+  Tokenizer tokenizer(TextSource::tryCreate(text.data(), text.size()));
+  tokenizer.tryNext();
+  const Result<Expression*> expr = Expression::tryCompile(tokenizer, options);
+  if (!expr.ok()) {
+    return expr.getStatus();
+  }
+  return shared_ptr<const Expression>(expr.get());
+}
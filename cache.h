@@ -0,0 +1,82 @@
+#if !defined CACHE_H
+#define      CACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "expression.h"
+
+// Compiled expressions, keyed by their source text, so that text seen
+// before doesn't have to be tokenized and compiled again. The cache holds a
+// bounded number of expressions, evicting the least recently used.
+//
+// Any number of threads can use the cache at once. Keys are spread over
+// shards, each with its own lock, and expressions are compiled outside the
+// locks. The capacity is split between the shards, so the cache never
+// holds more than its capacity, but each shard evicts its own least
+// recently used entry when it's full: recency is only exact within a shard,
+// and a shard can evict while others have room. The expressions are
+// shared and immutable, so they can be evaluated on many threads at once,
+// and stay valid while held even if evicted.
+class ExpressionCache {
+public:
+  // Hold up to 'capacity' expressions, compiled with the given options.
+  // Those can't use an arena (evicted trees have to be freed). If they have
+  // a symbol table, compiles are serialized since they add to it.
+  explicit ExpressionCache(size_t capacity,
+                           const Expression::CompileOptions& options =
+                           Expression::CompileOptions(),
+                           int shards = 16);
+
+  // Return the compiled expression, compiling it if it isn't cached. Text
+  // that doesn't compile throws, and isn't cached.
+  std::shared_ptr<const Expression> get(const std::string& text);
+
+  // The same, returning the error instead of throwing it
+  Result<std::shared_ptr<const Expression> > tryGet(const std::string& text);
+
+  // Drop every expression (the counters are kept)
+  void clear();
+
+  size_t getCapacity() const { return capacity; }
+  size_t size() const;
+
+  uint64_t getHits() const { return hits; }
+  uint64_t getMisses() const { return misses; }
+  uint64_t getEvictions() const { return evictions; }
+
+private:
+  typedef std::pair<std::string, std::shared_ptr<const Expression> > Entry;
+
+  struct Shard {
+    std::mutex lock;
+    size_t capacity;           // Its share of the cache's
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  };
+
+  ExpressionCache(const ExpressionCache&) = delete;
+  ExpressionCache& operator=(const ExpressionCache&) = delete;
+
+  Shard& getShard(const std::string& text);
+  Result<std::shared_ptr<const Expression> > compile(const std::string&);
+
+  const size_t capacity;
+  const Expression::CompileOptions options;
+  std::mutex compileLock;
+
+  std::vector<std::unique_ptr<Shard> > shards;
+
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.h"
+#include "exception.h"
+#include "expression.h"
+
+#include "gtest/gtest.h"
+
+TEST(CacheTest, HitsAndMisses) {
+  ExpressionCache cache(10);
+  std::shared_ptr<const Expression> a = cache.get("1 + 2");
+  std::shared_ptr<const Expression> b = cache.get("1 + 2");
+  std::shared_ptr<const Expression> c = cache.get("1 + 3");
+
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_EQ(1u, cache.getHits());
+  EXPECT_EQ(2u, cache.getMisses());
+  EXPECT_EQ(0u, cache.getEvictions());
+  EXPECT_EQ(2u, cache.size());
+
+  ExecutionContext context;
+  EXPECT_EQ(3, a->evaluate(context).getInteger());
+  EXPECT_EQ(4, c->evaluate(context).getInteger());
+}
+
+TEST(CacheTest, LeastRecentlyUsedIsEvicted) {
+  // One shard, so the order is exact
+  ExpressionCache cache(2, Expression::CompileOptions(), 1);
+  std::shared_ptr<const Expression> one = cache.get("1");
+  cache.get("2");
+  cache.get("1");
+  cache.get("3");  // Evicts 2
+
+  EXPECT_EQ(1u, cache.getEvictions());
+  EXPECT_EQ(2u, cache.size());
+
+  EXPECT_EQ(one, cache.get("1"));
+  const uint64_t misses = cache.getMisses();
+  cache.get("2");
+  EXPECT_EQ(misses + 1, cache.getMisses());
+}
+
+// The capacity is split between the shards, without rounding up
+TEST(CacheTest, NeverHoldsMoreThanItsCapacity) {
+  const size_t capacities[] = { 1, 5, 16, 17, 100, 1000 };
+  for (size_t capacity : capacities) {
+    ExpressionCache cache(capacity);
+    for (size_t i = 0; i < capacity * 4; i++) {
+      cache.get(std::to_string(i));
+      ASSERT_LE(cache.size(), cache.getCapacity()) << capacity;
+    }
+    EXPECT_LT(capacity / 2, cache.size()) << capacity;
+  }
+}
+
+TEST(CacheTest, EvictedExpressionsStayValid) {
+  ExpressionCache cache(1);
+  std::shared_ptr<const Expression> e = cache.get("'still' + ' here'");
+  cache.get("2");
+  cache.clear();
+  EXPECT_EQ(0u, cache.size());
+
+  ExecutionContext context;
+  EXPECT_EQ("still here", e->evaluate(context).getString());
+}
+
+TEST(CacheTest, ErrorsArentCached) {
+  ExpressionCache cache(10);
+  EXPECT_THROW(cache.get("1 +"), Exception);
+  EXPECT_THROW(cache.get("1 +"), Exception);
+  EXPECT_EQ(2u, cache.getMisses());
+  EXPECT_EQ(0u, cache.size());
+
+  // Evaluation errors are the caller's
+  std::shared_ptr<const Expression> e = cache.get("true + true");
+  ExecutionContext context;
+  EXPECT_THROW(e->evaluate(context), Exception);
+}
+
+TEST(CacheTest, TryGet) {
+  ExpressionCache cache(10);
+  Result<std::shared_ptr<const Expression> > e = cache.tryGet("1 +");
+  EXPECT_EQ(Status::SYNTAX_ERROR, e.getStatus().getCode());
+  EXPECT_EQ(nullptr, e.get());
+  EXPECT_EQ(0u, cache.size());
+
+  e = cache.tryGet("1 + 2");
+  ASSERT_TRUE(e.ok());
+  EXPECT_EQ(e.get(), cache.tryGet("1 + 2").get());
+  EXPECT_EQ(e.get(), cache.get("1 + 2"));
+  EXPECT_EQ(2u, cache.getHits());
+}
+
+TEST(CacheTest, Options) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = true;
+  options.backend = Expression::BACKEND_BYTECODE;
+
+  ExpressionCache cache(10, options);
+  std::shared_ptr<const Expression> e = cache.get("x * (2 + 3)");
+  EXPECT_EQ(0, symbols.find("x"));
+
+  ExecutionContext context(symbols);
+  context.set(0, Expression::Value(2.0));
+  EXPECT_EQ(10, e->evaluate(context).getNumber());
+}
+
+// An expression too large for bytecode is an error like any other
+TEST(CacheTest, TooLargeForBytecode) {
+  SymbolTable symbols;
+  symbols.add("x");
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.backend = Expression::BACKEND_BYTECODE;
+
+  std::string text = "1";
+  for (int i = 0; i < 70000; i++) {
+    text += ", x";
+  }
+
+  ExpressionCache cache(10, options);
+  const Result<std::shared_ptr<const Expression> > e = cache.tryGet(text);
+  EXPECT_EQ(Status::EVALUATION_ERROR, e.getStatus().getCode());
+  EXPECT_EQ("Expression is too large to lower to bytecode",
+            e.getStatus().getMessage());
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_THROW(cache.get(text), Exception);
+}
+
+TEST(CacheTest, Threads) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  ExpressionCache cache(8, options, 4);
+
+  const int kThreads = 8;
+  const int kRounds = 500;
+  std::vector<int> failures(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([&, t] {
+      ExecutionContext context(1);
+      for (int i = 0; i < kRounds; i++) {
+        // More distinct texts than the cache holds, so some get evicted
+        const int n = (i * 7 + t) % 12;
+        std::shared_ptr<const Expression> e =
+            cache.get("x + " + std::to_string(n));
+        context.set(0, Expression::Value(double(i)));
+        if (e->evaluate(context).getNumber() != i + n) {
+          ++failures[t];
+        }
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < kThreads; t++) {
+    EXPECT_EQ(0, failures[t]);
+  }
+  EXPECT_EQ(uint64_t(kThreads * kRounds),
+            cache.getHits() + cache.getMisses());
+  EXPECT_LE(cache.size(), 8u);
+  EXPECT_LT(0u, cache.getEvictions());
+  EXPECT_EQ(1, symbols.size());
+}
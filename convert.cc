@@ -0,0 +1,228 @@
+#include "convert.h"
+
+#include <algorithm>
+#include <locale.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+namespace {
+
+// The powers of ten that doubles hold exactly
+const double kPowers[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+  1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+const int kMaxPower = 22;
+
+// Significant digits written, as by ostream's default precision
+const int kPrecision = 6;
+
+// Doubles hold every integer up to this exactly
+const uint64_t kMaxExact = uint64_t(1) << 53;
+
+bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// What the C library uses in place of '.', if the program has set a locale
+char decimalPoint() {
+  return *localeconv()->decimal_point;
+}
+
+string slowFormat(double v) {
+  char buffer[32];
+  const int length = snprintf(buffer, sizeof(buffer), "%.6g", v);
+  const char point = decimalPoint();
+  if (point != '.') {
+    replace(buffer, buffer + length, point, '.');
+  }
+  return string(buffer, length);
+}
+
+bool slowParse(const char* text, size_t length, double& result) {
+  string copy(text, length);
+  const char point = decimalPoint();
+  if (point != '.') {
+    // That's never part of a number in the C locale
+    if (copy.find(point) != string::npos) return false;
+    replace(copy.begin(), copy.end(), '.', point);
+  }
+
+  char* end = nullptr;
+  const double value = strtod(copy.c_str(), &end);
+  if (end == copy.c_str() || *end != '\0') {
+    return false;
+  }
+  result = value;
+  return true;
+}
+
+}  // namespace
+
+string number2string(double v) {
+  if (v == 0) {
+    return signbit(v) ? "-0" : "0";
+  }
+
+  // Outside this range (and for inf and NaN), leave it to printf
+  const double a = fabs(v);
+  if (!(a >= 1e-5 && a < 1e15)) {
+    return slowFormat(v);
+  }
+
+  // 10^exponent <= a < 10^(exponent + 1), except that rounding in the
+  // product may make it one too large for a just under a power of ten;
+  // then the digits round up to exactly that power anyway.
+  int exponent = 0;
+  if (a >= 1) {
+    while (a >= kPowers[exponent + 1]) exponent++;
+  } else {
+    exponent = -1;
+    while (a * kPowers[-exponent] < 1) exponent--;
+  }
+
+  // Scale to six digits before the point. That's a single rounding, by an
+  // exact power of ten, so it's off by much less than the margin used
+  // here; only values that close to halfway between two results (or exactly
+  // on it, where printf looks at the exact binary value) go to printf.
+  const int shift = kPrecision - 1 - exponent;
+  const double scaled =
+      (shift >= 0) ? a * kPowers[shift] : a / kPowers[-shift];
+  const double whole = floor(scaled);
+  const double fraction = scaled - whole;
+  if (scaled < 99999.5 || fabs(fraction - 0.5) < 1e-6) {
+    return slowFormat(v);
+  }
+
+  int64_t digits = int64_t(whole) + (fraction > 0.5 ? 1 : 0);
+  if (digits == 1000000) {
+    digits = 100000;
+    exponent++;
+  }
+
+  char text[kPrecision];
+  for (int i = kPrecision - 1; i >= 0; i--) {
+    text[i] = '0' + digits % 10;
+    digits /= 10;
+  }
+
+  // As with %g, trailing zeros after the point are dropped, and the point
+  // with them if nothing's left
+  int count = kPrecision;
+  while (count > 1 && text[count - 1] == '0') {
+    count--;
+  }
+
+  char buffer[32];
+  char* out = buffer;
+  if (v < 0) {
+    *out++ = '-';
+  }
+
+  if (exponent >= kPrecision || exponent < -4) {
+    *out++ = text[0];
+    if (count > 1) {
+      *out++ = '.';
+      out = copy(text + 1, text + count, out);
+    }
+    *out++ = 'e';
+    *out++ = (exponent < 0) ? '-' : '+';
+    const int magnitude = abs(exponent);
+    *out++ = '0' + magnitude / 10;
+    *out++ = '0' + magnitude % 10;
+  } else if (exponent >= 0) {
+    for (int i = 0; i <= exponent; i++) {
+      *out++ = (i < count) ? text[i] : '0';
+    }
+    if (count > exponent + 1) {
+      *out++ = '.';
+      out = copy(text + exponent + 1, text + count, out);
+    }
+  } else {
+    *out++ = '0';
+    *out++ = '.';
+    out = fill_n(out, -exponent - 1, '0');
+    out = copy(text, text + count, out);
+  }
+
+  return string(buffer, out - buffer);
+}
+
+bool string2number(const char* text, size_t length, double& result) {
+  const char* p = text;
+  const char* const end = text + length;
+
+  const bool negative = (p != end && *p == '-');
+  if (p != end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+
+  // The digits, without leading zeros, as an integer, and the power of ten
+  // to multiply it by. Past 19 digits, the integer isn't right, but then
+  // it isn't used.
+  uint64_t mantissa = 0;
+  int significant = 0;
+  int exponent = 0;
+  bool any = false;
+  for (; p != end && isDigit(*p); p++) {
+    any = true;
+    if (mantissa != 0 || *p != '0') {
+      mantissa = mantissa * 10 + (*p - '0');
+      significant++;
+    }
+  }
+  if (p != end && *p == '.') {
+    for (p++; p != end && isDigit(*p); p++) {
+      any = true;
+      if (mantissa != 0 || *p != '0') {
+        mantissa = mantissa * 10 + (*p - '0');
+        significant++;
+      }
+      exponent--;
+    }
+  }
+
+  // An exponent needs digits, or the 'e' isn't part of the number
+  if (any && p != end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    const bool negativeExponent = (q != end && *q == '-');
+    if (q != end && (*q == '-' || *q == '+')) {
+      q++;
+    }
+    if (q != end && isDigit(*q)) {
+      int value = 0;
+      for (; q != end && isDigit(*q); q++) {
+        if (value < 100000) {
+          value = value * 10 + (*q - '0');
+        }
+      }
+      exponent += negativeExponent ? -value : value;
+      p = q;
+    }
+  }
+
+  // Anything else (whitespace, hex, inf, ...) is left to strtod
+  if (!any || p != end) {
+    return slowParse(text, length, result);
+  }
+
+  // Both the mantissa and the power of ten are exact, so one multiply or
+  // divide rounds correctly. Otherwise strtod does the hard work.
+  double value = 0;
+  if (significant != 0) {
+    if (significant > 19 || mantissa > kMaxExact ||
+        exponent < -kMaxPower || exponent > kMaxPower) {
+      return slowParse(text, length, result);
+    }
+    value = (exponent < 0) ? double(mantissa) / kPowers[-exponent]
+                           : double(mantissa) * kPowers[exponent];
+  }
+
+  result = negative ? -value : value;
+  return true;
+}
@@ -0,0 +1,21 @@
+#if !defined CONVERT_H
+#define      CONVERT_H
+
+#include <stddef.h>
+#include <string>
+
+// Conversions between numbers and their text, for strings upcast to
+// numbers and numbers upcast to strings. These are on the hot path of
+// mixed expressions like 'id-' + n or '42' * 2, so the common cases are
+// done directly, without streams or strtod; the rest go to the C library.
+// Either way the results don't depend on the locale.
+
+// The number as ostream's default formatting writes it, i.e. printf's
+// "%.6g" in the C locale: "42", "0.1", "3.14159", "1e+20", "-inf"
+std::string number2string(double);
+
+// Parse the whole text as strtod would in the C locale, correctly rounded.
+// Returns false, leaving 'result' alone, if it isn't a number.
+bool string2number(const char* text, size_t length, double& result);
+
+#endif
@@ -0,0 +1,192 @@
+#include "convert.h"
+
+#include <limits>
+#include <locale.h>
+#include <math.h>
+#include <random>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// What ostream writes by default, which number2string must match
+std::string Streamed(double v) {
+  std::ostringstream out;
+  out << v;
+  return out.str();
+}
+
+// strtod's verdict on the whole text, and the value's bits
+std::string Strtod(const std::string& text) {
+  char* end = nullptr;
+  const double value = strtod(text.c_str(), &end);
+  if (end == text.c_str() || *end != '\0') {
+    return "invalid";
+  }
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return std::to_string(bits);
+}
+
+std::string Parsed(const std::string& text) {
+  double value = 0;
+  if (!string2number(text.data(), text.size(), value)) {
+    return "invalid";
+  }
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return std::to_string(bits);
+}
+
+}  // namespace
+
+TEST(ConvertTest, Format) {
+  EXPECT_EQ("0", number2string(0));
+  EXPECT_EQ("-0", number2string(-0.0));
+  EXPECT_EQ("42", number2string(42));
+  EXPECT_EQ("-42", number2string(-42));
+  EXPECT_EQ("0.1", number2string(0.1));
+  EXPECT_EQ("0.3", number2string(0.1 + 0.2));
+  EXPECT_EQ("3.14159", number2string(3.14159265));
+  EXPECT_EQ("123457", number2string(123456.7));
+  EXPECT_EQ("1.23457e+06", number2string(1234567));
+  EXPECT_EQ("1e+06", number2string(999999.5));
+  EXPECT_EQ("0.0001", number2string(0.0001));
+  EXPECT_EQ("1e-05", number2string(0.00001));
+  EXPECT_EQ("1e+20", number2string(1e20));
+  EXPECT_EQ("1.79769e+308", number2string(1.7976931348623157e308));
+  EXPECT_EQ("4.94066e-324", number2string(4.9406564584124654e-324));
+  EXPECT_EQ("inf", number2string(std::numeric_limits<double>::infinity()));
+  EXPECT_EQ("-inf",
+            number2string(-std::numeric_limits<double>::infinity()));
+  EXPECT_EQ(Streamed(NAN), number2string(NAN));
+}
+
+TEST(ConvertTest, FormatMatchesStreams) {
+  const double cases[] = {
+    0.5, 2.5, 1.5, 0.125, 123456.5, 1234565, 1234575, 9999995, 99999.95,
+    0.000123456, 0.0001234565, 1e-4, 9.999995e-5, 1e15, 999999999999999.0,
+    1e14, 123456789012345.0, 1e-5, 9.9999949999e-6, 65536, 4294967296.0,
+    0.30000000000000004, 1.0000005, 1.0000015, 2.0000025,
+  };
+  for (double v : cases) {
+    EXPECT_EQ(Streamed(v), number2string(v)) << v;
+    EXPECT_EQ(Streamed(-v), number2string(-v)) << -v;
+  }
+
+  std::mt19937_64 random(1);
+
+  // Any bits at all
+  for (int i = 0; i < 100000; i++) {
+    const uint64_t bits = random();
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    ASSERT_EQ(Streamed(v), number2string(v)) << bits;
+  }
+
+  // Numbers in the range that's formatted directly, and numbers with few
+  // digits, which land on or near the halfway points
+  std::uniform_real_distribution<double> exponents(-6, 16);
+  for (int i = 0; i < 100000; i++) {
+    const double v = pow(10, exponents(random));
+    ASSERT_EQ(Streamed(v), number2string(v)) << v;
+
+    const double few = double(random() % 100000000) /
+        pow(10, int(random() % 12));
+    ASSERT_EQ(Streamed(few), number2string(few)) << few;
+  }
+}
+
+TEST(ConvertTest, Parse) {
+  double value = 0;
+  EXPECT_TRUE(string2number("42", 2, value));
+  EXPECT_EQ(42, value);
+  EXPECT_TRUE(string2number("-2.5e3", 6, value));
+  EXPECT_EQ(-2500, value);
+
+  // Only the given length is read
+  EXPECT_TRUE(string2number("1234", 2, value));
+  EXPECT_EQ(12, value);
+
+  value = 7;
+  EXPECT_FALSE(string2number("4x", 2, value));
+  EXPECT_FALSE(string2number("", 0, value));
+  EXPECT_EQ(7, value);
+}
+
+TEST(ConvertTest, ParseMatchesStrtod) {
+  const char* const cases[] = {
+    "0", "-0", "+0", "00", "0.0", "-0.0e5", "1", "+1", "-1", ".5", "5.",
+    "-.5e-3", "1e5", "1E+05", "1e-5", "1e22", "1e23", "1e-22", "1e-23",
+    "9007199254740992", "9007199254740993", "18446744073709551615",
+    "18446744073709551616", "123456789012345678901234567890",
+    "0.1", "0.30000000000000004", "2.2250738585072011e-308",
+    "4.9406564584124654e-324", "2e-324", "1e400", "-1e400", "1e-400",
+    "1.7976931348623157e308", "1.7976931348623159e308",
+    "0000000000000000000000000001", "0.0000000000000000000000000001",
+    "1e99999999999", "1e-99999999999", "0e99999999999",
+    "0x1A", "0x1p3", "inf", "-Infinity", "nan", " 1", "1 ", "", "+", "-",
+    ".", "e5", "1e", "1e+", "1.2.3", "--1", "1,5", "1e5.5", "abc",
+  };
+  for (const char* text : cases) {
+    EXPECT_EQ(Strtod(text), Parsed(text)) << text;
+  }
+
+  std::mt19937_64 random(1);
+
+  // Decimal numbers of up to 25 digits, with exponents
+  for (int i = 0; i < 100000; i++) {
+    std::string text = (random() % 2) ? "-" : "";
+    const int digits = 1 + random() % 25;
+    const int point = random() % (digits + 1);
+    for (int d = 0; d < digits; d++) {
+      if (d == point) text += '.';
+      text += char('0' + random() % 10);
+    }
+    if (random() % 2) {
+      text += "e" + std::to_string(int(random() % 80) - 40);
+    }
+    ASSERT_EQ(Strtod(text), Parsed(text)) << text;
+  }
+
+  // Any double, written out in full
+  for (int i = 0; i < 100000; i++) {
+    const uint64_t bits = random();
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    char text[32];
+    snprintf(text, sizeof(text), "%.17g", v);
+    ASSERT_EQ(Strtod(text), Parsed(text)) << text;
+  }
+}
+
+TEST(ConvertTest, LocaleIndependent) {
+  // Only meaningful where a locale with a decimal comma is installed
+  const char* const locales[] = { "de_DE.UTF-8", "de_DE", "fr_FR.UTF-8" };
+  const char* found = nullptr;
+  for (const char* locale : locales) {
+    if (setlocale(LC_NUMERIC, locale) != nullptr) {
+      found = locale;
+      break;
+    }
+  }
+  if (found == nullptr) {
+    return;
+  }
+
+  double value = 0;
+  EXPECT_TRUE(string2number("2.5", 3, value));
+  EXPECT_EQ(2.5, value);
+  EXPECT_TRUE(string2number("0.1234567890123456789e-30", 25, value));
+  EXPECT_FALSE(string2number("2,5", 3, value));
+  EXPECT_EQ("2.5", number2string(2.5));
+  EXPECT_EQ("1.5e+300", number2string(1.5e300));
+
+  setlocale(LC_NUMERIC, "C");
+}
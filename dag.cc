@@ -0,0 +1,480 @@
+// Sharing expressions' identical subtrees (Expression::share) and
+// evaluating the shared nodes once; see dag.h.
+
+#include "dag.h"
+#include "bytecode.h"
+#include "exception.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <string.h>
+
+using namespace std;
+
+typedef Expression::Value Value;
+
+namespace {
+
+// Mix another value into a hash
+size_t combine(size_t hash, size_t value) {
+  return hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+}
+
+// Numbers hash and compare by their bits, so that 0 and -0 stay apart
+uint64_t bits(const Expression::Value& v) {
+  uint64_t result = 0;
+  switch (v.getType()) {
+    case Expression::TYPE_NUMBER: {
+      const double number = v.getNumber();
+      memcpy(&result, &number, sizeof(result));
+      break;
+    }
+    case Expression::TYPE_INTEGER:
+      result = v.getInteger();
+      break;
+    case Expression::TYPE_BOOL:
+      result = v.getBool();
+      break;
+    default:
+      break;
+  }
+  return result;
+}
+
+size_t hashValue(const Expression::Value& v) {
+  const size_t hash = combine(0, v.getType());
+  if (v.getType() == Expression::TYPE_STRING) {
+    return combine(hash, std::hash<string>()(v.getString()));
+  }
+  return combine(hash, bits(v));
+}
+
+bool sameValue(const Expression::Value& x, const Expression::Value& y) {
+  if (x.getType() != y.getType()) {
+    return false;
+  } else if (x.getType() == Expression::TYPE_STRING) {
+    return x.getString() == y.getString();
+  }
+  return bits(x) == bits(y);
+}
+
+Expression::Value fail(Status& status, const char* format,
+                       const string& argument = string()) {
+  status.update(Status(Status::EVALUATION_ERROR, format, argument));
+  return Expression::Value();
+}
+
+}  // namespace
+
+// Sharing
+
+int Expression::share(ExpressionDag&) const {
+  throw Exception("This kind of expression can't be shared");
+}
+
+int ConstantExpression::share(ExpressionDag& dag) const {
+  return dag.addConstant(value);
+}
+
+int VariableExpression::share(ExpressionDag& dag) const {
+  return dag.addVariable(name, slot);
+}
+
+int UnaryOperator::share(ExpressionDag& dag) const {
+  return dag.addNode(ExpressionDag::UNARY, op, child->share(dag));
+}
+
+// Specialized subclasses share with the plain operator
+int BinaryOperator::share(ExpressionDag& dag) const {
+  const int a = left->share(dag);
+  const int b = right->share(dag);
+  return dag.addNode(ExpressionDag::BINARY, op, a, b);
+}
+
+int LogicalOperator::share(ExpressionDag& dag) const {
+  const int a = left->share(dag);
+  const int b = right->share(dag);
+  return dag.addNode(ExpressionDag::LOGICAL, op, a, b);
+}
+
+int TernaryOperator::share(ExpressionDag& dag) const {
+  const int a = test->share(dag);
+  const int b = positive->share(dag);
+  const int c = negative->share(dag);
+  return dag.addNode(ExpressionDag::TERNARY, OP_TERNARY, a, b, c);
+}
+
+int SequenceExpression::share(ExpressionDag& dag) const {
+  vector<int> shared;
+  for (const Expression* sub : subs) {
+    shared.push_back(sub->share(dag));
+  }
+  return dag.addList(ExpressionDag::SEQUENCE, shared);
+}
+
+int ConcatExpression::share(ExpressionDag& dag) const {
+  vector<int> shared;
+  for (const Expression* operand : operands) {
+    shared.push_back(operand->share(dag));
+  }
+  return dag.addList(ExpressionDag::CONCAT, shared);
+}
+
+int BytecodeExpression::share(ExpressionDag& dag) const {
+  return tree->share(dag);
+}
+
+ExpressionDag::ExpressionDag() {}
+
+int ExpressionDag::add(const Expression& expr) {
+  roots.push_back(expr.share(*this));
+  return roots.size() - 1;
+}
+
+int ExpressionDag::addConstant(const Expression::Value& value) {
+  Node node;
+  node.kind = CONSTANT;
+  node.op = 0;
+  node.a = node.b = node.c = 0;
+  node.hash = combine(CONSTANT, hashValue(value));
+  node.value = value;
+  return intern(node);
+}
+
+int ExpressionDag::addVariable(const string& name, int slot) {
+  Node node;
+  node.kind = VARIABLE;
+  node.op = 0;
+  node.a = slot;
+  node.b = node.c = 0;
+  node.hash = combine(VARIABLE, slot);
+  node.value = Expression::Value(name);
+  return intern(node);
+}
+
+int ExpressionDag::addNode(Kind kind, Expression::Operator op,
+                           int a, int b, int c) {
+  PRECONDITION((kind == UNARY) || (kind == BINARY) || (kind == LOGICAL) ||
+               (kind == TERNARY));
+  const int count = (kind == UNARY) ? 1 : (kind == TERNARY) ? 3 : 2;
+  const int kids[] = { a, (count > 1) ? b : 0, (count > 2) ? c : 0 };
+
+  Node node;
+  node.kind = kind;
+  node.op = op;
+  node.a = kids[0];
+  node.b = kids[1];
+  node.c = kids[2];
+  node.hash = combine(kind, op);
+  for (int i = 0; i < count; i++) {
+    PRECONDITION((kids[i] >= 0) && (kids[i] < getNodeCount()));
+    node.hash = combine(node.hash, nodes[kids[i]].hash);
+  }
+  return intern(node);
+}
+
+int ExpressionDag::addList(Kind kind, const vector<int>& list) {
+  PRECONDITION((kind == SEQUENCE) || (kind == CONCAT));
+
+  Node node;
+  node.kind = kind;
+  node.op = 0;
+  node.a = children.size();
+  node.b = list.size();
+  node.c = 0;
+  node.hash = combine(kind, list.size());
+  for (int child : list) {
+    PRECONDITION((child >= 0) && (child < getNodeCount()));
+    node.hash = combine(node.hash, nodes[child].hash);
+  }
+  return intern(node, list.data());
+}
+
+int ExpressionDag::intern(Node& node, const int* listChildren) {
+  auto range = index.equal_range(node.hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (sameNode(nodes[it->second], node, listChildren)) {
+      return it->second;
+    }
+  }
+
+  // Only now are the list's children added
+  if (listChildren != nullptr) {
+    children.insert(children.end(), listChildren, listChildren + node.b);
+  }
+
+  const int result = nodes.size();
+  nodes.push_back(std::move(node));
+  index.insert(make_pair(nodes.back().hash, result));
+  addSlots(result);
+  return result;
+}
+
+void ExpressionDag::addSlots(int n) {
+  const Node& node = nodes[n];
+  vector<int> kids;
+  switch (node.kind) {
+    case CONSTANT:
+    case VARIABLE:
+      break;
+    case UNARY:
+      kids.push_back(node.a);
+      break;
+    case BINARY:
+    case LOGICAL:
+      kids.push_back(node.a);
+      kids.push_back(node.b);
+      break;
+    case TERNARY:
+      kids.push_back(node.a);
+      kids.push_back(node.b);
+      kids.push_back(node.c);
+      break;
+    case SEQUENCE:
+    case CONCAT:
+      kids.assign(children.begin() + node.a,
+                  children.begin() + node.a + node.b);
+      break;
+  }
+
+  vector<int> mine;
+  if (node.kind == VARIABLE) {
+    mine.push_back(node.a);
+  }
+  for (int kid : kids) {
+    vector<int> merged;
+    set_union(mine.begin(), mine.end(), slots[kid].begin(),
+              slots[kid].end(), back_inserter(merged));
+    mine.swap(merged);
+  }
+
+  for (int slot : mine) {
+    if (size_t(slot) >= dependents.size()) {
+      dependents.resize(slot + 1);
+    }
+    dependents[slot].push_back(n);
+  }
+  slots.push_back(std::move(mine));
+}
+
+const vector<int>& ExpressionDag::getDependents(int slot) const {
+  static const vector<int> none;
+  return (slot >= 0 && size_t(slot) < dependents.size())
+      ? dependents[slot] : none;
+}
+
+bool ExpressionDag::sameNode(const Node& existing, const Node& node,
+                             const int* listChildren) const {
+  if ((existing.kind != node.kind) || (existing.op != node.op)) {
+    return false;
+  }
+
+  switch (node.kind) {
+    case CONSTANT:
+      return sameValue(existing.value, node.value);
+    case SEQUENCE:
+    case CONCAT:
+      return (existing.b == node.b) &&
+          equal(listChildren, listChildren + node.b,
+                children.begin() + existing.a);
+    default:
+      // Children are shared already, so the same children are the same
+      // nodes
+      return (existing.a == node.a) && (existing.b == node.b) &&
+          (existing.c == node.c);
+  }
+}
+
+size_t structuralHash(const Expression& expr) {
+  ExpressionDag dag;
+  return dag.getNode(dag.getRoot(dag.add(expr))).hash;
+}
+
+bool structurallyEqual(const Expression& x, const Expression& y) {
+  ExpressionDag dag;
+  return dag.getRoot(dag.add(x)) == dag.getRoot(dag.add(y));
+}
+
+// Evaluating
+
+DagEvaluator::DagEvaluator(const ExpressionDag& inDag)
+    : dag(inDag), generation(0), computed(0) {
+  reset();
+}
+
+void DagEvaluator::reset() {
+  // Entries from earlier generations are stale, unless the count has
+  // wrapped around to them
+  if (++generation == 0) {
+    for (Entry& entry : entries) {
+      entry.generation = 0;
+    }
+    generation = 1;
+  }
+
+  Entry stale;
+  stale.generation = 0;
+  stale.failed = false;
+  entries.resize(dag.getNodeCount(), stale);
+
+  errors.clear();
+  computed = 0;
+}
+
+void DagEvaluator::invalidate(int slot) {
+  for (int n : dag.getDependents(slot)) {
+    if (size_t(n) >= entries.size()) {
+      break;
+    }
+    Entry& entry = entries[n];
+    if (entry.generation == generation) {
+      entry.generation = 0;
+      if (entry.failed) {
+        errors.erase(n);
+      }
+    }
+  }
+}
+
+void DagEvaluator::set(ExecutionContext& e, int slot, const Value& value) {
+  PRECONDITION(slot >= 0);
+  if (slot < e.size()) {
+    if (sameValue(e.get(slot), value)) {
+      return;
+    }
+    e.set(slot, value);
+    invalidate(slot);
+    return;
+  }
+
+  // Growing the context defines the slots up to this one, which were
+  // errors before
+  const int first = e.size();
+  e.set(slot, value);
+  for (int s = first; s <= slot; s++) {
+    invalidate(s);
+  }
+}
+
+Expression::Value DagEvaluator::evaluate(int i, ExecutionContext& e) {
+  Value result = get(dag.getRoot(i), e);
+  if (!e.getStatus().ok()) {
+    e.takeStatus().check();
+  }
+  return result;
+}
+
+Result<Expression::Value> DagEvaluator::tryEvaluate(int i,
+                                                    ExecutionContext& e) {
+  Value result = get(dag.getRoot(i), e);
+  if (!e.getStatus().ok()) {
+    return e.takeStatus();
+  }
+  return result;
+}
+
+Expression::Value DagEvaluator::get(int n, ExecutionContext& e) {
+  PRECONDITION(size_t(dag.getNodeCount()) == entries.size());
+
+  if (entries[n].generation == generation) {
+    if (entries[n].failed) {
+      e.getStatus().update(errors[n]);
+    }
+    return entries[n].value;
+  }
+
+  // The node's own error has to be kept for the other expressions that use
+  // it, even if this one has failed already
+  Status earlier;
+  const bool failedEarlier = !e.getStatus().ok();
+  if (failedEarlier) {
+    earlier = e.takeStatus();
+  }
+
+  Value value = compute(n, e);
+  computed++;
+
+  Entry& entry = entries[n];
+  entry.generation = generation;
+  entry.failed = !e.getStatus().ok();
+  entry.value = value;
+  if (entry.failed) {
+    errors[n] = e.getStatus();
+  }
+
+  if (failedEarlier) {
+    e.getStatus() = std::move(earlier);
+  }
+  return value;
+}
+
+// As the nodes' compute() does
+Expression::Value DagEvaluator::compute(int n, ExecutionContext& e) {
+  const ExpressionDag::Node& node = dag.getNode(n);
+  const Expression::Operator op = Expression::Operator(node.op);
+  switch (node.kind) {
+    case ExpressionDag::CONSTANT:
+      return node.value;
+
+    case ExpressionDag::VARIABLE:
+      if (node.a >= e.size()) {
+        return fail(e.getStatus(), "Undefined variable: %s",
+                    node.value.getString());
+      }
+      return e.get(node.a);
+
+    case ExpressionDag::UNARY:
+      return Expression::applyUnary(op, get(node.a, e), e.getStatus());
+
+    case ExpressionDag::BINARY: {
+      if (Expression::isAssignment(op)) {
+        return fail(e.getStatus(), "Not implemented: %s",
+                    Expression::operator2string(op));
+      }
+      const Value left = get(node.a, e);
+      const Value right = get(node.b, e);
+      return Expression::applyBinary(op, left, right, e.getStatus());
+    }
+
+    case ExpressionDag::LOGICAL: {
+      const bool settles = (op == Expression::OP_OROR);
+      const Value left = get(node.a, e);
+      if (left.getType() == Expression::TYPE_UNKNOWN) {
+        return Value();
+      } else if (left.asBool() == settles) {
+        return Value(settles);
+      }
+      const Value right = get(node.b, e);
+      if (right.getType() == Expression::TYPE_UNKNOWN) {
+        return Value();
+      }
+      return Value(right.asBool());
+    }
+
+    case ExpressionDag::TERNARY:
+      return get(get(node.a, e).asBool() ? node.b : node.c, e);
+
+    case ExpressionDag::SEQUENCE: {
+      if (node.b == 0) {
+        return fail(e.getStatus(), "Attempt to execute an empty sequence");
+      }
+      Value v;
+      for (int i = 0; i < node.b; i++) {
+        v = get(dag.getChild(node.a + i), e);
+      }
+      return v;
+    }
+
+    case ExpressionDag::CONCAT: {
+      vector<Value> values(node.b);
+      for (int i = 0; i < node.b; i++) {
+        values[i] = get(dag.getChild(node.a + i), e);
+      }
+      return Expression::applyConcat(values.data(), node.b);
+    }
+  }
+
+  ASSERTION(false);
+  return Value();
+}
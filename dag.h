@@ -0,0 +1,182 @@
+#if !defined DAG_H
+#define      DAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expression.h"
+#include "status.h"
+
+// Many expressions, with every distinct subtree stored once. Rule sets
+// often repeat a subexpression like (a * 1.5 + b) across hundreds of
+// rules; compiled separately, each rule has its own copy, built and
+// evaluated again each time. Added to a DAG, they share one node, which a
+// DagEvaluator computes once per evaluation.
+//
+// Nodes are hash-consed: a node is only added if there's no node already
+// with the same kind, operator, constant or variable, and children. Since
+// the children are shared first, two subtrees get the same node exactly
+// when they have the same structure. Specialized operators are kept as
+// the operator they stand for, so they share with plain ones; bytecode and
+// native expressions are added as the trees they run. Variables are kept
+// by slot, so expressions added together must use the same symbol table.
+//
+// Each node also records the variables it depends on, so that when only a
+// few of them change, a DagEvaluator can keep the values of the nodes that
+// don't depend on those and compute just the rest again.
+class ExpressionDag {
+public:
+  enum Kind {
+    CONSTANT,  // value: the constant
+    VARIABLE,  // a: the slot; value: the name, as a string
+    UNARY,     // op; a: the operand
+    BINARY,    // op; a, b: the operands
+    LOGICAL,   // op: && or ||; a, b: the operands
+    TERNARY,   // a, b, c: the test and branches
+    SEQUENCE,  // a, b: the offset and count of the children
+    CONCAT     // The same, for a ConcatExpression
+  };
+
+  struct Node {
+    uint8_t kind;
+    uint8_t op;  // An Expression::Operator
+    int a;
+    int b;
+    int c;
+    size_t hash;  // Of the structure, not of the node indexes
+    Expression::Value value;
+  };
+
+  ExpressionDag();
+
+  // Add the expression's nodes, sharing any subtree that's already here,
+  // and return the expression's index
+  int add(const Expression&);
+
+  // The number of expressions
+  int size() const { return roots.size(); }
+
+  // The node at the top of expression 'i'
+  int getRoot(int i) const { return roots[i]; }
+
+  int getNodeCount() const { return nodes.size(); }
+  const Node& getNode(int i) const { return nodes[i]; }
+
+  // Child 'i' of a sequence or concatenation is node getChild(a + i)
+  int getChild(int i) const { return children[i]; }
+
+  // The slots of the variables in the node's subtree, in order
+  const std::vector<int>& getSlots(int node) const { return slots[node]; }
+
+  // The nodes with the slot's variable in their subtrees, children before
+  // parents
+  const std::vector<int>& getDependents(int slot) const;
+
+  // Return the node with these contents, adding it if it's new. These are
+  // for Expression::share; the children must be nodes already here.
+  int addConstant(const Expression::Value&);
+  int addVariable(const std::string& name, int slot);
+  int addNode(Kind, Expression::Operator, int a, int b = 0, int c = 0);
+  int addList(Kind, const std::vector<int>& children);
+
+private:
+  ExpressionDag(const ExpressionDag&) = delete;
+  ExpressionDag& operator=(const ExpressionDag&) = delete;
+
+  // Return the node if there's one the same already, or else add it
+  int intern(Node&, const int* listChildren = nullptr);
+  bool sameNode(const Node&, const Node&, const int* listChildren) const;
+
+  // Work out the new node's slots from its children's
+  void addSlots(int node);
+
+  std::vector<int> roots;
+  std::vector<Node> nodes;
+  std::vector<int> children;
+  std::unordered_multimap<size_t, int> index;  // Node hash to node
+  std::vector<std::vector<int> > slots;        // Per node
+  std::vector<std::vector<int> > dependents;   // Per slot
+};
+
+// Structural hash and equality of expressions: the same for expressions
+// that a DAG would share, i.e. with the same nodes, operators, constants
+// and variables, whatever the backend or specialization
+size_t structuralHash(const Expression&);
+bool structurallyEqual(const Expression&, const Expression&);
+
+// Evaluates the expressions in a DAG, computing each node at most once
+// between calls to reset(). Like an ExecutionContext, it's for one thread;
+// any number of evaluators can share a DAG.
+//
+//   for each record:
+//     context.set(...);
+//     evaluator.reset();
+//     for each expression i:
+//       ... evaluator.evaluate(i, context) ...
+//
+// The values and errors are just those of evaluating each expression on
+// its own: && and || and ?: only compute the operands they need, and an
+// expression fails only on a node that it computes (or would have, if
+// another expression hadn't already).
+//
+// For a stream of records where only a few variables change each time,
+// there's no need to reset: set() changes a variable and forgets just the
+// nodes that depend on it, so evaluating again only computes the paths
+// from that variable to the tops of the expressions.
+//
+//   for each change:
+//     evaluator.set(context, slot, value);
+//     ... evaluator.evaluate(i, context) ...
+class DagEvaluator {
+public:
+  explicit DagEvaluator(const ExpressionDag&);
+
+  // Forget the nodes computed so far. Call this whenever the context's
+  // variables change (unless it's by set()), and after adding to the DAG.
+  void reset();
+
+  // Forget the nodes that depend on the variable in the slot, after it's
+  // changed in the context
+  void invalidate(int slot);
+
+  // Change the variable in the context, forgetting the nodes that depend
+  // on it, unless the value is the same as before
+  void set(ExecutionContext&, int slot, const Expression::Value&);
+
+  // Expression i's value. evaluate() throws on errors, as
+  // Expression::evaluate does; tryEvaluate() returns them.
+  Expression::Value evaluate(int i, ExecutionContext&);
+  Result<Expression::Value> tryEvaluate(int i, ExecutionContext&);
+
+  // The number of nodes computed since reset() or clearComputedCount()
+  int getComputedCount() const { return computed; }
+  void clearComputedCount() { computed = 0; }
+
+private:
+  struct Entry {
+    uint32_t generation;  // The node's value is valid in this one
+    bool failed;          // If so, its error is in 'errors'
+    Expression::Value value;
+  };
+
+  DagEvaluator(const DagEvaluator&) = delete;
+  DagEvaluator& operator=(const DagEvaluator&) = delete;
+
+  // The node's value, computing it unless it's been computed already
+  Expression::Value get(int node, ExecutionContext&);
+  Expression::Value compute(int node, ExecutionContext&);
+
+  const ExpressionDag& dag;
+  std::vector<Entry> entries;
+  uint32_t generation;
+  int computed;
+
+  // The first error in each failed node's subtree, to be reported again
+  // by each expression that uses the node
+  std::unordered_map<int, Status> errors;
+};
+
+#endif
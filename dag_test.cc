@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dag.h"
+#include "exception.h"
+#include "expression.h"
+#include "test_util.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Compile the texts and add them to the DAG, in order
+std::vector<std::unique_ptr<Expression> > AddAll(
+    const std::vector<std::string>& texts, SymbolTable& symbols,
+    ExpressionDag& dag) {
+  std::vector<std::unique_ptr<Expression> > expressions;
+  for (const std::string& text : texts) {
+    expressions.emplace_back(Compile(text, symbols));
+    EXPECT_EQ(int(expressions.size()) - 1, dag.add(*expressions.back()));
+  }
+  return expressions;
+}
+
+std::string Outcome(DagEvaluator& evaluator, int i,
+                    ExecutionContext& context) {
+  const Result<Expression::Value> v = evaluator.tryEvaluate(i, context);
+  return v.ok() ? Describe(v.get()) : "error: " + v.getStatus().getMessage();
+}
+
+bool Equal(const std::string& x, const std::string& y,
+           bool optimize = false) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> ex(Compile(x, symbols,
+                                         Expression::BACKEND_TREE, optimize));
+  std::unique_ptr<Expression> ey(Compile(y, symbols,
+                                         Expression::BACKEND_BYTECODE,
+                                         optimize));
+  const bool equal = structurallyEqual(*ex, *ey);
+  if (equal) {
+    EXPECT_EQ(structuralHash(*ex), structuralHash(*ey));
+  }
+  return equal;
+}
+
+}  // namespace
+
+TEST(DagTest, SharesSubtrees) {
+  SymbolTable symbols;
+  ExpressionDag dag;
+  auto expressions = AddAll({
+    "a * 1.5 + b > 3", "a * 1.5 + b < c", "(a * 1.5 + b) * 2",
+  }, symbols, dag);
+
+  // a, 1.5, *, b and + once, and then 3, >, c, <, 2 and *
+  EXPECT_EQ(3, dag.size());
+  EXPECT_EQ(11, dag.getNodeCount());
+
+  const ExpressionDag::Node& top = dag.getNode(dag.getRoot(2));
+  const ExpressionDag::Node& first = dag.getNode(dag.getRoot(0));
+  EXPECT_EQ(ExpressionDag::BINARY, top.kind);
+  EXPECT_EQ(top.a, first.a);
+
+  // Within one expression too: only 1, +, * and the sequence are new
+  std::unique_ptr<Expression> e(Compile("(a + 1) * (a + 1), (a + 1)",
+                                        symbols));
+  dag.add(*e);
+  EXPECT_EQ(11 + 4, dag.getNodeCount());
+
+  // Adding the same again adds no nodes
+  dag.add(*expressions[1]);
+  EXPECT_EQ(11 + 4, dag.getNodeCount());
+  EXPECT_EQ(dag.getRoot(1), dag.getRoot(4));
+}
+
+TEST(DagTest, StructuralEquality) {
+  EXPECT_TRUE(Equal("a * 1.5 + b", "(a*1.5)+b"));
+  EXPECT_TRUE(Equal("'x' + a + 'y'", "'x' + a + 'y'", true));
+  EXPECT_TRUE(Equal("a ? b : c, a && b", "a ? b : c, a && b"));
+
+  // Specialized operators are the ones they stand for
+  EXPECT_TRUE(Equal("(a ? 1.5 : 2.5) * 2", "(a ? 1.5 : 2.5) * 2", true));
+
+  EXPECT_FALSE(Equal("a + b", "b + a"));
+  EXPECT_FALSE(Equal("a + b", "a - b"));
+  EXPECT_FALSE(Equal("a && b", "a || b"));
+  EXPECT_FALSE(Equal("1", "1.0"));
+  EXPECT_FALSE(Equal("1", "true"));
+  EXPECT_FALSE(Equal("1", "'1'"));
+  EXPECT_FALSE(Equal("0.0", "-0.0", true));
+  EXPECT_FALSE(Equal("a, b", "a, b, b"));
+
+  // Variables are their slots
+  SymbolTable symbols;
+  std::unique_ptr<Expression> x(Compile("a + b", symbols));
+  std::unique_ptr<Expression> y(Compile("b + a", symbols));
+  EXPECT_FALSE(structurallyEqual(*x, *y));
+  EXPECT_NE(structuralHash(*x), structuralHash(*y));
+}
+
+TEST(DagTest, ComputesSharedNodesOnce) {
+  SymbolTable symbols;
+  ExpressionDag dag;
+  auto expressions = AddAll({
+    "a * 1.5 + b > 3", "a * 1.5 + b < c", "(a * 1.5 + b) * 2",
+  }, symbols, dag);
+
+  ExecutionContext context(symbols);
+  context.set(symbols.find("a"), Expression::Value(2.0));
+  context.set(symbols.find("b"), Expression::Value(1.0));
+  context.set(symbols.find("c"), Expression::Value(5.0));
+
+  DagEvaluator evaluator(dag);
+  EXPECT_EQ(true, evaluator.evaluate(0, context).getBool());
+  EXPECT_EQ(7, evaluator.getComputedCount());
+  EXPECT_EQ(true, evaluator.evaluate(1, context).getBool());
+  EXPECT_EQ(7 + 2, evaluator.getComputedCount());
+  EXPECT_EQ(8, evaluator.evaluate(2, context).getNumber());
+  EXPECT_EQ(11, evaluator.getComputedCount());
+
+  // Nothing's computed again until reset
+  context.set(symbols.find("a"), Expression::Value(0.0));
+  EXPECT_EQ(8, evaluator.evaluate(2, context).getNumber());
+  EXPECT_EQ(11, evaluator.getComputedCount());
+
+  evaluator.reset();
+  EXPECT_EQ(0, evaluator.getComputedCount());
+  EXPECT_EQ(2, evaluator.evaluate(2, context).getNumber());
+  EXPECT_EQ(7, evaluator.getComputedCount());
+}
+
+TEST(DagTest, OnlyComputesWhatsNeeded) {
+  SymbolTable symbols;
+  ExpressionDag dag;
+  auto expressions = AddAll({
+    "a && b * 'x'", "a ? 1 : b * 'x'", "b * 'x'", "a || b * 'x'",
+  }, symbols, dag);
+
+  ExecutionContext context(symbols);
+  context.set(symbols.find("a"), Expression::Value(false));
+  context.set(symbols.find("b"), Expression::Value(2.0));
+
+  // The failing operand is never reached, until it's evaluated on its own
+  DagEvaluator evaluator(dag);
+  EXPECT_EQ("type 3: false", Outcome(evaluator, 0, context));
+  const int computed = evaluator.getComputedCount();
+  EXPECT_EQ("error: Invalid operation (*) on strings",
+            Outcome(evaluator, 1, context));
+  EXPECT_LT(computed, evaluator.getComputedCount());
+  EXPECT_EQ("error: Invalid operation (*) on strings",
+            Outcome(evaluator, 2, context));
+  EXPECT_THROW(evaluator.evaluate(3, context), Exception);
+  EXPECT_TRUE(context.getStatus().ok());
+}
+
+TEST(DagTest, KeepsTheFirstError) {
+  SymbolTable symbols;
+  ExpressionDag dag;
+  auto expressions = AddAll({
+    "'y' - 'z' + b * 'x'", "b * 'x'", "b * 'x' + ('y' - 'z')", "b, 1",
+  }, symbols, dag);
+
+  ExecutionContext context(symbols);
+  context.set(symbols.find("b"), Expression::Value(2.0));
+
+  // Each expression fails on its own first error, although the node that
+  // has it was computed while evaluating another
+  DagEvaluator evaluator(dag);
+  for (int i = 0; i < dag.size(); i++) {
+    EXPECT_EQ(Outcome(*expressions[i], context),
+              Outcome(evaluator, i, context)) << i;
+  }
+
+  ExecutionContext empty;
+  evaluator.reset();
+  EXPECT_EQ("error: Undefined variable: b", Outcome(evaluator, 3, empty));
+}
+
+// Rules made of random subexpressions, many of them shared, must give the
+// same values and errors as their trees
+TEST(DagTest, RandomExpressions) {
+  Generator generator;
+  for (int i = 0; i < 200; i++) {
+    std::vector<std::string> parts;
+    for (int p = 0; p < 6; p++) {
+      parts.push_back(generator.expression(3));
+    }
+    std::vector<std::string> texts;
+    for (int r = 0; r < 10; r++) {
+      texts.push_back(generator.expression(2) + " + " +
+                      parts[generator.next(6)] + " * " +
+                      parts[generator.next(6)]);
+    }
+
+    SymbolTable symbols;
+    ExpressionDag dag;
+    auto expressions = AddAll(texts, symbols, dag);
+    DagEvaluator evaluator(dag);
+
+    for (int j = 0; j < 10; j++) {
+      ExecutionContext context(j == 0 ? 0 : symbols.size());
+      for (int slot = 0; slot < context.size(); slot++) {
+        context.set(slot, generator.value());
+      }
+
+      evaluator.reset();
+      for (int k = 0; k < dag.size(); k++) {
+        // Not in order, so that shared nodes are met in different ways
+        const int r = (k * 7) % dag.size();
+        ASSERT_EQ(Outcome(*expressions[r], context),
+                  Outcome(evaluator, r, context))
+            << texts[r] << " (context " << j << ")";
+      }
+      EXPECT_LE(evaluator.getComputedCount(), dag.getNodeCount());
+    }
+  }
+}
+
+TEST(DagTest, RecordsDependencies) {
+  SymbolTable symbols;
+  ExpressionDag dag;
+  auto expressions = AddAll({ "(a + 1) * (b + 2) + c", "b, 3" }, symbols,
+                            dag);
+  const int a = symbols.find("a");
+  const int b = symbols.find("b");
+  const int c = symbols.find("c");
+
+  EXPECT_EQ(std::vector<int>({ a, b, c }), dag.getSlots(dag.getRoot(0)));
+  EXPECT_EQ(std::vector<int>({ b }), dag.getSlots(dag.getRoot(1)));
+  EXPECT_TRUE(dag.getSlots(dag.getNode(dag.getRoot(0)).a).size() == 2);
+
+  // b, b + 2, *, + and the sequence, in that order
+  const std::vector<int>& dependents = dag.getDependents(b);
+  ASSERT_EQ(5u, dependents.size());
+  EXPECT_TRUE(std::is_sorted(dependents.begin(), dependents.end()));
+  EXPECT_EQ(dag.getRoot(1), dependents.back());
+  EXPECT_TRUE(dag.getDependents(c + 1).empty());
+}
+
+// Changing a variable only computes the nodes that depend on it again
+TEST(DagTest, Incremental) {
+  SymbolTable symbols;
+  ExpressionDag dag;
+  auto expressions = AddAll({ "(a + 1) * (b + 2) + (c - 3)", "c * 2" },
+                            symbols, dag);
+  const int a = symbols.find("a");
+  const int b = symbols.find("b");
+  const int c = symbols.find("c");
+
+  ExecutionContext context(symbols);
+  DagEvaluator evaluator(dag);
+  evaluator.set(context, a, Expression::Value(1.0));
+  evaluator.set(context, b, Expression::Value(2.0));
+  evaluator.set(context, c, Expression::Value(5.0));
+  EXPECT_EQ(10, evaluator.evaluate(0, context).getNumber());
+  EXPECT_EQ(11, evaluator.getComputedCount());
+
+  // b, b + 2, * and the top
+  evaluator.clearComputedCount();
+  evaluator.set(context, b, Expression::Value(0.0));
+  EXPECT_EQ(6, evaluator.evaluate(0, context).getNumber());
+  EXPECT_EQ(4, evaluator.getComputedCount());
+
+  // The same value changes nothing
+  evaluator.clearComputedCount();
+  evaluator.set(context, b, Expression::Value(0.0));
+  EXPECT_EQ(6, evaluator.evaluate(0, context).getNumber());
+  EXPECT_EQ(0, evaluator.getComputedCount());
+
+  // c and 2 are shared, so c is computed once, and then each expression
+  // computes its own path to the top
+  evaluator.set(context, c, Expression::Value(7.0));
+  EXPECT_EQ(14, evaluator.evaluate(1, context).getNumber());
+  EXPECT_EQ(2, evaluator.getComputedCount());
+  EXPECT_EQ(8, evaluator.evaluate(0, context).getNumber());
+  EXPECT_EQ(2 + 2, evaluator.getComputedCount());
+
+  // Errors go away with their causes
+  evaluator.set(context, a, Expression::Value("x"));
+  EXPECT_THROW(evaluator.evaluate(0, context), Exception);
+  evaluator.set(context, a, Expression::Value(int64_t(3)));
+  EXPECT_EQ(12, evaluator.evaluate(0, context).getNumber());
+
+  // Growing the context defines the variables it didn't have
+  ExecutionContext small;
+  evaluator.reset();
+  EXPECT_THROW(evaluator.evaluate(1, small), Exception);
+  evaluator.set(small, c, Expression::Value(1.0));
+  EXPECT_EQ(2, evaluator.evaluate(1, small).getNumber());
+  EXPECT_EQ(Expression::TYPE_UNKNOWN,
+            evaluator.evaluate(0, small).getType());
+}
+
+// Random changes to one variable at a time must give the same values and
+// errors as evaluating the trees afresh
+TEST(DagTest, RandomChanges) {
+  Generator generator;
+  for (int i = 0; i < 100; i++) {
+    std::vector<std::string> texts;
+    for (int r = 0; r < 4; r++) {
+      texts.push_back(generator.expression(5));
+    }
+
+    SymbolTable symbols;
+    ExpressionDag dag;
+    auto expressions = AddAll(texts, symbols, dag);
+    ExecutionContext context(symbols);
+    DagEvaluator evaluator(dag);
+
+    for (int j = 0; j < 50 && symbols.size() > 0; j++) {
+      evaluator.set(context, generator.next(symbols.size()),
+                    generator.value());
+      for (int k = 0; k < dag.size(); k++) {
+        ASSERT_EQ(Outcome(*expressions[k], context),
+                  Outcome(evaluator, k, context))
+            << texts[k] << " (change " << j << ")";
+      }
+    }
+  }
+}
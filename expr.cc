@@ -1,36 +1,35 @@
 #include <iostream>
-#include <sstream>
-#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "cache.h"
 #include "exception.h"
 #include "expression.h"
-#include "textsource.h"
-#include "tokenizer.h"
+#include "parallel.h"
+#include "stream.h"
 
 using namespace std;
 
-int main(int argc, char* argv[]) {
-  try {
-    while (cin.good()) {
-      std::string line;
-      getline(cin, line);
-      if (line.empty()) break;
-
-      std::istringstream in(line);
-      Tokenizer tokenizer(new TextSource(in));
-      tokenizer.next();
+namespace {
 
-      Expression* e = Expression::compile(tokenizer);
-      POSTCONDITION(e != 0);
-
-      e->print(cout);
-      cout << " => ";
-      ExecutionContext exe;
-      Expression::Value v = e->evaluate(exe);
-
-      cout << v << endl;
-    }
+void usage() {
+  cerr << "usage: expr [--stream] [--threads N]" << endl
+       << endl
+       << "Reads expressions from standard input, one per line, and prints"
+       << endl
+       << "each with its value. Normally stops at the first empty line or"
+       << endl
+       << "error. With --stream, reads to the end of the input, evaluating"
+       << endl
+       << "on N threads (default: one per CPU), and prints an error in place"
+       << endl
+       << "of the value for lines that fail." << endl;
+}
 
+int runInteractive(ExpressionCache& cache) {
+  try {
+    evaluateLines(cin, cout, cache);
     return 0;
 
   } catch (const Exception& e) {
@@ -39,3 +38,47 @@ int main(int argc, char* argv[]) {
 
   return 1;
 }
+
+// stdout gets a large buffer, so that the output isn't written in small
+// pieces
+int runStreaming(ExpressionCache& cache, int threads) {
+  static char outputBuffer[1 << 20];
+  setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+
+  ThreadPool pool(threads);
+  const long errors = evaluateStream(cin, cout, cache, pool);
+  if (errors > 0) {
+    cerr << errors << " line(s) failed" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool stream = false;
+  int threads = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+      if (threads <= 0) {
+        usage();
+        return 2;
+      }
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  // Lines are often repeated, so don't compile them again
+  ExpressionCache cache(1000);
+
+  if (stream) {
+    return runStreaming(cache, threads);
+  }
+  return runInteractive(cache);
+}
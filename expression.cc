@@ -1,17 +1,33 @@
 #include "expression.h"
+#include "bytecode.h"
+#include "convert.h"
 #include "exception.h"
+#include "jit.h"
 #include "textsource.h"
 #include "tokenizer.h"
 
 #include <iostream>
-#include <sstream>
+#include <memory>
 #include <stdlib.h>
+#include <string.h>
 
 using namespace std;
 
-Expression::Expression() {}
+Expression::Expression() : staticType(TYPE_UNKNOWN) {}
 Expression::~Expression() {}
 
+Result<Expression::Value> Expression::tryEvaluate(ExecutionContext& e) const {
+  Value result = compute(e);
+  if (!e.getStatus().ok()) {
+    return e.takeStatus();
+  }
+  return result;
+}
+
+Expression::Type Expression::inferType() const {
+  return TYPE_UNKNOWN;
+}
+
 
 struct OperatorInfo {
   Expression::Operator op;
@@ -67,28 +83,28 @@ Expression::Operator Expression::string2operator(const std::string& s) {
   throw Exception("Unknown operator " + s);
 }
 
-namespace {
-
-const char* operator2string(Expression::Operator op) {
+const char* Expression::operator2string(Expression::Operator op) {
   for (int i = 0; opInfo[i].text != 0; i++) {
     if (op == opInfo[i].op) return opInfo[i].text;
   }
   return "(unknown op)";
 }
 
-double toNumber(const string & s) {
-  char* endptr = nullptr;
-  const double result = strtod(s.c_str(), &endptr);
-  if (endptr == s.c_str() || endptr == nullptr || *endptr != '\0') {
-    throw Exception("Invalid conversion to number: '" + s + "'");
-  }
-  return result;
+namespace {
+
+// Record an evaluation error, and return a placeholder for the value
+Expression::Value fail(Status& status, const char* format,
+                       const string& argument = string()) {
+  status.update(Status(Status::EVALUATION_ERROR, format, argument));
+  return Expression::Value();
 }
 
-string toString(const double v) {
-  ostringstream o;
-  o << v;
-  return o.str();
+double toNumber(const string & s, Status& status) {
+  double result = 0;
+  if (!string2number(s.data(), s.size(), result)) {
+    fail(status, "Invalid conversion to number: '%s'", s);
+  }
+  return result;
 }
 
 Expression::Type upcastType(Expression::Type left, Expression::Type right) {
@@ -101,246 +117,300 @@ Expression::Type upcastType(Expression::Type left, Expression::Type right) {
   } else if ((left == Expression::TYPE_NUMBER) ||
              (right == Expression::TYPE_NUMBER)) {
     return Expression::TYPE_NUMBER;
+  } else if ((left == Expression::TYPE_INTEGER) ||
+             (right == Expression::TYPE_INTEGER)) {
+    return Expression::TYPE_INTEGER;
   } else {
     return Expression::TYPE_BOOL;
   }
 }
 
-double toNumber(const Expression::Value& v) {
-  if (v.type == Expression::TYPE_NUMBER) {
-    return v.numberValue;
-  } else if (v.type == Expression::TYPE_STRING) {
-    return toNumber(v.stringValue);
+double toNumber(const Expression::Value& v, Status& status) {
+  if (v.getType() == Expression::TYPE_NUMBER) {
+    return v.getNumber();
+  } else if (v.getType() == Expression::TYPE_INTEGER) {
+    return v.getInteger();
+  } else if (v.getType() == Expression::TYPE_STRING) {
+    return toNumber(v.getString(), status);
   } else {
-    return (v.boolValue ? 1 : 0);
+    return (v.getBool() ? 1 : 0);
   }
 }
 
-int32_t toInt(const Expression::Value& v) {
-  if (v.type == Expression::TYPE_NUMBER) {
-    return (int32_t) v.numberValue;
-  } else if (v.type == Expression::TYPE_STRING) {
-    return (int32_t) toNumber(v.stringValue);
+// For operands upcast to integers, which are integers or Booleans
+int64_t toInteger(const Expression::Value& v) {
+  if (v.getType() == Expression::TYPE_INTEGER) {
+    return v.getInteger();
   } else {
-    return (v.boolValue ? 1 : 0);
+    return (v.getBool() ? 1 : 0);
   }
 }
 
 string toString(const Expression::Value & v) {
-  if (v.type == Expression::TYPE_STRING) {
-    return v.stringValue;
-  } else if (v.type == Expression::TYPE_NUMBER) {
-    return toString(v.numberValue);
+  if (v.getType() == Expression::TYPE_STRING) {
+    return v.getString();
+  } else if (v.getType() == Expression::TYPE_NUMBER) {
+    return number2string(v.getNumber());
+  } else if (v.getType() == Expression::TYPE_INTEGER) {
+    return to_string(v.getInteger());
   } else {
-    return (v.boolValue ? "true" : "false");
+    return (v.getBool() ? "true" : "false");
   }
 }
 
 bool toBool(const Expression::Value & v) {
-  if (v.type == Expression::TYPE_BOOL) {
-    return v.boolValue;
-  } else if (v.type == Expression::TYPE_STRING) {
-    if (v.stringValue == "true") {
+  if (v.getType() == Expression::TYPE_BOOL) {
+    return v.getBool();
+  } else if (v.getType() == Expression::TYPE_STRING) {
+    const string& s = v.getString();
+    if (s == "true") {
       return true;
-    } else if (v.stringValue == "false") {
+    } else if (s == "false") {
       return false;
     } else {
-      return !v.stringValue.empty();
+      return !s.empty();
     }
+  } else if (v.getType() == Expression::TYPE_INTEGER) {
+    return (v.getInteger() != 0);
   } else {
-    return (v.numberValue != 0);
+    return (v.getNumber() != 0);
   }
 }
 
-Expression::Value upcast(Expression::Value v, Expression::Type toType) {
-  if (v.type == toType) {
-    return v;
-  }
-  Expression::Value result;
-  result.type = toType;
+// Where each of the tokenizer's symbols is in opInfo, as a unary operator
+// and as a binary one (-1 if it isn't one), so that the parser doesn't have
+// to search the table.
+struct SymbolInfo {
+  int unary;
+  int binary;
+};
 
-  if (toType == Expression::TYPE_STRING) {
-    if (v.type == Expression::TYPE_NUMBER) {
-      result.stringValue = toString(v.numberValue);
-    } else {
-      result.stringValue = (v.boolValue ? "true" : "false");
-    }
-  } else if (toType == Expression::TYPE_NUMBER) {
-    if (v.type == Expression::TYPE_STRING) {
-      v.numberValue = toNumber(v.stringValue);
-    } else {
-      v.numberValue = (v.boolValue ? 1 : 0);
-    }
-  } else {
-    if (v.type == Expression::TYPE_STRING) {
-      v.boolValue = !v.stringValue.empty();
-    } else {
-      v.boolValue = v.numberValue != 0;
+vector<SymbolInfo> makeSymbolTable() {
+  vector<SymbolInfo> table(Tokenizer::SYM_COUNT);
+  for (int s = 0; s < Tokenizer::SYM_COUNT; s++) {
+    const char* text = Tokenizer::getSymbolText(Tokenizer::Symbol(s));
+    table[s].unary = table[s].binary = -1;
+
+    for (int i = 0; opInfo[i].text != 0; i++) {
+      if (strcmp(text, opInfo[i].text) == 0) {
+        (opInfo[i].level == 2 ? table[s].unary : table[s].binary) = i;
+      }
     }
   }
+  return table;
+}
 
-  return result;
+// The token must be an operator
+const SymbolInfo& getSymbolInfo(const Tokenizer& tok) {
+  static const vector<SymbolInfo> table = makeSymbolTable();
+  PRECONDITION(tok.getSymbol() != Tokenizer::SYM_NONE);
+  return table[tok.getSymbol()];
 }
 
-void expect(Tokenizer& tok, Tokenizer::TokenType type, const char* text) {
-  if ((tok.getTokenType() == type) && (tok.getTokenText() == text)) {
-    tok.next();
-  } else {
-    ostringstream out;
-    out << "Syntax error. Expecting \"" << text << "\" at line "
-        << tok.getLineNumber() << ", column "
-        << tok.getColumnNumber();
-    
-    throw Exception(out.str());
+// The parser's functions return null on a syntax error, leaving it in
+// 'status' and deleting whatever they'd built. A malformed token ends the
+// tokens early, so what the parser makes of that doesn't matter: the
+// tokenizer's error is the one reported.
+
+Expression* syntaxError(Status& status, const char* format,
+                        const string& argument = string(), int line = 0,
+                        int column = 0) {
+  status.update(Status(Status::SYNTAX_ERROR, format, argument, line,
+                       column));
+  return nullptr;
+}
+
+bool expect(Tokenizer& tok, Tokenizer::Symbol symbol, Status& status) {
+  if (tok.getSymbol() == symbol) {
+    tok.tryNext();
+    return true;
   }
+
+  syntaxError(status, "Syntax error. Expecting \"%s\" at line %l, column %c",
+              Tokenizer::getSymbolText(symbol), tok.getLineNumber(),
+              tok.getColumnNumber());
+  return false;
 }
 
-Expression* compileConstant(Tokenizer & tok) {
+Expression* compileConstant(Tokenizer& tok,
+                            const Expression::CompileOptions& options,
+                            Status& status) {
   if (tok.eof()) {
-    throw Exception("Syntax error: unexpected end of input");
+    return syntaxError(status, "Syntax error: unexpected end of input");
   }
 
   if (tok.getTokenType() == Tokenizer::TOK_STRING) {
-    auto* result = new ConstantExpression(tok.getTokenText());
-    tok.next();
+    auto* result = new (options.arena) ConstantExpression(
+        string(tok.getTokenData(), tok.getTokenLength()));
+    tok.tryNext();
     return result;
   } else if (tok.getTokenType() == Tokenizer::TOK_NUMBER) {
-    auto* result = new ConstantExpression(toNumber(tok.getTokenText()));
-    tok.next();
+    auto* result = tok.isInteger() ?
+        new (options.arena) ConstantExpression(
+            Expression::Value(tok.getInteger())) :
+        new (options.arena) ConstantExpression(tok.getNumber());
+    tok.tryNext();
     return result;
   } else if (tok.getTokenType() == Tokenizer::TOK_KEYWORD) {
-    bool val;
-
-    if (tok.getTokenText() == "true") {
-      val = true;
-    } else if (tok.getTokenText() == "false") {
-      val = false;
+    Expression* result;
+
+    if (tok.getKeyword() == Tokenizer::KEY_TRUE) {
+      result = new (options.arena) ConstantExpression(true);
+    } else if (tok.getKeyword() == Tokenizer::KEY_FALSE) {
+      result = new (options.arena) ConstantExpression(false);
+    } else if (options.symbols != nullptr) {
+      result = new (options.arena) VariableExpression(
+          tok.getTokenText(), options.symbols->add(tok.getTokenText()));
     } else {
-      throw Exception("Unexpected keyword: " + tok.getTokenText());
+      return syntaxError(status, "Unexpected keyword: %s",
+                         tok.getTokenText());
     }
 
-    tok.next();
-    return new ConstantExpression(val);
+    tok.tryNext();
+    return result;
   }
 
-  throw Exception("Unknown token type");
+  return syntaxError(status, "Unknown token type");
 }
 
 // Forward declaration.
-Expression* compileSequence(Tokenizer& tok);
-
-Expression* compileBrackets(Tokenizer& tok) {
-  if (tok.getTokenType() != Tokenizer::TOK_OPERATOR) {
-    return compileConstant(tok);
-  }
-
-  Expression* expr = 0;
-  if (tok.getTokenText() == "(") {
-    tok.next();
-    expr = compileSequence(tok);
-    expect(tok, Tokenizer::TOK_OPERATOR, ")");
-  } else if (tok.getTokenText() == "[") {
-    tok.next();
-    expr = compileSequence(tok);
-    expect(tok, Tokenizer::TOK_OPERATOR, "]");
-  } else if (tok.getTokenText() == "{") {
-    tok.next();
-    expr = compileSequence(tok);
-    expect(tok, Tokenizer::TOK_OPERATOR, "}");
+Expression* compileSequence(Tokenizer& tok,
+                            const Expression::CompileOptions& options,
+                            Status& status);
+
+Expression* compileBrackets(Tokenizer& tok,
+                            const Expression::CompileOptions& options,
+                            Status& status) {
+  if (tok.eof() || tok.getTokenType() != Tokenizer::TOK_OPERATOR) {
+    return compileConstant(tok, options, status);
+  }
+
+  Tokenizer::Symbol close;
+  if (tok.getSymbol() == Tokenizer::SYM_LPAREN) {
+    close = Tokenizer::SYM_RPAREN;
+  } else if (tok.getSymbol() == Tokenizer::SYM_LBRACKET) {
+    close = Tokenizer::SYM_RBRACKET;
+  } else if (tok.getSymbol() == Tokenizer::SYM_LBRACE) {
+    close = Tokenizer::SYM_RBRACE;
   } else {
-    throw Exception("Unexpected operator: " + tok.getTokenText());
+    return syntaxError(status, "Unexpected operator: %s",
+                       tok.getTokenText());
   }
 
+  tok.tryNext();
+  Expression* expr = compileSequence(tok, options, status);
+  if (expr != nullptr && !expect(tok, close, status)) {
+    delete expr;
+    return nullptr;
+  }
   return expr;
 }
 
-Expression* compileUnary(Tokenizer& tok) {
-  if (tok.getTokenType() == Tokenizer::TOK_OPERATOR) {
-    int match = -1;
-    for (int i = 0; (match < 0) && (opInfo[i].text != 0); i++) {
-      if ((tok.getTokenText() == opInfo[i].text) &&
-          (opInfo[i].level == 2)) {
-        match = i;
-      }
-    }
-
+Expression* compileUnary(Tokenizer& tok,
+                         const Expression::CompileOptions& options,
+                         Status& status) {
+  if (!tok.eof() && tok.getTokenType() == Tokenizer::TOK_OPERATOR) {
+    const int match = getSymbolInfo(tok).unary;
     if (match >= 0) {
-      tok.next();
-      return new UnaryOperator(opInfo[match].op, compileUnary(tok));
+      tok.tryNext();
+      // Parse the operand first, so that it's allocated first
+      Expression* child = compileUnary(tok, options, status);
+      if (child == nullptr) {
+        return nullptr;
+      }
+      return new (options.arena) UnaryOperator(opInfo[match].op, child);
     }
   }
 
-  return compileBrackets(tok);
+  return compileBrackets(tok, options, status);
 }
 
-Expression* compileTernary(Tokenizer& tok, Expression* condition) {
-  Expression* positive = compileSequence(tok);
-  expect(tok, Tokenizer::TOK_OPERATOR, ":");
-  Expression* negative = compileSequence(tok);
-  return new TernaryOperator(condition, positive, negative);
-}
-
-// Parse a left-associative binary operator. Most of 'em, as it turns
-// out. This is based on the table above. At level 2 and below, we get
-// more specific because either the operators are unary, right associative
-// or brackets.
-Expression* compileLevel(Tokenizer& tok, int level) {
-  if (level == 2) {
-    return compileUnary(tok);
+Expression* compileTernary(Tokenizer& tok,
+                           const Expression::CompileOptions& options,
+                           Status& status, Expression* condition) {
+  unique_ptr<Expression> test(condition);
+  unique_ptr<Expression> positive(compileSequence(tok, options, status));
+  if (positive == nullptr || !expect(tok, Tokenizer::SYM_COLON, status)) {
+    return nullptr;
   }
+  Expression* negative = compileSequence(tok, options, status);
+  if (negative == nullptr) {
+    return nullptr;
+  }
+  return new (options.arena) TernaryOperator(test.release(),
+                                             positive.release(), negative);
+}
 
-  Expression* expr = compileLevel(tok, level - 1);
-
-  // Process left-associative binary operators
-  while (true) {
-    if (tok.eof() || (tok.getTokenType() != Tokenizer::TOK_OPERATOR)) {
-      return expr;
+// Parse binary operators by precedence climbing, on the levels in the
+// table above: read an operand, then take operators for as long as they're
+// at 'level' or tighter (lower). They're all left-associative, so an
+// operator's right operand only takes operators tighter than it. The
+// ternary operator's "right operand" is both of its branches.
+Expression* compileBinary(Tokenizer& tok,
+                          const Expression::CompileOptions& options,
+                          Status& status, int level) {
+  Expression* expr = compileUnary(tok, options, status);
+
+  while (expr != nullptr && !tok.eof() &&
+         (tok.getTokenType() == Tokenizer::TOK_OPERATOR)) {
+    const int i = getSymbolInfo(tok).binary;
+    if ((i < 0) || (opInfo[i].level > level)) {
+      break;
     }
 
-    bool found = false;
-    for (int i = 0; !found && (opInfo[i].text != 0); i++) {
-      if ((opInfo[i].level == level) &&
-          (tok.getTokenText() == opInfo[i].text)) {
-
-        tok.next();
-        if (opInfo[i].op == Expression::OP_TERNARY) {
-          expr = compileTernary(tok, expr);
-        } else {
-          expr = new BinaryOperator(opInfo[i].op,
-                                    expr,
-                                    compileLevel(tok, level-1));
-        }
-        found = true;
+    tok.tryNext();
+    if (opInfo[i].op == Expression::OP_TERNARY) {
+      expr = compileTernary(tok, options, status, expr);
+    } else {
+      // Nodes are allocated in evaluation order (children first), so
+      // an arena lays them out in the order they're visited
+      Expression* right = compileBinary(tok, options, status,
+                                        opInfo[i].level - 1);
+      if (right == nullptr) {
+        delete expr;
+        return nullptr;
+      }
+      if (opInfo[i].op == Expression::OP_ANDAND ||
+          opInfo[i].op == Expression::OP_OROR) {
+        expr = new (options.arena) LogicalOperator(opInfo[i].op, expr,
+                                                   right);
+      } else {
+        expr = new (options.arena) BinaryOperator(opInfo[i].op, expr,
+                                                  right);
       }
     }
-
-    if (!found) break;
   }
 
   return expr;
 }
 
-Expression* compileSequence(Tokenizer& tok) {
-  Expression* expr = compileLevel(tok, 14);
+Expression* compileSequence(Tokenizer& tok,
+                            const Expression::CompileOptions& options,
+                            Status& status) {
+  Expression* expr = compileBinary(tok, options, status, 14);
+  if (expr == nullptr) {
+    return nullptr;
+  }
   SequenceExpression* seq = nullptr;
 
   while (!tok.eof() &&
-         (tok.getTokenType() == Tokenizer::TOK_OPERATOR) &&
-         (tok.getTokenText() == ",")) {
+         (tok.getSymbol() == Tokenizer::SYM_COMMA)) {
     if (seq == nullptr) {
-      seq = new SequenceExpression();
+      seq = new (options.arena) SequenceExpression();
       seq->append(expr);
+      expr = seq;
     }
 
-    tok.next();
-    seq->append(compileLevel(tok, 14));
+    tok.tryNext();
+    Expression* sub = compileBinary(tok, options, status, 14);
+    if (sub == nullptr) {
+      delete seq;
+      return nullptr;
+    }
+    seq->append(sub);
   }
 
-  if (seq != nullptr) {
-    return seq;
-  } else {
-    return expr;
-  }
+  return expr;
 }
 
 }  // namespace
@@ -350,7 +420,10 @@ std::string Expression::Value::asString() const {
 }
 
 double Expression::Value::asNumber() const {
-  return toNumber(*this);
+  Status status;
+  const double result = toNumber(*this, status);
+  status.check();
+  return result;
 }
 
 bool Expression::Value::asBool() const {
@@ -358,30 +431,283 @@ bool Expression::Value::asBool() const {
 }
 
 Expression* Expression::compile(Tokenizer& tok) {
-  std::unique_ptr<Expression> result(compileSequence(tok));
-  if (!tok.eof()) {
-    std::ostringstream out;
-    out << "Extraneous text after expression at line " << tok.getLineNumber()
-        << ", column " << tok.getColumnNumber();
-    throw Exception(out.str());
+  return compile(tok, CompileOptions());
+}
+
+Expression* Expression::compile(Tokenizer& tok,
+                                const CompileOptions& options) {
+  Result<Expression*> result = tryCompile(tok, options);
+  result.getStatus().check();
+  return result.get();
+}
+
+Result<Expression*> Expression::tryCompile(Tokenizer& tok,
+                                           const CompileOptions& options) {
+  Status status;
+  std::unique_ptr<Expression> result(compileSequence(tok, options, status));
+  if (!tok.getStatus().ok()) {
+    return tok.getStatus();
+  } else if (!status.ok()) {
+    return status;
+  } else if (!tok.eof()) {
+    return Status(Status::SYNTAX_ERROR,
+                  "Extraneous text after expression at line %l, column %c",
+                  string(), tok.getLineNumber(), tok.getColumnNumber());
+  }
+
+  if (options.optimize) {
+    Expression* simplified = result.release()->simplify(options, status);
+    result.reset(simplified);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (options.backend == BACKEND_BYTECODE) {
+    // Bytecode has limits the text doesn't, and lowering throws past them
+    // (freeing the tree)
+    try {
+      return new (options.arena) BytecodeExpression(result.release());
+    } catch (const Exception& ex) {
+      return Status(Status::EVALUATION_ERROR, "%s", ex.what());
+    }
+  } else if (options.backend == BACKEND_NATIVE) {
+    return new (options.arena) NativeExpression(result.release());
   }
   return result.release();
 }
 
+bool Expression::isAssignment(Operator op) {
+  switch (op) {
+    case OP_ASSIGNMENT:
+    case OP_PLUSEQ:
+    case OP_MINUSEQ:
+    case OP_MULTIPLYEQ:
+    case OP_DIVIDEEQ:
+    case OP_MODEQ:
+    case OP_ANDEQ:
+    case OP_XOREQ:
+    case OP_OREQ:
+    case OP_LEFTEQ:
+    case OP_RIGHTEQ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+Expression::Value Expression::applyUnary(Operator op, const Value& operand) {
+  Status status;
+  Value result = applyUnary(op, operand, status);
+  status.check();
+  return result;
+}
+
+Expression::Value Expression::applyUnary(Operator op, const Value& operand,
+                                         Status& status) {
+  if (op == OP_NOT) {
+    return Value(!operand.asBool());
+  } else if (op == OP_BITNOT) {
+    if (operand.getType() == TYPE_BOOL) {
+      return Value(!operand.getBool());
+    } else if (operand.getType() == TYPE_INTEGER) {
+      return Value(~operand.getInteger());
+    } else {
+      int64_t i = toNumber(operand, status);
+      return Value(double(~i));
+    }
+  } else if (op == OP_NEGATIVE) {
+    if (operand.getType() == TYPE_INTEGER) {
+      return Value(int64_t(0 - uint64_t(operand.getInteger())));
+    }
+    return Value(-toNumber(operand, status));
+  } else if (op == OP_POSITIVE) {
+    if (operand.getType() == TYPE_INTEGER) {
+      return operand;
+    }
+    return Value(toNumber(operand, status));
+  } else {
+    return fail(status, "Unknown unary operator");
+  }
+}
+
+Expression::Value Expression::applyBinary(Operator op,
+                                          const Value& leftValue,
+                                          const Value& rightValue) {
+  Status status;
+  Value result = applyBinary(op, leftValue, rightValue, status);
+  status.check();
+  return result;
+}
+
+Expression::Value Expression::applyBinary(Operator op,
+                                          const Value& leftValue,
+                                          const Value& rightValue,
+                                          Status& status) {
+  const Type type = upcastType(leftValue.getType(), rightValue.getType());
+  if (type == TYPE_STRING) {
+    // Only convert the operands that aren't strings already
+    string leftBuffer, rightBuffer;
+    const string& lval = (leftValue.getType() == TYPE_STRING) ?
+        leftValue.getString() : (leftBuffer = toString(leftValue));
+    const string& rval = (rightValue.getType() == TYPE_STRING) ?
+        rightValue.getString() : (rightBuffer = toString(rightValue));
+
+    switch (op) {
+      case OP_PLUS:      return Value(lval + rval);
+      case OP_LESS:      return Value(lval < rval);
+      case OP_LESSEQ:    return Value(lval <= rval);
+      case OP_GREATER:   return Value(lval > rval);
+      case OP_GREATEREQ: return Value(lval >= rval);
+      case OP_EQUAL:     return Value(lval == rval);
+      case OP_NOTEQUAL:  return Value(lval != rval);
+      default:
+        return fail(status, "Invalid operation (%s) on strings",
+                    operator2string(op));
+    }
+
+  } else if (type == TYPE_NUMBER) {
+    const double lval = toNumber(leftValue, status);
+    const double rval = toNumber(rightValue, status);
+
+    switch (op) {
+      case OP_MULTIPLY:   return Value(lval * rval);
+      case OP_DIVIDE:     return Value(lval / rval);
+      case OP_MOD:
+        if (int32_t(rval) == 0) {
+          return fail(status, "Division by zero");
+        }
+        // The smallest integer % -1 overflows
+        return Value((int32_t(rval) == -1) ?
+                     0.0 : double(int32_t(lval) % int32_t(rval)));
+      case OP_PLUS:       return Value(lval + rval);
+      case OP_MINUS:      return Value(lval - rval);
+      case OP_SHIFTLEFT:
+        return Value(double(int32_t(lval) << int32_t(rval)));
+      case OP_SHIFTRIGHT:
+        return Value(double(int32_t(lval) >> int32_t(rval)));
+      case OP_LESS:       return Value(lval < rval);
+      case OP_LESSEQ:     return Value(lval <= rval);
+      case OP_GREATER:    return Value(lval > rval);
+      case OP_GREATEREQ:  return Value(lval >= rval);
+      case OP_EQUAL:      return Value(lval == rval);
+      case OP_NOTEQUAL:   return Value(lval != rval);
+      case OP_AND:
+        return Value(double(int32_t(lval) & int32_t(rval)));
+      case OP_XOR:
+        return Value(double(int32_t(lval) ^ int32_t(rval)));
+      case OP_OR:
+        return Value(double(int32_t(lval) | int32_t(rval)));
+      default:
+        return fail(status, "Invalid operation (%s) on numbers",
+                    operator2string(op));
+    }
+
+  } else if (type == TYPE_INTEGER) {
+    // +, - and * are done unsigned, so that they wrap around
+    const int64_t lval = toInteger(leftValue);
+    const int64_t rval = toInteger(rightValue);
+    const uint64_t ulval = lval;
+    const uint64_t urval = rval;
+
+    switch (op) {
+      case OP_MULTIPLY:   return Value(int64_t(ulval * urval));
+      case OP_DIVIDE:     return Value(double(lval) / double(rval));
+      case OP_MOD:
+        if (rval == 0) {
+          return fail(status, "Division by zero");
+        }
+        // The smallest integer % -1 overflows
+        return Value((rval == -1) ? int64_t(0) : lval % rval);
+      case OP_PLUS:       return Value(int64_t(ulval + urval));
+      case OP_MINUS:      return Value(int64_t(ulval - urval));
+      case OP_SHIFTLEFT:  return Value(int64_t(ulval << (rval & 63)));
+      case OP_SHIFTRIGHT: return Value(lval >> (rval & 63));
+      case OP_LESS:       return Value(lval < rval);
+      case OP_LESSEQ:     return Value(lval <= rval);
+      case OP_GREATER:    return Value(lval > rval);
+      case OP_GREATEREQ:  return Value(lval >= rval);
+      case OP_EQUAL:      return Value(lval == rval);
+      case OP_NOTEQUAL:   return Value(lval != rval);
+      case OP_AND:        return Value(lval & rval);
+      case OP_XOR:        return Value(lval ^ rval);
+      case OP_OR:         return Value(lval | rval);
+      default:
+        return fail(status, "Invalid operation (%s) on integers",
+                    operator2string(op));
+    }
+
+  } else if (type == TYPE_BOOL) {
+    const bool lval = leftValue.getBool();
+    const bool rval = rightValue.getBool();
+
+    switch (op) {
+      case OP_EQUAL:    return Value(lval == rval);
+      case OP_NOTEQUAL: return Value(lval != rval);
+      default:
+        return fail(status, "Invalid operation (%s) on Boolean values",
+                    operator2string(op));
+    }
+
+  } else if (type == TYPE_UNKNOWN) {
+    // Unknown type -- we've given up trying to evaluate
+    return Value();
+  } else {
+    ASSERTION(false);
+    return Value();
+  }
+}
+
+Expression::Value Expression::applyConcat(const Value* values, int count) {
+  // Strings are measured exactly, and other values allowed as much room
+  // as the longest conversion could take, so that one allocation will do
+  const size_t kMaxConverted = 24;
+
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    const Type type = values[i].getType();
+    if (type == TYPE_UNKNOWN) {
+      return Value();
+    }
+    length += (type == TYPE_STRING) ? values[i].getString().size()
+                                    : kMaxConverted;
+  }
+
+  string result;
+  result.reserve(length);
+  for (int i = 0; i < count; i++) {
+    if (values[i].getType() == TYPE_STRING) {
+      result += values[i].getString();
+    } else {
+      result += toString(values[i]);
+    }
+  }
+  return Value(std::move(result));
+}
+
 ConstantExpression::ConstantExpression(const Value& v)
   : value(v)
-{}
+{
+  annotate();
+}
+
+ConstantExpression::ConstantExpression(const std::string& s) : value(s) {
+  annotate();
+}
 
-ConstantExpression::ConstantExpression(const std::string& s)
-    : value({ s, 0, false, TYPE_STRING }) {}
+ConstantExpression::ConstantExpression(double n) : value(n) {
+  annotate();
+}
 
-ConstantExpression::ConstantExpression(double n)
-    : value({ "", n, false, TYPE_NUMBER }) {}
+ConstantExpression::ConstantExpression(bool b) : value(b) {
+  annotate();
+}
 
-ConstantExpression::ConstantExpression(bool b)
-    : value({ "", 0, b, TYPE_BOOL }) {}
+Expression::Type ConstantExpression::inferType() const {
+  return value.getType();
+}
 
-Expression::Value ConstantExpression::evaluate(ExecutionContext&) const {
+Expression::Value ConstantExpression::compute(ExecutionContext&) const {
   return value;
 }
 
@@ -390,73 +716,76 @@ void ConstantExpression::print(ostream& out) const {
 }
 
 void ConstantExpression::set(double v) {
-  value.numberValue = v;
-  value.type = TYPE_NUMBER;
+  value = Value(v);
+  annotate();
 }
 
 void ConstantExpression::set(const string & s) {
-  value.stringValue = s;
-  value.type = TYPE_STRING;
+  value = Value(s);
+  annotate();
 }
 
 void ConstantExpression::set(bool f) {
-  value.boolValue = f;
-  value.type = TYPE_BOOL;
+  value = Value(f);
+  annotate();
 }
 
 const string & ConstantExpression::getString() const {
-  if (value.type != TYPE_STRING) {
+  if (value.getType() != TYPE_STRING) {
     throw Exception("Invalid type; not a string");
   }
-  return value.stringValue;
+  return value.getString();
 }
 
 double ConstantExpression::getNumber() const {
-  if (value.type != TYPE_NUMBER) {
+  if (value.getType() != TYPE_NUMBER) {
     throw Exception("Invalid type; not a number");
   }
-  return value.numberValue;
+  return value.getNumber();
+}
+
+int64_t ConstantExpression::getInteger() const {
+  if (value.getType() != TYPE_INTEGER) {
+    throw Exception("Invalid type; not an integer");
+  }
+  return value.getInteger();
 }
 
 bool ConstantExpression::getBool() const {
-  if (value.type != TYPE_BOOL) {
+  if (value.getType() != TYPE_BOOL) {
     throw Exception("Invalid type; not a Boolean");
   }
-  return value.boolValue;
+  return value.getBool();
+}
+
+VariableExpression::VariableExpression(const std::string& inName, int inSlot)
+    : name(inName), slot(inSlot) {
+  PRECONDITION(slot >= 0);
+}
+
+Expression::Value VariableExpression::compute(ExecutionContext& e) const {
+  if (slot >= e.size()) {
+    return fail(e.getStatus(), "Undefined variable: %s", name);
+  }
+  return e.get(slot);
+}
+
+void VariableExpression::print(ostream& out) const {
+  out << name;
 }
 
 UnaryOperator::UnaryOperator(Expression::Operator inOp, Expression* inChild)
     : op(inOp), child(inChild)
-{}
+{
+  annotate();
+}
 
 UnaryOperator::~UnaryOperator() {
   delete child;
 }
 
-Expression::Value UnaryOperator::evaluate(ExecutionContext& e) const {
-  Expression::Value result = child->evaluate(e);
-  if (op == OP_NOT) {
-    result.boolValue = !result.asBool();
-    result.type = TYPE_BOOL;
-  } else if (op == OP_BITNOT) {
-    if (result.type == TYPE_BOOL) {
-      result.boolValue = !result.asBool();
-    } else {
-      int64_t i = result.asNumber();
-      result.numberValue = ~i;
-      result.type = TYPE_NUMBER;
-    }
-  } else if (op == OP_NEGATIVE) {
-    result.numberValue = -result.asNumber();
-    result.type = TYPE_NUMBER;
-  } else if (op == OP_POSITIVE) {
-    result.numberValue = result.asNumber();
-    result.type = TYPE_NUMBER;
-  } else {
-    throw Exception("Unknown unary operator");
-  }
-
-  return result;
+Expression::Value UnaryOperator::compute(ExecutionContext& e) const {
+  return applyUnary(op, child->compute(e), e.getStatus());
 }
 
 void UnaryOperator::print(ostream& out) const {
@@ -464,10 +793,33 @@ void UnaryOperator::print(ostream& out) const {
   child->print(out);
 }
 
+Expression::Type UnaryOperator::inferType() const {
+  switch (op) {
+    case OP_NOT:
+      return TYPE_BOOL;
+    case OP_NEGATIVE:
+    case OP_POSITIVE:
+    case OP_BITNOT: {
+      // Integers stay integers, and ~ complements Booleans; anything else
+      // is converted to a number
+      const Type type = child->getStaticType();
+      if (type == TYPE_UNKNOWN || type == TYPE_INTEGER ||
+          (op == OP_BITNOT && type == TYPE_BOOL)) {
+        return type;
+      }
+      return TYPE_NUMBER;
+    }
+    default:
+      return TYPE_UNKNOWN;
+  }
+}
+
 BinaryOperator::BinaryOperator(Expression::Operator inOp,
                                Expression* inLeft,
                                Expression* inRight)
     : op(inOp), left(inLeft), right(inRight) {
+  PRECONDITION(op != OP_ANDAND && op != OP_OROR);
+  annotate();
 }
 
 BinaryOperator::~BinaryOperator() {
@@ -475,173 +827,86 @@ BinaryOperator::~BinaryOperator() {
   delete right;
 }
 
-Expression::Value BinaryOperator::evaluate(ExecutionContext& e) const {
+Expression::Value BinaryOperator::compute(ExecutionContext& e) const {
   // None of the assignment operators make sense, since we don't have
   // lvalues.
-  switch (op) {
-    case OP_ASSIGNMENT:
-    case OP_PLUSEQ:
-    case OP_MINUSEQ:
-    case OP_MULTIPLYEQ:
-    case OP_DIVIDEEQ:
-    case OP_MODEQ:
-    case OP_ANDEQ:
-    case OP_XOREQ:
-    case OP_OREQ:
-    case OP_LEFTEQ:
-    case OP_RIGHTEQ:
-      throw Exception("Not implemented: " + string(operator2string(op)));
-    default:
-      ;
+  if (isAssignment(op)) {
+    return fail(e.getStatus(), "Not implemented: %s", operator2string(op));
   }
 
-  Value leftValue = left->evaluate(e);
-  Value rightValue = right->evaluate(e);
+  const Value leftValue = left->compute(e);
+  const Value rightValue = right->compute(e);
+  return applyBinary(op, leftValue, rightValue, e.getStatus());
+}
 
-  Value result;
-  result.type = upcastType(leftValue.type, rightValue.type);
-  if (result.type == TYPE_STRING) {
-    leftValue.stringValue = toString(leftValue);
-    rightValue.stringValue = toString(rightValue);
+void BinaryOperator::print(ostream& out) const {
+  out << "(";
+  left->print(out);
+  out << operator2string(op);
+  right->print(out);
+  out << ")";
+}
 
-    switch (op) {
-      case OP_PLUS:
-        result.stringValue = leftValue.stringValue + rightValue.stringValue;
-        break;
-      case OP_LESS:
-        result.boolValue = leftValue.stringValue < rightValue.stringValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_LESSEQ:
-        result.boolValue = leftValue.stringValue <= rightValue.stringValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_GREATER:
-        result.boolValue = leftValue.stringValue > rightValue.stringValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_GREATEREQ:
-        result.boolValue = leftValue.stringValue >= rightValue.stringValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_EQUAL:
-        result.boolValue = leftValue.stringValue == rightValue.stringValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_NOTEQUAL:
-        result.boolValue = leftValue.stringValue != rightValue.stringValue;
-        result.type = TYPE_BOOL;
-        break;
-      default:
-        throw Exception(string("Invalid operation (") +
-                        operator2string(op) + ") on strings");
-    }
+Expression::Type BinaryOperator::inferType() const {
+  if (isAssignment(op)) {
+    return TYPE_UNKNOWN;
+  }
 
-  } else if (result.type == TYPE_NUMBER) {
-    leftValue.numberValue = toNumber(leftValue);
-    rightValue.numberValue = toNumber(rightValue);
+  const Type type = upcastType(left->getStaticType(), right->getStaticType());
+  if (type == TYPE_UNKNOWN) {
+    return TYPE_UNKNOWN;
+  }
 
-    switch (op) {
-      case OP_MULTIPLY:
-        result.numberValue = leftValue.numberValue * rightValue.numberValue;
-        break;
-      case OP_DIVIDE:
-        result.numberValue = leftValue.numberValue / rightValue.numberValue;
-        break;
-      case OP_MOD:
-        result.numberValue = toInt(leftValue) % toInt(rightValue);
-        break;
-      case OP_PLUS:
-        result.numberValue = leftValue.numberValue + rightValue.numberValue;
-        break;
-      case OP_MINUS:
-        result.numberValue = leftValue.numberValue - rightValue.numberValue;
-        break;
-      case OP_SHIFTLEFT:
-        result.numberValue = toInt(leftValue) << toInt(rightValue);
-        break;
-      case OP_SHIFTRIGHT:
-        result.numberValue = toInt(leftValue) >> toInt(rightValue);
-        break;
-      case OP_LESS:
-        result.boolValue = leftValue.numberValue < rightValue.numberValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_LESSEQ:
-        result.boolValue = leftValue.numberValue <= rightValue.numberValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_GREATER:
-        result.boolValue = leftValue.numberValue > rightValue.numberValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_GREATEREQ:
-        result.boolValue = leftValue.numberValue >= rightValue.numberValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_EQUAL:
-        result.boolValue = leftValue.numberValue == rightValue.numberValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_NOTEQUAL:
-        result.boolValue = leftValue.numberValue != rightValue.numberValue;
-        result.type = TYPE_BOOL;
-        break;
-      case OP_AND:
-        result.numberValue = toInt(leftValue) & toInt(rightValue);
-        break;
-      case OP_XOR:
-        result.numberValue = toInt(leftValue) ^ toInt(rightValue);
-        break;
-      case OP_OR:
-        result.numberValue = toInt(leftValue) | toInt(rightValue);
-        break;
-      case OP_ANDAND:
-        result.boolValue = toBool(leftValue) && toBool(rightValue);
-        result.type = TYPE_BOOL;
-        break;
-      case OP_OROR:
-        result.boolValue = toBool(leftValue) || toBool(rightValue);
-        result.type = TYPE_BOOL;
-        break;
-      default:
-        throw Exception(string("Invalid operation (") +
-                        operator2string(op) + ") on numbers");
-    }
+  switch (op) {
+    case OP_LESS:
+    case OP_LESSEQ:
+    case OP_GREATER:
+    case OP_GREATEREQ:
+    case OP_EQUAL:
+    case OP_NOTEQUAL:
+    case OP_ANDAND:
+    case OP_OROR:
+      return TYPE_BOOL;
+    case OP_DIVIDE:
+      return (type == TYPE_INTEGER) ? TYPE_NUMBER : type;
+    default:
+      // The rest give the operand type (or fail)
+      return type;
+  }
+}
+
+LogicalOperator::LogicalOperator(Expression::Operator inOp,
+                                 Expression* inLeft,
+                                 Expression* inRight)
+    : op(inOp), left(inLeft), right(inRight) {
+  PRECONDITION(op == OP_ANDAND || op == OP_OROR);
+  annotate();
+}
 
-  } else if (result.type == TYPE_BOOL) {
-    bool lval = toBool(leftValue);
-    bool rval = toBool(rightValue);
-    result.type = TYPE_BOOL;
+LogicalOperator::~LogicalOperator() {
+  delete left;
+  delete right;
+}
 
-    switch (op) {
-      case OP_EQUAL:
-        result.boolValue = lval == rval;
-        break;
-      case OP_NOTEQUAL:
-        result.boolValue = lval != rval;
-        break;
-      case OP_ANDAND:
-        result.boolValue = lval && rval;
-        break;
-      case OP_OROR:
-        result.boolValue = lval || rval;
-        break;
-      default:
-        throw Exception(string("Invalid operation (") +
-                        operator2string(op) + ") on Boolean values");
-    }
+Expression::Value LogicalOperator::compute(ExecutionContext& e) const {
+  // The left value that settles the result without evaluating the right
+  const bool settles = (op == OP_OROR);
 
-  } else if (result.type == TYPE_UNKNOWN) {
-    // Unknown type -- we've given up trying to evaluate
-  } else {
-    ASSERTION(false);
+  const Value leftValue = left->compute(e);
+  if (leftValue.getType() == TYPE_UNKNOWN) {
+    return Value();
+  } else if (leftValue.asBool() == settles) {
+    return Value(settles);
   }
 
-  return result;
+  const Value rightValue = right->compute(e);
+  if (rightValue.getType() == TYPE_UNKNOWN) {
+    return Value();
+  }
+  return Value(rightValue.asBool());
 }
 
-void BinaryOperator::print(ostream& out) const {
+void LogicalOperator::print(ostream& out) const {
   out << "(";
   left->print(out);
   out << operator2string(op);
@@ -649,10 +914,20 @@ void BinaryOperator::print(ostream& out) const {
   out << ")";
 }
 
+Expression::Type LogicalOperator::inferType() const {
+  if (left->getStaticType() == TYPE_UNKNOWN ||
+      right->getStaticType() == TYPE_UNKNOWN) {
+    return TYPE_UNKNOWN;
+  }
+  return TYPE_BOOL;
+}
+
 TernaryOperator::TernaryOperator(Expression* condition,
                                  Expression* pos,
                                  Expression* neg)
-    : test(condition), positive(pos), negative(neg) {}
+    : test(condition), positive(pos), negative(neg) {
+  annotate();
+}
 
 TernaryOperator::~TernaryOperator() {
   delete test;
@@ -660,11 +935,11 @@ TernaryOperator::~TernaryOperator() {
   delete negative;
 }
 
-Expression::Value TernaryOperator::evaluate(ExecutionContext& e) const {
-  if (test->evaluate(e).asBool()) {
-    return positive->evaluate(e);
+Expression::Value TernaryOperator::compute(ExecutionContext& e) const {
+  if (test->compute(e).asBool()) {
+    return positive->compute(e);
   } else {
-    return negative->evaluate(e);
+    return negative->compute(e);
   }
 }
 
@@ -678,6 +953,11 @@ void TernaryOperator::print(ostream& out) const {
   out << ")";
 }
 
+Expression::Type TernaryOperator::inferType() const {
+  const Type type = positive->getStaticType();
+  return (type == negative->getStaticType()) ? type : TYPE_UNKNOWN;
+}
+
 SequenceExpression::SequenceExpression() {}
 
 SequenceExpression::~SequenceExpression() {
@@ -694,16 +974,17 @@ const Expression* SequenceExpression::getSub(int i) const {
 void SequenceExpression::append(Expression* expr) {
   PRECONDITION(expr != 0);
   subs.push_back(expr);
+  annotate();
 }
 
-Expression::Value SequenceExpression::evaluate(ExecutionContext & e) const {
+Expression::Value SequenceExpression::compute(ExecutionContext & e) const {
   if (subs.empty()) {
-    throw Exception("Attempt to execute an empty sequence");
+    return fail(e.getStatus(), "Attempt to execute an empty sequence");
   }
 
   Value v;
   for (const auto* sub : subs) {
-    v = sub->evaluate(e);
+    v = sub->compute(e);
   }
   return v;
 }
@@ -715,13 +996,97 @@ void SequenceExpression::print(ostream& out) const {
   }
 }
 
+Expression::Type SequenceExpression::inferType() const {
+  return subs.empty() ? TYPE_UNKNOWN : subs.back()->getStaticType();
+}
+
+ConcatExpression::ConcatExpression() : unknownOperand(false) {}
+
+ConcatExpression::~ConcatExpression() {
+  for (auto* operand : operands) {
+    delete operand;
+  }
+}
+
+const Expression* ConcatExpression::getOperand(int i) const {
+  PRECONDITION(i < (int) operands.size());
+  return operands[i];
+}
+
+void ConcatExpression::append(Expression* expr) {
+  PRECONDITION(expr != 0);
+  operands.push_back(expr);
+  if (expr->getStaticType() == TYPE_UNKNOWN) {
+    unknownOperand = true;
+  }
+  annotate();
+}
+
+Expression::Value ConcatExpression::compute(ExecutionContext& e) const {
+  // Most chains are short enough for their values to fit on the stack
+  const int kFixedValues = 8;
+  Value fixed[kFixedValues];
+  vector<Value> allocated;
+  Value* values = fixed;
+  const int n = operands.size();
+  if (n > kFixedValues) {
+    allocated.resize(n);
+    values = &allocated[0];
+  }
+
+  for (int i = 0; i < n; i++) {
+    values[i] = operands[i]->compute(e);
+  }
+  return applyConcat(values, n);
+}
+
+// As the chain of + it replaced, so that it reads back the same
+void ConcatExpression::print(ostream& out) const {
+  for (unsigned i = 1; i < operands.size(); i++) {
+    out << "(";
+  }
+  for (unsigned i = 0; i < operands.size(); i++) {
+    if (i > 0) out << operator2string(OP_PLUS);
+    operands[i]->print(out);
+    if (i > 0) out << ")";
+  }
+}
+
+Expression::Type ConcatExpression::inferType() const {
+  return unknownOperand ? TYPE_UNKNOWN : TYPE_STRING;
+}
+
+int SymbolTable::add(const std::string& name) {
+  auto it = slots.find(name);
+  if (it != slots.end()) {
+    return it->second;
+  }
+
+  const int slot = names.size();
+  slots[name] = slot;
+  names.push_back(name);
+  return slot;
+}
+
+int SymbolTable::find(const std::string& name) const {
+  auto it = slots.find(name);
+  return (it == slots.end()) ? -1 : it->second;
+}
+
+const std::string& SymbolTable::getName(int slot) const {
+  PRECONDITION((slot >= 0) && (slot < size()));
+  return names[slot];
+}
+
 ostream& operator<<(ostream& out, const Expression::Value& v) {
-  if (v.type == Expression::TYPE_NUMBER) {
-    out << v.numberValue;
-  } else if (v.type == Expression::TYPE_STRING) {
-    out << "\"" << v.stringValue << "\"";
-  } else if (v.type == Expression::TYPE_BOOL) {
-    out << (v.boolValue ? "true" : "false");
+  if (v.getType() == Expression::TYPE_NUMBER) {
+    out << v.getNumber();
+  } else if (v.getType() == Expression::TYPE_INTEGER) {
+    out << v.getInteger();
+  } else if (v.getType() == Expression::TYPE_STRING) {
+    out << "\"" << v.getString() << "\"";
+  } else if (v.getType() == Expression::TYPE_BOOL) {
+    out << (v.getBool() ? "true" : "false");
   } else {
     out << "(invalid value)";
   }
@@ -1,15 +1,28 @@
 #if !defined EXPRESSION_H
 #define      EXPRESSION_H
 
+#include <atomic>
+#include <cstddef>
 #include <iosfwd>
+#include <stdint.h>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "status.h"
+
+class Arena;
+class BytecodeBuilder;
+class Column;
+class ColumnBatch;
+class ExecutionContext;
+class ExpressionDag;
+class ExpressionWriter;
+class NativeBuilder;
+class SymbolTable;
 class Tokenizer;
 
-class ExecutionContext {
-};
-
 class Expression {
 protected:
   Expression();
@@ -21,7 +34,8 @@ public:
     TYPE_UNKNOWN,
     TYPE_STRING,
     TYPE_NUMBER,
-    TYPE_BOOL
+    TYPE_BOOL,
+    TYPE_INTEGER  // 64 bits, signed
   };
 
   enum Operator {
@@ -62,24 +76,245 @@ public:
     OP_COMMA
   };
 
-  struct Value {
-    std::string stringValue;
-    double      numberValue;
-    bool        boolValue;
-    Type        type;
-
+  // A Value is a 16-byte tagged union. Strings are kept out of line in
+  // shared, reference-counted storage, so copying a Value never copies
+  // characters, and numbers, integers and Booleans never touch the heap.
+  //
+  // Integers are kept apart from (double) numbers so that they stay exact
+  // past 2^53. Arithmetic on integers (and Booleans, as 0 or 1) gives
+  // integers, wrapping around on overflow, except that / always gives a
+  // number; mixed with numbers, they're converted to numbers.
+  class Value {
+  public:
+    Value() : type(TYPE_UNKNOWN) { payload.number = 0; }
+    explicit Value(double n) : type(TYPE_NUMBER) { payload.number = n; }
+    explicit Value(int64_t i) : type(TYPE_INTEGER) { payload.integer = i; }
+    explicit Value(bool b) : type(TYPE_BOOL) {
+      payload.number = 0;
+      payload.boolean = b;
+    }
+    explicit Value(const std::string& s) : type(TYPE_STRING) {
+      payload.string = new StringData(s);
+    }
+    explicit Value(std::string&& s) : type(TYPE_STRING) {
+      payload.string = new StringData(std::move(s));
+    }
+    explicit Value(const char* s) : type(TYPE_STRING) {
+      payload.string = new StringData(s);
+    }
+
+    Value(const Value& v) : type(v.type), payload(v.payload) { retain(); }
+    Value(Value&& v) noexcept : type(v.type), payload(v.payload) {
+      v.type = TYPE_UNKNOWN;
+    }
+    ~Value() { release(); }
+
+    Value& operator=(const Value& v) {
+      if (this != &v) {
+        v.retain();
+        release();
+        type = v.type;
+        payload = v.payload;
+      }
+      return *this;
+    }
+
+    Value& operator=(Value&& v) noexcept {
+      if (this != &v) {
+        release();
+        type = v.type;
+        payload = v.payload;
+        v.type = TYPE_UNKNOWN;
+      }
+      return *this;
+    }
+
+    Type getType() const { return type; }
+
+    // These return the raw value, and are valid only for the matching type
+    double getNumber() const { return payload.number; }
+    int64_t getInteger() const { return payload.integer; }
+    bool getBool() const { return payload.boolean; }
+    const std::string& getString() const { return payload.string->text; }
+
+    // These convert from whatever the type is
     std::string asString() const;
     double asNumber() const;
     bool asBool() const;
+
+  private:
+    friend class NativeBuilder;  // Native code reads Values in place
+
+    struct StringData {
+      StringData(const std::string& s) : references(1), text(s) {}
+      StringData(std::string&& s) : references(1), text(std::move(s)) {}
+
+      std::atomic<int> references;
+      const std::string text;
+    };
+
+    union Payload {
+      double number;
+      int64_t integer;
+      bool boolean;
+      StringData* string;
+    };
+
+    void retain() const {
+      if (type == TYPE_STRING) {
+        payload.string->references.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    void release() {
+      if ((type == TYPE_STRING) &&
+          (payload.string->references.fetch_sub(
+              1, std::memory_order_acq_rel) == 1)) {
+        delete payload.string;
+      }
+    }
+
+    Type type;
+    Payload payload;
   };
 
-  virtual Value evaluate(ExecutionContext&) const = 0;
-  
+  // How a compiled expression is evaluated
+  enum Backend {
+    BACKEND_TREE,     // Walk the node tree
+    BACKEND_BYTECODE, // Run a flat register program; see bytecode.h
+    BACKEND_NATIVE    // Run machine code where possible; see jit.h
+  };
+
+  struct CompileOptions {
+    CompileOptions()
+        : backend(BACKEND_TREE), symbols(nullptr),
+          optimize(false), strict(false), arena(nullptr) {}
+
+    Backend backend;
+
+    // If set, identifiers other than 'true' and 'false' are variables,
+    // resolved to slots in this table (and added to it if they're new).
+    // Otherwise they're a syntax error.
+    SymbolTable* symbols;
+
+    // Fold constant subtrees and apply simple identities; see simplify()
+    bool optimize;
+
+    // When optimizing, a constant subtree that fails to evaluate is a
+    // compile error. Otherwise it's left alone, to fail when evaluated.
+    bool strict;
+
+    // If set, the nodes are allocated in this arena, which must outlive
+    // the expression; see arena.h (what the nodes own stays on the heap)
+    Arena* arena;
+  };
+
+  // Nodes are allocated with new, or with new (arena) to put them in an
+  // Arena; a null arena means the heap. Deleting a node in an arena runs
+  // its destructor, but leaves the memory to the arena.
+  static void* operator new(size_t size);
+  static void* operator new(size_t size, Arena*);
+  static void operator delete(void* p);
+  static void operator delete(void* p, Arena*);
+
+  // Evaluating doesn't change the expression, so any number of threads can
+  // evaluate one at once, each with its own ExecutionContext. (The same
+  // goes for evaluateBatch.) Values, and the strings they share, can be
+  // copied and destroyed on any thread. See parallel.h.
+  //
+  // evaluate() throws if evaluating fails, e.g. on operands of the wrong
+  // type; tryEvaluate() is the Status API version.
+  Value evaluate(ExecutionContext&) const;
+  Result<Value> tryEvaluate(ExecutionContext&) const;
+
+  // What those both call. An error is left in the context's status (unless
+  // it has one already) rather than thrown, and the value is then
+  // meaningless. Evaluating has no side effects, so nodes needn't stop at
+  // an error: they can carry on with whatever their children returned.
+  virtual Value compute(ExecutionContext&) const = 0;
+
   virtual void print(std::ostream&) const = 0;
 
+  // The type every successful evaluation of this expression has, or
+  // TYPE_UNKNOWN if that depends on the inputs. Nodes work this out from
+  // their children when they're built (or simplified).
+  Type getStaticType() const { return staticType; }
+
+  // Return an equivalent expression that's cheaper to evaluate, after
+  // simplifying the children. This expression is consumed: it's either
+  // returned or deleted. New nodes go in the options' arena. If the
+  // options are strict, an error found in a constant subtree is left in
+  // the status (unless it has one already).
+  virtual Expression* simplify(const CompileOptions&, Status&);
+
+  // Append instructions that leave the value of this expression in
+  // register 'reg'. The default hands the whole subtree to compute().
+  virtual void lower(BytecodeBuilder&, int reg) const;
+
+  // Evaluate every row of the batch, leaving one result per row. Each
+  // node handles a whole column per call. Throws if any row would.
+  void evaluateBatch(const ColumnBatch&, Column& result) const;
+
+  // Evaluate the given rows (in order) of the batch, leaving one result per
+  // row. The default evaluates the rows one at a time.
+  virtual void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                            Column& result) const;
+
+  // Append this expression's nodes to the writer, children first, and
+  // return the index of its own; see serialize.h. The default throws.
+  virtual int save(ExpressionWriter&) const;
+
+  // Add this expression's nodes to the DAG, children first, sharing any
+  // subtree that's there already, and return the index of its own; see
+  // dag.h. The default throws.
+  virtual int share(ExpressionDag&) const;
+
+  // Append machine code that leaves the value of this expression in
+  // register 'reg', and return its NativeBuilder::Kind. The default
+  // appends nothing and returns KIND_NONE, leaving the builder to evaluate
+  // the subtree with the tree interpreter.
+  virtual int emitNative(NativeBuilder&, int reg) const;
+
+  // Compile the text from the tokenizer's current token on. Text that
+  // isn't an expression, or that the backend can't take, throws;
+  // tryCompile() is the Status API version.
   static Expression* compile(Tokenizer&);
+  static Expression* compile(Tokenizer&, const CompileOptions&);
+  static Result<Expression*> tryCompile(Tokenizer&, const CompileOptions&);
 
   static Operator string2operator(const std::string& text);
+  static const char* operator2string(Operator);
+
+  // The semantics of each operator, applied to already-evaluated operands.
+  // Every evaluator goes through these so that they all agree. && and ||
+  // aren't included, since they don't always evaluate both operands; see
+  // LogicalOperator. Errors throw, or with a status, are left in it as by
+  // compute().
+  static Value applyUnary(Operator, const Value&);
+  static Value applyUnary(Operator, const Value&, Status&);
+  static Value applyBinary(Operator, const Value& left, const Value& right);
+  static Value applyBinary(Operator, const Value& left, const Value& right,
+                           Status&);
+
+  // The values joined as by a chain of +, when the first + is on strings:
+  // each is converted to a string, and if any is unknown, so is the
+  // result. This can't fail. See ConcatExpression.
+  static Value applyConcat(const Value* values, int count);
+
+  // The assignment operators parse, but can't be evaluated (there are no
+  // lvalues). Evaluating one throws before its operands are evaluated.
+  static bool isAssignment(Operator);
+
+protected:
+  // Work out the static type from the children's. The default is
+  // TYPE_UNKNOWN.
+  virtual Type inferType() const;
+
+  // Set the static type; call whenever the children change
+  void annotate() { staticType = inferType(); }
+
+private:
+  Type staticType;
 };
 
 class ConstantExpression : public Expression {
@@ -89,8 +324,14 @@ public:
   ConstantExpression(bool b);
   ConstantExpression(double n);
 
-  Value evaluate(ExecutionContext&) const override;
+  Value compute(ExecutionContext&) const override;
   void print(std::ostream&) const override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
 
   void set(double);
   void set(const std::string&);
@@ -98,20 +339,56 @@ public:
 
   const std::string & getString() const;
   double getNumber() const;
+  int64_t getInteger() const;
   bool getBool() const;
-  Type getType() const { return value.type; }
+  Type getType() const { return value.getType(); }
+
+protected:
+  Type inferType() const override;
 
 private:
     Value value;
 };
 
+// Reads a variable's value from its slot in the ExecutionContext
+class VariableExpression : public Expression {
+public:
+  VariableExpression(const std::string& name, int slot);
+
+  Value compute(ExecutionContext&) const override;
+  void print(std::ostream&) const override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
+
+  const std::string& getName() const { return name; }
+  int getSlot() const { return slot; }
+
+private:
+  std::string name;
+  int slot;
+};
+
 class UnaryOperator : public Expression {
 public:
   UnaryOperator(Operator, Expression* child);
   ~UnaryOperator() override;
 
-  Value evaluate(ExecutionContext &) const override;
+  Value compute(ExecutionContext&) const override;
   void print(std::ostream &) const override;
+  Expression* simplify(const CompileOptions&, Status&) override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
+
+protected:
+  Type inferType() const override;
 
 private:
   Operator op;
@@ -123,8 +400,47 @@ public:
   BinaryOperator(Operator op, Expression* left, Expression* right);
   ~BinaryOperator() override;
 
-  Value evaluate(ExecutionContext &) const override;
+  Value compute(ExecutionContext&) const override;
   void print(std::ostream &) const override;
+  Expression* simplify(const CompileOptions&, Status&) override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
+
+  Operator getOperator() const { return op; }
+
+protected:
+  Type inferType() const override;
+
+  // Specialized subclasses evaluate the operands themselves
+  Operator op;
+  Expression* left;
+  Expression* right;
+};
+
+// && and ||, which only evaluate their right operand when the left one
+// doesn't settle the result. Operands are tested like the condition of ?:,
+// and the result is a Boolean, or unknown if a tested operand is.
+class LogicalOperator : public Expression {
+public:
+  LogicalOperator(Operator op, Expression* left, Expression* right);
+  ~LogicalOperator() override;
+
+  Value compute(ExecutionContext&) const override;
+  void print(std::ostream&) const override;
+  Expression* simplify(const CompileOptions&, Status&) override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
+
+protected:
+  Type inferType() const override;
 
 private:
   Operator op;
@@ -137,8 +453,18 @@ public:
   TernaryOperator(Expression* test, Expression* pos, Expression* neg);
   ~TernaryOperator() override;
 
-  Value evaluate(ExecutionContext&) const override;
+  Value compute(ExecutionContext&) const override;
   void print(std::ostream&) const override;
+  Expression* simplify(const CompileOptions&, Status&) override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
+
+protected:
+  Type inferType() const override;
 
 private:
   Expression* test;
@@ -156,15 +482,121 @@ public:
 
   void append(Expression*);
 
-  Value evaluate(ExecutionContext& e) const override;
+  Value compute(ExecutionContext&) const override;
   void print(std::ostream&) const override;
+  Expression* simplify(const CompileOptions&, Status&) override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+  int emitNative(NativeBuilder&, int reg) const override;
+
+protected:
+  Type inferType() const override;
 
 private:
   std::vector<Expression*> subs;
 };
 
+// A chain of + on strings, like 'id-' + n + '-' + m, evaluated in one go:
+// the operands are converted as + converts them, and copied once into a
+// string allocated at its full length, instead of each + copying the whole
+// string so far. The optimizer puts these in place of the chains; see
+// BinaryOperator::simplify. Any operand can come first; the chain's first
+// + is what has to be on a string.
+class ConcatExpression : public Expression {
+public:
+  ConcatExpression();
+  ~ConcatExpression() override;
+
+  int getCount() const { return operands.size(); }
+  const Expression* getOperand(int i) const;
+
+  void append(Expression*);
+
+  Value compute(ExecutionContext&) const override;
+  void print(std::ostream&) const override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+
+protected:
+  Type inferType() const override;
+
+private:
+  std::vector<Expression*> operands;
+  bool unknownOperand;  // Whether any operand's static type is unknown
+};
+
+// Maps variable names to the slots that hold their values in an
+// ExecutionContext. Names are resolved once, when expressions are compiled,
+// so evaluation only does an indexed load.
+class SymbolTable {
+public:
+  // Return the slot for the name, adding the name if it's new
+  int add(const std::string& name);
+
+  // Return the slot for the name, or -1 if it isn't known
+  int find(const std::string& name) const;
+
+  const std::string& getName(int slot) const;
+  int size() const { return names.size(); }
+
+private:
+  std::unordered_map<std::string, int> slots;
+  std::vector<std::string> names;
+};
+
+// Holds the values of the variables, one per slot. Callers fill in the
+// slots before calling evaluate(); slots never set hold an unknown value.
+//
+// It also holds the first error Expression::compute() runs into.
+// evaluate() and tryEvaluate() take that out again, so between
+// evaluations the status is OK.
+class ExecutionContext {
+public:
+  ExecutionContext() {}
+  explicit ExecutionContext(int slots) : values(slots) {}
+  explicit ExecutionContext(const SymbolTable& symbols)
+      : values(symbols.size()) {}
+
+  int size() const { return values.size(); }
+
+  const Expression::Value& get(int slot) const { return values[slot]; }
+
+  void set(int slot, const Expression::Value& v) {
+    if (slot >= size()) values.resize(slot + 1);
+    values[slot] = v;
+  }
+
+  Status& getStatus() { return status; }
+
+  // Return the status, leaving this one OK
+  Status takeStatus() {
+    Status result;
+    std::swap(result, status);
+    return result;
+  }
+
+private:
+  std::vector<Expression::Value> values;
+  Status status;
+};
+
 // A couple handy printing operators
 std::ostream& operator<<(std::ostream&, const Expression::Value&);
 std::ostream& operator<<(std::ostream&, const Expression&);
 
+// Inline, since it's called once per evaluation
+inline Expression::Value Expression::evaluate(ExecutionContext& e) const {
+  Value result = compute(e);
+  if (!e.getStatus().ok()) {
+    e.takeStatus().check();
+  }
+  return result;
+}
+
 #endif
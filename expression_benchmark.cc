@@ -0,0 +1,558 @@
+// Performance measurements for each stage: reading text, tokenizing,
+// compiling and evaluating. The corpora in benchdata/ are read from the
+// current directory, so run it from the top of the tree ("make bench" then
+// ./expression_benchmark, or "make bench_json" to record the results).
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "convert.h"
+#include "dag.h"
+#include "exception.h"
+#include "expression.h"
+#include "parallel.h"
+#include "serialize.h"
+#include "test_util.h"
+#include "textsource.h"
+#include "tokenizer.h"
+
+#include "benchmark/benchmark.h"
+
+namespace {
+
+// Rules like the ones in our rule files: mostly operators between short
+// names and constants
+const char* const kOperatorDense =
+    "a<<=b>>=c!=d&&e||f==g<=h>=i+=j-=k*=l/=m%=n&=o^=p|=q<<r>>s ";
+const char* const kRule =
+    "(price * quantity >= 100 && region == 'EU') || (flag != true && "
+    "count % 7 == 3) ? total - discount : -total ";
+
+std::string Repeat(const std::string& text, int n) {
+  std::string result;
+  for (int i = 0; i < n; i++) {
+    result += text;
+  }
+  return result;
+}
+
+// The whole of a file in benchdata/, or an empty string if it can't be read
+std::string ReadCorpus(const std::string& name) {
+  std::ifstream in("benchdata/" + name);
+  std::ostringstream text;
+  text << in.rdbuf();
+  return text.str();
+}
+
+// The non-blank lines of a file in benchdata/
+std::vector<std::string> ReadLines(const std::string& name) {
+  std::istringstream in(ReadCorpus(name));
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.find_first_not_of(" \t") != std::string::npos) {
+      lines.push_back(line);
+    }
+  }
+  return lines;
+}
+
+// TextSource
+
+void ReadCharacters(benchmark::State& state, bool skip_comments) {
+  const std::string text = Repeat(ReadCorpus("commented.expr"), 20);
+  if (text.empty()) {
+    state.SkipWithError("Can't read benchdata/commented.expr");
+    return;
+  }
+
+  for (auto _ : state) {
+    TextSource source(text.data(), text.size(), skip_comments);
+    int sum = 0;
+    while (!source.eof()) {
+      sum += source.current();
+      source.consume();
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+}
+
+void BM_TextSourceSkippingComments(benchmark::State& state) {
+  ReadCharacters(state, true);
+}
+BENCHMARK(BM_TextSourceSkippingComments);
+
+void BM_TextSourceKeepingComments(benchmark::State& state) {
+  ReadCharacters(state, false);
+}
+BENCHMARK(BM_TextSourceKeepingComments);
+
+// Tokenizer
+
+void Tokenize(benchmark::State& state, const std::string& text) {
+  int64_t tokens = 0;
+  for (auto _ : state) {
+    Tokenizer tokenizer(new TextSource(text.data(), text.size()));
+    while (tokenizer.next()) {
+      ++tokens;
+    }
+  }
+  state.SetItemsProcessed(tokens);
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+}
+
+void BM_TokenizeOperators(benchmark::State& state) {
+  Tokenize(state, Repeat(kOperatorDense, 100));
+}
+BENCHMARK(BM_TokenizeOperators);
+
+void BM_TokenizeRules(benchmark::State& state) {
+  Tokenize(state, Repeat(kRule, 100));
+}
+BENCHMARK(BM_TokenizeRules);
+
+void BM_TokenizeCorpus(benchmark::State& state) {
+  const std::string text = Repeat(ReadCorpus("rules.expr"), 20);
+  if (text.empty()) {
+    state.SkipWithError("Can't read benchdata/rules.expr");
+    return;
+  }
+  Tokenize(state, text);
+}
+BENCHMARK(BM_TokenizeCorpus);
+
+// Compiling
+
+void BM_CompileRule(benchmark::State& state) {
+  const std::string text = kRule;
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+
+  for (auto _ : state) {
+    std::unique_ptr<Expression> e(Compile(text, options));
+    benchmark::DoNotOptimize(e.get());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompileRule);
+
+// Each rule in the corpus is one item
+void BM_CompileCorpus(benchmark::State& state) {
+  const std::vector<std::string> rules = ReadLines("rules.expr");
+  if (rules.empty()) {
+    state.SkipWithError("Can't read benchdata/rules.expr");
+    return;
+  }
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = state.range(0);
+
+  for (auto _ : state) {
+    for (const std::string& rule : rules) {
+      std::unique_ptr<Expression> e(Compile(rule, options));
+      benchmark::DoNotOptimize(e.get());
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * rules.size());
+}
+BENCHMARK(BM_CompileCorpus)->ArgName("optimize")->Arg(0)->Arg(1);
+
+// The same rules, saved (as compiled) in an image and loaded back
+void BM_LoadCorpus(benchmark::State& state) {
+  const std::vector<std::string> rules = ReadLines("rules.expr");
+  if (rules.empty()) {
+    state.SkipWithError("Can't read benchdata/rules.expr");
+    return;
+  }
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = state.range(0);
+
+  ExpressionWriter writer;
+  for (const std::string& rule : rules) {
+    std::unique_ptr<Expression> e(Compile(rule, options));
+    writer.add(*e);
+  }
+  const std::string data = writer.getImage();
+  ExpressionImage image(data.data(), data.size());
+
+  for (auto _ : state) {
+    for (int i = 0; i < image.size(); i++) {
+      std::unique_ptr<Expression> e(image.load(i, options));
+      benchmark::DoNotOptimize(e.get());
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * rules.size());
+}
+BENCHMARK(BM_LoadCorpus)->ArgName("optimize")->Arg(0)->Arg(1);
+
+// An expression 'depth' levels of parentheses deep, with 'width' operands
+// in each set. The operators cycle through all the precedence levels.
+std::string Generate(int depth, int width) {
+  static const char* const kOperators[] = {
+    " * ", " + ", " << ", " < ", " == ", " & ", " ^ ", " | ", " && ", " || ",
+    " - ", " / ", " >= ", " != ",
+  };
+  static int next = 0;
+
+  std::string result;
+  for (int i = 0; i < width; i++) {
+    if (i > 0) {
+      result += kOperators[next++ % 14];
+    }
+    if (depth > 1) {
+      result += "(" + Generate(depth - 1, width) + ")";
+    } else {
+      result += (i % 2 == 0) ? "x" : "2";
+    }
+  }
+  return result;
+}
+
+// x + (x + (x + ...)), nested 'depth' deep
+std::string Nest(int depth) {
+  std::string result = "x";
+  for (int i = 1; i < depth; i++) {
+    result = "x + (" + result + ")";
+  }
+  return result;
+}
+
+void CompileText(benchmark::State& state, const std::string& text) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+
+  for (auto _ : state) {
+    std::unique_ptr<Expression> e(Compile(text, options));
+    benchmark::DoNotOptimize(e.get());
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+}
+
+void BM_ParseGenerated(benchmark::State& state) {
+  CompileText(state, Generate(state.range(0), state.range(1)));
+}
+BENCHMARK(BM_ParseGenerated)
+    ->ArgNames({"depth", "width"})
+    ->Args({1, 2})->Args({1, 64})
+    ->Args({4, 2})->Args({4, 8})
+    ->Args({12, 2});
+
+void BM_CompileShallow(benchmark::State& state) {
+  CompileText(state, "x + 1");
+}
+BENCHMARK(BM_CompileShallow);
+
+void BM_CompileDeep(benchmark::State& state) {
+  CompileText(state, Nest(state.range(0)));
+}
+BENCHMARK(BM_CompileDeep)->Arg(16)->Arg(256);
+
+void BM_CompileWide(benchmark::State& state) {
+  CompileText(state, Generate(1, state.range(0)));
+}
+BENCHMARK(BM_CompileWide)->Arg(16)->Arg(256);
+
+// Conversions between numbers and strings, as when upcasting, against the
+// stream and strtod they replace (argument 0). Each conversion is one item.
+const double kNumbers[] = {
+  0, 1, 42, -7, 0.5, 3.14159265, 1e-3, 123456.789, 2.5e10, -1e-20,
+  1234567, 0.1,
+};
+const char* const kNumberTexts[] = {
+  "0", "1", "42", "-7", "0.5", "3.14159", "0.001", "123457", "2.5e+10",
+  "-1e-20", "1.23457e+06", "0.1",
+};
+
+void BM_NumberToString(benchmark::State& state) {
+  const bool fast = state.range(0);
+  for (auto _ : state) {
+    for (double number : kNumbers) {
+      if (fast) {
+        benchmark::DoNotOptimize(number2string(number));
+      } else {
+        std::ostringstream out;
+        out << number;
+        benchmark::DoNotOptimize(out.str());
+      }
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) *
+                          (sizeof(kNumbers) / sizeof(kNumbers[0])));
+}
+BENCHMARK(BM_NumberToString)->ArgName("fast")->Arg(0)->Arg(1);
+
+void BM_StringToNumber(benchmark::State& state) {
+  const bool fast = state.range(0);
+  std::vector<std::string> texts(std::begin(kNumberTexts),
+                                 std::end(kNumberTexts));
+  for (auto _ : state) {
+    for (const std::string& text : texts) {
+      double number = 0;
+      if (fast) {
+        string2number(text.data(), text.size(), number);
+      } else {
+        number = strtod(text.c_str(), nullptr);
+      }
+      benchmark::DoNotOptimize(number);
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * texts.size());
+}
+BENCHMARK(BM_StringToNumber)->ArgName("fast")->Arg(0)->Arg(1);
+
+// Evaluating. Each corpus is compiled once, then evaluated over and over
+// with the same variables; each expression evaluated is one item. The
+// argument is the Expression::Backend.
+
+void Evaluate(benchmark::State& state, const std::string& corpus) {
+  const std::vector<std::string> texts = ReadLines(corpus);
+  if (texts.empty()) {
+    state.SkipWithError(("Can't read benchdata/" + corpus).c_str());
+    return;
+  }
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = true;
+  options.backend = Expression::Backend(state.range(0));
+
+  std::vector<std::unique_ptr<Expression> > expressions;
+  for (const std::string& text : texts) {
+    expressions.emplace_back(Compile(text, options));
+  }
+
+  ExecutionContext context(symbols);
+  const struct {
+    const char* name;
+    Expression::Value value;
+  } variables[] = {
+    { "x", Expression::Value(3.5) },
+    { "y", Expression::Value(-2.0) },
+    { "z", Expression::Value(12.0) },
+    { "name", Expression::Value("alice") },
+    { "region", Expression::Value("EU") },
+    { "flag", Expression::Value(true) },
+    { "done", Expression::Value(false) },
+  };
+  for (const auto& v : variables) {
+    const int slot = symbols.find(v.name);
+    if (slot >= 0) {
+      context.set(slot, v.value);
+    }
+  }
+
+  // Every expression in the corpus must evaluate without errors
+  try {
+    for (const auto& e : expressions) {
+      e->evaluate(context);
+    }
+  } catch (const Exception& ex) {
+    state.SkipWithError(ex.what());
+    return;
+  }
+
+  for (auto _ : state) {
+    for (const auto& e : expressions) {
+      benchmark::DoNotOptimize(e->evaluate(context));
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * expressions.size());
+}
+
+void BM_EvaluateNumber(benchmark::State& state) {
+  Evaluate(state, "number.expr");
+}
+BENCHMARK(BM_EvaluateNumber)->ArgName("backend")->DenseRange(0, 2);
+
+void BM_EvaluateString(benchmark::State& state) {
+  Evaluate(state, "string.expr");
+}
+BENCHMARK(BM_EvaluateString)->ArgName("backend")->DenseRange(0, 2);
+
+void BM_EvaluateBool(benchmark::State& state) {
+  Evaluate(state, "bool.expr");
+}
+BENCHMARK(BM_EvaluateBool)->ArgName("backend")->DenseRange(0, 2);
+
+void BM_EvaluateMixed(benchmark::State& state) {
+  Evaluate(state, "mixed.expr");
+}
+BENCHMARK(BM_EvaluateMixed)->ArgName("backend")->DenseRange(0, 2);
+
+// A chain of 'operands' strings and numbers joined with +, on the tree
+// backend, unoptimized (a copy per +) and optimized (one concatenation).
+void BM_EvaluateConcatChain(benchmark::State& state) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = state.range(1) != 0;
+
+  std::string text = "name";
+  for (int i = 1; i < state.range(0); i++) {
+    text += (i % 2) ? " + '-'" : " + x";
+  }
+  std::unique_ptr<Expression> e(Compile(text, options));
+
+  ExecutionContext context(symbols);
+  context.set(symbols.find("name"), Expression::Value("alice"));
+  context.set(symbols.find("x"), Expression::Value(3.5));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(e->evaluate(context));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EvaluateConcatChain)
+    ->ArgNames({ "operands", "optimize" })
+    ->ArgsProduct({ { 4, 16, 256 }, { 0, 1 } });
+
+// A rule set whose rules share subexpressions, as ours do: each compares
+// one of a few scores against its own threshold. Each rule is evaluated
+// on its own, or all of them together from a DAG, computing each score
+// once. One item is the whole rule set.
+void BM_EvaluateSharedRules(benchmark::State& state) {
+  const char* const scores[] = {
+    "(a * 1.5 + b)", "(a * a - c / 2)", "(b * 3 + c * 0.25 - a)",
+    "((a + b + c) / 3)",
+  };
+  const int kRules = 400;
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  std::vector<std::unique_ptr<Expression> > rules;
+  ExpressionDag dag;
+  for (int i = 0; i < kRules; i++) {
+    const std::string text = std::string(scores[i % 4]) + " > " +
+        std::to_string(i % 50) + " && " + scores[(i / 4) % 4] + " < 90";
+    rules.emplace_back(Compile(text, options));
+    dag.add(*rules.back());
+  }
+
+  ExecutionContext context(symbols);
+  context.set(symbols.find("a"), Expression::Value(7.0));
+  context.set(symbols.find("b"), Expression::Value(2.0));
+  context.set(symbols.find("c"), Expression::Value(12.0));
+
+  if (state.range(0) == 0) {
+    for (auto _ : state) {
+      for (const auto& rule : rules) {
+        benchmark::DoNotOptimize(rule->evaluate(context));
+      }
+    }
+  } else {
+    DagEvaluator evaluator(dag);
+    for (auto _ : state) {
+      evaluator.reset();
+      for (int i = 0; i < dag.size(); i++) {
+        benchmark::DoNotOptimize(evaluator.evaluate(i, context));
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EvaluateSharedRules)->ArgName("dag")->Arg(0)->Arg(1);
+
+// Terms [begin, end) of a sum, added in a balanced tree
+std::string BalancedSum(int begin, int end, int variables) {
+  if (end - begin == 1) {
+    return "(v" + std::to_string(begin % variables) + " * " +
+        std::to_string(begin + 1) + " - " + std::to_string(begin % 7) + ")";
+  }
+  const int middle = (begin + end) / 2;
+  return "(" + BalancedSum(begin, middle, variables) + " + " +
+      BalancedSum(middle, end, variables) + ")";
+}
+
+// A large expression over many variables, one of which changes before
+// each evaluation. It's evaluated afresh each time, or incrementally,
+// computing only the nodes on the paths from the changed variable (the
+// "nodes" counter).
+void BM_EvaluateIncremental(benchmark::State& state) {
+  const int kVariables = 64;
+  const std::string text = BalancedSum(0, 4 * kVariables, kVariables);
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  std::unique_ptr<Expression> e(Compile(text, options));
+  ExpressionDag dag;
+  dag.add(*e);
+
+  ExecutionContext context(symbols);
+  for (int i = 0; i < kVariables; i++) {
+    context.set(i, Expression::Value(double(i)));
+  }
+
+  DagEvaluator evaluator(dag);
+  const bool incremental = state.range(0) != 0;
+  int i = 0;
+  for (auto _ : state) {
+    const int slot = i % kVariables;
+    const Expression::Value value(double(i++ % 100));
+    if (incremental) {
+      evaluator.set(context, slot, value);
+      benchmark::DoNotOptimize(evaluator.evaluate(0, context));
+    } else {
+      context.set(slot, value);
+      benchmark::DoNotOptimize(e->evaluate(context));
+    }
+  }
+  if (incremental) {
+    state.counters["nodes"] =
+        double(evaluator.getComputedCount()) / state.iterations();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EvaluateIncremental)->ArgName("incremental")->Arg(0)->Arg(1);
+
+// Parallel evaluation of a batch of a million rows, on 1 to N threads.
+// The time is wall-clock time, so ideal scaling halves it each time the
+// threads double.
+void BM_EvaluateParallel(benchmark::State& state) {
+  const int kRows = 1000000;
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  std::unique_ptr<Expression> e(
+      Compile("x * 2 + y > 10 && y < 5 ? x - y : x + y", options));
+
+  ColumnBatch batch(kRows);
+  batch.getColumn(symbols.size() - 1);
+  Column& x = batch.getColumn(symbols.find("x"));
+  Column& y = batch.getColumn(symbols.find("y"));
+  for (int i = 0; i < kRows; i++) {
+    x.append(Expression::Value(double(i % 100)));
+    y.append(Expression::Value(double(i % 7)));
+  }
+
+  ThreadPool pool(state.range(0));
+  Column result;
+  for (auto _ : state) {
+    evaluateParallel(*e, batch, result, pool);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * kRows);
+}
+BENCHMARK(BM_EvaluateParallel)
+    ->ArgName("threads")
+    ->RangeMultiplier(2)
+    ->Range(1, std::max(1u, std::thread::hardware_concurrency()))
+    ->UseRealTime();
+
+}  // namespace
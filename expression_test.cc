@@ -1,6 +1,9 @@
 #include <iostream>
+#include <new>
 #include <sstream>
 #include <memory>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "exception.h"
 #include "expression.h"
@@ -9,6 +12,25 @@
 
 #include "gtest/gtest.h"
 
+// Count heap allocations, so tests can check that evaluation doesn't
+// allocate.
+static int allocations = 0;
+
+void* operator new(size_t size) {
+  ++allocations;
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
 // Helper functions: evaluate the given expression, and return a value.
 Expression::Value Evaluate(const char* expr) {
   std::istringstream s(expr);
@@ -47,13 +69,79 @@ TEST(ExpressionTest, Errors) {
   EXPECT_THROW(EvaluateDouble("true + true"), Exception);
 }
 
+// The message thrown by compiling and evaluating the text, or "" if nothing
+// is thrown
+std::string Thrown(const char* text,
+                   const Expression::CompileOptions& options) {
+  try {
+    std::istringstream s(text);
+    Tokenizer tokenizer(new TextSource(s));
+    tokenizer.next();
+    std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+    ExecutionContext exe;
+    e->evaluate(exe);
+  } catch (const Exception& e) {
+    return e.what();
+  }
+  return "";
+}
+
+// The same, with the Status API
+std::string Failed(const char* text,
+                   const Expression::CompileOptions& options) {
+  std::istringstream s(text);
+  Tokenizer tokenizer(TextSource::tryCreate(s));
+  tokenizer.tryNext();
+  const Result<Expression*> e = Expression::tryCompile(tokenizer, options);
+  if (!e.ok()) {
+    EXPECT_EQ(nullptr, e.get());
+    return e.getStatus().getMessage();
+  }
+
+  std::unique_ptr<Expression> expr(e.get());
+  ExecutionContext exe;
+  const Result<Expression::Value> v = expr->tryEvaluate(exe);
+  if (!v.ok()) {
+    // The error isn't left in the context
+    EXPECT_TRUE(exe.getStatus().ok());
+    return v.getStatus().getMessage();
+  }
+  return "";
+}
+
+TEST(ExpressionTest, Statuses) {
+  const char* texts[] = {
+    "%6", "6++", "++6", "4 = 2", "4 4", "1 +", "(1", "1 ? 2", "'a",
+    "1 /* 2", "@", "true + true", "'a' - 'b'", "1 / 0", "5 % 0",
+    "-'a'", "(1, 'a' * 2) + 1", "1 + (true < false)", "x", "2 + 3",
+    "true ? 1 : 'a' / 2", "false && 'a' < 1",
+  };
+  Expression::CompileOptions options;
+  for (int optimize = 0; optimize < 2; optimize++) {
+    for (int strict = 0; strict < 2; strict++) {
+      options.optimize = optimize;
+      options.strict = strict;
+      for (const char* text : texts) {
+        EXPECT_EQ(Thrown(text, options), Failed(text, options)) << text;
+      }
+    }
+  }
+
+  EXPECT_EQ("", Failed("2 + 3", options));
+  EXPECT_EQ("Division by zero", Failed("5 % 0", options));
+  EXPECT_EQ("Invalid operation (+) on Boolean values",
+            Failed("true + true", options));
+  EXPECT_EQ("Syntax error: unexpected end of input", Failed("1 +", options));
+
+  // The first error is the one reported
+  EXPECT_EQ("Division by zero", Failed("(5 % 0) + (true + true)", options));
+}
+
 TEST(ExpressionTest, Constants) {
   EXPECT_EQ(1.0, EvaluateDouble("1.0"));
   EXPECT_EQ(0xabc, EvaluateDouble("0xabc"));
-  // FIXME: This should be interpreted as an octal int, but isn't because
-  // I'm using strtod(). Given that bit operators exist, I probably want to
-  // distinguish between ints and floats anyway.
-  EXPECT_EQ(054.0, EvaluateDouble("054"));
+  EXPECT_EQ(054, EvaluateDouble("054"));
+  EXPECT_EQ(0.5, EvaluateDouble("0.5"));
   EXPECT_EQ(" str ", EvaluateString("' str '"));
   EXPECT_EQ("\nstr\n", EvaluateString("'\\nstr\\n'"));
   EXPECT_EQ(true, EvaluateBool("true"));
@@ -73,6 +161,9 @@ TEST(ExpressionTest, NumberBinaryOperators) {
   EVALUATE_DOUBLE(12 / -4);
   EVALUATE_DOUBLE(11 % 10);
   EVALUATE_DOUBLE(11 % -10);
+  EXPECT_EQ(0, EvaluateDouble("-2147483648.0 % -1"));
+  EXPECT_THROW(Evaluate("1.5 % 0"), Exception);
+  EXPECT_THROW(Evaluate("7 % 0.5"), Exception);
   EVALUATE_DOUBLE(12 - 4);
   EVALUATE_DOUBLE(12 - -4);
   EVALUATE_DOUBLE(-12 - 4);
@@ -97,6 +188,40 @@ TEST(ExpressionTest, NumberBinaryOperators) {
   EVALUATE_BOOL(5 != 5);
 }
 
+TEST(ExpressionTest, Integers) {
+  EXPECT_EQ(Expression::TYPE_INTEGER, Evaluate("1").getType());
+  EXPECT_EQ(Expression::TYPE_NUMBER, Evaluate("1.0").getType());
+  EXPECT_EQ(Expression::TYPE_INTEGER, Evaluate("-1").getType());
+  EXPECT_EQ(Expression::TYPE_INTEGER, Evaluate("~0x0f & 0xff").getType());
+  EXPECT_EQ(Expression::TYPE_INTEGER, Evaluate("true + 1").getType());
+
+  // Exact past 2^53, where doubles aren't
+  EXPECT_EQ(9007199254740993, Evaluate("9007199254740992 + 1").getInteger());
+  EXPECT_EQ(int64_t(1) << 62, Evaluate("1 << 62").getInteger());
+  EXPECT_EQ(-1, Evaluate("0xffffffffffffffff").getInteger());
+  EXPECT_EQ(0x123456789, Evaluate("0x123456789abc >> 12").getInteger());
+
+  // Arithmetic wraps around, and shift counts are taken mod 64
+  EXPECT_EQ(INT64_MIN, Evaluate("0x7fffffffffffffff + 1").getInteger());
+  EXPECT_EQ(INT64_MIN, Evaluate("-0x8000000000000000").getInteger());
+  EXPECT_EQ(2, Evaluate("1 << 65").getInteger());
+  EXPECT_EQ(-1, Evaluate("-8 >> 67").getInteger());
+
+  // / always gives a number; % is an integer, and can't divide by zero
+  EXPECT_EQ(2.5, Evaluate("5 / 2").getNumber());
+  EXPECT_EQ(-1, Evaluate("-7 % 2").getInteger());
+  EXPECT_EQ(0, Evaluate("-0x8000000000000000 % -1").getInteger());
+  EXPECT_THROW(Evaluate("7 % 0"), Exception);
+
+  // Mixed with numbers, they're converted
+  EXPECT_EQ(Expression::TYPE_NUMBER, Evaluate("1 + 0.5").getType());
+  EXPECT_EQ(1.5, Evaluate("1 + 0.5").getNumber());
+  EXPECT_TRUE(Evaluate("1 == 1.0").getBool());
+  EXPECT_EQ("x1", EvaluateString("'x' + 1"));
+  EXPECT_EQ("9007199254740993", EvaluateString("9007199254740993"));
+  EXPECT_THROW(Evaluate("'1' * 2"), Exception);
+}
+
 TEST(ExpressionTest, StringBinaryOperators) {
   EXPECT_EQ("foobar", EvaluateString("'foo' + 'bar'"));
   EXPECT_FALSE(EvaluateBool("'foo' < 'bar'"));
@@ -127,12 +252,95 @@ TEST(ExpressionTest, TernaryOperator) {
   EVALUATE_DOUBLE(1 > 3 ? 2 : 4);
 }
 
+TEST(ExpressionTest, ShortCircuit) {
+  // The right operand isn't evaluated if the left one settles the result
+  EXPECT_FALSE(EvaluateBool("false && 'a' * 2"));
+  EXPECT_TRUE(EvaluateBool("1 || true + true"));
+  EXPECT_THROW(Evaluate("true && 'a' * 2"), Exception);
+  EXPECT_THROW(Evaluate("0 || true + true"), Exception);
+
+  // The result is always a Boolean
+  EXPECT_EQ(Expression::TYPE_BOOL, Evaluate("4 && 2").getType());
+  EXPECT_EQ(Expression::TYPE_BOOL, Evaluate("0 || 'x'").getType());
+
+  // Operands are tested like the condition of ?:, instead of being upcast
+  // to a common type, so strings are allowed
+  EXPECT_TRUE(EvaluateBool("'foo' && true"));
+  EXPECT_TRUE(EvaluateBool("1 && 'foo'"));
+  EXPECT_FALSE(EvaluateBool("'' || 0"));
+  EXPECT_FALSE(EvaluateBool("'false' || false"));
+  EXPECT_TRUE(EvaluateBool("-1 && true"));
+
+  // An unknown operand gives an unknown result, unless it isn't evaluated
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+
+  std::istringstream s("x && y");
+  Tokenizer tokenizer(new TextSource(s));
+  tokenizer.next();
+  std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+
+  ExecutionContext exe(symbols);
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e->evaluate(exe).getType());
+  exe.set(symbols.find("x"), Expression::Value(false));
+  EXPECT_FALSE(e->evaluate(exe).asBool());
+  exe.set(symbols.find("x"), Expression::Value(true));
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e->evaluate(exe).getType());
+  exe.set(symbols.find("y"), Expression::Value(2.0));
+  EXPECT_TRUE(e->evaluate(exe).asBool());
+
+  // Nor is an undefined variable an error if it isn't evaluated
+  ExecutionContext small(1);
+  small.set(symbols.find("x"), Expression::Value(false));
+  EXPECT_FALSE(e->evaluate(small).asBool());
+  small.set(symbols.find("x"), Expression::Value(true));
+  EXPECT_THROW(e->evaluate(small), Exception);
+}
+
 TEST(ExpressionTest, Parentheses) {
   EVALUATE_DOUBLE(2 * (4 + 5));
   EVALUATE_DOUBLE(2 * 4 + 5);
   EVALUATE_DOUBLE((2 * 4) + 5);
 }
 
+TEST(ExpressionTest, Precedence) {
+  struct {
+    const char* text;
+    const char* printed;
+  } cases[] = {
+    { "a + b * c - d", "((a+(b*c))-d)" },
+    { "a - b - c", "((a-b)-c)" },
+    { "a * b % c / d", "(((a*b)%c)/d)" },
+    { "-a * -b", "(-a*-b)" },
+    { "!a == b", "(!a==b)" },
+    { "a << 1 + b < c == d & e ^ f | g && h || i",
+      "((((((((a<<(1+b))<c)==d)&e)^f)|g)&&h)||i)" },
+    { "a || b && c | d ^ e & f == g < h << i + j * k",
+      "(a||(b&&(c|(d^(e&(f==(g<(h<<(i+(j*k))))))))))" },
+    { "a = b += c", "((a=b)+=c)" },
+    { "a || b ? c : d", "((a||b)?c:d)" },
+    { "a ? b : c ? d : e", "(a?b:(c?d:e))" },
+    { "a = b ? c, d : e, f", "(a=(b?c,d:e,f))" },
+    { "a ? b : c = d", "(a?b:(c=d))" },
+  };
+
+  for (const auto& c : cases) {
+    SymbolTable symbols;
+    Expression::CompileOptions options;
+    options.symbols = &symbols;
+
+    std::istringstream s(c.text);
+    Tokenizer tokenizer(new TextSource(s));
+    tokenizer.next();
+    std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+
+    std::ostringstream printed;
+    e->print(printed);
+    EXPECT_EQ(c.printed, printed.str()) << c.text;
+  }
+}
+
 TEST(ExpressionTest, Sequences) {
   // These values in these sequences are unused and obviously can generate
   // no side effects, so I need to disable the warning.
@@ -142,3 +350,102 @@ TEST(ExpressionTest, Sequences) {
   EXPECT_EQ((true, false, false), EvaluateBool("true, false, false"));
 #pragma GCC diagnostic pop
 }
+
+TEST(ExpressionTest, Values) {
+  EXPECT_LE(sizeof(Expression::Value), 16u);
+
+  Expression::Value unknown;
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, unknown.getType());
+
+  Expression::Value number(2.5);
+  EXPECT_EQ(Expression::TYPE_NUMBER, number.getType());
+  EXPECT_EQ(2.5, number.getNumber());
+  EXPECT_EQ("2.5", number.asString());
+  EXPECT_TRUE(number.asBool());
+
+  Expression::Value str("12");
+  Expression::Value copy = str;
+  EXPECT_EQ(&str.getString(), &copy.getString());  // shared, not copied
+  EXPECT_EQ(12, copy.asNumber());
+
+  copy = number;
+  EXPECT_EQ(Expression::TYPE_NUMBER, copy.getType());
+  EXPECT_EQ("12", str.getString());
+
+  Expression::Value moved(std::move(str));
+  EXPECT_EQ("12", moved.getString());
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, str.getType());
+
+  Expression::Value b(false);
+  EXPECT_EQ("false", b.asString());
+  EXPECT_EQ(0, b.asNumber());
+
+  Expression::Value integer(int64_t(-12));
+  EXPECT_EQ(Expression::TYPE_INTEGER, integer.getType());
+  EXPECT_EQ(-12, integer.getInteger());
+  EXPECT_EQ(-12, integer.asNumber());
+  EXPECT_EQ("-12", integer.asString());
+  EXPECT_TRUE(integer.asBool());
+  EXPECT_FALSE(Expression::Value(int64_t(0)).asBool());
+}
+
+TEST(ExpressionTest, NumbersDontAllocate) {
+  std::istringstream s("~9 & 3, (1 + 2.5) * 4 < 20 ? -(7 % 3) : 1 << 4");
+  Tokenizer tokenizer(new TextSource(s));
+  tokenizer.next();
+  std::unique_ptr<Expression> e(Expression::compile(tokenizer));
+
+  ExecutionContext exe;
+  const int before = allocations;
+  const Expression::Value v = e->evaluate(exe);
+  EXPECT_EQ(before, allocations);
+  EXPECT_EQ(-1, v.getInteger());
+}
+
+TEST(ExpressionTest, Variables) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+
+  std::istringstream s("x * 2 + y, x < limit");
+  Tokenizer tokenizer(new TextSource(s));
+  tokenizer.next();
+  std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+
+  std::ostringstream printed;
+  e->print(printed);
+  EXPECT_EQ("((x*2)+y),(x<limit)", printed.str());
+
+  ASSERT_EQ(3, symbols.size());
+  EXPECT_EQ(0, symbols.find("x"));
+  EXPECT_EQ(1, symbols.find("y"));
+  EXPECT_EQ(2, symbols.find("limit"));
+  EXPECT_EQ(-1, symbols.find("z"));
+  EXPECT_EQ("limit", symbols.getName(2));
+  EXPECT_EQ(0, symbols.add("x"));
+
+  // Compile once, evaluate per record
+  ExecutionContext exe(symbols);
+  exe.set(symbols.find("limit"), Expression::Value(10.0));
+  for (int x = 0; x < 20; x++) {
+    exe.set(symbols.find("x"), Expression::Value(double(x)));
+    EXPECT_EQ(x < 10, e->evaluate(exe).asBool());
+  }
+
+  // Slots that were never set are unknown
+  std::istringstream s2("x * 2 + y");
+  Tokenizer tokenizer2(new TextSource(s2));
+  tokenizer2.next();
+  std::unique_ptr<Expression> e2(Expression::compile(tokenizer2, options));
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e2->evaluate(exe).getType());
+  exe.set(symbols.find("y"), Expression::Value("!"));
+  EXPECT_EQ("38!", e2->evaluate(exe).asString());
+
+  // A context without the slot can't evaluate the variable
+  ExecutionContext empty;
+  EXPECT_THROW(e2->evaluate(empty), Exception);
+}
+
+TEST(ExpressionTest, VariablesNeedSymbols) {
+  EXPECT_THROW(Evaluate("x + 1"), Exception);
+}
@@ -0,0 +1,1008 @@
+#include "jit.h"
+#include "exception.h"
+
+#include <iostream>
+#include <limits>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN32)
+#define HAVE_NATIVE_CODE 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+// General purpose registers
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R14 = 14
+};
+
+// The registers the code keeps its arguments in, which calls preserve
+const int kSlots = RBX;
+const int kCount = R12;
+const int kContext = R13;
+const int kResult = R14;
+
+// Scratch SSE register, outside the ones expressions use
+const int kScratch = 15;
+
+// Condition codes
+enum {
+  CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+  CC_P = 0xa, CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+  CC_ALWAYS = -1
+};
+
+// The stack frame: the expression registers are saved here around calls
+// to the tree interpreter, which leaves its result after them. Together
+// with the four registers pushed, it keeps the stack 16-byte aligned.
+const int kFallbackResult = NativeBuilder::kRegisters * 8;
+const int kFrameSize = 136;
+
+static_assert(kFallbackResult + 8 <= kFrameSize, "Frame too small");
+static_assert(sizeof(Expression::Type) == 4, "Types must be 32 bits");
+
+}  // namespace
+
+NativeBuilder::NativeBuilder() : bail(newLabel()) {}
+
+NativeBuilder::Kind NativeBuilder::compile(const Expression& root) {
+  PRECONDITION(code.empty());
+
+  // int function(const Value* slots, int64_t count,
+  //              ExecutionContext* context, double* result)
+  push(RBX);
+  push(R12);
+  push(R13);
+  push(R14);
+  byte(0x48);  // sub rsp, kFrameSize
+  byte(0x81);
+  modrm(3, 5, RSP);
+  int32(kFrameSize);
+  move(kSlots, RDI);
+  move(kCount, RSI);
+  move(kContext, RDX);
+  move(kResult, RCX);
+
+  const int kind = root.emitNative(*this, 0);
+  if (kind == KIND_NONE) {
+    code.clear();
+    return KIND_NONE;
+  }
+
+  // Return 1 with the result, or 0 to bail out
+  sseMemory(0xf2, 0x11, 0, kResult, 0);  // movsd [result], xmm0
+  byte(0xb8);                             // mov eax, 1
+  int32(1);
+  const int done = newLabel();
+  jump(done);
+  bind(bail);
+  alu(0x31, RAX, RAX);                    // xor eax, eax
+  bind(done);
+  byte(0x48);                             // add rsp, kFrameSize
+  byte(0x81);
+  modrm(3, 0, RSP);
+  int32(kFrameSize);
+  pop(R14);
+  pop(R13);
+  pop(R12);
+  pop(RBX);
+  byte(0xc3);                             // ret
+
+  for (const auto& fixup : fixups) {
+    const int target = labels[fixup.second];
+    ASSERTION(target >= 0);
+    const int32_t offset = target - (fixup.first + 4);
+    memcpy(&code[fixup.first], &offset, sizeof(offset));
+  }
+  return Kind(kind);
+}
+
+NativeBuilder::Kind NativeBuilder::operand(const Expression* expr, int reg) {
+  if (reg >= kRegisters) {
+    return KIND_NONE;
+  }
+
+  const size_t start = code.size();
+  const int kind = expr->emitNative(*this, reg);
+  if (kind != KIND_NONE) {
+    return Kind(kind);
+  }
+  rewind(start);
+
+  if (expr->getStaticType() == Expression::TYPE_STRING) {
+    return KIND_NONE;
+  } else if (expr->getStaticType() == Expression::TYPE_BOOL) {
+    fallback(expr, reg, EXPECT_BOOL);
+    return KIND_BOOL;
+  } else if (expr->getStaticType() == Expression::TYPE_INTEGER) {
+    fallback(expr, reg, EXPECT_INTEGER);
+    return KIND_INTEGER;
+  }
+  fallback(expr, reg, EXPECT_NUMBER);
+  return KIND_NUMBER;
+}
+
+bool NativeBuilder::test(const Expression* expr, int reg) {
+  if (reg >= kRegisters) {
+    return false;
+  }
+
+  // A variable holding a Boolean can be tested too
+  const VariableExpression* variable =
+      dynamic_cast<const VariableExpression*>(expr);
+  if ((variable != nullptr) && this->variable(reg, variable->getSlot(), true)) {
+    truth(reg);
+    return true;
+  }
+
+  const size_t start = code.size();
+  const int kind = expr->emitNative(*this, reg);
+  if (kind == KIND_INTEGER) {
+    // No integer but 0 converts to 0
+    toNumber(reg);
+    truth(reg);
+  } else if (kind == KIND_NUMBER) {
+    truth(reg);
+  } else if (kind == KIND_NONE) {
+    rewind(start);
+    fallback(expr, reg, EXPECT_TRUTH);
+  }
+  return true;
+}
+
+void NativeBuilder::constant(int reg, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  moveImmediate(RAX, bits);
+  sse(0x66, 0x6e, reg, RAX, true);  // movq xmm, rax
+}
+
+void NativeBuilder::integer(int reg, int64_t value) {
+  moveImmediate(RAX, value);
+  sse(0x66, 0x6e, reg, RAX, true);  // movq xmm, rax
+}
+
+bool NativeBuilder::variable(int reg, int slot, bool truth) {
+  typedef Expression::Value Value;
+  const int64_t address = int64_t(slot) * sizeof(Value);
+  if ((slot < 0) ||
+      (address + sizeof(Value) > size_t(numeric_limits<int32_t>::max()))) {
+    return false;
+  }
+  const int32_t type = address + offsetof(Value, type);
+  const int32_t payload = address + offsetof(Value, payload);
+
+  // An undefined variable is an error; let the tree report it
+  byte(0x49);               // cmp r12, slot
+  byte(0x81);
+  modrm(3, 7, kCount);
+  int32(slot);
+  jumpTo(CC_LE, bail);
+
+  rex(false, 0, kSlots);    // cmp dword [rbx + type], TYPE_NUMBER
+  byte(0x81);
+  memory(7, kSlots, type);
+  int32(Expression::TYPE_NUMBER);
+
+  if (!truth) {
+    jumpTo(CC_NE, bail);
+    sseMemory(0xf2, 0x10, reg, kSlots, payload);
+    return true;
+  }
+
+  const int boolean = newLabel();
+  const int done = newLabel();
+  jumpTo(CC_NE, boolean);
+  sseMemory(0xf2, 0x10, reg, kSlots, payload);
+  jump(done);
+
+  const int integer = newLabel();
+  bind(boolean);
+  rex(false, 0, kSlots);    // cmp dword [rbx + type], TYPE_BOOL
+  byte(0x81);
+  memory(7, kSlots, type);
+  int32(Expression::TYPE_BOOL);
+  jumpTo(CC_NE, integer);
+  rex(false, RAX, kSlots);  // movzx eax, byte [rbx + payload]
+  byte(0x0f);
+  byte(0xb6);
+  memory(RAX, kSlots, payload);
+  toRegister(reg);
+  jump(done);
+
+  bind(integer);
+  rex(false, 0, kSlots);    // cmp dword [rbx + type], TYPE_INTEGER
+  byte(0x81);
+  memory(7, kSlots, type);
+  int32(Expression::TYPE_INTEGER);
+  jumpTo(CC_NE, bail);
+  rex(true, 0, kSlots);     // cmp qword [rbx + payload], 0
+  byte(0x83);
+  memory(7, kSlots, payload);
+  byte(0);
+  setFlag(CC_NE, RAX);
+  byte(0x0f);               // movzx eax, al
+  byte(0xb6);
+  modrm(3, RAX, RAX);
+  toRegister(reg);
+  bind(done);
+  return true;
+}
+
+void NativeBuilder::unary(Expression::Operator op, int reg) {
+  switch (op) {
+    case Expression::OP_NEGATIVE:
+      // Flip the sign bit
+      moveImmediate(RAX, uint64_t(1) << 63);
+      sse(0x66, 0x6e, kScratch, RAX, true);  // movq xmm15, rax
+      sse(0x66, 0x57, reg, kScratch);        // xorpd
+      break;
+
+    case Expression::OP_BITNOT:
+      // Through int64, like applyUnary
+      sse(0xf2, 0x2c, RAX, reg, true);       // cvttsd2si rax, xmm
+      byte(0x48);                            // not rax
+      byte(0xf7);
+      modrm(3, 2, RAX);
+      sse(0x66, 0x57, reg, reg);             // xorpd xmm, xmm
+      sse(0xf2, 0x2a, reg, RAX, true);       // cvtsi2sd xmm, rax
+      break;
+
+    case Expression::OP_NOT:
+      sse(0xf2, 0x2c, RAX, reg);             // cvttsd2si eax, xmm
+      byte(0x83);                            // xor eax, 1
+      modrm(3, 6, RAX);
+      byte(1);
+      toRegister(reg);
+      break;
+
+    default:
+      ASSERTION(false);
+  }
+}
+
+void NativeBuilder::integerUnary(Expression::Operator op, int reg) {
+  sse(0x66, 0x7e, reg, RAX, true);         // movq rax, xmm
+  byte(0x48);                              // neg or not rax
+  byte(0xf7);
+  switch (op) {
+    case Expression::OP_NEGATIVE:
+      modrm(3, 3, RAX);
+      break;
+    case Expression::OP_BITNOT:
+      modrm(3, 2, RAX);
+      break;
+    default:
+      ASSERTION(false);
+  }
+  sse(0x66, 0x6e, reg, RAX, true);         // movq xmm, rax
+}
+
+bool NativeBuilder::binary(Expression::Operator op, int reg) {
+  const int right = reg + 1;
+  PRECONDITION(right < kRegisters);
+
+  switch (op) {
+    case Expression::OP_MULTIPLY:
+      sse(0xf2, 0x59, reg, right);
+      return true;
+    case Expression::OP_DIVIDE:
+      sse(0xf2, 0x5e, reg, right);
+      return true;
+    case Expression::OP_PLUS:
+      sse(0xf2, 0x58, reg, right);
+      return true;
+    case Expression::OP_MINUS:
+      sse(0xf2, 0x5c, reg, right);
+      return true;
+
+    // ucomisd sets ZF, PF and CF for unordered operands (NaN), so each
+    // test must come out false for them
+    case Expression::OP_LESS:
+    case Expression::OP_LESSEQ:
+      sse(0x66, 0x2e, right, reg);
+      setFlag(op == Expression::OP_LESS ? CC_A : CC_AE, RAX);
+      break;
+    case Expression::OP_GREATER:
+    case Expression::OP_GREATEREQ:
+      sse(0x66, 0x2e, reg, right);
+      setFlag(op == Expression::OP_GREATER ? CC_A : CC_AE, RAX);
+      break;
+    case Expression::OP_EQUAL:
+      sse(0x66, 0x2e, reg, right);
+      setFlag(CC_E, RAX);
+      setFlag(CC_NP, RCX);
+      alu(0x21, RAX, RCX);  // and eax, ecx
+      break;
+    case Expression::OP_NOTEQUAL:
+      sse(0x66, 0x2e, reg, right);
+      setFlag(CC_NE, RAX);
+      setFlag(CC_P, RCX);
+      alu(0x09, RAX, RCX);  // or eax, ecx
+      break;
+
+    // Through int32, like the casts in Expression::applyBinary()
+    case Expression::OP_MOD:
+    case Expression::OP_SHIFTLEFT:
+    case Expression::OP_SHIFTRIGHT:
+    case Expression::OP_AND:
+    case Expression::OP_XOR:
+    case Expression::OP_OR:
+      sse(0xf2, 0x2c, RAX, reg);    // cvttsd2si eax, xmm
+      sse(0xf2, 0x2c, RCX, right);  // cvttsd2si ecx, xmm
+      switch (op) {
+        case Expression::OP_MOD:
+          // Dividing by 0, or INT_MIN by -1, traps; leave that to the tree
+          alu(0x85, RCX, RCX);      // test ecx, ecx
+          jumpTo(CC_E, bail);
+          byte(0x83);               // cmp ecx, -1
+          modrm(3, 7, RCX);
+          byte(0xff);
+          jumpTo(CC_E, bail);
+          byte(0x99);               // cdq
+          byte(0xf7);               // idiv ecx
+          modrm(3, 7, RCX);
+          alu(0x89, RAX, RDX);      // mov eax, edx
+          break;
+        case Expression::OP_SHIFTLEFT:
+          byte(0xd3);               // shl eax, cl
+          modrm(3, 4, RAX);
+          break;
+        case Expression::OP_SHIFTRIGHT:
+          byte(0xd3);               // sar eax, cl
+          modrm(3, 7, RAX);
+          break;
+        case Expression::OP_AND:
+          alu(0x21, RAX, RCX);
+          break;
+        case Expression::OP_XOR:
+          alu(0x31, RAX, RCX);
+          break;
+        default:
+          alu(0x09, RAX, RCX);
+          break;
+      }
+      toRegister(reg);
+      return true;
+
+    default:
+      return false;
+  }
+
+  // A comparison, with its result in al
+  byte(0x0f);  // movzx eax, al
+  byte(0xb6);
+  modrm(3, RAX, RAX);
+  toRegister(reg);
+  return true;
+}
+
+bool NativeBuilder::integerBinary(Expression::Operator op, int reg) {
+  const int right = reg + 1;
+  PRECONDITION(right < kRegisters);
+
+  int condition;
+  switch (op) {
+    case Expression::OP_LESS:      condition = CC_L; break;
+    case Expression::OP_LESSEQ:    condition = CC_LE; break;
+    case Expression::OP_GREATER:   condition = CC_G; break;
+    case Expression::OP_GREATEREQ: condition = CC_GE; break;
+    case Expression::OP_EQUAL:     condition = CC_E; break;
+    case Expression::OP_NOTEQUAL:  condition = CC_NE; break;
+    case Expression::OP_MULTIPLY:
+    case Expression::OP_MOD:
+    case Expression::OP_PLUS:
+    case Expression::OP_MINUS:
+    case Expression::OP_SHIFTLEFT:
+    case Expression::OP_SHIFTRIGHT:
+    case Expression::OP_AND:
+    case Expression::OP_XOR:
+    case Expression::OP_OR:
+      condition = CC_ALWAYS;
+      break;
+    default:
+      return false;
+  }
+
+  sse(0x66, 0x7e, reg, RAX, true);    // movq rax, xmm
+  sse(0x66, 0x7e, right, RCX, true);  // movq rcx, xmm
+
+  if (condition != CC_ALWAYS) {
+    alu(0x39, RAX, RCX, true);        // cmp rax, rcx
+    setFlag(condition, RAX);
+    byte(0x0f);                       // movzx eax, al
+    byte(0xb6);
+    modrm(3, RAX, RAX);
+    toRegister(reg);
+    return true;
+  }
+
+  // Arithmetic wraps around, and shifts only use the low 6 bits of the
+  // count, as in applyBinary
+  switch (op) {
+    case Expression::OP_MULTIPLY:
+      byte(0x48);                     // imul rax, rcx
+      byte(0x0f);
+      byte(0xaf);
+      modrm(3, RAX, RCX);
+      break;
+    case Expression::OP_MOD:
+      // Dividing by 0 fails, and the smallest integer by -1 traps; leave
+      // both to the tree
+      alu(0x85, RCX, RCX, true);      // test rcx, rcx
+      jumpTo(CC_E, bail);
+      byte(0x48);                     // cmp rcx, -1
+      byte(0x83);
+      modrm(3, 7, RCX);
+      byte(0xff);
+      jumpTo(CC_E, bail);
+      byte(0x48);                     // cqo
+      byte(0x99);
+      byte(0x48);                     // idiv rcx
+      byte(0xf7);
+      modrm(3, 7, RCX);
+      alu(0x89, RAX, RDX, true);      // mov rax, rdx
+      break;
+    case Expression::OP_PLUS:
+      alu(0x01, RAX, RCX, true);
+      break;
+    case Expression::OP_MINUS:
+      alu(0x29, RAX, RCX, true);
+      break;
+    case Expression::OP_SHIFTLEFT:
+      byte(0x48);                     // shl rax, cl
+      byte(0xd3);
+      modrm(3, 4, RAX);
+      break;
+    case Expression::OP_SHIFTRIGHT:
+      byte(0x48);                     // sar rax, cl
+      byte(0xd3);
+      modrm(3, 7, RAX);
+      break;
+    case Expression::OP_AND:
+      alu(0x21, RAX, RCX, true);
+      break;
+    case Expression::OP_XOR:
+      alu(0x31, RAX, RCX, true);
+      break;
+    default:
+      alu(0x09, RAX, RCX, true);
+      break;
+  }
+  sse(0x66, 0x6e, reg, RAX, true);    // movq xmm, rax
+  return true;
+}
+
+void NativeBuilder::toNumber(int reg) {
+  sse(0x66, 0x7e, reg, RAX, true);    // movq rax, xmm
+  sse(0x66, 0x57, reg, reg);          // xorpd xmm, xmm
+  sse(0xf2, 0x2a, reg, RAX, true);    // cvtsi2sd xmm, rax
+}
+
+void NativeBuilder::toInteger(int reg) {
+  sse(0xf2, 0x2c, RAX, reg, true);    // cvttsd2si rax, xmm
+  sse(0x66, 0x6e, reg, RAX, true);    // movq xmm, rax
+}
+
+void NativeBuilder::truth(int reg) {
+  // Anything but zero is true, including NaN
+  sse(0x66, 0x57, kScratch, kScratch);  // xorpd xmm15, xmm15
+  sse(0x66, 0x2e, reg, kScratch);       // ucomisd xmm, xmm15
+  setFlag(CC_NE, RAX);
+  setFlag(CC_P, RCX);
+  alu(0x09, RAX, RCX);                  // or eax, ecx
+  byte(0x0f);                           // movzx eax, al
+  byte(0xb6);
+  modrm(3, RAX, RAX);
+  toRegister(reg);
+}
+
+int NativeBuilder::newLabel() {
+  labels.push_back(-1);
+  return labels.size() - 1;
+}
+
+void NativeBuilder::bind(int label) {
+  labels[label] = code.size();
+}
+
+void NativeBuilder::jump(int label) {
+  jumpTo(CC_ALWAYS, label);
+}
+
+void NativeBuilder::jumpIf(int reg, bool value, int label) {
+  // Booleans are exactly 0 or 1
+  sse(0x66, 0x57, kScratch, kScratch);  // xorpd xmm15, xmm15
+  sse(0x66, 0x2e, reg, kScratch);       // ucomisd xmm, xmm15
+  jumpTo(value ? CC_NE : CC_E, label);
+}
+
+// Evaluate the subtree for native code, returning 1 with its value as a
+// number, or 0 if the code should bail out. An error is left for the tree
+// to report when it evaluates the whole expression again, and nothing may
+// be thrown through the native code, which has no unwind information.
+int NativeBuilder::runFallback(const Expression* expr,
+                               ExecutionContext* context,
+                               int expect, double* result) {
+  try {
+    const bool was_ok = context->getStatus().ok();
+    const Expression::Value v = expr->compute(*context);
+    if (!context->getStatus().ok()) {
+      if (was_ok) context->getStatus() = Status();
+      return 0;
+    }
+    if (expect == EXPECT_TRUTH) {
+      if (v.getType() == Expression::TYPE_UNKNOWN) {
+        return 0;
+      }
+      *result = v.asBool() ? 1 : 0;
+    } else if (v.getType() == Expression::TYPE_NUMBER &&
+               expect == EXPECT_NUMBER) {
+      *result = v.getNumber();
+    } else if (v.getType() == Expression::TYPE_BOOL &&
+               expect == EXPECT_BOOL) {
+      *result = v.getBool() ? 1 : 0;
+    } else if (v.getType() == Expression::TYPE_INTEGER &&
+               expect == EXPECT_INTEGER) {
+      const int64_t integer = v.getInteger();
+      memcpy(result, &integer, sizeof(integer));
+    } else {
+      return 0;
+    }
+    return 1;
+  } catch (...) {
+    return 0;
+  }
+}
+
+void NativeBuilder::fallback(const Expression* expr, int reg,
+                             Expect expect) {
+  PRECONDITION(reg < kRegisters);
+
+  // The registers below this one are live; the call may change them
+  for (int i = 0; i < reg; i++) {
+    sseMemory(0xf2, 0x11, i, RSP, i * 8);
+  }
+
+  moveImmediate(RDI, reinterpret_cast<uintptr_t>(expr));
+  move(RSI, kContext);
+  byte(0xba);                        // mov edx, expect
+  int32(expect);
+  rex(true, RCX, RSP);               // lea rcx, [rsp + kFallbackResult]
+  byte(0x8d);
+  memory(RCX, RSP, kFallbackResult);
+  moveImmediate(RAX, reinterpret_cast<uintptr_t>(&runFallback));
+  byte(0xff);                        // call rax
+  modrm(3, 2, RAX);
+
+  for (int i = 0; i < reg; i++) {
+    sseMemory(0xf2, 0x10, i, RSP, i * 8);
+  }
+  alu(0x85, RAX, RAX);               // test eax, eax
+  jumpTo(CC_E, bail);
+  sseMemory(0xf2, 0x10, reg, RSP, kFallbackResult);
+}
+
+// Forget everything appended since the code was 'size' bytes long
+void NativeBuilder::rewind(size_t size) {
+  code.resize(size);
+  size_t kept = 0;
+  for (const auto& fixup : fixups) {
+    if (size_t(fixup.first) < size) {
+      fixups[kept++] = fixup;
+    }
+  }
+  fixups.resize(kept);
+}
+
+void NativeBuilder::byte(int value) {
+  code.push_back(uint8_t(value));
+}
+
+void NativeBuilder::int32(int32_t value) {
+  const size_t at = code.size();
+  code.resize(at + sizeof(value));
+  memcpy(&code[at], &value, sizeof(value));
+}
+
+void NativeBuilder::int64(uint64_t value) {
+  const size_t at = code.size();
+  code.resize(at + sizeof(value));
+  memcpy(&code[at], &value, sizeof(value));
+}
+
+// The REX prefix, if it's needed, for registers numbered 0 to 15
+void NativeBuilder::rex(bool wide, int reg, int rm) {
+  const int prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) |
+      ((rm & 8) ? 1 : 0);
+  if (prefix != 0x40) {
+    byte(prefix);
+  }
+}
+
+void NativeBuilder::modrm(int mod, int reg, int rm) {
+  byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + offset], always with a 32-bit offset
+void NativeBuilder::memory(int reg, int base, int32_t offset) {
+  modrm(2, reg, base);
+  if ((base & 7) == RSP) {
+    byte(0x24);  // SIB: no index
+  }
+  int32(offset);
+}
+
+void NativeBuilder::sse(int prefix, int opcode, int reg, int rm, bool wide) {
+  byte(prefix);
+  rex(wide, reg, rm);
+  byte(0x0f);
+  byte(opcode);
+  modrm(3, reg, rm);
+}
+
+void NativeBuilder::sseMemory(int prefix, int opcode, int reg, int base,
+                              int32_t offset) {
+  byte(prefix);
+  rex(false, reg, base);
+  byte(0x0f);
+  byte(opcode);
+  memory(reg, base, offset);
+}
+
+void NativeBuilder::move(int dest, int source) {
+  rex(true, source, dest);
+  byte(0x89);
+  modrm(3, source, dest);
+}
+
+void NativeBuilder::moveImmediate(int reg, uint64_t value) {
+  rex(true, 0, reg);
+  byte(0xb8 + (reg & 7));
+  int64(value);
+}
+
+// An ALU instruction: add (0x01), sub (0x29), and (0x21), or (0x09), xor
+// (0x31), cmp (0x39), test (0x85) or mov (0x89), on registers. It's 32-bit
+// unless 'wide'.
+void NativeBuilder::alu(int opcode, int dest, int source, bool wide) {
+  rex(wide, source, dest);
+  byte(opcode);
+  modrm(3, source, dest);
+}
+
+// Set the low byte of eax, ecx or edx to the condition
+void NativeBuilder::setFlag(int condition, int reg) {
+  PRECONDITION(reg < RBX);
+  byte(0x0f);
+  byte(0x90 + condition);
+  modrm(3, 0, reg);
+}
+
+// Convert eax to a double in the register. Clearing it first saves a
+// dependency on its old value.
+void NativeBuilder::toRegister(int reg) {
+  sse(0x66, 0x57, reg, reg);  // xorpd xmm, xmm
+  sse(0xf2, 0x2a, reg, RAX);  // cvtsi2sd xmm, eax
+}
+
+void NativeBuilder::jumpTo(int condition, int label) {
+  if (condition == CC_ALWAYS) {
+    byte(0xe9);
+  } else {
+    byte(0x0f);
+    byte(0x80 + condition);
+  }
+  fixups.push_back(make_pair(int(code.size()), label));
+  int32(0);
+}
+
+void NativeBuilder::push(int reg) {
+  rex(false, 0, reg);
+  byte(0x50 + (reg & 7));
+}
+
+void NativeBuilder::pop(int reg) {
+  rex(false, 0, reg);
+  byte(0x58 + (reg & 7));
+}
+
+NativeExpression::NativeExpression(Expression* inTree)
+    : tree(inTree), kind(NativeBuilder::KIND_NONE), function(nullptr),
+      mapping(nullptr), mapping_size(0), bails(0) {
+  PRECONDITION(tree != nullptr);
+  annotate();
+
+#if defined HAVE_NATIVE_CODE
+  NativeBuilder builder;
+  kind = builder.compile(*tree);
+  if (kind == NativeBuilder::KIND_NONE) {
+    return;
+  }
+
+  // Write the code, then make it executable but not writable. If that
+  // can't be done, the tree will have to do.
+  const vector<uint8_t>& code = builder.getCode();
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t size = (code.size() + page - 1) / page * page;
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return;
+  }
+  memcpy(memory, code.data(), code.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return;
+  }
+
+  mapping = memory;
+  mapping_size = size;
+  function = reinterpret_cast<Function>(memory);
+#endif
+}
+
+NativeExpression::~NativeExpression() {
+#if defined HAVE_NATIVE_CODE
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_size);
+  }
+#endif
+  delete tree;
+}
+
+bool NativeExpression::isSupported() {
+#if defined HAVE_NATIVE_CODE
+  return true;
+#else
+  return false;
+#endif
+}
+
+Expression::Value NativeExpression::compute(ExecutionContext& e) const {
+  // Races on the count only make it a little off, so it needn't be exact
+  const int bailed = bails.load(memory_order_relaxed);
+  if ((function != nullptr) && (bailed >= kMaxBails) &&
+      (bailed < kMaxBails + kRetryInterval)) {
+    bails.store(bailed + 1, memory_order_relaxed);
+  } else if (function != nullptr) {
+    const Value* slots = (e.size() > 0) ? &e.get(0) : nullptr;
+    double result;
+    if (function(slots, e.size(), &e, &result)) {
+      // Only write the count (and so share its cache line) when it changes
+      if (bailed != 0) {
+        bails.store(0, memory_order_relaxed);
+      }
+      if (kind == NativeBuilder::KIND_BOOL) {
+        return Value(result != 0);
+      } else if (kind == NativeBuilder::KIND_INTEGER) {
+        int64_t integer;
+        memcpy(&integer, &result, sizeof(integer));
+        return Value(integer);
+      }
+      return Value(result);
+    }
+
+    // A retry that bails out waits for the next one
+    bails.store((bailed >= kMaxBails) ? kMaxBails : bailed + 1,
+                memory_order_relaxed);
+  }
+
+  return tree->compute(e);
+}
+
+void NativeExpression::print(ostream& out) const {
+  tree->print(out);
+}
+
+void NativeExpression::lower(BytecodeBuilder& builder, int reg) const {
+  tree->lower(builder, reg);
+}
+
+void NativeExpression::evaluateRows(const ColumnBatch& batch,
+                                    const vector<int>& rows,
+                                    Column& result) const {
+  tree->evaluateRows(batch, rows, result);
+}
+
+int NativeExpression::save(ExpressionWriter& writer) const {
+  return tree->save(writer);
+}
+
+int NativeExpression::share(ExpressionDag& dag) const {
+  return tree->share(dag);
+}
+
+Expression::Type NativeExpression::inferType() const {
+  return tree->getStaticType();
+}
+
+// Native code for each of the node types
+
+int Expression::emitNative(NativeBuilder&, int) const {
+  return NativeBuilder::KIND_NONE;
+}
+
+int ConstantExpression::emitNative(NativeBuilder& builder, int reg) const {
+  if (value.getType() == TYPE_NUMBER) {
+    builder.constant(reg, value.getNumber());
+    return NativeBuilder::KIND_NUMBER;
+  } else if (value.getType() == TYPE_BOOL) {
+    builder.constant(reg, value.getBool() ? 1 : 0);
+    return NativeBuilder::KIND_BOOL;
+  } else if (value.getType() == TYPE_INTEGER) {
+    builder.integer(reg, value.getInteger());
+    return NativeBuilder::KIND_INTEGER;
+  }
+  return NativeBuilder::KIND_NONE;
+}
+
+int VariableExpression::emitNative(NativeBuilder& builder, int reg) const {
+  return builder.variable(reg, slot, false) ? NativeBuilder::KIND_NUMBER
+                                            : NativeBuilder::KIND_NONE;
+}
+
+int UnaryOperator::emitNative(NativeBuilder& builder, int reg) const {
+  if (op == OP_NOT) {
+    if (!builder.test(child, reg)) {
+      return NativeBuilder::KIND_NONE;
+    }
+    builder.unary(OP_NOT, reg);
+    return NativeBuilder::KIND_BOOL;
+  }
+
+  const NativeBuilder::Kind kind = builder.operand(child, reg);
+  if (kind == NativeBuilder::KIND_NONE) {
+    return NativeBuilder::KIND_NONE;
+  }
+
+  // Integers stay integers
+  if (kind == NativeBuilder::KIND_INTEGER) {
+    if (op == OP_NEGATIVE || op == OP_BITNOT) {
+      builder.integerUnary(op, reg);
+    }
+    return NativeBuilder::KIND_INTEGER;
+  }
+
+  switch (op) {
+    case OP_NEGATIVE:
+      // A Boolean is already 0 or 1
+      builder.unary(OP_NEGATIVE, reg);
+      return NativeBuilder::KIND_NUMBER;
+    case OP_POSITIVE:
+      return NativeBuilder::KIND_NUMBER;
+    case OP_BITNOT:
+      // Complements Booleans
+      if (kind == NativeBuilder::KIND_BOOL) {
+        builder.unary(OP_NOT, reg);
+        return NativeBuilder::KIND_BOOL;
+      }
+      builder.unary(OP_BITNOT, reg);
+      return NativeBuilder::KIND_NUMBER;
+    default:
+      return NativeBuilder::KIND_NONE;
+  }
+}
+
+int BinaryOperator::emitNative(NativeBuilder& builder, int reg) const {
+  if (isAssignment(op)) {
+    return NativeBuilder::KIND_NONE;
+  }
+
+  const NativeBuilder::Kind leftKind = builder.operand(left, reg);
+  if (leftKind == NativeBuilder::KIND_NONE) {
+    return NativeBuilder::KIND_NONE;
+  }
+  const NativeBuilder::Kind rightKind = builder.operand(right, reg + 1);
+  if (rightKind == NativeBuilder::KIND_NONE) {
+    return NativeBuilder::KIND_NONE;
+  }
+
+  // Booleans can only be compared for equality, and that's the same as
+  // comparing them as numbers; anything else fails
+  const bool equality = (op == OP_EQUAL || op == OP_NOTEQUAL);
+  if (leftKind == NativeBuilder::KIND_BOOL &&
+      rightKind == NativeBuilder::KIND_BOOL && !equality) {
+    return NativeBuilder::KIND_NONE;
+  }
+
+  // Integers (with Booleans) stay integers, but mixed with numbers, or
+  // divided, they're converted to numbers
+  if (leftKind == NativeBuilder::KIND_INTEGER ||
+      rightKind == NativeBuilder::KIND_INTEGER) {
+    const bool number = (leftKind == NativeBuilder::KIND_NUMBER ||
+                         rightKind == NativeBuilder::KIND_NUMBER ||
+                         op == OP_DIVIDE);
+    for (int i = 0; i < 2; i++) {
+      const NativeBuilder::Kind kind = (i == 0) ? leftKind : rightKind;
+      const ConstantExpression* constant =
+          dynamic_cast<const ConstantExpression*>((i == 0) ? left : right);
+      if (number && kind == NativeBuilder::KIND_INTEGER &&
+          constant != nullptr) {
+        // A literal, as in x * 2: load the number instead
+        builder.constant(reg + i, double(constant->getInteger()));
+      } else if (number && kind == NativeBuilder::KIND_INTEGER) {
+        builder.toNumber(reg + i);
+      } else if (!number && kind == NativeBuilder::KIND_BOOL) {
+        builder.toInteger(reg + i);
+      }
+    }
+
+    if (!number) {
+      if (!builder.integerBinary(op, reg)) {
+        return NativeBuilder::KIND_NONE;
+      }
+      return (equality || op == OP_LESS || op == OP_LESSEQ ||
+              op == OP_GREATER || op == OP_GREATEREQ)
+          ? NativeBuilder::KIND_BOOL : NativeBuilder::KIND_INTEGER;
+    }
+  }
+
+  if (!builder.binary(op, reg)) {
+    return NativeBuilder::KIND_NONE;
+  }
+
+  switch (op) {
+    case OP_LESS:
+    case OP_LESSEQ:
+    case OP_GREATER:
+    case OP_GREATEREQ:
+    case OP_EQUAL:
+    case OP_NOTEQUAL:
+      return NativeBuilder::KIND_BOOL;
+    default:
+      return NativeBuilder::KIND_NUMBER;
+  }
+}
+
+int LogicalOperator::emitNative(NativeBuilder& builder, int reg) const {
+  // The left operand's truth, if it settles the result, is the result
+  if (!builder.test(left, reg)) {
+    return NativeBuilder::KIND_NONE;
+  }
+  const int end = builder.newLabel();
+  builder.jumpIf(reg, op == OP_OROR, end);
+  builder.test(right, reg);
+  builder.bind(end);
+  return NativeBuilder::KIND_BOOL;
+}
+
+int TernaryOperator::emitNative(NativeBuilder& builder, int reg) const {
+  if (!builder.test(test, reg)) {
+    return NativeBuilder::KIND_NONE;
+  }
+  const int toNegative = builder.newLabel();
+  const int end = builder.newLabel();
+  builder.jumpIf(reg, false, toNegative);
+
+  // The result's type mustn't depend on the branch
+  const NativeBuilder::Kind kind = builder.operand(positive, reg);
+  if (kind == NativeBuilder::KIND_NONE) {
+    return NativeBuilder::KIND_NONE;
+  }
+  builder.jump(end);
+  builder.bind(toNegative);
+  if (builder.operand(negative, reg) != kind) {
+    return NativeBuilder::KIND_NONE;
+  }
+  builder.bind(end);
+  return kind;
+}
+
+int SequenceExpression::emitNative(NativeBuilder& builder, int reg) const {
+  // Every part is evaluated (so that its errors are found), and the last
+  // gives the value
+  NativeBuilder::Kind kind = NativeBuilder::KIND_NONE;
+  for (const auto* sub : subs) {
+    kind = builder.operand(sub, reg);
+    if (kind == NativeBuilder::KIND_NONE) {
+      return NativeBuilder::KIND_NONE;
+    }
+  }
+  return kind;
+}
@@ -0,0 +1,196 @@
+#if !defined JIT_H
+#define      JIT_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include "expression.h"
+
+// Compiles the numeric and Boolean parts of an expression tree to x86-64
+// machine code, for the native backend (see NativeExpression). Numbers,
+// integers (as their bits) and Booleans (as 0 or 1) are kept in SSE
+// registers, which are allocated as a stack, like the bytecode's: an
+// expression compiled into register N may use any register above N.
+// Integer operations move their operands to general purpose registers and
+// back.
+//
+// Variables are assumed to hold numbers (or, where only their truth is
+// needed, Booleans or integers), and subtrees that can't be compiled, such
+// as string operations, are evaluated by the tree interpreter and assumed
+// to give the kind of value the code needs. The code checks these
+// assumptions as it runs, and bails out if one fails, or if the tree
+// interpreter fails; the whole expression is then evaluated by the tree
+// interpreter instead. Since evaluating has no side effects, that gives
+// exactly the tree's results and errors.
+class NativeBuilder {
+public:
+  // What the code for an expression leaves in its register
+  enum Kind {
+    KIND_NONE,    // Nothing: the expression can't be compiled
+    KIND_NUMBER,
+    KIND_BOOL,    // 0 or 1
+    KIND_INTEGER  // The int64_t's bits, in the low half
+  };
+
+  // The registers available to expressions
+  static const int kRegisters = 15;
+
+  NativeBuilder();
+
+  // Compile the whole expression into a function, returning the kind of
+  // value it gives, or KIND_NONE if the expression can't be compiled. The
+  // expression must outlive the code.
+  Kind compile(const Expression&);
+
+  // The machine code, once compiled
+  const std::vector<uint8_t>& getCode() const { return code; }
+
+  // Used by Expression::emitNative:
+
+  // Append code that leaves the value of the expression in 'reg', and
+  // return its kind. If the expression can't be compiled, it's evaluated
+  // by the tree interpreter, unless it's a string, which the caller can't
+  // use; then nothing is appended and this returns KIND_NONE.
+  Kind operand(const Expression*, int reg);
+
+  // Append code that leaves the truth of the expression (as for the test
+  // of ?:) in 'reg', as a Boolean. Returns false, appending nothing, if
+  // there's no room.
+  bool test(const Expression*, int reg);
+
+  void constant(int reg, double);
+  void integer(int reg, int64_t);
+
+  // Load the variable's number. If 'truth', a Boolean or an integer will
+  // do as well, giving its truth (as 0 or 1). Returns false, appending
+  // nothing, if the slot is out of range for the code.
+  bool variable(int reg, int slot, bool truth);
+
+  // reg = op reg, for OP_NEGATIVE and OP_BITNOT on numbers, and OP_NOT on
+  // Booleans
+  void unary(Expression::Operator, int reg);
+
+  // reg = op reg, for OP_NEGATIVE and OP_BITNOT on integers
+  void integerUnary(Expression::Operator, int reg);
+
+  // reg = reg op (reg + 1), for the operators that work on numbers.
+  // Returns false, appending nothing, for the others.
+  bool binary(Expression::Operator, int reg);
+
+  // The same, for integers, and the operators that give integers (or, for
+  // comparisons, Booleans)
+  bool integerBinary(Expression::Operator, int reg);
+
+  // Convert the integer in 'reg' to a number
+  void toNumber(int reg);
+
+  // Convert the Boolean in 'reg' to an integer
+  void toInteger(int reg);
+
+  // Replace the number in 'reg' with its truth
+  void truth(int reg);
+
+  // Labels within the code, for branches
+  int newLabel();
+  void bind(int label);
+  void jump(int label);
+
+  // Jump if the Boolean in 'reg' is 'value'
+  void jumpIf(int reg, bool value, int label);
+
+private:
+  enum Expect {
+    EXPECT_NUMBER = KIND_NUMBER,
+    EXPECT_BOOL = KIND_BOOL,
+    EXPECT_INTEGER = KIND_INTEGER,
+    EXPECT_TRUTH
+  };
+
+  static int runFallback(const Expression*, ExecutionContext*, int expect,
+                         double* result);
+
+  void fallback(const Expression*, int reg, Expect);
+  void bailUnless(int condition);
+  void rewind(size_t size);
+
+  // Instruction encoding
+  void byte(int);
+  void int32(int32_t);
+  void int64(uint64_t);
+  void rex(bool wide, int reg, int rm);
+  void modrm(int mod, int reg, int rm);
+  void memory(int reg, int base, int32_t offset);
+  void sse(int prefix, int opcode, int reg, int rm, bool wide = false);
+  void sseMemory(int prefix, int opcode, int reg, int base, int32_t offset);
+  void move(int dest, int source);
+  void moveImmediate(int reg, uint64_t value);
+  void alu(int opcode, int dest, int source, bool wide = false);
+  void setFlag(int condition, int reg);
+  void toRegister(int reg);
+  void jumpTo(int condition, int label);
+  void push(int reg);
+  void pop(int reg);
+
+  std::vector<uint8_t> code;
+  std::vector<int> labels;                     // Address of each, or -1
+  std::vector<std::pair<int, int> > fixups;    // Offset to patch, label
+  int bail;                                    // The bail-out label
+};
+
+// Evaluates a tree with native code where it can; see NativeBuilder. On
+// platforms other than x86-64, or if the tree can't be compiled at all, it
+// just evaluates the tree. Printing, lowering and batches go to the tree.
+class NativeExpression : public Expression {
+public:
+  // Takes ownership of the tree
+  explicit NativeExpression(Expression* tree);
+  ~NativeExpression() override;
+
+  Value compute(ExecutionContext&) const override;
+  void print(std::ostream&) const override;
+  void lower(BytecodeBuilder&, int reg) const override;
+  void evaluateRows(const ColumnBatch&, const std::vector<int>& rows,
+                    Column& result) const override;
+  int save(ExpressionWriter&) const override;
+  int share(ExpressionDag&) const override;
+
+  // Whether this platform can run native code
+  static bool isSupported();
+
+  // Whether the expression has native code
+  bool isNative() const { return function != nullptr; }
+
+  // Whether the code has bailed out so often that it's being skipped, for
+  // now, in favour of the tree
+  bool isSkippingNative() const {
+    return bails.load(std::memory_order_relaxed) >= kMaxBails;
+  }
+
+protected:
+  Type inferType() const override;
+
+private:
+  typedef int (*Function)(const Value* slots, int64_t count,
+                          ExecutionContext*, double* result);
+
+  // After this many bail-outs in a row, the assumptions the code makes
+  // evidently don't hold, so the code is skipped. It's tried again once
+  // every kRetryInterval evaluations, in case the inputs have changed; if
+  // it runs, it's used as before.
+  static const int kMaxBails = 64;
+  static const int kRetryInterval = 1024;
+
+  Expression* tree;
+  NativeBuilder::Kind kind;
+  Function function;
+  void* mapping;
+  size_t mapping_size;
+  // Bail-outs in a row, and then, once skipping, evaluations since
+  // kMaxBails
+  mutable std::atomic<int> bails;
+};
+
+#endif
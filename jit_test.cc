@@ -0,0 +1,220 @@
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "exception.h"
+#include "expression.h"
+#include "jit.h"
+#include "test_util.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+bool IsNative(const std::string& text) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> e(Compile(text, symbols,
+                                        Expression::BACKEND_NATIVE));
+  return static_cast<NativeExpression*>(e.get())->isNative();
+}
+
+}  // namespace
+
+// The native backend must agree with the tree on every value and error
+TEST(JitTest, MatchesTree) {
+  const char* const cases[] = {
+    "1", "1.5", "'str'", "true", "false",
+    "!1", "~1", "-1", "+1", "!'foo'", "~true", "-'12'", "+false", "-false",
+    "!0", "!(0 / 0)", "~(4294967296 * 4294967296)", "~-2.5", "-(0 / 0)",
+    "5 * 7", "12 / 4", "12 / -4", "11 % 10", "11 % -10", "-11 % 10",
+    "4294967296 % 7", "12 - 4", "12 + 4", "1 << 8", "156 >> 3", "-156 >> 3",
+    "1 << 33", "1 << -1", "127 & 48", "48 | 1", "5 ^ 31", "10000000000 | 0",
+    "4 && 0", "4 || 0", "1 / 0", "-1 / 0", "0 / 0", "0 * -1",
+    "5 < 7", "5 > 7", "5 <= 7", "5 >= 7", "5 == 5", "5 != 5",
+    "0 / 0 < 1", "0 / 0 >= 1", "0 / 0 == 0 / 0", "0 / 0 != 0 / 0",
+    "'foo' + 'bar'", "'foo' < 'bar'", "'foo' == 'foo'", "'foo' + 1",
+    "1 + '2'", "'3' * 2", "true + 1", "true == false", "true && false",
+    "true || false", "true == 1", "false != 0", "true < 2",
+    "1 < 3 ? 2 : 4", "1 > 3 ? 2 : 4", "'' ? 1 : 'x'", "1 ? true : 2",
+    "2 * (4 + 5)", "(2 * 4) + 5", "4, 5, 6", "true, false, 'x'",
+    "1 ? 2 : 3, 4", "1 ? 2, 3 : 4", "0 / 0 ? 1 : 2",
+    "false && 'a' * 2", "true || (1 += 2)", "'foo' && 1", "'' || 'x'",
+    "0 || 1 && 2", "'' && (1 || 0)", "!('a' < 'b')", "('a' < 'b') + 1",
+    "((1 + 2) * (3 + 4)) - ((5 + 6) * (7 + 8)) / ((9 - 10) * (11 - 12))",
+    "9007199254740992 + 1", "0x7fffffffffffffff + 1", "5 / 2", "7 % -1",
+    "1 << 65", "-8 >> 67", "3 * 2.5", "~0", "1 == 1.0", "-0x8000000000000000",
+    "(1 < 2) + 3", "true ^ 3", "5 - 7 < 0", "1 ? 2 : 2.5",
+    // Errors
+    "true + true", "'foo' * 2", "'foo' - 'bar'", "1 + 'x' * 2",
+    "4 = 2", "1 += (1 / 0)", "true << true", "true < false",
+    "true && true + true", "false || 'a' - 'b'", "1 + (true * false)",
+    "7 % 0", "7 % false", "1.5 % 0", "7 % 0.5", "-2147483648.0 % -1",
+  };
+
+  for (const char* text : cases) {
+    for (bool optimize : { false, true }) {
+      SymbolTable symbols;
+      std::unique_ptr<Expression> tree(Compile(
+          text, symbols, Expression::BACKEND_TREE, optimize));
+      std::unique_ptr<Expression> native(Compile(
+          text, symbols, Expression::BACKEND_NATIVE, optimize));
+      ExecutionContext context;
+      EXPECT_EQ(Outcome(*tree, context), Outcome(*native, context)) << text;
+    }
+  }
+}
+
+// Random expressions over variables holding numbers (including the
+// awkward ones), integers, Booleans and strings, or missing altogether
+TEST(JitTest, RandomExpressions) {
+  Generator generator;
+  for (int i = 0; i < 2000; i++) {
+    const std::string text = generator.expression(5);
+    SymbolTable symbols;
+    std::unique_ptr<Expression> tree(Compile(
+        text, symbols, Expression::BACKEND_TREE));
+    std::unique_ptr<Expression> native(Compile(
+        text, symbols, Expression::BACKEND_NATIVE, i % 2));
+
+    for (int j = 0; j < 20; j++) {
+      ExecutionContext context(j == 0 ? 0 : symbols.size());
+      for (int slot = 0; slot < context.size(); slot++) {
+        context.set(slot, generator.value());
+      }
+      ASSERT_EQ(Outcome(*tree, context), Outcome(*native, context))
+          << text << " (context " << j << ")";
+    }
+  }
+}
+
+TEST(JitTest, CompilesNumbersAndBooleans) {
+  if (!NativeExpression::isSupported()) {
+    return;
+  }
+
+  EXPECT_TRUE(IsNative("x * 2 + 1 > y"));
+  EXPECT_TRUE(IsNative("flag && !done"));
+  EXPECT_TRUE(IsNative("x < 0 ? -x : x"));
+  EXPECT_TRUE(IsNative("(x & 255) << 2"));
+
+  // Strings in part of the expression are left to the tree
+  EXPECT_TRUE(IsNative("name == 'alice' && x > 1"));
+  EXPECT_TRUE(IsNative("(name + 'x' < 'b') + 1"));
+
+  // Nothing to compile
+  EXPECT_FALSE(IsNative("name + 'x'"));
+  EXPECT_FALSE(IsNative("x ? 'yes' : 'no'"));
+  EXPECT_FALSE(IsNative("x += 1"));
+}
+
+TEST(JitTest, Variables) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> e(Compile(
+      "flag ? x * 2 : -x", symbols, Expression::BACKEND_NATIVE));
+  const int x = symbols.find("x");
+  const int flag = symbols.find("flag");
+
+  ExecutionContext context(symbols);
+  context.set(x, Expression::Value(3.0));
+  context.set(flag, Expression::Value(true));
+  EXPECT_EQ(6, e->evaluate(context).getNumber());
+  context.set(flag, Expression::Value(0.0));
+  EXPECT_EQ(-3, e->evaluate(context).getNumber());
+
+  // Not numbers, so the tree takes over
+  context.set(x, Expression::Value("3"));
+  EXPECT_EQ(-3, e->evaluate(context).getNumber());
+  context.set(flag, Expression::Value("yes"));
+  EXPECT_THROW(e->evaluate(context), Exception);
+
+  ExecutionContext empty;
+  try {
+    e->evaluate(empty);
+    FAIL();
+  } catch (const Exception& ex) {
+    EXPECT_STREQ("Undefined variable: flag", ex.what());
+  }
+}
+
+// The tree takes over while the code keeps bailing out, but not for good
+TEST(JitTest, KeepsBailingOut) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> e(Compile(
+      "x + 1", symbols, Expression::BACKEND_NATIVE));
+  const NativeExpression* native =
+      static_cast<const NativeExpression*>(e.get());
+  ExecutionContext context(symbols);
+  context.set(0, Expression::Value("a"));
+  for (int i = 0; i < 10000; i++) {
+    EXPECT_EQ("a1", e->evaluate(context).getString());
+  }
+  EXPECT_EQ(native->isNative(), native->isSkippingNative());
+
+  // Once the inputs suit the code again, it comes back into use
+  context.set(0, Expression::Value(1.0));
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_EQ(i + 2, e->evaluate(context).getNumber());
+    context.set(0, Expression::Value(i + 2.0));
+  }
+  EXPECT_FALSE(native->isSkippingNative());
+}
+
+// % works through int32, so a fraction can divide by zero, and INT_MIN by
+// -1 would overflow; every backend must fail or give 0 the same way
+TEST(JitTest, ModByZero) {
+  const Expression::Backend backends[] = {
+    Expression::BACKEND_TREE, Expression::BACKEND_BYTECODE,
+    Expression::BACKEND_NATIVE,
+  };
+  for (Expression::Backend backend : backends) {
+    for (bool optimize : { false, true }) {
+      SymbolTable symbols;
+      std::unique_ptr<Expression> e(Compile(
+          "x % y", symbols, backend, optimize));
+      ExecutionContext context(symbols);
+      context.set(symbols.find("x"), Expression::Value(1.5));
+      context.set(symbols.find("y"), Expression::Value(0.5));
+      EXPECT_EQ("error: Division by zero", Outcome(*e, context));
+      context.set(symbols.find("y"), Expression::Value(int64_t(0)));
+      EXPECT_EQ("error: Division by zero", Outcome(*e, context));
+
+      context.set(symbols.find("x"), Expression::Value(-2147483648.0));
+      context.set(symbols.find("y"), Expression::Value(-1.0));
+      EXPECT_EQ(0, e->evaluate(context).getNumber());
+      context.set(symbols.find("x"), Expression::Value(INT64_MIN));
+      context.set(symbols.find("y"), Expression::Value(int64_t(-1)));
+      EXPECT_EQ(0, e->evaluate(context).getInteger());
+    }
+  }
+}
+
+// More operands than registers
+TEST(JitTest, ManyRegisters) {
+  std::string text = "x";
+  for (int i = 0; i < 40; i++) {
+    text = "(x - " + std::to_string(i) + " * (" + text + "))";
+  }
+
+  SymbolTable symbols;
+  std::unique_ptr<Expression> tree(Compile(
+      text, symbols, Expression::BACKEND_TREE));
+  std::unique_ptr<Expression> native(Compile(
+      text, symbols, Expression::BACKEND_NATIVE));
+  for (double x : { 0.0, 1.0, -0.5, 1.0001 }) {
+    ExecutionContext context(symbols);
+    context.set(0, Expression::Value(x));
+    EXPECT_EQ(Outcome(*tree, context), Outcome(*native, context)) << x;
+  }
+}
+
+TEST(JitTest, Printing) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> e(Compile(
+      "x + 2 * 3", symbols, Expression::BACKEND_NATIVE, true));
+  std::ostringstream out;
+  e->print(out);
+  EXPECT_EQ("(x+6)", out.str());
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e->getStaticType());
+}
@@ -0,0 +1,416 @@
+#include "kernels.h"
+#include "exception.h"
+
+#include <atomic>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef void (*BinaryKernel)(const double*, const double*, double*, int);
+typedef void (*CompareKernel)(const double*, const double*, uint64_t*, int);
+
+struct KernelTable {
+  BinaryKernel multiply, divide, plus, minus;
+  BinaryKernel bitAnd, bitXor, bitOr, shiftLeft, shiftRight;
+  CompareKernel less, lessEq, greater, greaterEq, equal, notEqual;
+};
+
+void clearMask(uint64_t* mask, int n) {
+  for (int i = 0; i < (n + 63) / 64; i++) {
+    mask[i] = 0;
+  }
+}
+
+// The operators. The vector forms below must match 'scalar' exactly.
+
+struct Multiply {
+  static double scalar(double a, double b) { return a * b; }
+};
+
+struct Divide {
+  static double scalar(double a, double b) { return a / b; }
+};
+
+struct Plus {
+  static double scalar(double a, double b) { return a + b; }
+};
+
+struct Minus {
+  static double scalar(double a, double b) { return a - b; }
+};
+
+struct BitAnd {
+  static double scalar(double a, double b) {
+    return int32_t(a) & int32_t(b);
+  }
+};
+
+struct BitXor {
+  static double scalar(double a, double b) {
+    return int32_t(a) ^ int32_t(b);
+  }
+};
+
+struct BitOr {
+  static double scalar(double a, double b) {
+    return int32_t(a) | int32_t(b);
+  }
+};
+
+struct ShiftLeft {
+  static double scalar(double a, double b) {
+    return int32_t(a) << int32_t(b);
+  }
+};
+
+struct ShiftRight {
+  static double scalar(double a, double b) {
+    return int32_t(a) >> int32_t(b);
+  }
+};
+
+struct Less {
+  static bool scalar(double a, double b) { return a < b; }
+};
+
+struct LessEq {
+  static bool scalar(double a, double b) { return a <= b; }
+};
+
+struct Greater {
+  static bool scalar(double a, double b) { return a > b; }
+};
+
+struct GreaterEq {
+  static bool scalar(double a, double b) { return a >= b; }
+};
+
+struct Equal {
+  static bool scalar(double a, double b) { return a == b; }
+};
+
+struct NotEqual {
+  static bool scalar(double a, double b) { return a != b; }
+};
+
+// Portable versions
+
+template <typename Op>
+void scalarBinary(const double* a, const double* b, double* out, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = Op::scalar(a[i], b[i]);
+  }
+}
+
+template <typename Op>
+void scalarCompare(const double* a, const double* b, uint64_t* mask, int n) {
+  clearMask(mask, n);
+  for (int i = 0; i < n; i++) {
+    if (Op::scalar(a[i], b[i])) {
+      mask[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+  }
+}
+
+#if defined HAVE_X86_KERNELS
+
+#define AVX2 __attribute__((target("avx2")))
+#define SSE2 __attribute__((target("sse2")))
+
+// The int32 operators truncate like the int32_t casts in the number
+// branch of Expression::applyBinary(). Both give 0x80000000 for values out
+// of range.
+AVX2 inline __m128i avx2Int(__m256d v) { return _mm256_cvttpd_epi32(v); }
+SSE2 inline __m128i sse2Int(__m128d v) { return _mm_cvttpd_epi32(v); }
+
+// The vector forms of each operator
+template <typename Op> struct Vector;
+
+// Shift counts are masked to five bits, as the scalar shift instructions do
+AVX2 inline __m128i shiftCount(__m256d v) {
+  return _mm_and_si128(avx2Int(v), _mm_set1_epi32(31));
+}
+
+template <> struct Vector<Multiply> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_mul_pd(a, b);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+};
+
+template <> struct Vector<Divide> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_div_pd(a, b);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+};
+
+template <> struct Vector<Plus> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_add_pd(a, b);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+};
+
+template <> struct Vector<Minus> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_sub_pd(a, b);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+};
+
+template <> struct Vector<BitAnd> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cvtepi32_pd(_mm_and_si128(avx2Int(a), avx2Int(b)));
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) {
+    return _mm_cvtepi32_pd(_mm_and_si128(sse2Int(a), sse2Int(b)));
+  }
+};
+
+template <> struct Vector<BitXor> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cvtepi32_pd(_mm_xor_si128(avx2Int(a), avx2Int(b)));
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) {
+    return _mm_cvtepi32_pd(_mm_xor_si128(sse2Int(a), sse2Int(b)));
+  }
+};
+
+template <> struct Vector<BitOr> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cvtepi32_pd(_mm_or_si128(avx2Int(a), avx2Int(b)));
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) {
+    return _mm_cvtepi32_pd(_mm_or_si128(sse2Int(a), sse2Int(b)));
+  }
+};
+
+// SSE2 has no per-lane shifts, so those stay scalar there
+template <> struct Vector<ShiftLeft> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cvtepi32_pd(_mm_sllv_epi32(avx2Int(a), shiftCount(b)));
+  }
+};
+
+template <> struct Vector<ShiftRight> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cvtepi32_pd(_mm_srav_epi32(avx2Int(a), shiftCount(b)));
+  }
+};
+
+// Comparisons are false if either side is NaN, except for !=
+template <> struct Vector<Less> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_cmplt_pd(a, b); }
+};
+
+template <> struct Vector<LessEq> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cmp_pd(a, b, _CMP_LE_OQ);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_cmple_pd(a, b); }
+};
+
+template <> struct Vector<Greater> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_cmpgt_pd(a, b); }
+};
+
+template <> struct Vector<GreaterEq> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cmp_pd(a, b, _CMP_GE_OQ);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_cmpge_pd(a, b); }
+};
+
+template <> struct Vector<Equal> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) { return _mm_cmpeq_pd(a, b); }
+};
+
+template <> struct Vector<NotEqual> {
+  AVX2 static __m256d avx2(__m256d a, __m256d b) {
+    return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ);
+  }
+  SSE2 static __m128d sse2(__m128d a, __m128d b) {
+    return _mm_cmpneq_pd(a, b);
+  }
+};
+
+template <typename Op>
+AVX2 void avx2Binary(const double* a, const double* b, double* out, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, Vector<Op>::avx2(_mm256_loadu_pd(a + i),
+                                               _mm256_loadu_pd(b + i)));
+  }
+  for (; i < n; i++) {
+    out[i] = Op::scalar(a[i], b[i]);
+  }
+}
+
+template <typename Op>
+AVX2 void avx2Compare(const double* a, const double* b, uint64_t* mask,
+                      int n) {
+  clearMask(mask, n);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const uint64_t bits = _mm256_movemask_pd(
+        Vector<Op>::avx2(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mask[i >> 6] |= bits << (i & 63);
+  }
+  for (; i < n; i++) {
+    if (Op::scalar(a[i], b[i])) {
+      mask[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+  }
+}
+
+template <typename Op>
+SSE2 void sse2Binary(const double* a, const double* b, double* out, int n) {
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(out + i, Vector<Op>::sse2(_mm_loadu_pd(a + i),
+                                            _mm_loadu_pd(b + i)));
+  }
+  for (; i < n; i++) {
+    out[i] = Op::scalar(a[i], b[i]);
+  }
+}
+
+template <typename Op>
+SSE2 void sse2Compare(const double* a, const double* b, uint64_t* mask,
+                      int n) {
+  clearMask(mask, n);
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    const uint64_t bits = _mm_movemask_pd(
+        Vector<Op>::sse2(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mask[i >> 6] |= bits << (i & 63);
+  }
+  for (; i < n; i++) {
+    if (Op::scalar(a[i], b[i])) {
+      mask[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+  }
+}
+
+const KernelTable avx2Kernels = {
+  avx2Binary<Multiply>, avx2Binary<Divide>, avx2Binary<Plus>,
+  avx2Binary<Minus>, avx2Binary<BitAnd>, avx2Binary<BitXor>,
+  avx2Binary<BitOr>, avx2Binary<ShiftLeft>, avx2Binary<ShiftRight>,
+  avx2Compare<Less>, avx2Compare<LessEq>, avx2Compare<Greater>,
+  avx2Compare<GreaterEq>, avx2Compare<Equal>, avx2Compare<NotEqual>
+};
+
+const KernelTable sse2Kernels = {
+  sse2Binary<Multiply>, sse2Binary<Divide>, sse2Binary<Plus>,
+  sse2Binary<Minus>, sse2Binary<BitAnd>, sse2Binary<BitXor>,
+  sse2Binary<BitOr>, scalarBinary<ShiftLeft>, scalarBinary<ShiftRight>,
+  sse2Compare<Less>, sse2Compare<LessEq>, sse2Compare<Greater>,
+  sse2Compare<GreaterEq>, sse2Compare<Equal>, sse2Compare<NotEqual>
+};
+
+#endif  // HAVE_X86_KERNELS
+
+const KernelTable scalarKernels = {
+  scalarBinary<Multiply>, scalarBinary<Divide>, scalarBinary<Plus>,
+  scalarBinary<Minus>, scalarBinary<BitAnd>, scalarBinary<BitXor>,
+  scalarBinary<BitOr>, scalarBinary<ShiftLeft>, scalarBinary<ShiftRight>,
+  scalarCompare<Less>, scalarCompare<LessEq>, scalarCompare<Greater>,
+  scalarCompare<GreaterEq>, scalarCompare<Equal>, scalarCompare<NotEqual>
+};
+
+const KernelTable* tableFor(KernelSet set) {
+  switch (set) {
+#if defined HAVE_X86_KERNELS
+    case KERNELS_AVX2: return &avx2Kernels;
+    case KERNELS_SSE2: return &sse2Kernels;
+#endif
+    default:           return &scalarKernels;
+  }
+}
+
+KernelSet bestKernelSet() {
+#if defined HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return KERNELS_AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    return KERNELS_SSE2;
+  }
+#endif
+  return KERNELS_SCALAR;
+}
+
+std::atomic<KernelSet> activeSet(bestKernelSet());
+
+}  // namespace
+
+KernelSet getBestKernelSet() {
+  static const KernelSet best = bestKernelSet();
+  return best;
+}
+
+KernelSet getKernelSet() {
+  return activeSet.load(std::memory_order_relaxed);
+}
+
+void setKernelSet(KernelSet set) {
+  PRECONDITION(set <= getBestKernelSet());
+  activeSet.store(set, std::memory_order_relaxed);
+}
+
+bool numberKernel(Expression::Operator op, const double* a, const double* b,
+                  double* out, int n) {
+  const KernelTable* table = tableFor(getKernelSet());
+  BinaryKernel kernel;
+
+  switch (op) {
+    case Expression::OP_MULTIPLY:   kernel = table->multiply; break;
+    case Expression::OP_DIVIDE:     kernel = table->divide; break;
+    case Expression::OP_PLUS:       kernel = table->plus; break;
+    case Expression::OP_MINUS:      kernel = table->minus; break;
+    case Expression::OP_AND:        kernel = table->bitAnd; break;
+    case Expression::OP_XOR:        kernel = table->bitXor; break;
+    case Expression::OP_OR:         kernel = table->bitOr; break;
+    case Expression::OP_SHIFTLEFT:  kernel = table->shiftLeft; break;
+    case Expression::OP_SHIFTRIGHT: kernel = table->shiftRight; break;
+    default:
+      return false;
+  }
+
+  kernel(a, b, out, n);
+  return true;
+}
+
+bool compareKernel(Expression::Operator op, const double* a, const double* b,
+                   uint64_t* mask, int n) {
+  const KernelTable* table = tableFor(getKernelSet());
+  CompareKernel kernel;
+
+  switch (op) {
+    case Expression::OP_LESS:      kernel = table->less; break;
+    case Expression::OP_LESSEQ:    kernel = table->lessEq; break;
+    case Expression::OP_GREATER:   kernel = table->greater; break;
+    case Expression::OP_GREATEREQ: kernel = table->greaterEq; break;
+    case Expression::OP_EQUAL:     kernel = table->equal; break;
+    case Expression::OP_NOTEQUAL:  kernel = table->notEqual; break;
+    default:
+      return false;
+  }
+
+  kernel(a, b, mask, n);
+  return true;
+}
@@ -0,0 +1,44 @@
+#if !defined KERNELS_H
+#define      KERNELS_H
+
+#include <stdint.h>
+
+#include "expression.h"
+
+// Kernels that run the numeric operators over whole columns, for batch
+// evaluation. Each has AVX2 and SSE2 versions, picked at run time from what
+// the CPU supports, and a portable scalar version. They all give exactly
+// the same results as Expression::applyBinary.
+
+enum KernelSet {
+  KERNELS_SCALAR,
+  KERNELS_SSE2,
+  KERNELS_AVX2
+};
+
+// The best set the CPU supports
+KernelSet getBestKernelSet();
+
+// The set in use. It starts out as the best one; tests may pick another
+// (which must be supported) to compare them. It can be switched at any
+// time, from any thread: each kernel call reads the set once, so a call
+// already running finishes with the set it started with, and calls after
+// the switch use the new one. A batch that's being evaluated meanwhile may
+// use both, one for some operators and one for others, which is harmless
+// since every set gives the same results.
+KernelSet getKernelSet();
+void setKernelSet(KernelSet);
+
+// out[i] = a[i] op b[i] for the arithmetic operators (* / + -) and the
+// operators that work on int32 (& | ^ << >>). Returns false, doing nothing,
+// for any other operator.
+bool numberKernel(Expression::Operator, const double* a, const double* b,
+                  double* out, int n);
+
+// Sets bit i of the mask (bit i % 64 of word i / 64) if a[i] op b[i], for
+// the comparison operators. The mask must have room for (n + 63) / 64
+// words. Returns false, doing nothing, for any other operator.
+bool compareKernel(Expression::Operator, const double* a, const double* b,
+                   uint64_t* mask, int n);
+
+#endif
@@ -0,0 +1,128 @@
+#include "kernels.h"
+
+#include <limits>
+#include <string.h>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int kSize = 203;  // not a multiple of any vector width
+
+// Operands covering the awkward cases: NaN, infinities, signed zeros,
+// values out of int32 range, and shift counts out of range.
+void MakeOperands(std::vector<double>& a, std::vector<double>& b) {
+  const double special[] = {
+    0.0, -0.0, 1.0, -1.0, 2.5, -2.5, 31, 32, 33, -1e300, 1e300,
+    4294967296.0, -2147483649.0, 2147483647.0,
+    std::numeric_limits<double>::infinity(),
+    -std::numeric_limits<double>::infinity(),
+    std::numeric_limits<double>::quiet_NaN(),
+  };
+  const int count = sizeof(special) / sizeof(special[0]);
+
+  a.clear();
+  b.clear();
+  unsigned seed = 1;
+  for (int i = 0; i < kSize; i++) {
+    seed = seed * 1103515245 + 12345;
+    if (i % 3 == 0) {
+      a.push_back(special[i % count]);
+      b.push_back(special[(i / 3) % count]);
+    } else {
+      a.push_back(double(int(seed >> 8) % 2000 - 1000) / 8);
+      b.push_back(double(int(seed >> 20) % 40 - 4));
+    }
+  }
+}
+
+class RestoreKernels {
+public:
+  RestoreKernels() : saved(getKernelSet()) {}
+  ~RestoreKernels() { setKernelSet(saved); }
+private:
+  KernelSet saved;
+};
+
+}  // namespace
+
+TEST(KernelsTest, Selection) {
+  RestoreKernels restore;
+  EXPECT_EQ(getBestKernelSet(), getKernelSet());
+  setKernelSet(KERNELS_SCALAR);
+  EXPECT_EQ(KERNELS_SCALAR, getKernelSet());
+}
+
+TEST(KernelsTest, NotAKernel) {
+  double a = 1, b = 2, out = 0;
+  uint64_t mask = 0;
+  EXPECT_FALSE(numberKernel(Expression::OP_LESS, &a, &b, &out, 1));
+  EXPECT_FALSE(numberKernel(Expression::OP_MOD, &a, &b, &out, 1));
+  EXPECT_FALSE(compareKernel(Expression::OP_PLUS, &a, &b, &mask, 1));
+  EXPECT_FALSE(compareKernel(Expression::OP_ANDAND, &a, &b, &mask, 1));
+}
+
+// Every kernel set must give exactly the results of the scalar one.
+TEST(KernelsTest, SetsAgree) {
+  RestoreKernels restore;
+  std::vector<double> a, b;
+  MakeOperands(a, b);
+
+  const Expression::Operator numberOps[] = {
+    Expression::OP_MULTIPLY, Expression::OP_DIVIDE, Expression::OP_PLUS,
+    Expression::OP_MINUS, Expression::OP_AND, Expression::OP_XOR,
+    Expression::OP_OR, Expression::OP_SHIFTLEFT, Expression::OP_SHIFTRIGHT,
+  };
+  const Expression::Operator compareOps[] = {
+    Expression::OP_LESS, Expression::OP_LESSEQ, Expression::OP_GREATER,
+    Expression::OP_GREATEREQ, Expression::OP_EQUAL, Expression::OP_NOTEQUAL,
+  };
+
+  for (int set = KERNELS_SCALAR; set <= getBestKernelSet(); set++) {
+    for (int n : { 0, 1, 3, 64, 65, kSize }) {
+      for (Expression::Operator op : numberOps) {
+        std::vector<double> expected(n + 1, 7), actual(n + 1, 7);
+        setKernelSet(KERNELS_SCALAR);
+        ASSERT_TRUE(numberKernel(op, a.data(), b.data(), expected.data(), n));
+        setKernelSet(KernelSet(set));
+        ASSERT_TRUE(numberKernel(op, a.data(), b.data(), actual.data(), n));
+        EXPECT_EQ(0, memcmp(expected.data(), actual.data(),
+                            expected.size() * sizeof(double)))
+            << "set " << set << " op " << Expression::operator2string(op)
+            << " n " << n;
+      }
+
+      for (Expression::Operator op : compareOps) {
+        const int words = (n + 63) / 64;
+        std::vector<uint64_t> expected(words + 1, 7), actual(words + 1, 7);
+        setKernelSet(KERNELS_SCALAR);
+        ASSERT_TRUE(compareKernel(op, a.data(), b.data(), expected.data(), n));
+        setKernelSet(KernelSet(set));
+        ASSERT_TRUE(compareKernel(op, a.data(), b.data(), actual.data(), n));
+        EXPECT_EQ(expected, actual)
+            << "set " << set << " op " << Expression::operator2string(op)
+            << " n " << n;
+      }
+    }
+  }
+}
+
+TEST(KernelsTest, Results) {
+  const double a[] = { 1, 2, 3, 4, 5 };
+  const double b[] = { 5, 4, 3, 2, 1 };
+  double out[5];
+  uint64_t mask;
+
+  ASSERT_TRUE(numberKernel(Expression::OP_PLUS, a, b, out, 5));
+  for (double v : out) EXPECT_EQ(6, v);
+
+  ASSERT_TRUE(numberKernel(Expression::OP_SHIFTLEFT, a, b, out, 5));
+  EXPECT_EQ(32, out[0]);
+  EXPECT_EQ(10, out[4]);
+
+  ASSERT_TRUE(compareKernel(Expression::OP_LESS, a, b, &mask, 5));
+  EXPECT_EQ(3u, mask);
+  ASSERT_TRUE(compareKernel(Expression::OP_GREATEREQ, a, b, &mask, 5));
+  EXPECT_EQ(0x1cu, mask);
+}
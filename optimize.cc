@@ -0,0 +1,347 @@
+// The simplify() pass run by Expression::compile when optimizing. Constant
+// subtrees are folded into a single ConstantExpression, a few identities
+// that can't change any result are applied, chains of + on strings become
+// ConcatExpressions, and binary operators whose operand types are known
+// are replaced by the ones in specialized.h.
+
+#include <cmath>
+
+#include "exception.h"
+#include "expression.h"
+#include "specialized.h"
+
+using namespace std;
+
+namespace {
+
+bool isConstant(const Expression* expr) {
+  return dynamic_cast<const ConstantExpression*>(expr) != nullptr;
+}
+
+// True for a numeric or integer constant with exactly this value. Zero
+// must be +0: x - -0 turns x = -0 into +0.
+bool isNumber(const Expression* expr, int value) {
+  const ConstantExpression* c = dynamic_cast<const ConstantExpression*>(expr);
+  if (c == nullptr) {
+    return false;
+  } else if (c->getType() == Expression::TYPE_INTEGER) {
+    return c->getInteger() == value;
+  }
+  return (c->getType() == Expression::TYPE_NUMBER) &&
+      (c->getNumber() == value) && !std::signbit(c->getNumber());
+}
+
+// An integer constant used with a number is converted to a number every
+// time it's evaluated. Convert it once, now, instead, so that the operator
+// can be specialized.
+void convertInteger(Expression*& expr, const Expression* other,
+                    Arena* arena) {
+  const ConstantExpression* c = dynamic_cast<const ConstantExpression*>(expr);
+  if ((c != nullptr) && (c->getType() == Expression::TYPE_INTEGER) &&
+      (other->getStaticType() == Expression::TYPE_NUMBER)) {
+    Expression* number = new (arena) ConstantExpression(
+        double(c->getInteger()));
+    delete expr;
+    expr = number;
+  }
+}
+
+// Replace the expression, which must only depend on constants, with its
+// value. If evaluating it fails, keep the expression so that it fails when
+// evaluated, and (when strict) pass the error on.
+Expression* fold(Expression* expr,
+                 const Expression::CompileOptions& options, Status& status) {
+  ExecutionContext e;
+  const Result<Expression::Value> value = expr->tryEvaluate(e);
+  if (!value.ok()) {
+    if (options.strict) status.update(value.getStatus());
+    return expr;
+  }
+
+  delete expr;
+  return new (options.arena) ConstantExpression(value.get());
+}
+
+}  // namespace
+
+Expression* specializeBinary(Expression::Operator op, Expression* left,
+                             Expression* right, Arena* arena) {
+  const Expression::Type type = left->getStaticType();
+  if (type != right->getStaticType()) {
+    return nullptr;
+  }
+
+  if (type == Expression::TYPE_NUMBER) {
+    switch (op) {
+      case Expression::OP_MULTIPLY:
+        return new (arena) NumberMultiply(op, left, right);
+      case Expression::OP_DIVIDE:
+        return new (arena) NumberDivide(op, left, right);
+      case Expression::OP_PLUS:
+        return new (arena) NumberAdd(op, left, right);
+      case Expression::OP_MINUS:
+        return new (arena) NumberSubtract(op, left, right);
+      case Expression::OP_LESS:
+        return new (arena) NumberLess(op, left, right);
+      case Expression::OP_LESSEQ:
+        return new (arena) NumberLessEqual(op, left, right);
+      case Expression::OP_GREATER:
+        return new (arena) NumberGreater(op, left, right);
+      case Expression::OP_GREATEREQ:
+        return new (arena) NumberGreaterEqual(op, left, right);
+      case Expression::OP_EQUAL:
+        return new (arena) NumberEqual(op, left, right);
+      case Expression::OP_NOTEQUAL:
+        return new (arena) NumberNotEqual(op, left, right);
+      default:
+        return nullptr;
+    }
+
+  } else if (type == Expression::TYPE_INTEGER) {
+    switch (op) {
+      case Expression::OP_MULTIPLY:
+        return new (arena) IntegerMultiply(op, left, right);
+      case Expression::OP_DIVIDE:
+        return new (arena) IntegerDivide(op, left, right);
+      case Expression::OP_PLUS:
+        return new (arena) IntegerAdd(op, left, right);
+      case Expression::OP_MINUS:
+        return new (arena) IntegerSubtract(op, left, right);
+      case Expression::OP_SHIFTLEFT:
+        return new (arena) IntegerShiftLeft(op, left, right);
+      case Expression::OP_SHIFTRIGHT:
+        return new (arena) IntegerShiftRight(op, left, right);
+      case Expression::OP_LESS:
+        return new (arena) IntegerLess(op, left, right);
+      case Expression::OP_LESSEQ:
+        return new (arena) IntegerLessEqual(op, left, right);
+      case Expression::OP_GREATER:
+        return new (arena) IntegerGreater(op, left, right);
+      case Expression::OP_GREATEREQ:
+        return new (arena) IntegerGreaterEqual(op, left, right);
+      case Expression::OP_EQUAL:
+        return new (arena) IntegerEqual(op, left, right);
+      case Expression::OP_NOTEQUAL:
+        return new (arena) IntegerNotEqual(op, left, right);
+      case Expression::OP_AND:
+        return new (arena) IntegerAnd(op, left, right);
+      case Expression::OP_XOR:
+        return new (arena) IntegerXor(op, left, right);
+      case Expression::OP_OR:
+        return new (arena) IntegerOr(op, left, right);
+      default:
+        return nullptr;
+    }
+
+  } else if (type == Expression::TYPE_STRING) {
+    switch (op) {
+      case Expression::OP_PLUS:
+        return new (arena) StringConcat(op, left, right);
+      case Expression::OP_LESS:
+        return new (arena) StringLess(op, left, right);
+      case Expression::OP_LESSEQ:
+        return new (arena) StringLessEqual(op, left, right);
+      case Expression::OP_GREATER:
+        return new (arena) StringGreater(op, left, right);
+      case Expression::OP_GREATEREQ:
+        return new (arena) StringGreaterEqual(op, left, right);
+      case Expression::OP_EQUAL:
+        return new (arena) StringEqual(op, left, right);
+      case Expression::OP_NOTEQUAL:
+        return new (arena) StringNotEqual(op, left, right);
+      default:
+        return nullptr;
+    }
+
+  } else if (type == Expression::TYPE_BOOL) {
+    switch (op) {
+      case Expression::OP_EQUAL:
+        return new (arena) BoolEqual(op, left, right);
+      case Expression::OP_NOTEQUAL:
+        return new (arena) BoolNotEqual(op, left, right);
+      default:
+        return nullptr;
+    }
+  }
+
+  return nullptr;
+}
+
+Expression* Expression::simplify(const CompileOptions&, Status&) {
+  return this;
+}
+
+Expression* UnaryOperator::simplify(const CompileOptions& options,
+                                    Status& status) {
+  child = child->simplify(options, status);
+  annotate();
+  if (isConstant(child)) {
+    return fold(this, options, status);
+  }
+
+  // !!b is just b, if b is a Boolean
+  const UnaryOperator* inner = dynamic_cast<const UnaryOperator*>(child);
+  if (op == OP_NOT && inner != nullptr && inner->op == OP_NOT &&
+      inner->child->getStaticType() == TYPE_BOOL) {
+    Expression* result = inner->child;
+    const_cast<UnaryOperator*>(inner)->child = nullptr;
+    delete this;
+    return result;
+  }
+
+  return this;
+}
+
+Expression* BinaryOperator::simplify(const CompileOptions& options,
+                                     Status& status) {
+  left = left->simplify(options, status);
+  right = right->simplify(options, status);
+  annotate();
+  if (isConstant(left) && isConstant(right)) {
+    return fold(this, options, status);
+  }
+
+  // A + on a chain of + on strings continues the chain. The chain so far
+  // is a ConcatExpression, or (if it's only one + long) a + with a string
+  // operand.
+  if (op == OP_PLUS) {
+    ConcatExpression* chain = dynamic_cast<ConcatExpression*>(left);
+    BinaryOperator* inner = dynamic_cast<BinaryOperator*>(left);
+    if (chain != nullptr) {
+      left = nullptr;
+    } else if (inner != nullptr && inner->op == OP_PLUS &&
+               (inner->left->getStaticType() == TYPE_STRING ||
+                inner->right->getStaticType() == TYPE_STRING)) {
+      chain = new (options.arena) ConcatExpression;
+      chain->append(inner->left);
+      chain->append(inner->right);
+      inner->left = inner->right = nullptr;
+    }
+
+    if (chain != nullptr) {
+      chain->append(right);
+      right = nullptr;
+      delete this;
+      return chain;
+    }
+  }
+
+  // x * 1, 1 * x, x / 1 and x - 0 are x, if x is a number, or an integer
+  // (as long as the result is too: an integer / 1 is a number). x + 0
+  // isn't: it turns -0 into +0.
+  Expression** keep = nullptr;
+  if (op == OP_MULTIPLY && isNumber(right, 1)) {
+    keep = &left;
+  } else if (op == OP_MULTIPLY && isNumber(left, 1)) {
+    keep = &right;
+  } else if (op == OP_DIVIDE && isNumber(right, 1)) {
+    keep = &left;
+  } else if (op == OP_MINUS && isNumber(right, 0)) {
+    keep = &left;
+  }
+
+  const Type type = getStaticType();
+  if (keep != nullptr && (*keep)->getStaticType() == type &&
+      (type == TYPE_NUMBER || type == TYPE_INTEGER)) {
+    Expression* result = *keep;
+    *keep = nullptr;
+    delete this;
+    return result;
+  }
+
+  convertInteger(left, right, options.arena);
+  convertInteger(right, left, options.arena);
+  Expression* result = specializeBinary(op, left, right, options.arena);
+  if (result != nullptr) {
+    left = right = nullptr;
+    delete this;
+    return result;
+  }
+
+  return this;
+}
+
+Expression* LogicalOperator::simplify(const CompileOptions& options,
+                                      Status& status) {
+  left = left->simplify(options, status);
+
+  // As with ?:, the right operand is left alone if it's never evaluated
+  if (isConstant(left)) {
+    ExecutionContext e;
+    const bool settles = (op == OP_OROR);
+    if (left->evaluate(e).asBool() == settles) {
+      delete this;
+      return new (options.arena) ConstantExpression(settles);
+    }
+
+    right = right->simplify(options, status);
+    annotate();
+    if (isConstant(right)) {
+      return fold(this, options, status);
+    }
+
+    // true && b and false || b are b, if b is a Boolean
+    if (right->getStaticType() == TYPE_BOOL) {
+      Expression* result = right;
+      right = nullptr;
+      delete this;
+      return result;
+    }
+    return this;
+  }
+
+  right = right->simplify(options, status);
+  annotate();
+  return this;
+}
+
+Expression* TernaryOperator::simplify(const CompileOptions& options,
+                                      Status& status) {
+  test = test->simplify(options, status);
+
+  // Only the branch that's taken is simplified, so that a strict compile
+  // doesn't reject errors in the other one
+  if (isConstant(test)) {
+    ExecutionContext e;
+    Expression*& branch = test->evaluate(e).asBool() ? positive : negative;
+    branch = branch->simplify(options, status);
+    Expression* result = branch;
+    branch = nullptr;
+    delete this;
+    return result;
+  }
+
+  positive = positive->simplify(options, status);
+  negative = negative->simplify(options, status);
+  annotate();
+  return this;
+}
+
+Expression* SequenceExpression::simplify(const CompileOptions& options,
+                                         Status& status) {
+  for (auto*& sub : subs) {
+    sub = sub->simplify(options, status);
+  }
+
+  // Constants have no effect except as the value of the sequence, so
+  // drop the ones that aren't last
+  vector<Expression*> kept;
+  for (unsigned i = 0; i < subs.size(); i++) {
+    if (isConstant(subs[i]) && i + 1 < subs.size()) {
+      delete subs[i];
+    } else {
+      kept.push_back(subs[i]);
+    }
+  }
+  subs.swap(kept);
+
+  if (subs.size() == 1) {
+    Expression* result = subs[0];
+    subs.clear();
+    delete this;
+    return result;
+  }
+
+  annotate();
+  return this;
+}
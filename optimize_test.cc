@@ -0,0 +1,353 @@
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "exception.h"
+#include "expression.h"
+#include "specialized.h"
+#include "test_util.h"
+#include "textsource.h"
+#include "tokenizer.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// x is in slot 0, whichever test runs first
+SymbolTable& Symbols() {
+  static SymbolTable symbols;
+  if (symbols.size() == 0) {
+    symbols.add("x");
+  }
+  return symbols;
+}
+
+Expression* Compile(const std::string& text, bool optimize,
+                    bool strict = false) {
+  Expression::CompileOptions options;
+  options.symbols = &Symbols();
+  options.optimize = optimize;
+  options.strict = strict;
+  return ::Compile(text, options);
+}
+
+// The printed form of the optimized expression
+std::string Simplify(const std::string& text) {
+  std::unique_ptr<Expression> e(Compile(text, true));
+  std::ostringstream out;
+  out << *e;
+  return out.str();
+}
+
+// Evaluate the expression with and without optimizing, and check that both
+// give the same value, or both throw the same error
+void ExpectSameResult(const std::string& text, ExecutionContext& e) {
+  std::unique_ptr<Expression> plain(Compile(text, false));
+  std::unique_ptr<Expression> optimized(Compile(text, true));
+
+  std::ostringstream expected, actual;
+  try {
+    const Expression::Value v = plain->evaluate(e);
+    expected << v << " type " << v.getType();
+  } catch (const Exception& ex) {
+    expected << "error: " << ex.what();
+  }
+  try {
+    const Expression::Value v = optimized->evaluate(e);
+    actual << v << " type " << v.getType();
+  } catch (const Exception& ex) {
+    actual << "error: " << ex.what();
+  }
+  EXPECT_EQ(expected.str(), actual.str()) << text;
+}
+
+}  // namespace
+
+TEST(Optimize, FoldsConstants) {
+  EXPECT_EQ("(86400*x)", Simplify("(3600 * 24) * x"));
+  EXPECT_EQ("\"prefixsuffix\"", Simplify("'prefix' + 'suffix'"));
+  EXPECT_EQ("-7", Simplify("-(3 + 4)"));
+  EXPECT_EQ("true", Simplify("!(1 > 2)"));
+  EXPECT_EQ("(x+3)", Simplify("x + (1 + 2)"));
+  EXPECT_EQ("((x+1)+2)", Simplify("x + 1 + 2"));
+}
+
+TEST(Optimize, Identities) {
+  EXPECT_EQ("(x?1.5:2.5)", Simplify("(x ? 1.5 : 2.5) * 1"));
+  EXPECT_EQ("(x?1.5:2.5)", Simplify("1 * (x ? 1.5 : 2.5)"));
+  EXPECT_EQ("(x?1.5:2.5)", Simplify("(x ? 1.5 : 2.5) / 1.0"));
+  EXPECT_EQ("(x?1.5:2.5)", Simplify("(x ? 1.5 : 2.5) - 0"));
+  EXPECT_EQ("(!x<\"a\")", Simplify("!!(!x < 'a')"));
+
+  // Integers too, unless the result is a number
+  EXPECT_EQ("(x?1:2)", Simplify("(x ? 1 : 2) * 1"));
+  EXPECT_EQ("(x?1:2)", Simplify("(x ? 1 : 2) - 0"));
+  EXPECT_EQ("((x?1:2)/1)", Simplify("(x ? 1 : 2) / 1"));
+  EXPECT_EQ("((x?1:2)*1)", Simplify("(x ? 1 : 2) * 1.0"));
+
+  // Only numbers are left alone by these
+  EXPECT_EQ("(x*1)", Simplify("x * 1"));
+  EXPECT_EQ("(b*1)", Simplify("b * 1"));
+  EXPECT_EQ("!!x", Simplify("!!x"));
+  EXPECT_EQ("((x>1)*1)", Simplify("(x > 1) * 1"));
+
+  // x + 0 turns -0 into +0, and x - -0 does the same
+  EXPECT_EQ("((x?1.5:2.5)+0)", Simplify("(x ? 1.5 : 2.5) + 0"));
+  EXPECT_EQ("((x?1.5:2.5)--0)", Simplify("(x ? 1.5 : 2.5) - (-0.0)"));
+}
+
+TEST(Optimize, ConstantTernary) {
+  EXPECT_EQ("x", Simplify("1 < 2 ? x : y"));
+  EXPECT_EQ("y", Simplify("'' ? x : y"));
+  EXPECT_EQ("(x?1:2)", Simplify("x ? 1 : 2"));
+}
+
+TEST(Optimize, ConstantLogic) {
+  EXPECT_EQ("false", Simplify("0 && x"));
+  EXPECT_EQ("true", Simplify("'yes' || x"));
+  EXPECT_EQ("!x", Simplify("true && !x"));
+  EXPECT_EQ("(true&&x)", Simplify("true && x"));
+  EXPECT_EQ("(x||false)", Simplify("x || 1 < 0"));
+}
+
+TEST(Optimize, Sequences) {
+  EXPECT_EQ("x", Simplify("1, 2, x"));
+  EXPECT_EQ("x,3", Simplify("x, 1 + 2"));
+  EXPECT_EQ("3", Simplify("1, 2, 3"));
+}
+
+TEST(Optimize, Specializes) {
+  // The integer constants are converted to numbers first
+  std::unique_ptr<Expression> e(Compile("((x ? 1.5 : 2.5) + 1) * 2", true));
+  const NumberMultiply* multiply = dynamic_cast<NumberMultiply*>(e.get());
+  ASSERT_NE(nullptr, multiply);
+  EXPECT_EQ(Expression::OP_MULTIPLY, multiply->getOperator());
+  EXPECT_EQ(Expression::TYPE_NUMBER, multiply->getStaticType());
+  EXPECT_EQ("(((x?1.5:2.5)+1)*2)", Simplify("((x ? 1.5 : 2.5) + 1) * 2"));
+
+  e.reset(Compile("((x ? 1 : 2) + 1) << 2", true));
+  EXPECT_NE(nullptr, dynamic_cast<IntegerShiftLeft*>(e.get()));
+  EXPECT_EQ(Expression::TYPE_INTEGER, e->getStaticType());
+  e.reset(Compile("(x ? 1 : 2) / 2", true));
+  EXPECT_NE(nullptr, dynamic_cast<IntegerDivide*>(e.get()));
+  EXPECT_EQ(Expression::TYPE_NUMBER, e->getStaticType());
+
+  e.reset(Compile("(x ? 'a' : 'b') + (!x + 'b')", true));
+  EXPECT_NE(nullptr, dynamic_cast<StringConcat*>(e.get()));
+
+  e.reset(Compile("(!x < 'a') != (!x > 'b')", true));
+  EXPECT_NE(nullptr, dynamic_cast<BoolNotEqual*>(e.get()));
+
+  e.reset(Compile("-'1' <= 'a' + !x", true));
+  EXPECT_EQ(nullptr, dynamic_cast<StringLessEqual*>(e.get()));
+
+  // Only when optimizing, and only when the types are known
+  e.reset(Compile("((x ? 1.5 : 2.5) + 1) * 2", false));
+  EXPECT_EQ(nullptr, dynamic_cast<NumberMultiply*>(e.get()));
+  e.reset(Compile("x * 2", true));
+  EXPECT_EQ(nullptr, dynamic_cast<NumberMultiply*>(e.get()));
+  e.reset(Compile("!x + 1", true));
+  EXPECT_EQ(nullptr, dynamic_cast<IntegerAdd*>(e.get()));
+}
+
+TEST(Optimize, Concatenates) {
+  std::unique_ptr<Expression> e(Compile("'a' + x + 'b' + (x + 1)", true));
+  const ConcatExpression* concat = dynamic_cast<ConcatExpression*>(e.get());
+  ASSERT_NE(nullptr, concat);
+  EXPECT_EQ(4, concat->getCount());
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, concat->getStaticType());
+  EXPECT_EQ("(((\"a\"+x)+\"b\")+(x+1))", Simplify("'a' + x + 'b' + (x + 1)"));
+
+  // The chain starts at the first + on a string
+  e.reset(Compile("x + 1 + 'a' + !x + 2", true));
+  concat = dynamic_cast<ConcatExpression*>(e.get());
+  ASSERT_NE(nullptr, concat);
+  EXPECT_EQ(4, concat->getCount());
+  EXPECT_EQ("((((x+1)+\"a\")+!x)+2)", Simplify("x + 1 + 'a' + !x + 2"));
+
+  e.reset(Compile("'a' + !x + 'b'", true));
+  EXPECT_NE(nullptr, dynamic_cast<ConcatExpression*>(e.get()));
+  EXPECT_EQ(Expression::TYPE_STRING, e->getStaticType());
+
+  // A single + isn't a chain, and neither is a + that isn't on strings
+  e.reset(Compile("'a' + x", true));
+  EXPECT_EQ(nullptr, dynamic_cast<ConcatExpression*>(e.get()));
+  e.reset(Compile("x + 1 + 2", true));
+  EXPECT_EQ(nullptr, dynamic_cast<ConcatExpression*>(e.get()));
+  e.reset(Compile("1 + 2 + 'a' + x", true));
+  EXPECT_EQ(nullptr, dynamic_cast<ConcatExpression*>(e.get()));
+
+  // Only when optimizing
+  e.reset(Compile("'a' + x + 'b'", false));
+  EXPECT_EQ(nullptr, dynamic_cast<ConcatExpression*>(e.get()));
+
+  // Long chains are one node
+  std::string text = "'start'";
+  for (int i = 0; i < 500; i++) {
+    text += (i % 2) ? " + '-'" : " + x";
+  }
+  e.reset(Compile(text, true));
+  concat = dynamic_cast<ConcatExpression*>(e.get());
+  ASSERT_NE(nullptr, concat);
+  EXPECT_EQ(501, concat->getCount());
+  ExecutionContext context(1);
+  context.set(0, Expression::Value(int64_t(7)));
+  const std::string result = e->evaluate(context).getString();
+  EXPECT_EQ(5 + 500, int(result.size()));
+  EXPECT_EQ("start7-7-", result.substr(0, 9));
+}
+
+TEST(Optimize, StaticTypesAfterSimplifying) {
+  // The ternary's type is only known once the test is folded
+  const char* text = "(1 < 2 ? (x ? 1.5 : 2.5) : 'a') + 1";
+  std::unique_ptr<Expression> e(Compile(text, false));
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e->getStaticType());
+  e.reset(Compile(text, true));
+  EXPECT_EQ(Expression::TYPE_NUMBER, e->getStaticType());
+  EXPECT_NE(nullptr, dynamic_cast<NumberAdd*>(e.get()));
+}
+
+TEST(Optimize, StaticTypes) {
+  struct {
+    const char* text;
+    Expression::Type type;
+  } cases[] = {
+    { "1", Expression::TYPE_INTEGER },
+    { "1.5", Expression::TYPE_NUMBER },
+    { "'a'", Expression::TYPE_STRING },
+    { "true", Expression::TYPE_BOOL },
+    { "x", Expression::TYPE_UNKNOWN },
+    { "-x", Expression::TYPE_UNKNOWN },
+    { "-1", Expression::TYPE_INTEGER },
+    { "-'1'", Expression::TYPE_NUMBER },
+    { "-true", Expression::TYPE_NUMBER },
+    { "!x", Expression::TYPE_BOOL },
+    { "~x", Expression::TYPE_UNKNOWN },
+    { "~'1'", Expression::TYPE_NUMBER },
+    { "~1", Expression::TYPE_INTEGER },
+    { "~true", Expression::TYPE_BOOL },
+    { "x + 1", Expression::TYPE_UNKNOWN },
+    { "-'1' + 1", Expression::TYPE_NUMBER },
+    { "true + 1", Expression::TYPE_INTEGER },
+    { "1 / 1", Expression::TYPE_NUMBER },
+    { "1.5 / 1", Expression::TYPE_NUMBER },
+    { "1 << 2", Expression::TYPE_INTEGER },
+    { "!x + 'a'", Expression::TYPE_STRING },
+    { "!x < 'a'", Expression::TYPE_BOOL },
+    { "x < 1", Expression::TYPE_UNKNOWN },
+    { "x ? 1 : 2", Expression::TYPE_INTEGER },
+    { "x ? 1 : 2.5", Expression::TYPE_UNKNOWN },
+    { "x ? 1 : 'a'", Expression::TYPE_UNKNOWN },
+    { "x, 'a'", Expression::TYPE_STRING },
+  };
+
+  for (const auto& c : cases) {
+    std::unique_ptr<Expression> e(Compile(c.text, false));
+    EXPECT_EQ(c.type, e->getStaticType()) << c.text;
+  }
+}
+
+TEST(Optimize, SameResults) {
+  const char* const texts[] = {
+    "(3600 * 24) * x",
+    "'prefix' + 'suffix' + x",
+    "-x + 0",
+    "-x * 1",
+    "-(x * 0)",
+    "-(x * 0) - 0",
+    "!!(x < 3)",
+    "x ? 1 + 1 : 'two'",
+    "true ? x : 1/0",
+    "1, 2, x",
+    "true + true",
+    "x + (true + true)",
+    "'a' - 'b'",
+    "1 += 2",
+    "1 < 2 ? 3 : true - true",
+    "false && 'a' * 2",
+    "true && 'a' * 2",
+    "x && 1 + 2",
+    "1 && x",
+    "0 || -x",
+    "(-x + 1) * 2 - -x / 4",
+    "(-x < 0) == (-x <= 3)",
+    "(-x + 'a') + (-x + 'b')",
+    "(-x + 'a') < (-x + 'b')",
+    "-x / (x - x)",
+    "unset * 1",
+    "-unset * 1",
+    "(x ? 1 : 2) * 1",
+    "(x ? 1 : 2) / 1",
+    "(x ? 1.5 : 2.5) * 1",
+    "x * 2 + 0.5",
+    "x & 0xff | 1 << 40",
+    "0x7fffffffffffffff + 1",
+    "7 % 0",
+    "1.5 % 0",
+    "x % 0",
+    "x % -1",
+    "(x - 2147483646) % -1",
+    "'a' + x + 'b' + x",
+    "x + 'a' + 1 + 2.5 + true",
+    "x + 1 + 'a' + x",
+    "'a' + unset + 'b'",
+    "unset + 'a' + 'b'",
+    "'a' + x + (1 + 2) + x",
+    "'a' + (x + 'b' + x) + 'c'",
+    "'a' + x + (true + true) + x",
+    "'a' + x + 'b' == 'a' + x + 'b'",
+    "(x ? 'a' : 'b') + x + 0x7fffffffffffffff",
+  };
+
+  const Expression::Value xs[] = {
+    Expression::Value(-2.0), Expression::Value(0.0), Expression::Value(5.0),
+    Expression::Value(int64_t(-2)), Expression::Value(int64_t(5)),
+  };
+  for (const Expression::Value& x : xs) {
+    ExecutionContext e(2);
+    e.set(0, x);
+    for (const char* text : texts) {
+      ExpectSameResult(text, e);
+    }
+  }
+}
+
+TEST(Optimize, ErrorsWaitForEvaluation) {
+  EXPECT_EQ("x,(true+true)", Simplify("x, true + true"));
+
+  std::unique_ptr<Expression> e(Compile("x, true + true", true));
+  ExecutionContext context(1);
+  EXPECT_THROW(e->evaluate(context), Exception);
+}
+
+TEST(Optimize, StrictReportsErrors) {
+  EXPECT_THROW(Compile("x, true + true", true, true), Exception);
+  EXPECT_THROW(Compile("x ? 'a' - 'b' : 1", true, true), Exception);
+  EXPECT_THROW(Compile("1 += 2", true, true), Exception);
+
+  // Branches that are never taken aren't checked
+  std::unique_ptr<Expression> e(Compile("true ? x : 'a' - 'b'", true, true));
+  EXPECT_EQ(Expression::TYPE_UNKNOWN, e->getStaticType());
+}
+
+TEST(Optimize, Backends) {
+  std::istringstream s("(3600 * 24) * x + 1 * 2");
+  Tokenizer tokenizer(new TextSource(s));
+  tokenizer.next();
+
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = true;
+  options.backend = Expression::BACKEND_BYTECODE;
+  std::unique_ptr<Expression> e(Expression::compile(tokenizer, options));
+
+  std::ostringstream out;
+  out << *e;
+  EXPECT_EQ("((86400*x)+2)", out.str());
+
+  ExecutionContext context(symbols);
+  context.set(0, Expression::Value(2.0));
+  EXPECT_EQ(172802, e->evaluate(context).getNumber());
+}
@@ -0,0 +1,212 @@
+#include "parallel.h"
+#include "exception.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+using namespace std;
+
+ThreadPool::ThreadPool(int threads) : queued(0), stopping(false) {
+  PRECONDITION(threads >= 0);
+  if (threads == 0) {
+    threads = max(1u, thread::hardware_concurrency());
+  }
+
+  for (int i = 0; i < threads; i++) {
+    queues.push_back(unique_ptr<Queue>(new Queue));
+  }
+  for (int i = 0; i < threads; i++) {
+    workers.push_back(thread(&ThreadPool::work, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::parallelFor(int count, int grain,
+                             const function<void(int, int)>& body) {
+  PRECONDITION(count >= 0);
+  PRECONDITION(grain > 0);
+  if (count == 0) return;
+
+  const int chunks = count / grain + ((count % grain) != 0);
+  Job job(body, chunks);
+
+  // Deal the chunks out in contiguous runs, one run per queue
+  const int n = queues.size();
+  for (int q = 0; q < n; q++) {
+    const int first = int64_t(chunks) * q / n;
+    const int last = int64_t(chunks) * (q + 1) / n;
+    if (first == last) continue;
+
+    lock_guard<mutex> guard(queues[q]->lock);
+    for (int chunk = first; chunk < last; chunk++) {
+      const int64_t begin = int64_t(chunk) * grain;
+      const Task task = { &job, chunk, int(begin),
+                          int(min<int64_t>(count, begin + grain)) };
+      queues[q]->tasks.push_back(task);
+    }
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    queued += chunks;
+  }
+  wake.notify_all();
+
+  // Help out until there's nothing left to take, then wait for the chunks
+  // still running on the workers
+  Task task;
+  while (takeTask(0, task)) {
+    runTask(task);
+  }
+
+  {
+    unique_lock<mutex> guard(job.lock);
+    job.finished.wait(guard, [&job] { return job.pending == 0; });
+  }
+
+  for (const exception_ptr& error : job.errors) {
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+}
+
+void ThreadPool::work(int index) {
+  Task task;
+  while (true) {
+    if (takeTask(index, task)) {
+      runTask(task);
+      continue;
+    }
+
+    unique_lock<mutex> guard(lock);
+    wake.wait(guard, [this] { return stopping || (queued > 0); });
+    if (stopping && (queued <= 0)) {
+      return;
+    }
+  }
+}
+
+bool ThreadPool::takeTask(int index, Task& task) {
+  const int n = queues.size();
+  for (int i = 0; i < n; i++) {
+    Queue& queue = *queues[(index + i) % n];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.tasks.empty()) continue;
+
+    // Our own queue from the front, in order; others' from the back
+    if (i == 0) {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    } else {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    }
+    --queued;
+    return true;
+  }
+
+  return false;
+}
+
+void ThreadPool::runTask(const Task& task) {
+  Job& job = *task.job;
+  try {
+    job.body(task.begin, task.end);
+  } catch (...) {
+    job.errors[task.chunk] = current_exception();
+  }
+
+  // The caller may return as soon as 'pending' is 0, so this must be the
+  // last use of the job
+  lock_guard<mutex> guard(job.lock);
+  if (--job.pending == 0) {
+    job.finished.notify_all();
+  }
+}
+
+namespace {
+
+// Put the columns end to end. An unboxed layout is kept if every part
+// has it.
+void concatenate(const vector<Column>& parts, Column& result) {
+  int total = 0;
+  bool same = true;
+  for (const Column& part : parts) {
+    total += part.size();
+    same = same && (part.getLayout() == parts[0].getLayout());
+  }
+
+  if (same && (parts[0].getLayout() == Column::NUMBERS)) {
+    result.reset(Column::NUMBERS, total);
+    double* out = result.getNumbers();
+    for (const Column& part : parts) {
+      out = copy(part.getNumbers(), part.getNumbers() + part.size(), out);
+    }
+  } else if (same && (parts[0].getLayout() == Column::INTEGERS)) {
+    result.reset(Column::INTEGERS, total);
+    int64_t* out = result.getIntegers();
+    for (const Column& part : parts) {
+      out = copy(part.getIntegers(), part.getIntegers() + part.size(), out);
+    }
+  } else if (same && (parts[0].getLayout() == Column::BOOLS)) {
+    result.reset(Column::BOOLS, total);
+    uint8_t* out = result.getBools();
+    for (const Column& part : parts) {
+      out = copy(part.getBools(), part.getBools() + part.size(), out);
+    }
+  } else {
+    result.clear();
+    for (const Column& part : parts) {
+      for (int i = 0; i < part.size(); i++) {
+        result.append(part.get(i));
+      }
+    }
+  }
+}
+
+}  // namespace
+
+void evaluateParallel(const Expression& expr, const ColumnBatch& batch,
+                      Column& result, ThreadPool& pool, int grain) {
+  PRECONDITION(grain > 0);
+  const int count = batch.getRowCount();
+  if (count == 0) {
+    result.clear();
+    return;
+  }
+
+  vector<Column> parts(count / grain + ((count % grain) != 0));
+  pool.parallelFor(count, grain, [&](int begin, int end) {
+      vector<int> rows(end - begin);
+      for (int i = begin; i < end; i++) {
+        rows[i - begin] = i;
+      }
+      expr.evaluateRows(batch, rows, parts[begin / grain]);
+    });
+
+  concatenate(parts, result);
+}
+
+void evaluateParallel(const Expression& expr,
+                      vector<ExecutionContext>& contexts,
+                      vector<Expression::Value>& results,
+                      ThreadPool& pool, int grain) {
+  results.resize(contexts.size());
+  pool.parallelFor(contexts.size(), grain, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        results[i] = expr.evaluate(contexts[i]);
+      }
+    });
+}
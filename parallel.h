@@ -0,0 +1,106 @@
+#if !defined PARALLEL_H
+#define      PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "expression.h"
+
+// A fixed set of worker threads that run ranges of a loop. Each worker has
+// its own queue of chunks; it takes from the front of its own, and when
+// that's empty steals from the back of the others'. A parallelFor spreads
+// its chunks over the queues in contiguous runs, so each worker starts on
+// neighbouring chunks and only steals once it runs out.
+//
+// Any thread may call parallelFor, including a body running on the pool.
+// The calling thread runs chunks too while it waits.
+class ThreadPool {
+public:
+  // Start 'threads' workers, or one per hardware thread if it's 0
+  explicit ThreadPool(int threads = 0);
+
+  // Waits for the workers to finish what they're running
+  ~ThreadPool();
+
+  int size() const { return workers.size(); }
+
+  // Call body(begin, end) for consecutive ranges of at most 'grain' covering
+  // [0, count), on the workers and the calling thread, and wait for all of
+  // them. If any throw, the exception from the earliest range is rethrown
+  // once they've all finished.
+  void parallelFor(int count, int grain,
+                   const std::function<void(int, int)>& body);
+
+private:
+  // One parallelFor call
+  struct Job {
+    Job(const std::function<void(int, int)>& inBody, int chunks)
+        : body(inBody), pending(chunks), errors(chunks) {}
+
+    const std::function<void(int, int)>& body;
+    std::mutex lock;
+    std::condition_variable finished;
+    int pending;  // Chunks not yet run; guarded by 'lock'
+    std::vector<std::exception_ptr> errors;  // One per chunk
+  };
+
+  struct Task {
+    Job* job;
+    int chunk;
+    int begin;
+    int end;
+  };
+
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void work(int index);
+
+  // Take a task, from queue 'index' first and then from the others.
+  // Returns false if every queue is empty.
+  bool takeTask(int index, Task&);
+  void runTask(const Task&);
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<Queue> > queues;
+
+  // Workers sleep on 'wake' while there's nothing queued
+  std::mutex lock;
+  std::condition_variable wake;
+  std::atomic<int> queued;
+  bool stopping;
+};
+
+// Parallel versions of batch evaluation, which split the rows into chunks
+// of 'grain' and evaluate them on the pool. The results are in row order,
+// and the same as evaluating serially, whichever order the chunks run in.
+// If rows fail, the error from the earliest failing chunk is thrown.
+//
+// Expressions are safe to evaluate on many threads at once (see
+// Expression::evaluate), as are the values they share.
+
+// As Expression::evaluateBatch
+void evaluateParallel(const Expression&, const ColumnBatch&, Column& result,
+                      ThreadPool&, int grain = 4096);
+
+// Evaluate the expression in each context, leaving the value for
+// contexts[i] in results[i]. Each context is only used by one thread.
+void evaluateParallel(const Expression&,
+                      std::vector<ExecutionContext>& contexts,
+                      std::vector<Expression::Value>& results,
+                      ThreadPool&, int grain = 256);
+
+#endif
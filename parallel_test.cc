@@ -0,0 +1,146 @@
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "exception.h"
+#include "expression.h"
+#include "parallel.h"
+#include "test_util.h"
+
+#include "gtest/gtest.h"
+
+TEST(ThreadPoolTest, RunsEveryIndexOnce) {
+  ThreadPool pool(4);
+  EXPECT_EQ(4, pool.size());
+
+  const int count = 10007;
+  std::vector<std::atomic<int> > seen(count);
+  for (auto& s : seen) {
+    s = 0;
+  }
+
+  pool.parallelFor(count, 13, [&](int begin, int end) {
+      EXPECT_LE(end - begin, 13);
+      for (int i = begin; i < end; i++) {
+        ++seen[i];
+      }
+    });
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(1, seen[i]) << i;
+  }
+
+  // Nothing to do
+  pool.parallelFor(0, 13, [](int, int) { FAIL(); });
+}
+
+TEST(ThreadPoolTest, DefaultSize) {
+  ThreadPool pool;
+  EXPECT_LT(0, pool.size());
+}
+
+TEST(ThreadPoolTest, ThrowsTheEarliestError) {
+  ThreadPool pool(3);
+  std::atomic<int> ran(0);
+  try {
+    pool.parallelFor(100, 1, [&](int begin, int) {
+        ++ran;
+        if (begin == 70 || begin == 30) {
+          throw Exception("chunk " + std::to_string(begin));
+        }
+      });
+    FAIL();
+  } catch (const Exception& e) {
+    EXPECT_STREQ("chunk 30", e.what());
+  }
+
+  // The other chunks still ran
+  EXPECT_EQ(100, ran);
+}
+
+TEST(ThreadPoolTest, Nested) {
+  ThreadPool pool(2);
+  std::atomic<int> total(0);
+  pool.parallelFor(8, 1, [&](int, int) {
+      pool.parallelFor(100, 10, [&](int begin, int end) {
+          total += end - begin;
+        });
+    });
+  EXPECT_EQ(800, total);
+}
+
+TEST(ParallelTest, BatchesMatchSerialEvaluation) {
+  const char* const texts[] = {
+    "x * 2 + 1",
+    "x > 5000 && s < 3",
+    "s + 1",
+    "x < 100 ? 'small' : x",
+  };
+
+  SymbolTable symbols;
+  ColumnBatch batch(20000);
+  FillBatch(symbols, batch);
+  ThreadPool pool(4);
+
+  for (const char* text : texts) {
+    for (auto backend : { Expression::BACKEND_TREE,
+                          Expression::BACKEND_BYTECODE }) {
+      std::unique_ptr<Expression> e(Compile(text, symbols, backend));
+
+      Column serial, parallel;
+      e->evaluateBatch(batch, serial);
+      evaluateParallel(*e, batch, parallel, pool, 1000);
+
+      ASSERT_EQ(serial.size(), parallel.size()) << text;
+      for (int i = 0; i < serial.size(); i++) {
+        ASSERT_EQ(Describe(serial.get(i)), Describe(parallel.get(i)))
+            << text << " row " << i;
+      }
+    }
+  }
+
+  // An empty batch
+  ColumnBatch empty(0);
+  Column result;
+  result.append(Expression::Value(1.0));
+  std::unique_ptr<Expression> e(Compile("x + 1", symbols));
+  evaluateParallel(*e, empty, result, pool);
+  EXPECT_EQ(0, result.size());
+}
+
+TEST(ParallelTest, BatchErrors) {
+  SymbolTable symbols;
+  ColumnBatch batch(5000);
+  FillBatch(symbols, batch);
+  ThreadPool pool(4);
+
+  // Strings can't be subtracted
+  std::unique_ptr<Expression> e(Compile("s - 1", symbols));
+  Column result;
+  EXPECT_THROW(e->evaluateBatch(batch, result), Exception);
+  EXPECT_THROW(evaluateParallel(*e, batch, result, pool, 100), Exception);
+}
+
+TEST(ParallelTest, Contexts) {
+  SymbolTable symbols;
+  std::unique_ptr<Expression> e(Compile("x * x + s", symbols));
+
+  std::vector<ExecutionContext> contexts;
+  for (int i = 0; i < 1000; i++) {
+    contexts.push_back(ExecutionContext(symbols));
+    contexts.back().set(0, Expression::Value(double(i)));
+    contexts.back().set(1, (i % 2) ? Expression::Value("!")
+                                   : Expression::Value(1.0));
+  }
+
+  ThreadPool pool(4);
+  std::vector<Expression::Value> results;
+  evaluateParallel(*e, contexts, results, pool, 10);
+
+  ASSERT_EQ(contexts.size(), results.size());
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(Describe(e->evaluate(contexts[i])), Describe(results[i]));
+  }
+}
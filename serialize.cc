@@ -0,0 +1,501 @@
+// Saving expressions to binary images (Expression::save) and loading them
+// back; see serialize.h.
+
+#include "serialize.h"
+#include "bytecode.h"
+#include "exception.h"
+#include "jit.h"
+#include "specialized.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <typeinfo>
+#include <unistd.h>
+
+using namespace std;
+
+static_assert(sizeof(ImageHeader) == 24, "ImageHeader must be packed");
+static_assert(sizeof(ImageNode) == 16, "ImageNode must be packed");
+
+namespace {
+
+ImageNode makeNode(ImageNode::Kind kind) {
+  ImageNode node;
+  memset(&node, 0, sizeof(node));
+  node.kind = kind;
+  return node;
+}
+
+void throwBadImage(const string& why) {
+  throw Exception("Bad expression image: " + why);
+}
+
+bool isUnary(int op) {
+  return (op >= Expression::OP_NOT) && (op <= Expression::OP_POSITIVE);
+}
+
+bool isBinary(int op) {
+  return (op >= Expression::OP_MULTIPLY) && (op <= Expression::OP_RIGHTEQ) &&
+      (op != Expression::OP_ANDAND) && (op != Expression::OP_OROR) &&
+      (op != Expression::OP_TERNARY);
+}
+
+bool isLogical(int op) {
+  return (op == Expression::OP_ANDAND) || (op == Expression::OP_OROR);
+}
+
+}  // namespace
+
+// Saving
+
+int Expression::save(ExpressionWriter&) const {
+  throw Exception("This kind of expression can't be saved");
+}
+
+int ConstantExpression::save(ExpressionWriter& writer) const {
+  ImageNode node = makeNode(ImageNode::CONSTANT);
+  node.type = value.getType();
+  switch (value.getType()) {
+    case TYPE_NUMBER:
+      node.number = value.getNumber();
+      break;
+    case TYPE_INTEGER:
+      node.integer = value.getInteger();
+      break;
+    case TYPE_BOOL:
+      node.a = value.getBool();
+      break;
+    case TYPE_STRING:
+      node.a = writer.addString(value.getString());
+      node.more.b = value.getString().size();
+      break;
+    default:
+      break;
+  }
+  return writer.addNode(node);
+}
+
+int VariableExpression::save(ExpressionWriter& writer) const {
+  ImageNode node = makeNode(ImageNode::VARIABLE);
+  node.a = writer.addString(name);
+  node.more.b = name.size();
+  return writer.addNode(node);
+}
+
+int UnaryOperator::save(ExpressionWriter& writer) const {
+  ImageNode node = makeNode(ImageNode::UNARY);
+  node.op = op;
+  node.a = child->save(writer);
+  return writer.addNode(node);
+}
+
+int BinaryOperator::save(ExpressionWriter& writer) const {
+  // The specialized subclasses are rebuilt from the operand types
+  ImageNode node = makeNode((typeid(*this) == typeid(BinaryOperator))
+                            ? ImageNode::BINARY : ImageNode::SPECIALIZED);
+  node.op = op;
+  node.a = left->save(writer);
+  node.more.b = right->save(writer);
+  return writer.addNode(node);
+}
+
+int LogicalOperator::save(ExpressionWriter& writer) const {
+  ImageNode node = makeNode(ImageNode::LOGICAL);
+  node.op = op;
+  node.a = left->save(writer);
+  node.more.b = right->save(writer);
+  return writer.addNode(node);
+}
+
+int TernaryOperator::save(ExpressionWriter& writer) const {
+  ImageNode node = makeNode(ImageNode::TERNARY);
+  node.a = test->save(writer);
+  node.more.b = positive->save(writer);
+  node.more.c = negative->save(writer);
+  return writer.addNode(node);
+}
+
+int SequenceExpression::save(ExpressionWriter& writer) const {
+  vector<int> saved;
+  for (const Expression* sub : subs) {
+    saved.push_back(sub->save(writer));
+  }
+
+  ImageNode node = makeNode(ImageNode::SEQUENCE);
+  node.a = writer.addChildren(saved);
+  node.more.b = saved.size();
+  return writer.addNode(node);
+}
+
+int ConcatExpression::save(ExpressionWriter& writer) const {
+  vector<int> saved;
+  for (const Expression* operand : operands) {
+    saved.push_back(operand->save(writer));
+  }
+
+  ImageNode node = makeNode(ImageNode::CONCAT);
+  node.a = writer.addChildren(saved);
+  node.more.b = saved.size();
+  return writer.addNode(node);
+}
+
+int BytecodeExpression::save(ExpressionWriter& writer) const {
+  return tree->save(writer);
+}
+
+ExpressionWriter::ExpressionWriter() {}
+
+int ExpressionWriter::add(const Expression& expr) {
+  roots.push_back(expr.save(*this));
+  return roots.size() - 1;
+}
+
+int ExpressionWriter::addNode(const ImageNode& node) {
+  nodes.push_back(node);
+  return nodes.size() - 1;
+}
+
+uint32_t ExpressionWriter::addString(const string& s) {
+  auto it = stringOffsets.find(s);
+  if (it != stringOffsets.end()) {
+    return it->second;
+  }
+
+  const uint32_t offset = strings.size();
+  strings += s;
+  stringOffsets[s] = offset;
+  return offset;
+}
+
+uint32_t ExpressionWriter::addChildren(const vector<int>& indexes) {
+  const uint32_t offset = children.size();
+  children.insert(children.end(), indexes.begin(), indexes.end());
+  return offset;
+}
+
+string ExpressionWriter::getImage() const {
+  ImageHeader header;
+  memcpy(header.magic, "EXPR", 4);
+  header.version = kImageVersion;
+  header.rootCount = roots.size();
+  header.nodeCount = nodes.size();
+  header.childCount = children.size();
+  header.stringBytes = strings.size();
+
+  string image;
+  image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  image.append(reinterpret_cast<const char*>(roots.data()),
+               roots.size() * sizeof(uint32_t));
+  image.append(reinterpret_cast<const char*>(nodes.data()),
+               nodes.size() * sizeof(ImageNode));
+  image.append(reinterpret_cast<const char*>(children.data()),
+               children.size() * sizeof(uint32_t));
+  image.append(strings);
+  return image;
+}
+
+// Loading
+
+ExpressionImage::ExpressionImage(const char* inData, size_t inLength)
+    : data(inData), length(inLength), mapping(nullptr), mapping_size(0) {
+  PRECONDITION(data != nullptr || length == 0);
+  if (length < sizeof(header)) {
+    throwBadImage("too short");
+  }
+
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, "EXPR", 4) != 0) {
+    throwBadImage("not an image");
+  }
+  if ((header.version < 1) || (header.version > kImageVersion)) {
+    throwBadImage("unknown version " + to_string(header.version));
+  }
+
+  // The sections must fill the image exactly
+  const uint64_t size = sizeof(header) +
+      uint64_t(header.rootCount) * sizeof(uint32_t) +
+      uint64_t(header.nodeCount) * sizeof(ImageNode) +
+      uint64_t(header.childCount) * sizeof(uint32_t) +
+      header.stringBytes;
+  if (size != length) {
+    throwBadImage("wrong size");
+  }
+
+  roots = data + sizeof(header);
+  nodes = roots + header.rootCount * sizeof(uint32_t);
+  children = nodes + header.nodeCount * sizeof(ImageNode);
+  strings = children + header.childCount * sizeof(uint32_t);
+}
+
+ExpressionImage::~ExpressionImage() {
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_size);
+  }
+}
+
+ExpressionImage* ExpressionImage::openFile(const string& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  SystemException::check(fd, "Can't open " + path);
+
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    const int error = errno;
+    close(fd);
+    throw SystemException(error, "Can't read " + path);
+  }
+
+  // An empty file can't be mapped, and isn't an image anyway
+  const size_t size = info.st_size;
+  void* mapping = nullptr;
+  if (size > 0) {
+    mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      const int error = errno;
+      close(fd);
+      throw SystemException(error, "Can't map " + path);
+    }
+  }
+  close(fd);
+
+  try {
+    ExpressionImage* image = new ExpressionImage(
+        static_cast<const char*>(mapping), size);
+    image->mapping = mapping;
+    image->mapping_size = size;
+    return image;
+  } catch (...) {
+    if (mapping != nullptr) {
+      munmap(mapping, size);
+    }
+    throw;
+  }
+}
+
+uint32_t ExpressionImage::getRoot(int i) const {
+  uint32_t root;
+  memcpy(&root, roots + i * sizeof(uint32_t), sizeof(root));
+  return root;
+}
+
+ImageNode ExpressionImage::getNode(uint32_t i) const {
+  ImageNode node;
+  memcpy(&node, nodes + i * sizeof(ImageNode), sizeof(node));
+  return node;
+}
+
+uint32_t ExpressionImage::getChild(uint32_t i) const {
+  uint32_t child;
+  memcpy(&child, children + i * sizeof(uint32_t), sizeof(child));
+  return child;
+}
+
+string ExpressionImage::getString(uint32_t offset, uint32_t count) const {
+  if (uint64_t(offset) + count > header.stringBytes) {
+    throwBadImage("string out of range");
+  }
+  return string(strings + offset, count);
+}
+
+Expression* ExpressionImage::load(int i,
+                                  const Expression::CompileOptions& options)
+    const {
+  PRECONDITION((i >= 0) && (i < size()));
+
+  // The expression's nodes are the ones after the previous expression's
+  // top node, up to its own
+  const uint32_t first = (i == 0) ? 0 : getRoot(i - 1) + 1;
+  const uint32_t last = getRoot(i);
+  if ((last >= header.nodeCount) || (first == 0 && i > 0) ||
+      (first > last)) {
+    throwBadImage("expression " + to_string(i) + " out of range");
+  }
+
+  // Each node built so far, and whether it's been given to a parent. Every
+  // node but the last must be, exactly once, for the nodes to be a tree.
+  vector<Expression*> built;
+  vector<bool> taken;
+  built.reserve(last - first + 1);
+  taken.reserve(last - first + 1);
+
+  // Each node's children, and (until it's built, when they're still ours
+  // to free) the expressions for them
+  vector<uint32_t> kids;
+  vector<Expression*> operands;
+
+  try {
+    for (uint32_t n = first; n <= last; n++) {
+      const ImageNode node = getNode(n);
+
+      // The children, which must be earlier nodes that don't have a parent
+      kids.clear();
+      operands.clear();
+      switch (node.kind) {
+        case ImageNode::UNARY:
+          kids.push_back(node.a);
+          break;
+        case ImageNode::BINARY:
+        case ImageNode::SPECIALIZED:
+        case ImageNode::LOGICAL:
+          kids.push_back(node.a);
+          kids.push_back(node.more.b);
+          break;
+        case ImageNode::TERNARY:
+          kids.push_back(node.a);
+          kids.push_back(node.more.b);
+          kids.push_back(node.more.c);
+          break;
+        case ImageNode::SEQUENCE:
+        case ImageNode::CONCAT:
+          if ((node.more.b == 0) ||
+              (uint64_t(node.a) + node.more.b > header.childCount)) {
+            throwBadImage("sequence out of range");
+          }
+          for (uint32_t k = 0; k < node.more.b; k++) {
+            kids.push_back(getChild(node.a + k));
+          }
+          break;
+      }
+
+      Expression* expr = nullptr;
+      try {
+        for (uint32_t kid : kids) {
+          if ((kid < first) || (kid >= n) || taken[kid - first]) {
+            throwBadImage("node " + to_string(n) + " isn't in a tree");
+          }
+          taken[kid - first] = true;
+          operands.push_back(built[kid - first]);
+        }
+
+        switch (node.kind) {
+          case ImageNode::CONSTANT:
+            switch (node.type) {
+              case Expression::TYPE_NUMBER:
+                expr = new (options.arena) ConstantExpression(node.number);
+                break;
+              case Expression::TYPE_INTEGER:
+                expr = new (options.arena) ConstantExpression(
+                    Expression::Value(node.integer));
+                break;
+              case Expression::TYPE_BOOL:
+                expr = new (options.arena) ConstantExpression(node.a != 0);
+                break;
+              case Expression::TYPE_STRING:
+                expr = new (options.arena) ConstantExpression(
+                    getString(node.a, node.more.b));
+                break;
+              case Expression::TYPE_UNKNOWN:
+                expr = new (options.arena) ConstantExpression(
+                    Expression::Value());
+                break;
+              default:
+                throwBadImage("unknown constant type");
+            }
+            break;
+
+          case ImageNode::VARIABLE: {
+            if (options.symbols == nullptr) {
+              throw Exception("Loading variables needs a symbol table");
+            }
+            const string name = getString(node.a, node.more.b);
+            expr = new (options.arena) VariableExpression(
+                name, options.symbols->add(name));
+            break;
+          }
+
+          case ImageNode::UNARY:
+            if (!isUnary(node.op)) {
+              throwBadImage("unknown unary operator");
+            }
+            expr = new (options.arena) UnaryOperator(
+                Expression::Operator(node.op), operands[0]);
+            break;
+
+          case ImageNode::BINARY:
+            if (!isBinary(node.op)) {
+              throwBadImage("unknown binary operator");
+            }
+            expr = new (options.arena) BinaryOperator(
+                Expression::Operator(node.op), operands[0], operands[1]);
+            break;
+
+          case ImageNode::SPECIALIZED:
+            if (isBinary(node.op)) {
+              expr = specializeBinary(Expression::Operator(node.op),
+                                      operands[0], operands[1],
+                                      options.arena);
+            }
+            if (expr == nullptr) {
+              throwBadImage("no specialized operator for the operands");
+            }
+            break;
+
+          case ImageNode::LOGICAL:
+            if (!isLogical(node.op)) {
+              throwBadImage("unknown logical operator");
+            }
+            expr = new (options.arena) LogicalOperator(
+                Expression::Operator(node.op), operands[0], operands[1]);
+            break;
+
+          case ImageNode::TERNARY:
+            expr = new (options.arena) TernaryOperator(
+                operands[0], operands[1], operands[2]);
+            break;
+
+          case ImageNode::SEQUENCE: {
+            SequenceExpression* seq = new (options.arena) SequenceExpression;
+            for (Expression* operand : operands) {
+              seq->append(operand);
+            }
+            expr = seq;
+            break;
+          }
+
+          case ImageNode::CONCAT: {
+            ConcatExpression* concat =
+                new (options.arena) ConcatExpression;
+            for (Expression* operand : operands) {
+              concat->append(operand);
+            }
+            expr = concat;
+            break;
+          }
+
+          default:
+            throwBadImage("unknown node kind");
+        }
+      } catch (...) {
+        for (size_t k = 0; k < operands.size(); k++) {
+          taken[kids[k] - first] = false;
+        }
+        throw;
+      }
+
+      built.push_back(expr);
+      taken.push_back(false);
+    }
+
+    for (size_t k = 0; k + 1 < built.size(); k++) {
+      if (!taken[k]) {
+        throwBadImage("node " + to_string(first + k) + " isn't in a tree");
+      }
+    }
+  } catch (...) {
+    for (size_t k = 0; k < built.size(); k++) {
+      if (!taken[k]) {
+        delete built[k];
+      }
+    }
+    throw;
+  }
+
+  Expression* result = built.back();
+  if (options.backend == Expression::BACKEND_BYTECODE) {
+    result = new (options.arena) BytecodeExpression(result);
+  } else if (options.backend == Expression::BACKEND_NATIVE) {
+    result = new (options.arena) NativeExpression(result);
+  }
+  return result;
+}
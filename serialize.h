@@ -0,0 +1,150 @@
+#if !defined SERIALIZE_H
+#define      SERIALIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expression.h"
+
+// A binary image of compiled expressions, so that they can be saved once
+// and loaded later without tokenizing or parsing. The image holds any
+// number of expressions, as saved: optimized trees load optimized, with
+// the same specialized operators.
+//
+// The image refers to everything by index or offset, never by address, so
+// it can be mapped straight from a file and read in place. Loading one
+// expression only reads its own nodes. The layout (all integers in the
+// writer's byte order, which must be little-endian):
+//
+//   ImageHeader
+//   uint32_t roots[rootCount]        Index of each expression's top node
+//   ImageNode nodes[nodeCount]       Children before their parents
+//   uint32_t children[childCount]    Node indexes, for sequences
+//   char strings[stringBytes]        String constants and variable names
+//
+// An expression's nodes are the ones after the previous expression's top
+// node, up to its own.
+
+struct ImageHeader {
+  char magic[4];          // "EXPR"
+  uint32_t version;       // kImageVersion
+  uint32_t rootCount;
+  uint32_t nodeCount;
+  uint32_t childCount;
+  uint32_t stringBytes;
+};
+
+struct ImageNode {
+  enum Kind {
+    CONSTANT,     // type: an Expression::Type. a: the Boolean; a, b: the
+                  // string's offset and length; number or integer: the
+                  // number
+    VARIABLE,     // a, b: the name's offset and length
+    UNARY,        // op; a: the operand
+    BINARY,       // op; a, b: the operands
+    SPECIALIZED,  // The same, for an operator from specialized.h
+    LOGICAL,      // op: && or ||; a, b: the operands
+    TERNARY,      // a, b, c: the test and branches
+    SEQUENCE,     // a, b: the offset and count of the children
+    CONCAT        // The same, for a ConcatExpression
+  };
+
+  uint8_t kind;
+  uint8_t op;     // An Expression::Operator
+  uint8_t type;
+  uint8_t unused;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    } more;
+    double number;
+    int64_t integer;
+  };
+};
+
+// Version 1 had no integer constants, and version 2 no concatenations;
+// their images still load
+const uint32_t kImageVersion = 3;
+
+// Builds an image. Expressions are added with add(); Expression::save
+// uses the rest.
+class ExpressionWriter {
+public:
+  ExpressionWriter();
+
+  // Save the expression (for bytecode, the tree it runs) and return its
+  // index in the image
+  int add(const Expression&);
+
+  // The image, with everything added so far
+  std::string getImage() const;
+
+  // Append a node and return its index
+  int addNode(const ImageNode&);
+
+  // Add the string (unless it's already there) and return its offset
+  uint32_t addString(const std::string&);
+
+  // Append the node indexes to the children and return the offset of the
+  // first
+  uint32_t addChildren(const std::vector<int>&);
+
+private:
+  std::vector<uint32_t> roots;
+  std::vector<ImageNode> nodes;
+  std::vector<uint32_t> children;
+  std::string strings;
+  std::unordered_map<std::string, uint32_t> stringOffsets;
+};
+
+// Reads expressions back from an image. The image is read in place and
+// only checked as far as its header up front; each expression's nodes are
+// checked as they're loaded, so a damaged image throws rather than giving
+// a broken tree.
+class ExpressionImage {
+public:
+  // Read the image in the buffer, which must outlive this
+  ExpressionImage(const char* data, size_t length);
+
+  ~ExpressionImage();
+
+  // Map the file into memory and read it in place. Throws if the file
+  // can't be opened or mapped.
+  static ExpressionImage* openFile(const std::string& path);
+
+  // The number of expressions
+  int size() const { return header.rootCount; }
+
+  // Build expression 'i'. The options say where it goes: variables are
+  // resolved in the symbol table (which is needed if there are any),
+  // nodes go in the arena, and the backend is used. The tree is loaded
+  // as it was saved; the optimize and strict options are ignored.
+  Expression* load(int i, const Expression::CompileOptions&) const;
+
+private:
+  ExpressionImage(const ExpressionImage&) = delete;
+  ExpressionImage& operator=(const ExpressionImage&) = delete;
+
+  uint32_t getRoot(int i) const;
+  ImageNode getNode(uint32_t i) const;
+  uint32_t getChild(uint32_t i) const;
+  std::string getString(uint32_t offset, uint32_t length) const;
+
+  const char* data;
+  size_t length;
+  ImageHeader header;
+  const char* roots;
+  const char* nodes;
+  const char* children;
+  const char* strings;
+
+  void* mapping;  // The image, if it came from a file
+  size_t mapping_size;
+};
+
+#endif
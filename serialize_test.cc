@@ -0,0 +1,222 @@
+#include <memory>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "arena.h"
+#include "bytecode.h"
+#include "exception.h"
+#include "expression.h"
+#include "serialize.h"
+#include "specialized.h"
+#include "test_util.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const char* const kTexts[] = {
+  "1",
+  "'text with \\'quotes\\''",
+  "true",
+  "x * 2 + y",
+  "-x + 1 < 2 == !flag",
+  "(x + 1) * 2 - -x / 4",
+  "name + '!' + name",
+  "x && y || !z",
+  "x ? 'yes' : y ? 1 : false",
+  "x, y + 1, 3",
+  "(3600 * 24) * x",
+  "(-x + 'a') + (-x + 'b')",
+  "(-x < 0) != (-x > 2)",
+  "x += 1",
+  "(x ? 0x7fffffffffffffff : 2) << 4 | 9007199254740993",
+};
+
+std::string Print(const Expression& e) {
+  std::ostringstream out;
+  out << e;
+  return out.str();
+}
+
+// Save every text, compiled with the options, in one image
+std::string SaveAll(const Expression::CompileOptions& options) {
+  ExpressionWriter writer;
+  for (const char* text : kTexts) {
+    std::unique_ptr<Expression> e(Compile(text, options));
+    writer.add(*e);
+  }
+  return writer.getImage();
+}
+
+}  // namespace
+
+TEST(SerializeTest, RoundTrip) {
+  for (bool optimize : { false, true }) {
+    SymbolTable symbols;
+    Expression::CompileOptions options;
+    options.symbols = &symbols;
+    options.optimize = optimize;
+
+    const std::string image = SaveAll(options);
+    ExpressionImage loaded(image.data(), image.size());
+    ASSERT_EQ(int(sizeof(kTexts) / sizeof(kTexts[0])), loaded.size());
+
+    // Loading into a fresh symbol table gives the same printed form, and
+    // the same values
+    SymbolTable fresh;
+    Expression::CompileOptions loadOptions;
+    loadOptions.symbols = &fresh;
+
+    for (int i = 0; i < loaded.size(); i++) {
+      std::unique_ptr<Expression> original(Compile(kTexts[i], options));
+      std::unique_ptr<Expression> e(loaded.load(i, loadOptions));
+      EXPECT_EQ(Print(*original), Print(*e)) << kTexts[i];
+      EXPECT_EQ(original->getStaticType(), e->getStaticType()) << kTexts[i];
+
+      ExecutionContext before(symbols), after(fresh);
+      const double x[] = { -1, 0, 2.5 };
+      for (double value : x) {
+        before.set(symbols.add("x"), Expression::Value(value));
+        after.set(fresh.add("x"), Expression::Value(value));
+        before.set(symbols.add("name"), Expression::Value("n"));
+        after.set(fresh.add("name"), Expression::Value("n"));
+        EXPECT_EQ(Outcome(*original, before), Outcome(*e, after))
+            << kTexts[i];
+      }
+    }
+  }
+}
+
+TEST(SerializeTest, KeepsSpecializedOperators) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.optimize = true;
+
+  std::unique_ptr<Expression> e(Compile("((x ? 1.5 : 2.5) + 1) * 2",
+                                       options));
+  ASSERT_NE(nullptr, dynamic_cast<NumberMultiply*>(e.get()));
+
+  ExpressionWriter writer;
+  EXPECT_EQ(0, writer.add(*e));
+  const std::string image = writer.getImage();
+  ExpressionImage loaded(image.data(), image.size());
+
+  std::unique_ptr<Expression> copy(loaded.load(0, options));
+  EXPECT_NE(nullptr, dynamic_cast<NumberMultiply*>(copy.get()));
+  EXPECT_EQ("(((x?1.5:2.5)+1)*2)", Print(*copy));
+
+  // and concatenations
+  e.reset(Compile("'a' + x + 'b' + x", options));
+  ASSERT_NE(nullptr, dynamic_cast<ConcatExpression*>(e.get()));
+  ExpressionWriter concatWriter;
+  concatWriter.add(*e);
+  const std::string concatImage = concatWriter.getImage();
+  ExpressionImage concatLoaded(concatImage.data(), concatImage.size());
+  copy.reset(concatLoaded.load(0, options));
+  EXPECT_NE(nullptr, dynamic_cast<ConcatExpression*>(copy.get()));
+  EXPECT_EQ(Print(*e), Print(*copy));
+}
+
+TEST(SerializeTest, LoadOptions) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.backend = Expression::BACKEND_BYTECODE;
+
+  // Bytecode saves its tree
+  std::unique_ptr<Expression> e(Compile("x * 2 + 1", options));
+  ExpressionWriter writer;
+  writer.add(*e);
+  const std::string image = writer.getImage();
+  ExpressionImage loaded(image.data(), image.size());
+
+  std::unique_ptr<Expression> tree(loaded.load(0, options));
+  EXPECT_NE(nullptr, dynamic_cast<BytecodeExpression*>(tree.get()));
+  EXPECT_EQ("((x*2)+1)", Print(*tree));
+
+  Expression::CompileOptions treeOptions;
+  treeOptions.symbols = &symbols;
+  tree.reset(loaded.load(0, treeOptions));
+  EXPECT_EQ(nullptr, dynamic_cast<BytecodeExpression*>(tree.get()));
+  EXPECT_EQ("((x*2)+1)", Print(*tree));
+
+  // Into an arena
+  Arena arena;
+  treeOptions.arena = &arena;
+  tree.reset(loaded.load(0, treeOptions));
+  EXPECT_LT(0u, arena.getBytesUsed());
+  EXPECT_EQ("((x*2)+1)", Print(*tree));
+  tree.reset();
+
+  // Variables need a symbol table
+  EXPECT_THROW(loaded.load(0, Expression::CompileOptions()), Exception);
+}
+
+TEST(SerializeTest, Files) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  const std::string image = SaveAll(options);
+
+  char path[] = "/tmp/serialize_test_XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ(ssize_t(image.size()), write(fd, image.data(), image.size()));
+  close(fd);
+
+  std::unique_ptr<ExpressionImage> loaded(ExpressionImage::openFile(path));
+  ASSERT_EQ(int(sizeof(kTexts) / sizeof(kTexts[0])), loaded->size());
+  std::unique_ptr<Expression> e(loaded->load(3, options));
+  EXPECT_EQ("((x*2)+y)", Print(*e));
+
+  ASSERT_EQ(0, truncate(path, 0));
+  EXPECT_THROW(ExpressionImage::openFile(path), Exception);
+
+  unlink(path);
+  EXPECT_THROW(ExpressionImage::openFile(path), SystemException);
+}
+
+TEST(SerializeTest, DamagedImages) {
+  SymbolTable symbols;
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+
+  ExpressionWriter writer;
+  std::unique_ptr<Expression> e(Compile("x ? 'a' + y : 2, 3", options));
+  writer.add(*e);
+  const std::string image = writer.getImage();
+
+  // Headers
+  EXPECT_THROW(ExpressionImage(image.data(), 10), Exception);
+  EXPECT_THROW(ExpressionImage(image.data(), image.size() - 1), Exception);
+  std::string bad = image;
+  bad[0] = 'X';
+  EXPECT_THROW(ExpressionImage(bad.data(), bad.size()), Exception);
+  bad = image;
+  bad[4] = 99;
+  EXPECT_THROW(ExpressionImage(bad.data(), bad.size()), Exception);
+
+  // Flip bytes of the nodes and strings, one at a time. Each image either
+  // loads or throws, without leaking or crashing.
+  int failures = 0;
+  for (size_t i = sizeof(ImageHeader); i < image.size(); i++) {
+    for (int value : { 0, 1, 2, 0x7f, 0xff }) {
+      bad = image;
+      bad[i] = char(value);
+      ExpressionImage damaged(bad.data(), bad.size());
+      try {
+        std::unique_ptr<Expression> loaded(damaged.load(0, options));
+        Print(*loaded);
+      } catch (const Exception&) {
+        ++failures;
+      }
+    }
+  }
+  EXPECT_LT(0, failures);
+}
@@ -0,0 +1,158 @@
+#if !defined SPECIALIZED_H
+#define      SPECIALIZED_H
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+
+#include "expression.h"
+
+// BinaryOperators for operands whose types are known when the expression is
+// compiled (see Expression::getStaticType). They apply the operator straight
+// to the unboxed operands, skipping the upcast and conversions done by
+// Expression::applyBinary. Everything else (printing, lowering to bytecode,
+// batch evaluation) is the generic operator's.
+//
+// The optimizer (see Expression::simplify) puts these in place of generic
+// operators; the operand types must be as their names say.
+
+template <typename Function>
+class NumberOperator : public BinaryOperator {
+public:
+  NumberOperator(Operator op, Expression* left, Expression* right)
+      : BinaryOperator(op, left, right) {}
+
+  Value compute(ExecutionContext& e) const override {
+    const double lval = left->compute(e).getNumber();
+    const double rval = right->compute(e).getNumber();
+    return Value(Function()(lval, rval));
+  }
+};
+
+template <typename Function>
+class IntegerOperator : public BinaryOperator {
+public:
+  IntegerOperator(Operator op, Expression* left, Expression* right)
+      : BinaryOperator(op, left, right) {}
+
+  Value compute(ExecutionContext& e) const override {
+    const int64_t lval = left->compute(e).getInteger();
+    const int64_t rval = right->compute(e).getInteger();
+    return Value(Function()(lval, rval));
+  }
+};
+
+// Integer operations that differ from the standard functions', as in
+// Expression::applyBinary: arithmetic wraps around, shift counts are
+// taken mod 64, and division gives a number
+struct WrappingMultiplies {
+  int64_t operator()(int64_t a, int64_t b) const {
+    return int64_t(uint64_t(a) * uint64_t(b));
+  }
+};
+
+struct WrappingPlus {
+  int64_t operator()(int64_t a, int64_t b) const {
+    return int64_t(uint64_t(a) + uint64_t(b));
+  }
+};
+
+struct WrappingMinus {
+  int64_t operator()(int64_t a, int64_t b) const {
+    return int64_t(uint64_t(a) - uint64_t(b));
+  }
+};
+
+struct ShiftLeft {
+  int64_t operator()(int64_t a, int64_t b) const {
+    return int64_t(uint64_t(a) << (b & 63));
+  }
+};
+
+struct ShiftRight {
+  int64_t operator()(int64_t a, int64_t b) const {
+    return a >> (b & 63);
+  }
+};
+
+struct NumberDivides {
+  double operator()(int64_t a, int64_t b) const {
+    return double(a) / double(b);
+  }
+};
+
+template <typename Function>
+class StringOperator : public BinaryOperator {
+public:
+  StringOperator(Operator op, Expression* left, Expression* right)
+      : BinaryOperator(op, left, right) {}
+
+  Value compute(ExecutionContext& e) const override {
+    const Value lval = left->compute(e);
+    const Value rval = right->compute(e);
+    if (!e.getStatus().ok()) {
+      return Value();  // An operand failed, so it may not be a string
+    }
+    return Value(Function()(lval.getString(), rval.getString()));
+  }
+};
+
+template <typename Function>
+class BoolOperator : public BinaryOperator {
+public:
+  BoolOperator(Operator op, Expression* left, Expression* right)
+      : BinaryOperator(op, left, right) {}
+
+  Value compute(ExecutionContext& e) const override {
+    const bool lval = left->compute(e).getBool();
+    const bool rval = right->compute(e).getBool();
+    return Value(Function()(lval, rval));
+  }
+};
+
+typedef NumberOperator<std::multiplies<double> > NumberMultiply;
+typedef NumberOperator<std::divides<double> > NumberDivide;
+typedef NumberOperator<std::plus<double> > NumberAdd;
+typedef NumberOperator<std::minus<double> > NumberSubtract;
+typedef NumberOperator<std::less<double> > NumberLess;
+typedef NumberOperator<std::less_equal<double> > NumberLessEqual;
+typedef NumberOperator<std::greater<double> > NumberGreater;
+typedef NumberOperator<std::greater_equal<double> > NumberGreaterEqual;
+typedef NumberOperator<std::equal_to<double> > NumberEqual;
+typedef NumberOperator<std::not_equal_to<double> > NumberNotEqual;
+
+typedef IntegerOperator<WrappingMultiplies> IntegerMultiply;
+typedef IntegerOperator<NumberDivides> IntegerDivide;
+typedef IntegerOperator<WrappingPlus> IntegerAdd;
+typedef IntegerOperator<WrappingMinus> IntegerSubtract;
+typedef IntegerOperator<ShiftLeft> IntegerShiftLeft;
+typedef IntegerOperator<ShiftRight> IntegerShiftRight;
+typedef IntegerOperator<std::less<int64_t> > IntegerLess;
+typedef IntegerOperator<std::less_equal<int64_t> > IntegerLessEqual;
+typedef IntegerOperator<std::greater<int64_t> > IntegerGreater;
+typedef IntegerOperator<std::greater_equal<int64_t> > IntegerGreaterEqual;
+typedef IntegerOperator<std::equal_to<int64_t> > IntegerEqual;
+typedef IntegerOperator<std::not_equal_to<int64_t> > IntegerNotEqual;
+typedef IntegerOperator<std::bit_and<int64_t> > IntegerAnd;
+typedef IntegerOperator<std::bit_xor<int64_t> > IntegerXor;
+typedef IntegerOperator<std::bit_or<int64_t> > IntegerOr;
+
+typedef StringOperator<std::plus<std::string> > StringConcat;
+typedef StringOperator<std::less<std::string> > StringLess;
+typedef StringOperator<std::less_equal<std::string> > StringLessEqual;
+typedef StringOperator<std::greater<std::string> > StringGreater;
+typedef StringOperator<std::greater_equal<std::string> > StringGreaterEqual;
+typedef StringOperator<std::equal_to<std::string> > StringEqual;
+typedef StringOperator<std::not_equal_to<std::string> > StringNotEqual;
+
+typedef BoolOperator<std::equal_to<bool> > BoolEqual;
+typedef BoolOperator<std::not_equal_to<bool> > BoolNotEqual;
+
+// A specialized operator for the operands' static types, taking ownership
+// of them, or null (leaving them to the caller) if the types aren't known
+// or there's no specialized version of the operator. The node goes in the
+// arena, if there is one.
+Expression* specializeBinary(Expression::Operator, Expression* left,
+                             Expression* right, Arena*);
+
+#endif
@@ -0,0 +1,30 @@
+#include "status.h"
+#include "exception.h"
+
+using namespace std;
+
+string Status::getMessage() const {
+  string message;
+  for (const char* p = format; *p != '\0'; p++) {
+    if (p[0] != '%' || p[1] == '\0') {
+      message += *p;
+      continue;
+    }
+
+    switch (*++p) {
+      case 's': message += argument; break;
+      case 'l': message += to_string(line); break;
+      case 'c': message += to_string(column); break;
+      default:
+        message += '%';
+        message += *p;
+    }
+  }
+  return message;
+}
+
+void Status::check() const {
+  if (!ok()) {
+    throw Exception(getMessage());
+  }
+}
@@ -0,0 +1,75 @@
+#if !defined STATUS_H
+#define      STATUS_H
+
+#include <string>
+#include <utility>
+
+// The outcome of something that can fail: OK, or an error. The Status API
+// (the try... functions alongside the throwing ones) returns errors as
+// Statuses instead of throwing them, for callers that expect a lot of
+// malformed or mistyped input and can't afford to unwind the stack for
+// each one. The throwing functions just check the Status.
+//
+// Errors are cheap to make: one only records a message template and what
+// goes in it. The message is put together if getMessage() is called.
+class Status {
+public:
+  enum Code {
+    OK,
+    SYNTAX_ERROR,      // The text isn't a valid expression
+    EVALUATION_ERROR,  // Evaluating failed, e.g. on operands of a bad type
+    IO_ERROR           // A file couldn't be read
+  };
+
+  Status() : code(OK), format(""), line(0), column(0) {}
+
+  // An error. The format must be a string literal, since it isn't copied.
+  // In it, %s stands for the argument, and %l and %c for the line and
+  // column numbers.
+  Status(Code inCode, const char* inFormat,
+         std::string inArgument = std::string(), int inLine = 0,
+         int inColumn = 0)
+      : code(inCode), format(inFormat), argument(std::move(inArgument)),
+        line(inLine), column(inColumn) {}
+
+  bool ok() const { return code == OK; }
+  Code getCode() const { return code; }
+  std::string getMessage() const;
+
+  // Take the other status unless this is an error already, so that the
+  // first error is the one that's kept
+  void update(const Status& other) {
+    if (ok()) *this = other;
+  }
+
+  // Throw the error as an Exception, if there is one
+  void check() const;
+
+private:
+  Code code;
+  const char* format;
+  std::string argument;
+  int line;
+  int column;
+};
+
+// A value, or the error that kept it from being made
+template <typename T>
+class Result {
+public:
+  Result(T inValue) : value(std::move(inValue)) {}
+  Result(Status inStatus) : status(std::move(inStatus)), value() {}
+
+  bool ok() const { return status.ok(); }
+  const Status& getStatus() const { return status; }
+
+  // Valid only if ok()
+  const T& get() const { return value; }
+  T& get() { return value; }
+
+private:
+  Status status;
+  T value;
+};
+
+#endif
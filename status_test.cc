@@ -0,0 +1,65 @@
+#include "status.h"
+#include "exception.h"
+
+#include <memory>
+#include <string>
+
+#include "gtest/gtest.h"
+
+TEST(StatusTest, Ok) {
+  Status status;
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(Status::OK, status.getCode());
+  EXPECT_EQ("", status.getMessage());
+  EXPECT_NO_THROW(status.check());
+}
+
+TEST(StatusTest, Messages) {
+  EXPECT_EQ("Division by zero",
+            Status(Status::EVALUATION_ERROR, "Division by zero")
+            .getMessage());
+  EXPECT_EQ("Bad character 'x' at line 3, column 14",
+            Status(Status::SYNTAX_ERROR,
+                   "Bad character '%s' at line %l, column %c", "x", 3, 14)
+            .getMessage());
+
+  // Anything else after a % is left alone
+  EXPECT_EQ("100% %d %",
+            Status(Status::IO_ERROR, "100% %d %").getMessage());
+}
+
+TEST(StatusTest, FirstErrorIsKept) {
+  Status status;
+  status.update(Status());
+  EXPECT_TRUE(status.ok());
+
+  status.update(Status(Status::SYNTAX_ERROR, "first"));
+  status.update(Status(Status::EVALUATION_ERROR, "second"));
+  status.update(Status());
+  EXPECT_EQ(Status::SYNTAX_ERROR, status.getCode());
+  EXPECT_EQ("first", status.getMessage());
+}
+
+TEST(StatusTest, Check) {
+  const Status status(Status::EVALUATION_ERROR, "Undefined variable: %s",
+                      "x");
+  try {
+    status.check();
+    FAIL();
+  } catch (const Exception& e) {
+    EXPECT_EQ("Undefined variable: x", std::string(e.what()));
+  }
+}
+
+TEST(StatusTest, Results) {
+  Result<std::string> value(std::string("abc"));
+  EXPECT_TRUE(value.ok());
+  EXPECT_EQ("abc", value.get());
+
+  const Result<std::unique_ptr<int> > error =
+      Status(Status::IO_ERROR, "Can't read %s", "x");
+  EXPECT_FALSE(error.ok());
+  EXPECT_EQ(Status::IO_ERROR, error.getStatus().getCode());
+  EXPECT_EQ("Can't read x", error.getStatus().getMessage());
+  EXPECT_EQ(nullptr, error.get());
+}
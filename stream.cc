@@ -0,0 +1,235 @@
+#include "stream.h"
+#include "exception.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// A bounded queue between two threads of the pipeline. pop() returns false
+// once the queue is closed and empty, and push() drops the item and returns
+// false once it's closed, so either end can stop the other.
+template <typename T>
+class Pipe {
+public:
+  explicit Pipe(size_t inCapacity) : capacity(inCapacity), closed(false) {}
+
+  bool push(T item) {
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this] { return closed || items.size() < capacity; });
+    if (closed) return false;
+    items.push_back(std::move(item));
+    changed.notify_all();
+    return true;
+  }
+
+  bool pop(T& item) {
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this] { return closed || !items.empty(); });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    changed.notify_all();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    changed.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  mutex lock;
+  condition_variable changed;
+  deque<T> items;
+  bool closed;
+};
+
+// A run of whole lines of the input, and their output
+struct Batch {
+  string text;
+  vector<size_t> starts;    // Where each line starts, plus the end
+  long firstLine;           // Line number of the first, from 1
+  vector<string> outputs;   // One per chunk of lines, in order
+};
+
+const int kLinesPerChunk = 256;
+
+// Read the input a large block at a time, handing on the whole lines
+void readBatches(istream& in, size_t readSize,
+                 Pipe<unique_ptr<Batch> >& batches) {
+  string pending;  // A line continued in the next block
+  long line = 1;
+  vector<char> buffer(readSize);
+
+  while (true) {
+    in.read(buffer.data(), buffer.size());
+    const size_t n = in.gcount();
+    unique_ptr<Batch> batch(new Batch);
+    batch->text.swap(pending);
+    batch->text.append(buffer.data(), n);
+
+    // At the end, the last line needn't have a newline
+    size_t end = batch->text.size();
+    if (n > 0) {
+      const size_t newline = batch->text.rfind('\n');
+      end = (newline == string::npos) ? 0 : newline + 1;
+      pending.assign(batch->text, end, string::npos);
+      batch->text.resize(end);
+    }
+
+    batch->firstLine = line;
+    for (size_t i = 0; i < end; ) {
+      batch->starts.push_back(i);
+      const char* next = static_cast<const char*>(
+          memchr(batch->text.data() + i, '\n', end - i));
+      i = (next == nullptr) ? end : (next - batch->text.data()) + 1;
+    }
+    batch->starts.push_back(end);
+    line += batch->starts.size() - 1;
+
+    if (batch->starts.size() > 1 && !batches.push(std::move(batch))) {
+      return;  // Nothing more is wanted
+    }
+    if (n == 0) break;
+  }
+
+  batches.close();
+}
+
+// Compile and evaluate a line, and write it with its value. Bad lines are
+// expected here, so errors are returned rather than thrown, and then
+// nothing is written.
+Status evaluateLine(const string& text, ExpressionCache& cache,
+                    ostream& out) {
+  const Result<std::shared_ptr<const Expression> > e = cache.tryGet(text);
+  if (!e.ok()) return e.getStatus();
+
+  ExecutionContext exe;
+  const Result<Expression::Value> v = e.get()->tryEvaluate(exe);
+  if (!v.ok()) return v.getStatus();
+
+  e.get()->print(out);
+  out << " => " << v.get();
+  return Status();
+}
+
+// Compile and evaluate a batch's lines on the pool
+void evaluateBatch(Batch& batch, ExpressionCache& cache, ThreadPool& pool,
+                   atomic<long>& errors) {
+  const int lines = batch.starts.size() - 1;
+  batch.outputs.assign((lines + kLinesPerChunk - 1) / kLinesPerChunk,
+                       string());
+
+  pool.parallelFor(lines, kLinesPerChunk, [&](int begin, int end) {
+      ostringstream out;
+      for (int i = begin; i < end; i++) {
+        size_t length = batch.starts[i + 1] - batch.starts[i];
+        const char* text = batch.text.data() + batch.starts[i];
+        while (length > 0 &&
+               (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+          --length;
+        }
+
+        if (length > 0) {
+          // A line that throws anyway (before anything is written) is
+          // still just that line's error
+          Status status;
+          try {
+            status = evaluateLine(string(text, length), cache, out);
+          } catch (const Exception& ex) {
+            status = Status(Status::EVALUATION_ERROR, "%s", ex.what());
+          }
+          if (!status.ok()) {
+            out << "error: line " << batch.firstLine + i << ": "
+                << status.getMessage();
+            ++errors;
+          }
+        }
+        out << '\n';
+      }
+      batch.outputs[begin / kLinesPerChunk] = out.str();
+    });
+}
+
+// Write each batch's output, in order
+void writeBatches(ostream& out, Pipe<unique_ptr<Batch> >& batches) {
+  unique_ptr<Batch> batch;
+  while (batches.pop(batch)) {
+    for (const string& output : batch->outputs) {
+      out.write(output.data(), output.size());
+    }
+  }
+  out.flush();
+}
+
+// A thread of the pipeline, which is stopped by closing its pipe and
+// joined when this goes out of scope, so that leaving early (by a throw)
+// doesn't leave it running
+class Stage {
+public:
+  template <typename Function, typename... Args>
+  Stage(Pipe<unique_ptr<Batch> >& inPipe, Function&& function,
+        Args&&... args)
+      : pipe(inPipe), worker(std::forward<Function>(function),
+                             std::forward<Args>(args)...) {}
+
+  ~Stage() {
+    pipe.close();
+    worker.join();
+  }
+
+private:
+  Pipe<unique_ptr<Batch> >& pipe;
+  thread worker;
+};
+
+}  // namespace
+
+void evaluateLines(istream& in, ostream& out, ExpressionCache& cache) {
+  while (in.good()) {
+    std::string line;
+    getline(in, line);
+    if (line.empty()) break;
+
+    std::shared_ptr<const Expression> e = cache.get(line);
+    POSTCONDITION(e != nullptr);
+
+    e->print(out);
+    out << " => ";
+    ExecutionContext exe;
+    Expression::Value v = e->evaluate(exe);
+
+    out << v << endl;
+  }
+}
+
+long evaluateStream(istream& in, ostream& out, ExpressionCache& cache,
+                    ThreadPool& pool, size_t readSize) {
+  PRECONDITION(readSize > 0);
+
+  Pipe<unique_ptr<Batch> > input(4), output(4);
+  atomic<long> errors(0);
+
+  Stage reader(input, readBatches, std::ref(in), readSize, std::ref(input));
+  Stage writer(output, writeBatches, std::ref(out), std::ref(output));
+
+  unique_ptr<Batch> batch;
+  while (input.pop(batch)) {
+    evaluateBatch(*batch, cache, pool, errors);
+    output.push(std::move(batch));
+  }
+  return errors;
+}
@@ -0,0 +1,31 @@
+#if !defined STREAM_H
+#define      STREAM_H
+
+#include <istream>
+#include <ostream>
+#include <stddef.h>
+
+#include "cache.h"
+#include "parallel.h"
+
+// Evaluating expressions a line at a time, as expr does. Each line is
+// written out as the expression prints, then " => " and its value.
+
+// Read lines from 'in' until the end or the first empty line, writing each
+// with its value to 'out' as soon as it's read, for use at a terminal. The
+// first error is thrown.
+void evaluateLines(std::istream& in, std::ostream& out,
+                   ExpressionCache& cache);
+
+// Read every line of 'in', in blocks of 'readSize', and evaluate them on
+// the pool. Each line gets one line of output, in order: the same as
+// evaluateLines for a line that succeeds, "error: line N: ..." for one that
+// fails, and nothing for a blank line. Returns the number that failed.
+//
+// It's a pipeline of three stages: one thread reads, the pool compiles and
+// evaluates, and another thread writes, without flushing per line.
+long evaluateStream(std::istream& in, std::ostream& out,
+                    ExpressionCache& cache, ThreadPool& pool,
+                    size_t readSize = 1 << 20);
+
+#endif
@@ -0,0 +1,141 @@
+#include <sstream>
+#include <string>
+
+#include "cache.h"
+#include "exception.h"
+#include "parallel.h"
+#include "stream.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// The output of evaluating the input both ways
+std::string Interactive(const std::string& input) {
+  ExpressionCache cache(100);
+  std::istringstream in(input);
+  std::ostringstream out;
+  evaluateLines(in, out, cache);
+  return out.str();
+}
+
+std::string Streamed(const std::string& input, long* errors = nullptr,
+                     size_t readSize = 1 << 20,
+                     const Expression::CompileOptions& options =
+                     Expression::CompileOptions()) {
+  ExpressionCache cache(100, options);
+  ThreadPool pool(4);
+  std::istringstream in(input);
+  std::ostringstream out;
+  const long failed = evaluateStream(in, out, cache, pool, readSize);
+  if (errors != nullptr) {
+    *errors = failed;
+  }
+  return out.str();
+}
+
+}  // namespace
+
+TEST(StreamTest, Interactive) {
+  EXPECT_EQ("(1+2) => 3\n", Interactive("1 + 2\n"));
+  EXPECT_EQ("(1+2) => 3\n(2*3) => 6\n", Interactive("1 + 2\n2 * 3"));
+
+  // Stops at the first empty line
+  EXPECT_EQ("(1+2) => 3\n", Interactive("1 + 2\n\n2 * 3\n"));
+  EXPECT_EQ("", Interactive(""));
+
+  EXPECT_THROW(Interactive("1 + 2\n1.5 % 0\n"), Exception);
+  EXPECT_THROW(Interactive("1 +\n"), Exception);
+}
+
+// Each line gets one line of output, blank for blank lines, and the last
+// line needn't end in a newline
+TEST(StreamTest, SplitsLines) {
+  long errors;
+  EXPECT_EQ("(1+2) => 3\n\n(2*3) => 6\n",
+            Streamed("1 + 2\n\n2 * 3\n", &errors));
+  EXPECT_EQ(0, errors);
+
+  EXPECT_EQ("(1+2) => 3\n(2*3) => 6\n", Streamed("1 + 2\n2 * 3", &errors));
+  EXPECT_EQ("(1+2) => 3\n(2*3) => 6\n", Streamed("1 + 2\r\n2 * 3\r\n"));
+  EXPECT_EQ("(2*3) => 6\n", Streamed("2 * 3"));
+  EXPECT_EQ("", Streamed(""));
+  EXPECT_EQ("\n\n", Streamed("\n\n"));
+}
+
+// A line that fails gets an error in place of its value, and the rest go
+// on
+TEST(StreamTest, Errors) {
+  long errors;
+  EXPECT_EQ("(1+2) => 3\n"
+            "error: line 2: Division by zero\n"
+            "\n"
+            "error: line 4: Unexpected keyword: x\n"
+            "(7*3) => 21\n",
+            Streamed("1 + 2\n1.5 % 0\n\nx\n7 * 3", &errors));
+  EXPECT_EQ(2, errors);
+
+  const std::string output = Streamed("1 +\n'a' - 'b'\n", &errors);
+  EXPECT_EQ(2, errors);
+  EXPECT_EQ(0u, output.find("error: line 1: "));
+  EXPECT_NE(std::string::npos,
+            output.find("\nerror: line 2: Invalid operation (-) on strings\n"));
+}
+
+// A line the backend can't take is an error like any other
+TEST(StreamTest, TooLargeForBytecode) {
+  SymbolTable symbols;
+  symbols.add("x");
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.backend = Expression::BACKEND_BYTECODE;
+
+  std::string input = "1 + 2\n1";
+  for (int i = 0; i < 70000; i++) {
+    input += ", x";
+  }
+  input += "\n2 * 3\n";
+
+  long errors;
+  EXPECT_EQ("(1+2) => 3\n"
+            "error: line 2: Expression is too large to lower to bytecode\n"
+            "(2*3) => 6\n",
+            Streamed(input, &errors, 1 << 20, options));
+  EXPECT_EQ(1, errors);
+}
+
+// Many chunks of lines over many blocks, with lines split between blocks,
+// must come out in order with the right line numbers
+TEST(StreamTest, KeepsOrder) {
+  std::string input, expected;
+  for (int i = 0; i < 5000; i++) {
+    const std::string n = std::to_string(i);
+    if (i % 97 == 0) {
+      input += n + " % 0\n";
+      expected += "error: line " + std::to_string(i + 1) +
+          ": Division by zero\n";
+    } else {
+      input += n + " * 2\n";
+      expected += "(" + n + "*2) => " + std::to_string(i * 2) + "\n";
+    }
+  }
+
+  for (size_t readSize : { 1, 7, 4096, 1 << 20 }) {
+    long errors;
+    EXPECT_EQ(expected, Streamed(input, &errors, readSize)) << readSize;
+    EXPECT_EQ(52, errors);
+  }
+}
+
+// Without blank lines or errors, both ways give exactly the same output
+TEST(StreamTest, SameAsInteractive) {
+  std::string input;
+  for (int i = 0; i < 1000; i++) {
+    input += "'x' + " + std::to_string(i) + ", " + std::to_string(i) +
+        " / 3 < 100 ? true : 1.5 * " + std::to_string(i) + "\n";
+  }
+
+  EXPECT_EQ(Interactive(input), Streamed(input));
+  input.pop_back();
+  EXPECT_EQ(Interactive(input), Streamed(input));
+}
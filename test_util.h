@@ -0,0 +1,163 @@
+#if !defined TEST_UTIL_H
+#define      TEST_UTIL_H
+
+// Helpers shared by the tests and the benchmarks: compiling text,
+// describing values and outcomes so they can be compared, a batch with a
+// column of each kind, and random expressions and values.
+
+#include <cmath>
+#include <sstream>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "batch.h"
+#include "exception.h"
+#include "expression.h"
+#include "textsource.h"
+#include "tokenizer.h"
+
+// Compile the text with the options; malformed text throws
+inline Expression* Compile(const std::string& text,
+                           const Expression::CompileOptions& options) {
+  Tokenizer tokenizer(new TextSource(text.data(), text.size()));
+  tokenizer.next();
+  return Expression::compile(tokenizer, options);
+}
+
+// The same, with variables in the symbol table
+inline Expression* Compile(const std::string& text, SymbolTable& symbols,
+                           Expression::Backend backend =
+                           Expression::BACKEND_TREE,
+                           bool optimize = false) {
+  Expression::CompileOptions options;
+  options.symbols = &symbols;
+  options.backend = backend;
+  options.optimize = optimize;
+  return Compile(text, options);
+}
+
+// The value's type and exact bits (any NaN is as good as another)
+inline std::string Describe(const Expression::Value& v) {
+  std::ostringstream out;
+  out << "type " << v.getType() << ": ";
+  if (v.getType() == Expression::TYPE_NUMBER) {
+    if (std::isnan(v.getNumber())) {
+      out << "nan";
+    } else {
+      const double number = v.getNumber();
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      out << v << " (" << std::hex << bits << ")";
+    }
+  } else {
+    out << v;
+  }
+  return out.str();
+}
+
+// The outcome of an evaluation: the value, or the error message
+inline std::string Outcome(const Expression& e, ExecutionContext& context) {
+  try {
+    return Describe(e.evaluate(context));
+  } catch (const Exception& ex) {
+    return std::string("error: ") + ex.what();
+  }
+}
+
+// Add the variables x, y, b, s and unset to the symbol table, and fill the
+// batch's columns for them: x and y are numbers, b is Booleans, s mixes
+// strings and numbers, and unset's column is left empty
+inline void FillBatch(SymbolTable& symbols, ColumnBatch& batch) {
+  const char* const names[] = { "x", "y", "b", "s", "unset" };
+  for (const char* name : names) {
+    symbols.add(name);
+  }
+
+  // Adding a column may move the others, so add them all first
+  batch.getColumn(symbols.size() - 1);
+  Column& x = batch.getColumn(symbols.find("x"));
+  Column& y = batch.getColumn(symbols.find("y"));
+  Column& b = batch.getColumn(symbols.find("b"));
+  Column& s = batch.getColumn(symbols.find("s"));
+
+  for (int i = 0; i < batch.getRowCount(); i++) {
+    x.append(Expression::Value(i * 1.5 - 20));
+    y.append(Expression::Value(double(i % 7)));
+    b.append(Expression::Value(i % 3 == 0));
+    if (i % 2 == 0) {
+      s.append(Expression::Value(std::to_string(i)));
+    } else {
+      s.append(Expression::Value(double(i)));
+    }
+  }
+}
+
+// Random expressions over the variables a, b and c, and random values for
+// them (including the awkward ones). The sequence is the same every run.
+class Generator {
+public:
+  Generator() : seed(1) {}
+
+  int next(int n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+  }
+
+  std::string expression(int depth) {
+    const char* const leaves[] = {
+      "a", "b", "c", "a", "b", "c", "0", "1", "2.5", "31", "33",
+      "10000000000", "4294967296", "true", "false", "'s'",
+    };
+    const char* const unary[] = { "!", "~", "-", "+" };
+    const char* const binary[] = {
+      "*", "/", "+", "-", "<<", ">>", "<", "<=", ">", ">=", "==", "!=",
+      "&", "^", "|", "&&", "||",
+    };
+
+    if (depth == 0 || next(4) == 0) {
+      return leaves[next(sizeof(leaves) / sizeof(leaves[0]))];
+    }
+
+    switch (next(6)) {
+      case 0:
+        // Spaced, so that + + isn't read as ++
+        return unary[next(4)] + (" " + expression(depth - 1));
+      case 1:
+        return "(" + expression(depth - 1) + " ? " + expression(depth - 1) +
+            " : " + expression(depth - 1) + ")";
+      case 2:
+        // Often by a small constant, but by anything else too
+        return "(" + expression(depth - 1) + " % " +
+            (next(2) ? std::to_string(next(5) - 1) : expression(depth - 1)) +
+            ")";
+      default:
+        return "(" + expression(depth - 1) + " " +
+            binary[next(sizeof(binary) / sizeof(binary[0]))] + " " +
+            expression(depth - 1) + ")";
+    }
+  }
+
+  Expression::Value value() {
+    switch (next(23)) {
+      case 0: return Expression::Value(true);
+      case 1: return Expression::Value(false);
+      case 2: return Expression::Value("12");
+      case 3: return Expression::Value(std::nan(""));
+      case 4: return Expression::Value(-0.0);
+      case 5: return Expression::Value(INFINITY);
+      case 6: return Expression::Value(-1e300);
+      case 7: return Expression::Value(-2147483649.0);
+      case 8: return Expression::Value(33.0);
+      case 9: return Expression::Value(int64_t(7));
+      case 10: return Expression::Value(INT64_MIN);
+      case 11: return Expression::Value();
+      default: return Expression::Value(double(next(41) - 20) / 4);
+    }
+  }
+
+private:
+  unsigned seed;
+};
+
+#endif
@@ -1,44 +1,177 @@
 #include "textsource.h"
 #include "exception.h"
 
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-TextSource::TextSource(std::istream& in_stream, bool skip)
-    : in(in_stream),
-      current_char(0),
-      skipping_comments(skip),
-      line_number(1),
-      column_number(0)
+TextSource::TextSource(bool skip)
+    : in(nullptr),
+      mapping(nullptr),
+      mapping_size(0),
+      skipping_comments(skip)
 {
-  consume();
+}
+
+TextSource::TextSource(std::istream& stream, bool skip)
+    : in(&stream),
+      mapping(nullptr),
+      mapping_size(0),
+      skipping_comments(skip)
+{
+  start(copy.data(), copy.data());
+  status.check();
+}
+
+TextSource::TextSource(const char* data, size_t length, bool skip)
+    : in(nullptr),
+      mapping(nullptr),
+      mapping_size(0),
+      skipping_comments(skip)
+{
+  PRECONDITION(data != nullptr || length == 0);
+  start(data, data + length);
+  status.check();
+}
+
+TextSource::~TextSource() {
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_size);
+  }
+}
+
+int TextSource::map(const std::string& path, void*& mapping, size_t& size,
+                    const char*& step) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    step = "Can't open ";
+    return errno;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    const int error = errno;
+    close(fd);
+    step = "Can't read ";
+    return error;
+  }
+
+  // An empty file can't be mapped, and has nothing to map anyway
+  size = info.st_size;
+  mapping = nullptr;
+  if (size > 0) {
+    mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      const int error = errno;
+      close(fd);
+      mapping = nullptr;
+      step = "Can't map ";
+      return error;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+TextSource* TextSource::openFile(const std::string& path, bool skip) {
+  void* mapping;
+  size_t size;
+  const char* step;
+  const int error = map(path, mapping, size, step);
+  if (error != 0) {
+    throw SystemException(error, step + path);
+  }
+
+  TextSource* source = new TextSource(static_cast<const char*>(mapping),
+                                      size, skip);
+  source->mapping = mapping;
+  source->mapping_size = size;
+  return source;
+}
+
+TextSource* TextSource::tryCreate(std::istream& in, bool skip) {
+  TextSource* source = new TextSource(skip);
+  source->in = &in;
+  source->start(source->copy.data(), source->copy.data());
+  return source;
+}
+
+TextSource* TextSource::tryCreate(const char* data, size_t length,
+                                  bool skip) {
+  PRECONDITION(data != nullptr || length == 0);
+  TextSource* source = new TextSource(skip);
+  source->start(data, data + length);
+  return source;
+}
+
+TextSource* TextSource::tryOpenFile(const std::string& path, bool skip) {
+  TextSource* source = new TextSource(skip);
+  const char* step;
+  const int error = map(path, source->mapping, source->mapping_size, step);
+  if (error != 0) {
+    source->status = Status(Status::IO_ERROR, "%s",
+                            step + path + ": " + strerror(error));
+  }
+  const char* text = static_cast<const char*>(source->mapping);
+  source->start(text, text + source->mapping_size);
+  return source;
+}
+
+void TextSource::start(const char* begin, const char* end) {
+  text = begin;
+  position = begin;
+  current_position = begin;
+  limit = end;
+  hit_end = false;
+  current_char = 0;
+  line_number = 1;
+  column_number = 0;
+  tryConsume();
 }
 
 void TextSource::consume() {
+  tryConsume().check();
+}
+
+const Status& TextSource::tryConsume() {
   // Read the next character
-  if (in.eof()) {
+  if (hit_end) {
     current_char = -1;
+    current_position = limit;
   } else {
     next();
   }
 
   // If we're not skipping comments, or in any case if this is
   // the last character, then we're done
-  if (!skipping_comments || in.eof()) return;
+  if (!skipping_comments || hit_end) return status;
   if (current_char == '/') {
-    if (in.peek() == '/') {
+    // An offset, since reading a stream may move the text
+    const size_t comment = current_position - text;
+
+    if (peek() == '/') {
       // Eat a comment to the end of the line
-      while (current_char != '\n' && !in.eof()) {
+      while (current_char != '\n' && !hit_end) {
         next();
       }
       current_char = '\n';  // Treat the entire comment as whitespace
 
-    } else if (in.peek() == '*') {
+    } else if (peek() == '*') {
       // Eat a comment to the '*/' mark
       bool star = false;  // tiny state machine; I either saw '*' or not
       next();  // skip the asterisk
 
       while (true) {
-        if (in.eof()) throw Exception("Unterminated comment");
+        if (hit_end) {
+          status.update(Status(Status::SYNTAX_ERROR, "Unterminated comment"));
+          current_char = -1;
+          current_position = limit;
+          return status;
+        }
 
         next();
         if (star && current_char == '/') {
@@ -50,7 +183,9 @@ void TextSource::consume() {
         }
       }
     }
+    current_position = text + comment;
   }
+  return status;
 }
 
 bool TextSource::eof() const { return current_char == -1; }
@@ -65,6 +200,39 @@ void TextSource::next() {
     column_number = 0;
   }
 
-  current_char = in.get();
+  current_position = position;
+  current_char = get();
   ++column_number;
 }
+
+int TextSource::get() {
+  if (position == limit && !readMore()) {
+    hit_end = true;
+    return -1;
+  }
+  return static_cast<unsigned char>(*position++);
+}
+
+int TextSource::peek() {
+  if (position == limit && !readMore()) {
+    hit_end = true;
+    return -1;
+  }
+  return static_cast<unsigned char>(*position);
+}
+
+bool TextSource::readMore() {
+  if (in == nullptr) return false;
+  const int c = in->get();
+  if (c == std::char_traits<char>::eof()) return false;
+
+  // The copy may move, so keep the places as offsets
+  const size_t offset = position - text;
+  const size_t current = current_position - text;
+  copy.push_back(c);
+  text = copy.data();
+  position = text + offset;
+  current_position = text + current;
+  limit = text + copy.size();
+  return true;
+}
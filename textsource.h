@@ -2,19 +2,57 @@
 #define      TEXTSOURCE_H
 
 #include <iosfwd>
+#include <stddef.h>
+#include <string>
 
-// TextSource consumes an istream char by char, keeping track of line and
-// column position and skipping over comments.
+#include "status.h"
+
+// TextSource consumes text char by char, keeping track of line and
+// column position and skipping over comments. The text is read straight
+// from memory: a buffer the caller owns or a memory-mapped file. An
+// istream is read a character at a time, only as far as it's consumed (so
+// a source on std::cin doesn't wait for the end of the input), into a copy
+// that grows as it goes.
+//
+// An unterminated comment is an error: it throws, or, in the Status API,
+// ends the text early, leaving getStatus() failed.
 class TextSource {
 public:
+  // Reads (and copies) the stream as it's consumed; it must outlive the
+  // source
   TextSource(std::istream&, bool skip_comments = true);
 
+  // Reads the buffer in place; it must outlive the source
+  TextSource(const char* data, size_t length, bool skip_comments = true);
+
+  ~TextSource();
+
+  // Map the file into memory and read it in place. Throws if the file
+  // can't be opened or mapped.
+  static TextSource* openFile(const std::string& path,
+                              bool skip_comments = true);
+
+  // The Status API versions of the above, which don't throw. A file that
+  // can't be read gives an empty source, with the reason in getStatus().
+  static TextSource* tryCreate(std::istream&, bool skip_comments = true);
+  static TextSource* tryCreate(const char* data, size_t length,
+                               bool skip_comments = true);
+  static TextSource* tryOpenFile(const std::string& path,
+                                 bool skip_comments = true);
+
   // Return the current character; valid only if !eof()
   char current() const { return current_char; }
 
   // Move on to the next character
   void consume();
 
+  // The same, but an error ends the text instead of throwing. Returns
+  // getStatus().
+  const Status& tryConsume();
+
+  // OK, or the error that ended the text early
+  const Status& getStatus() const { return status; }
+
   // Have we consumed everything?
   bool eof() const;
 
@@ -22,19 +60,65 @@ public:
   int getLineNumber() const { return line_number; }
   int getColumnNumber() const { return column_number; }
 
+  // Where 'current()' is in memory (the end of the text at eof). A comment
+  // being skipped is at the address where it starts. For a buffer or a
+  // file, pointers stay valid for the life of the source, so [start, end)
+  // pointers taken around a token are its text. A stream's copy moves as
+  // it grows, so its pointers are only valid until the next consume().
+  const char* getPointer() const { return current_position; }
+
+  // The same as an offset from the start of the text, which stays valid
+  // for any source; getText() turns it back into a pointer
+  size_t getOffset() const { return current_position - text; }
+  const char* getText(size_t offset) const { return text + offset; }
+
   // Shall we eat code comments? We normally want to, but if the consumer
   // is reading a string, it temporarily turns off this processing.
   void skipComments(bool flag);
   bool getSkippingComments() const { return skipping_comments; }
 
 private:
-  // Sets current_char to the next character in the stream, and keeps
+  TextSource(const TextSource&) = delete;
+  TextSource& operator=(const TextSource&) = delete;
+
+  // A source with no text yet; see start()
+  explicit TextSource(bool skip_comments);
+
+  // Start reading the range [begin, end)
+  void start(const char* begin, const char* end);
+
+  // Map the file, returning 0 or the errno (and setting 'step' to say what
+  // failed)
+  static int map(const std::string& path, void*& mapping, size_t& size,
+                 const char*& step);
+
+  // Sets current_char to the next character in the text, and keeps
   // track of line/column counts.
   void next();
 
-  std::istream& in;
+  // Return the character after the current one, or -1 at the end. These
+  // two behave like istream::get() and peek(), including noting when
+  // they hit the end.
+  int get();
+  int peek();
+
+  // Read another character from the stream onto the copy. Returns false at
+  // the end of the stream, or if there isn't one.
+  bool readMore();
+
+  const char* text;  // The start
+  const char* position;
+  const char* current_position;
+  const char* limit;
+  bool hit_end;
+
+  std::istream* in;    // The stream, if reading one
+  std::string copy;    // What's been read of it
+  void* mapping;       // The text, if it came from a file
+  size_t mapping_size;
 
   int current_char;
+  Status status;
   bool skipping_comments;
   int line_number;
   int column_number;
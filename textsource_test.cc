@@ -2,15 +2,18 @@
 #include "exception.h"
 
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 
-// Return the sequence of characters returned by the source.
-std::string Consume(const std::string& text) {
-  std::istringstream s(text);
-  TextSource source(s);
+// Return the sequence of characters returned by the source, and where
+// it ended up.
+std::string Drain(TextSource& source) {
   std::string result;
 
   while (!source.eof()) {
@@ -18,7 +21,21 @@ std::string Consume(const std::string& text) {
     source.consume();
   }
 
-  return result;
+  return result + "@" + std::to_string(source.getLineNumber()) + ":" +
+      std::to_string(source.getColumnNumber());
+}
+
+// Return the sequence of characters returned by the source. Reading from a
+// stream and from a buffer must give the same results.
+std::string Consume(const std::string& text) {
+  std::istringstream s(text);
+  TextSource source(s);
+  const std::string fromStream = Drain(source);
+
+  TextSource buffer(text.data(), text.size());
+  EXPECT_EQ(fromStream, Drain(buffer)) << text;
+
+  return fromStream.substr(0, fromStream.rfind('@'));
 }
 
 TEST(TextSourceTest, Comments) {
@@ -48,6 +65,77 @@ TEST(TextSourceTest, Characters) {
 
 TEST(TextSourceTest, Errors) {
   EXPECT_THROW(Consume("/*/"), Exception);
+
+  const char* text = "/*/";
+  EXPECT_THROW(TextSource(text, strlen(text)), Exception);
+}
+
+TEST(TextSourceTest, Statuses) {
+  const char* text = "1 /* 2";
+  std::unique_ptr<TextSource> source(TextSource::tryCreate(text,
+                                                           strlen(text)));
+  EXPECT_TRUE(source->getStatus().ok());
+  EXPECT_EQ('1', source->current());
+  EXPECT_TRUE(source->tryConsume().ok());
+
+  // The error ends the text
+  EXPECT_EQ(Status::SYNTAX_ERROR, source->tryConsume().getCode());
+  EXPECT_EQ("Unterminated comment", source->getStatus().getMessage());
+  EXPECT_TRUE(source->eof());
+
+  // Failing to start is an error as well
+  std::istringstream in("/*");
+  source.reset(TextSource::tryCreate(in));
+  EXPECT_FALSE(source->getStatus().ok());
+  EXPECT_TRUE(source->eof());
+
+  source.reset(TextSource::tryOpenFile("/nonexistent/file"));
+  EXPECT_EQ(Status::IO_ERROR, source->getStatus().getCode());
+  EXPECT_EQ("Can't open /nonexistent/file: No such file or directory",
+            source->getStatus().getMessage());
+  EXPECT_TRUE(source->eof());
+}
+
+TEST(TextSourceTest, Buffers) {
+  // Only the given range is read
+  const char* text = "1 + 2; junk";
+  TextSource source(text, 5);
+  EXPECT_EQ("1 + 2@1:6", Drain(source));
+
+  TextSource empty(nullptr, 0);
+  EXPECT_TRUE(empty.eof());
+
+  // Where each kind of source ends up
+  const char* const cases[] = {
+    "", "a", "a/", "a\n", "/", "//", "a//b\nc", "/* x */", "x\n\n",
+  };
+  for (const char* c : cases) {
+    Consume(c);
+  }
+
+  TextSource raw("a/* b */", 8, false);
+  EXPECT_EQ("a/* b */@1:9", Drain(raw));
+}
+
+TEST(TextSourceTest, Files) {
+  char path[] = "/tmp/textsourceXXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  const std::string text = "x /* c */ + 1\n// done\n";
+  ASSERT_EQ(ssize_t(text.size()), write(fd, text.data(), text.size()));
+  close(fd);
+
+  std::unique_ptr<TextSource> source(TextSource::openFile(path));
+  TextSource buffer(text.data(), text.size());
+  EXPECT_EQ(Drain(buffer), Drain(*source));
+
+  // Empty files can't be mapped, but read fine
+  ASSERT_EQ(0, truncate(path, 0));
+  source.reset(TextSource::openFile(path));
+  EXPECT_TRUE(source->eof());
+
+  unlink(path);
+  EXPECT_THROW(TextSource::openFile(path), SystemException);
 }
 
 TEST(TextSourceTest, Position) {
@@ -98,3 +186,76 @@ TEST(TextSourceTest, Position) {
 
   EXPECT_TRUE(source.eof());
 }
+
+TEST(TextSourceTest, Pointers) {
+  const std::string text = "ab/* c */d";
+  TextSource source(text.data(), text.size());
+
+  EXPECT_EQ(text.data(), source.getPointer());
+  source.consume();
+  EXPECT_EQ(text.data() + 1, source.getPointer());
+
+  // The comment is where it starts
+  source.consume();
+  EXPECT_EQ(' ', source.current());
+  EXPECT_EQ(text.data() + 2, source.getPointer());
+  source.consume();
+  EXPECT_EQ('d', source.current());
+  EXPECT_EQ(text.data() + 9, source.getPointer());
+
+  source.consume();
+  EXPECT_TRUE(source.eof());
+  EXPECT_EQ(text.data() + text.size(), source.getPointer());
+  EXPECT_EQ(text.size(), source.getOffset());
+  EXPECT_EQ(text.data() + 2, source.getText(2));
+}
+
+// Only a single character at a time, counting how many have been read
+class CountingBuffer : public std::streambuf {
+public:
+  explicit CountingBuffer(const std::string& inText)
+      : text(inText), count(0) {}
+
+  size_t getCount() const { return count; }
+
+protected:
+  int_type underflow() override {
+    if (count == text.size()) return traits_type::eof();
+    setg(&text[count], &text[count], &text[count] + 1);
+    ++count;
+    return traits_type::to_int_type(text[count - 1]);
+  }
+
+private:
+  std::string text;
+  size_t count;
+};
+
+// A stream is only read as far as it's consumed, so that a source on a
+// terminal doesn't wait for more input than it needs
+TEST(TextSourceTest, ReadsStreamsLazily) {
+  CountingBuffer buffer("12\n/* x */3\n");
+  std::istream in(&buffer);
+  TextSource source(in);
+  EXPECT_EQ('1', source.current());
+  EXPECT_EQ(1u, buffer.getCount());
+
+  source.consume();
+  source.consume();
+  EXPECT_EQ('\n', source.current());
+  EXPECT_EQ(3u, buffer.getCount());
+
+  // A comment is read to its end
+  source.consume();
+  EXPECT_EQ(' ', source.current());
+  EXPECT_EQ(10u, buffer.getCount());
+  EXPECT_EQ(3u, source.getOffset());
+  EXPECT_EQ("/* x */", std::string(source.getText(3), 7));
+
+  source.consume();
+  EXPECT_EQ('3', source.current());
+  source.consume();
+  source.consume();
+  EXPECT_TRUE(source.eof());
+  EXPECT_EQ(12u, source.getOffset());
+}
@@ -1,9 +1,14 @@
 
 #include "tokenizer.h"
+#include "convert.h"
 #include "exception.h"
 
 #include <ctype.h>
-#include <sstream>
+#include <limits>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
 
 using namespace std;
 
@@ -29,6 +34,7 @@ using namespace std;
 
 namespace {
 
+// Indexed by Tokenizer::Symbol
 static const char* const OPERATORS[] = {
     "^",
     "^=",
@@ -81,12 +87,58 @@ static const char* const OPERATORS[] = {
     0
 };
 
-int findOp(const string& text) {
-  for (int i = 0; OPERATORS[i] != 0; i++) {
-    if (text == OPERATORS[i]) return i;
+// A trie of the OPERATORS, so that an operator is matched a character at
+// a time with one table lookup each. All prefixes of multi-character
+// operators (like '<<=') are also operators (in this case, '<' and '<<'),
+// so every node but the root is one.
+class OperatorTrie {
+public:
+  OperatorTrie() : nodes(1) {
+    int i = 0;
+    for (; OPERATORS[i] != 0; i++) {
+      int node = 0;
+      for (const char* p = OPERATORS[i]; *p != 0; p++) {
+        const unsigned char c = *p;
+        ASSERTION(c < kAlphabet);
+        if (nodes[node].next[c] < 0) {
+          nodes[node].next[c] = nodes.size();
+          nodes.push_back(Node());
+        }
+        node = nodes[node].next[c];
+      }
+      nodes[node].symbol = Tokenizer::Symbol(i);
+    }
+    ASSERTION(i == Tokenizer::SYM_COUNT);
+    ASSERTION(nodes.size() <= 128);  // Node numbers fit in an int8_t
   }
 
-  return -1;
+  // The node after reading 'c' at 'node', or -1 if no operator goes on
+  // that way. The root is node 0.
+  int step(int node, char c) const {
+    const unsigned char u = c;
+    return (u < kAlphabet) ? nodes[node].next[u] : -1;
+  }
+
+  Tokenizer::Symbol getSymbol(int node) const { return nodes[node].symbol; }
+
+private:
+  static const unsigned kAlphabet = 128;
+
+  struct Node {
+    Node() : symbol(Tokenizer::SYM_NONE) {
+      for (unsigned i = 0; i < kAlphabet; i++) next[i] = -1;
+    }
+
+    int8_t next[kAlphabet];
+    Tokenizer::Symbol symbol;
+  };
+
+  std::vector<Node> nodes;
+};
+
+const OperatorTrie& getOperators() {
+  static const OperatorTrie trie;
+  return trie;
 }
 
 int hexvalue(char c) {
@@ -102,12 +154,97 @@ bool isoctal(char c) {
   return ((c >= '0') && (c <= '7'));
 }
 
+// Indexed by Tokenizer::Keyword
+static const char* const KEYWORDS[] = {
+    "true",
+    "false",
+    0
+};
+
+Tokenizer::Keyword findKeyword(const char* text, size_t length) {
+  for (int i = 0; KEYWORDS[i] != 0; i++) {
+    if ((strncmp(KEYWORDS[i], text, length) == 0) &&
+        (KEYWORDS[i][length] == 0)) {
+      return Tokenizer::Keyword(i);
+    }
+  }
+  return Tokenizer::KEY_NONE;
+}
+
+// The value of an integer's digits in the base, if it's at most 'limit'
+bool parseInteger(const char* digits, size_t length, unsigned base,
+                  uint64_t limit, uint64_t& value) {
+  value = 0;
+  for (size_t i = 0; i < length; i++) {
+    const unsigned digit = hexvalue(digits[i]);
+    if (value > (limit - digit) / base) {
+      return false;
+    }
+    value = value * base + digit;
+  }
+  return true;
+}
+
+// Number tokens are read as Expression converts strings
+double parseNumber(const char* text, size_t length) {
+  double value = 0;
+  string2number(text, length, value);
+  return value;
+}
+
 }  // namespace
 
-Tokenizer::Tokenizer(TextSource* inSource) : source(inSource) {}
+Tokenizer::Tokenizer(TextSource* inSource)
+    : source(inSource),
+      token_start(source->getOffset()),
+      token_length(0),
+      symbol(SYM_NONE),
+      keyword(KEY_NONE),
+      is_integer(false),
+      integer(0),
+      number(0),
+      is_decoded(false),
+      have_text(false) {}
+
+const char* Tokenizer::getSymbolText(Symbol symbol) {
+  PRECONDITION(symbol >= 0 && symbol < SYM_COUNT);
+  return OPERATORS[symbol];
+}
+
+const string& Tokenizer::getTokenText() const {
+  if (!have_text) {
+    text.assign(getTokenData(), token_length);
+    have_text = true;
+  }
+  return text;
+}
 
 bool Tokenizer::next() {
-  token.clear();
+  const bool more = advance();
+  status.check();
+  return more;
+}
+
+const Status& Tokenizer::tryNext() {
+  advance();
+  return status;
+}
+
+bool Tokenizer::advance() {
+  // An error ends the text
+  if (!status.ok()) return false;
+  const bool more = readToken();
+  status.update(source->getStatus());
+  return more && status.ok();
+}
+
+bool Tokenizer::readToken() {
+  token_start = source->getOffset();
+  token_length = 0;
+  is_decoded = false;
+  symbol = SYM_NONE;
+  keyword = KEY_NONE;
+  have_text = false;
 
   skipWhiteSpace();
   if (source->eof()) return false;
@@ -130,33 +267,44 @@ bool Tokenizer::next() {
   } else {
     token_type = TOK_OPERATOR;
 
-    // Read an operator. This just appends characters until the
-    // symbol's no longer in the OPERATORS list. That means that
-    // all prefixes of multi-character operators (like '<<=') must
-    // also be operators (in this case, '<' and '<<').
+    // Read an operator. This just takes characters until the
+    // symbol's no longer in the OPERATORS trie.
+    const OperatorTrie& operators = getOperators();
+    int node = 0;
+    startToken();
     while (!source->eof()) {
-      token.append(1, source->current());
-
-      int pos = findOp(token);
-      if (pos >= 0) {
-        source->consume();
-        if (isspace(source->current())) break;
-      } else {
-        token.resize(token.size()-1);
-        if (token.empty()) {
-          throwError("Bad character '" + string(1,source->current()) + "'");
+      const int next = operators.step(node, source->current());
+      if (next < 0) {
+        if (node == 0) {
+          fail("Bad character '%s' (line %l, column %c)",
+               string(1, source->current()));
+          return false;
         }
         break;
       }
+
+      node = next;
+      source->tryConsume();
+      if (isspace(source->current())) break;
     }
+    endToken();
 
-    return !token.empty();
+    symbol = operators.getSymbol(node);
+    return true;
   }
 }
 
+void Tokenizer::startToken() {
+  token_start = source->getOffset();
+}
+
+void Tokenizer::endToken() {
+  token_length = source->getOffset() - token_start;
+}
+
 void Tokenizer::skipWhiteSpace() {
   while ((source->current() != -1) && isspace(source->current())) {
-    source->consume();
+    source->tryConsume();
   }
 }
 
@@ -173,151 +321,193 @@ private:
 void Tokenizer::readString(int delim) {
   ResetFlag resetter(source.get());
 
-  token.clear();
-  source->consume();
+  source->tryConsume();
+  startToken();
 
+  // The token is the text in the source up to the first escape. From
+  // there on, it's decoded into a copy.
+  bool escaped = false;
   while (true) {
     if (source->current() == -1) {
-      throwError("Unterminated string");
+      fail("Unterminated string (line %l, column %c)");
       return;
     }
 
     if (source->current() == delim) {
-      source->consume();
+      if (escaped) {
+        is_decoded = true;
+        token_length = decoded.size();
+      } else {
+        endToken();
+      }
+      source->tryConsume();
       return;
     }
 
     if (source->current() == '\\') {
+      if (!escaped) {
+        endToken();
+        decoded.assign(getTokenData(), token_length);
+        escaped = true;
+      }
 
-      source->consume();
+      source->tryConsume();
 
       if (isoctal(source->current())) {
         int result = source->current() - '0';
-        source->consume();
+        source->tryConsume();
         if (isoctal(source->current())) {
           result = result * 8 + (source->current() - '0');
-          source->consume();
+          source->tryConsume();
           if (isoctal(source->current())) {
             result = result * 8 + (source->current() - '0');
-            source->consume();
+            source->tryConsume();
           }
         }
 
         if (result > 255) {
-          throwError("Octal escape sequence out of range");
+          fail("Octal escape sequence out of range (line %l, column %c)");
+          return;
         }
 
-        token.append(1, result);
+        decoded.append(1, result);
 
       } else if (source->current() == 'x') {
 
-        source->consume();
+        source->tryConsume();
         if (!isxdigit(source->current())) {
-          throwError("Expecting a hex digit after \\x");
+          fail("Expecting a hex digit after \\x (line %l, column %c)");
+          return;
         }
         int result = hexvalue(source->current());
-        source->consume();
+        source->tryConsume();
         if (isxdigit(source->current())) {
           result = result * 16 + hexvalue(source->current());
-          source->consume();
+          source->tryConsume();
         }
 
-        token.append(1, result);
+        decoded.append(1, result);
 
       } else {
         switch (source->current()) {
-          case 'a': token.append("\a"); break;
-          case 'b': token.append("\b"); break;
-          case 'f': token.append("\f"); break;
-          case 'n': token.append("\n"); break;
-          case 'r': token.append("\r"); break;
-          case 't': token.append("\t"); break;
-          case 'v': token.append("\v"); break;
+          case 'a': decoded.append("\a"); break;
+          case 'b': decoded.append("\b"); break;
+          case 'f': decoded.append("\f"); break;
+          case 'n': decoded.append("\n"); break;
+          case 'r': decoded.append("\r"); break;
+          case 't': decoded.append("\t"); break;
+          case 'v': decoded.append("\v"); break;
           case '\\':
           case '\?':
           case '\'':
           case '\"':
             {
-              token.append(1, source->current());
+              decoded.append(1, source->current());
               break;
             }
 
           default:
-            throwError("Unknown escape character '" +
-                       string(1,source->current()) + "'");
+            fail("Unknown escape character '%s' (line %l, column %c)",
+                 string(1, source->current()));
+            return;
         }
 
-        source->consume();
+        source->tryConsume();
       }
     } else {
-      token.append(1, source->current());
-      source->consume();
+      if (escaped) {
+        decoded.append(1, source->current());
+      }
+      source->tryConsume();
     }
   }
 }
 
 void Tokenizer::readNumber() {
-  token.clear();
+  startToken();
 
+  // The base of an integer, or 0 for a fraction
+  unsigned base = 10;
+  bool octal = false;
   if (source->current() == '0') {
-    source->consume();
+    source->tryConsume();
     if (tolower(source->current()) == 'x') {
       // hex
-      source->consume();
-      token = "0x";
-      while (isxdigit(source->current())) {
-        token.append(1, source->current());
-        source->consume();
+      source->tryConsume();
+      if (!isxdigit(source->current())) {
+        fail("No valid hex digits after 0x (line %l, column %c)");
+        return;
       }
-      if (token == "0x") {
-        throwError("No valid hex digits after 0x");
+      while (isxdigit(source->current())) {
+        source->tryConsume();
       }
+      base = 16;
     } else {
-      // octal
-      token = "0";
-      while (isdigit(source->current())) {
-        if (source->current() >= '8') {
-          throwError("Digit out of range in octal constant");
-        }
-        token.append(1, source->current());
-        source->consume();
-      }
+      // octal, unless it turns out to be a fraction
+      octal = true;
     }
-  } else {
+  }
+
+  if (base == 10) {
     while (isdigit(source->current())) {
-      token.append(1, source->current());
-      source->consume();
+      source->tryConsume();
     }
 
     if (source->current() == '.') {
-      token.append(1, source->current());
-      source->consume();
+      source->tryConsume();
+      base = 0;
     }
 
     while (isdigit(source->current())) {
-      token.append(1, source->current());
-      source->consume();
+      source->tryConsume();
+    }
+  }
+
+  endToken();
+  const char* const data = getTokenData();
+
+  if (octal && (base == 10)) {
+    for (size_t i = 1; i < token_length; i++) {
+      if (data[i] >= '8') {
+        fail("Digit out of range in octal constant (line %l, column %c)");
+        return;
+      }
     }
+    base = 8;
+  }
+
+  // Decimal integers must fit in an int64_t; octal and hex ones just in
+  // 64 bits
+  const size_t prefix = (base == 16) ? 2 : 0;
+  uint64_t value;
+  is_integer = (base != 0) &&
+      parseInteger(data + prefix, token_length - prefix, base,
+                   (base == 10) ? numeric_limits<int64_t>::max()
+                                : numeric_limits<uint64_t>::max(),
+                   value);
+
+  if (is_integer) {
+    integer = value;
+    number = integer;
+  } else if (base == 8) {
+    fail("Octal constant out of range (line %l, column %c)");
+  } else {
+    number = parseNumber(data, token_length);
   }
 }
 
 void Tokenizer::readKeyword() {
-  token.clear();
+  startToken();
 
   while (isalnum(source->current()) || source->current() == '_') {
-    token.append(1, source->current());
-    source->consume();
+    source->tryConsume();
   }
-}
-
-void Tokenizer::throwError(const char* msg) {
-  ostringstream out;
-  out << msg << " (line " << source->getLineNumber()
-      << ", column " << source->getColumnNumber() << ")";
 
-  throw Exception(out.str());
+  endToken();
+  keyword = findKeyword(getTokenData(), token_length);
 }
 
-void Tokenizer::throwError(const string& msg) {
-  throwError(msg.c_str());
+void Tokenizer::fail(const char* format, const string& argument) {
+  status.update(Status(Status::SYNTAX_ERROR, format, argument,
+                       source->getLineNumber(), source->getColumnNumber()));
 }
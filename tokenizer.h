@@ -1,8 +1,13 @@
+#if !defined TOKENIZER_H
+#define      TOKENIZER_H
+
+#include "status.h"
 #include "textsource.h"
 
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <stdint.h>
 #include <string>
 
 class Tokenizer {
@@ -14,35 +19,153 @@ public:
     TOK_OPERATOR
   };
 
+  // The operators and other symbols that TOK_OPERATOR tokens can be
+  enum Symbol {
+    SYM_NONE = -1,        // Not an operator token
+    SYM_CARET,            // ^
+    SYM_CARET_EQ,         // ^=
+    SYM_TILDE,            // ~
+    SYM_LESS,             // <
+    SYM_LESS_LESS,        // <<
+    SYM_LESS_LESS_EQ,     // <<=
+    SYM_LESS_EQ,          // <=
+    SYM_EQ,               // =
+    SYM_EQ_EQ,            // ==
+    SYM_GREATER,          // >
+    SYM_GREATER_GREATER,  // >>
+    SYM_GREATER_GREATER_EQ,  // >>=
+    SYM_GREATER_EQ,       // >=
+    SYM_BAR,              // |
+    SYM_BAR_EQ,           // |=
+    SYM_BAR_BAR,          // ||
+    SYM_MINUS,            // -
+    SYM_MINUS_EQ,         // -=
+    SYM_ARROW,            // ->
+    SYM_MINUS_MINUS,      // --
+    SYM_COMMA,            // ,
+    SYM_BANG,             // !
+    SYM_BANG_EQ,          // !=
+    SYM_QUESTION,         // ?
+    SYM_COLON,            // :
+    SYM_SLASH,            // /
+    SYM_SLASH_EQ,         // /=
+    SYM_DOT,              // .
+    SYM_LPAREN,           // (
+    SYM_RPAREN,           // )
+    SYM_LBRACKET,         // [
+    SYM_RBRACKET,         // ]
+    SYM_STAR,             // *
+    SYM_STAR_EQ,          // *=
+    SYM_AMP,              // &
+    SYM_AMP_EQ,           // &=
+    SYM_AMP_AMP,          // &&
+    SYM_PERCENT,          // %
+    SYM_PERCENT_EQ,       // %=
+    SYM_PLUS,             // +
+    SYM_PLUS_EQ,          // +=
+    SYM_PLUS_PLUS,        // ++
+    SYM_SEMICOLON,        // ;
+    SYM_LBRACE,           // {
+    SYM_RBRACE,           // }
+    SYM_COUNT
+  };
+
+  // The keywords that TOK_KEYWORD tokens can be; anything else is a name
+  enum Keyword {
+    KEY_NONE = -1,        // A name
+    KEY_TRUE,             // true
+    KEY_FALSE,            // false
+    KEY_COUNT
+  };
+
+  static const char* getSymbolText(Symbol);
+
   // Takes ownership of the TextSource
   Tokenizer(TextSource*);
 
-  // Move on to the next (or first) token
+  // Move on to the next (or first) token. Returns false at the end of the
+  // text; malformed text throws.
   bool next();
 
-  bool eof() const { return source->eof() && token.empty(); }
+  // The Status API version: malformed text ends the tokens instead, and
+  // is reported by this and by getStatus() from then on
+  const Status& tryNext();
+  const Status& getStatus() const { return status; }
+
+  bool eof() const {
+    return (source->eof() && (token_length == 0)) || !status.ok();
+  }
 
   // These are valid only after successful calls to 'next()'
   TokenType getTokenType() const { return token_type; }
-  const std::string& getTokenText() const { return token; }
+  Symbol getSymbol() const { return symbol; }
+  Keyword getKeyword() const { return keyword; }
+
+  // The token's text: for a string, its contents with any escapes decoded.
+  // Tokens aren't copied out of the source; this points into it (or, for
+  // a string with escapes, at the decoded copy), and is valid until the
+  // next call to 'next()'.
+  const char* getTokenData() const {
+    return is_decoded ? decoded.data() : source->getText(token_start);
+  }
+  size_t getTokenLength() const { return token_length; }
+
+  // The token's text as a string. This makes a copy, so the parser only
+  // uses it for names and error messages.
+  const std::string& getTokenText() const;
+
+  // The value of a TOK_NUMBER. Integers (decimal ones that fit in 64 bits,
+  // and hex, or octal with a leading 0, of up to 64 bits, as their bit
+  // pattern) have an exact integer value, as well as the nearest double.
+  // Other numbers, with a '.' or too large, only have a double, which is
+  // what strtod makes of the text.
+  bool isInteger() const { return is_integer; }
+  int64_t getInteger() const { return integer; }
+  double getNumber() const { return number; }
 
   int getLineNumber() const { return current_line; }
   int getColumnNumber() const { return current_column; }
 
 private:
+  bool advance();
+  bool readToken();
   void skipWhiteSpace();
   void readString(int delim);
   void readNumber();
   void readKeyword();
 
-  void throwError(const char* msg);
-  void throwError(const std::string& msg);
+  // Record a syntax error at the current position; see Status for the
+  // format
+  void fail(const char* format,
+            const std::string& argument = std::string());
 
   std::unique_ptr<TextSource> source;
 
-  std::string token;
+  // Start the token at the current character
+  void startToken();
+
+  // End it before the current character
+  void endToken();
+
+  size_t token_start;  // Offset in the source, since a stream's text moves
+  size_t token_length;
   TokenType token_type;
+  Symbol symbol;
+  Keyword keyword;
+  bool is_integer;
+  int64_t integer;
+  double number;
+
+  std::string decoded;  // A string's contents, if it has escapes
+  bool is_decoded;      // The token is 'decoded', not in the source
+
+  mutable std::string text;  // Filled in by getTokenText()
+  mutable bool have_text;
 
   int current_column;
   int current_line;
+
+  Status status;
 };
+
+#endif
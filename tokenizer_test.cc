@@ -3,6 +3,8 @@
 #include <iostream>
 #include <vector>
 #include <sstream>
+#include <stdlib.h>
+#include <string.h>
 
 #include "exception.h"
 
@@ -276,3 +278,163 @@ TEST(TokenizerTest, Keywords) {
   EXPECT_EQ("foo_bar_", tok.getTokenText());
   EXPECT_FALSE(tok.next());
 }
+
+TEST(TokenizerTest, Symbols) {
+  std::istringstream in("<<= && ( x-- <");
+  Tokenizer tok(new TextSource(in));
+  const Tokenizer::Symbol expected[] = {
+    Tokenizer::SYM_LESS_LESS_EQ, Tokenizer::SYM_AMP_AMP,
+    Tokenizer::SYM_LPAREN, Tokenizer::SYM_NONE,
+    Tokenizer::SYM_MINUS_MINUS, Tokenizer::SYM_LESS,
+  };
+  for (Tokenizer::Symbol symbol : expected) {
+    EXPECT_TRUE(tok.next());
+    EXPECT_EQ(symbol, tok.getSymbol()) << tok.getTokenText();
+    if (symbol != Tokenizer::SYM_NONE) {
+      EXPECT_EQ(tok.getTokenText(), Tokenizer::getSymbolText(symbol));
+    }
+  }
+  EXPECT_FALSE(tok.next());
+  EXPECT_EQ(Tokenizer::SYM_NONE, tok.getSymbol());
+}
+
+TEST(TokenizerTest, TokensPointIntoTheSource) {
+  const char* text = "foo + 'bar' 12";
+  Tokenizer tok(new TextSource(text, strlen(text)));
+
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(text, tok.getTokenData());
+  EXPECT_EQ(3u, tok.getTokenLength());
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(text + 4, tok.getTokenData());
+  EXPECT_EQ(1u, tok.getTokenLength());
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(text + 7, tok.getTokenData());
+  EXPECT_EQ(3u, tok.getTokenLength());
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(text + 12, tok.getTokenData());
+  EXPECT_EQ("12", tok.getTokenText());
+  EXPECT_FALSE(tok.next());
+
+  // Strings with escapes are decoded into a copy
+  const char* escaped = "'a\\tb' \"\\x41\"";
+  Tokenizer tok2(new TextSource(escaped, strlen(escaped)));
+  EXPECT_TRUE(tok2.next());
+  EXPECT_EQ("a\tb", std::string(tok2.getTokenData(), tok2.getTokenLength()));
+  EXPECT_EQ("a\tb", tok2.getTokenText());
+  EXPECT_TRUE(tok2.next());
+  EXPECT_EQ("A", tok2.getTokenText());
+  EXPECT_FALSE(tok2.next());
+}
+
+// A stream's text moves as it's read, even in the middle of a token
+TEST(TokenizerTest, LongTokensFromAStream) {
+  const std::string name(10000, 'x');
+  const std::string digits(5000, '1');
+  std::istringstream in(name + " '" + name + "\\n" + name + "' " + digits +
+                        ".5 /* " + name + " */ " + name);
+  Tokenizer tok(new TextSource(in));
+
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(name, tok.getTokenText());
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(name + "\n" + name, tok.getTokenText());
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(digits + ".5", tok.getTokenText());
+  EXPECT_FALSE(tok.isInteger());
+  EXPECT_TRUE(tok.next());
+  EXPECT_EQ(name, std::string(tok.getTokenData(), tok.getTokenLength()));
+  EXPECT_FALSE(tok.next());
+}
+
+TEST(TokenizerTest, NumberValues) {
+  // Integers, including octal ones and hex bit patterns
+  const struct {
+    const char* text;
+    int64_t value;
+  } integers[] = {
+    { "0", 0 }, { "12", 12 }, { "017", 15 }, { "0x1F", 31 },
+    { "0xffffffffffffffff", -1 }, { "01777777777777777777777", -1 },
+    { "9007199254740993", 9007199254740993 },
+    { "9223372036854775807", 9223372036854775807 },
+  };
+  for (const auto& integer : integers) {
+    std::istringstream in(integer.text);
+    Tokenizer tok(new TextSource(in));
+    EXPECT_TRUE(tok.next());
+    EXPECT_EQ(Tokenizer::TOK_NUMBER, tok.getTokenType());
+    EXPECT_EQ(integer.text, tok.getTokenText());
+    EXPECT_TRUE(tok.isInteger()) << integer.text;
+    EXPECT_EQ(integer.value, tok.getInteger()) << integer.text;
+    EXPECT_EQ(double(integer.value), tok.getNumber()) << integer.text;
+  }
+
+  // Everything else is the same as converting the text with strtod
+  const char* const numbers[] = {
+    "12.", "12.25", "0.5", "017.5", "0x1ffffffffffffffff",
+    "9223372036854775808", "9999999999999999999", "18446744073709551617",
+    "123456789012345678901234567890",
+  };
+  for (const char* number : numbers) {
+    std::istringstream in(number);
+    Tokenizer tok(new TextSource(in));
+    EXPECT_TRUE(tok.next());
+    EXPECT_EQ(Tokenizer::TOK_NUMBER, tok.getTokenType());
+    EXPECT_EQ(number, tok.getTokenText());
+    EXPECT_FALSE(tok.isInteger()) << number;
+    EXPECT_EQ(strtod(number, nullptr), tok.getNumber()) << number;
+  }
+
+  // Octal that doesn't fit in 64 bits
+  std::istringstream in("02000000000000000000000");
+  Tokenizer tok(new TextSource(in));
+  EXPECT_THROW(tok.next(), Exception);
+}
+
+TEST(TokenizerTest, Statuses) {
+  std::istringstream in("1 + \n  @");
+  Tokenizer tok(new TextSource(in));
+  EXPECT_TRUE(tok.tryNext().ok());
+  EXPECT_EQ("1", tok.getTokenText());
+  EXPECT_TRUE(tok.tryNext().ok());
+  EXPECT_EQ("+", tok.getTokenText());
+  EXPECT_FALSE(tok.eof());
+
+  // An error looks like the end of the input, and stays
+  EXPECT_EQ(Status::SYNTAX_ERROR, tok.tryNext().getCode());
+  EXPECT_EQ("Bad character '@' (line 2, column 3)",
+            tok.getStatus().getMessage());
+  EXPECT_TRUE(tok.eof());
+  EXPECT_FALSE(tok.tryNext().ok());
+
+  // The source's errors come through the tokenizer
+  std::istringstream comment("1 /*");
+  Tokenizer tok2(TextSource::tryCreate(comment));
+  EXPECT_TRUE(tok2.tryNext().ok());
+  EXPECT_EQ("Unterminated comment", tok2.tryNext().getMessage());
+  EXPECT_TRUE(tok2.eof());
+
+  // and are thrown like its own
+  std::istringstream bad("'\\q'");
+  Tokenizer tok3(new TextSource(bad));
+  try {
+    tok3.next();
+    FAIL();
+  } catch (const Exception& e) {
+    EXPECT_EQ(tok3.getStatus().getMessage(), std::string(e.what()));
+  }
+}
+
+TEST(TokenizerTest, KeywordIds) {
+  std::istringstream in("true false truer x");
+  Tokenizer tok(new TextSource(in));
+  const Tokenizer::Keyword expected[] = {
+    Tokenizer::KEY_TRUE, Tokenizer::KEY_FALSE,
+    Tokenizer::KEY_NONE, Tokenizer::KEY_NONE,
+  };
+  for (Tokenizer::Keyword keyword : expected) {
+    EXPECT_TRUE(tok.next());
+    EXPECT_EQ(Tokenizer::TOK_KEYWORD, tok.getTokenType());
+    EXPECT_EQ(keyword, tok.getKeyword()) << tok.getTokenText();
+  }
+}